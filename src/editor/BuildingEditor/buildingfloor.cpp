@@ -24,20 +24,6 @@
 #include "furnituregroups.h"
 #include "roofhiding.h"
 
-#if defined(Q_OS_WIN) && (_MSC_VER >= 1600)
-// Hmmmm.  libtiled.dll defines the MapRands class as so:
-// class TILEDSHARED_EXPORT MapRands : public QVector<QVector<quint32> >
-// Suddenly I'm getting a 'multiply-defined symbol' error.
-// I found the solution here:
-// http://www.archivum.info/qt-interest@trolltech.com/2005-12/00242/RE-Linker-Problem-while-using-QMap.html
-#if QT_VERSION >= 060000
-// QVector is an alias for QList
-template class __declspec(dllimport) QList<QList<quint32> >;
-#else
-template class __declspec(dllimport) QVector<QVector<quint32> >;
-#endif
-#endif
-
 using namespace BuildingEditor;
 
 /////
@@ -2321,8 +2307,10 @@ void BuildingFloor::Square::ReplaceFloorGrime(BuildingTileEntry *grimeTile)
 #include "filesystemwatcher.h"
 #include "tiledeffile.h"
 #include "tilemetainfomgr.h"
+#include <QCoreApplication>
 #include <QDebug>
 #include <QFileInfo>
+#include <QThread>
 
 #if defined(Q_OS_WIN) && (_MSC_VER >= 1600)
 // Hmmmm.  libtiled.dll defines the Properties class as so:
@@ -2338,7 +2326,7 @@ namespace Internal {
 
 TileDefWatcher::TileDefWatcher() :
     mWatcher(new FileSystemWatcher(this)),
-    mTileDefFile(new TileDefFile()),
+    mTileDefFile(new TileDefFile(), &QObject::deleteLater),
     tileDefFileChecked(false),
     watching(false)
 {
@@ -2348,6 +2336,7 @@ TileDefWatcher::TileDefWatcher() :
 
 void TileDefWatcher::check()
 {
+    Q_ASSERT(QThread::currentThread() == thread());
     if (!tileDefFileChecked) {
         QFileInfo fileInfo(TileMetaInfoMgr::instance()->tilesDirectory() + QString::fromLatin1("/newtiledefinitions.tiles"));
 #if 1
@@ -2357,7 +2346,12 @@ void TileDefWatcher::check()
 #endif
         if (fileInfo.exists()) {
             qDebug() << "TileDefWatcher read " << fileInfo.absoluteFilePath();
-            mTileDefFile->read(fileInfo.absoluteFilePath());
+            // Other threads might still be using the old definitions.
+            QSharedPointer<TileDefFile> tileDefFile(new TileDefFile(), &QObject::deleteLater);
+            tileDefFile->read(fileInfo.absoluteFilePath());
+            QMutexLocker locker(&mMutex);
+            mTileDefFile = tileDefFile;
+            locker.unlock();
             if (!watching) {
                 mWatcher->addPath(fileInfo.canonicalFilePath());
                 watching = true;
@@ -2367,6 +2361,14 @@ void TileDefWatcher::check()
     }
 }
 
+QSharedPointer<TileDefFile> TileDefWatcher::tileDefFile()
+{
+    if (QThread::currentThread() == thread())
+        check();
+    QMutexLocker locker(&mMutex);
+    return mTileDefFile;
+}
+
 void TileDefWatcher::fileChanged(const QString &path)
 {
     qDebug() << "TileDefWatcher.fileChanged() " << path;
@@ -2378,16 +2380,18 @@ void TileDefWatcher::fileChanged(const QString &path)
 } // namespace Internal
 } // namespace Tiled
 
-static Tiled::Internal::TileDefWatcher *tileDefWatcher = nullptr;
-
 namespace BuildingEditor
 {
 
 Tiled::Internal::TileDefWatcher *getTileDefWatcher()
 {
-    if (tileDefWatcher == nullptr) {
-        tileDefWatcher = new Tiled::Internal::TileDefWatcher();
-    }
+    // Buildings are laid out on the map reader threads too, but the watcher
+    // belongs to the main thread.
+    static Tiled::Internal::TileDefWatcher *tileDefWatcher = [] {
+        Tiled::Internal::TileDefWatcher *watcher = new Tiled::Internal::TileDefWatcher();
+        watcher->moveToThread(QCoreApplication::instance()->thread());
+        return watcher;
+    }();
     return tileDefWatcher;
 }
 
@@ -2404,13 +2408,9 @@ struct GrimeProperties
     bool DoubleRight;
 };
 
-static bool tileHasGrimeProperties(BuildingTile *btile, GrimeProperties *props)
+static bool tileHasGrimeProperties(const QString &tilesetName, int index, GrimeProperties *props)
 {
-    if (btile == nullptr)
-        return false;
-
-    Tiled::Internal::TileDefWatcher *tileDefWatcher = getTileDefWatcher();
-    tileDefWatcher->check();
+    const QSharedPointer<TileDefFile> tileDefFile = getTileDefWatcher()->tileDefFile();
 
     if (props) {
         props->West = props->North = props->SouthEast = false;
@@ -2418,8 +2418,8 @@ static bool tileHasGrimeProperties(BuildingTile *btile, GrimeProperties *props)
         props->DoubleLeft = props->DoubleRight = false;
     }
 
-    if (TileDefTileset *tdts = tileDefWatcher->mTileDefFile->tileset(btile->mTilesetName)) {
-        if (TileDefTile *tdt = tdts->tileAt(btile->mIndex)) {
+    if (TileDefTileset *tdts = tileDefFile->tileset(tilesetName)) {
+        if (TileDefTile *tdt = tdts->tileAt(index)) {
             if (tdt->mProperties.contains(QString::fromLatin1("GrimeType"))) {
                 if (props) {
                     if (tdt->mProperties.contains(QString::fromLatin1("DoorWallW")) ||
@@ -2463,6 +2463,23 @@ static bool tileHasGrimeProperties(BuildingTile *btile, GrimeProperties *props)
     return false;
 }
 
+static bool tileHasGrimeProperties(BuildingTile *btile, GrimeProperties *props)
+{
+    if (btile == nullptr)
+        return false;
+    return tileHasGrimeProperties(btile->mTilesetName, btile->mIndex, props);
+}
+
+// BuildingTilesMgr::get() would add the tile, which only the main thread may do.
+static bool userTileHasGrimeProperties(const QString &tileName, GrimeProperties *props)
+{
+    QString tilesetName;
+    int index;
+    if (!BuildingTilesMgr::parseTileName(tileName, tilesetName, index))
+        return false;
+    return tileHasGrimeProperties(tilesetName, index, props);
+}
+
 #if 1
 void BuildingFloor::Square::ReplaceWallGrime(BuildingTileEntry *grimeTile, const QString &userTileWalls, const QString &userTileWalls2)
 {
@@ -2600,64 +2617,60 @@ void BuildingFloor::Square::ReplaceWallGrime(BuildingTileEntry *grimeTile, const
     }
 
     if (!userTileWalls.isEmpty()) {
-        if (BuildingTile *btile = BuildingTilesMgr::instance()->get(userTileWalls)) {
-            if (tileHasGrimeProperties(btile, &props)) {
-                if (props.FullWindow) {
-                    if (props.West) grimeEnumW = -1;
-                    if (props.North) grimeEnumN = -1;
-                } else if (props.Trim) {
-                    if (props.West && props.North) {
-                        grimeEnumW = BTC_GrimeWall::NorthWestTrim;
-                        grimeEnumN = -1;
-                    } else if (props.West) {
-                        grimeEnumW = BTC_GrimeWall::WestTrim;
-                    } else if (props.North) {
-                        grimeEnumN = BTC_GrimeWall::NorthTrim;
-                    } else if (props.SouthEast) {
-                        grimeEnumW = BTC_GrimeWall::SouthEastTrim;
-                    }
-                } else if (props.DoubleLeft) {
-                    if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleLeft;
-                    else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleLeft;
-                } else if (props.DoubleRight) {
-                    if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleRight;
-                    else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleRight;
+        if (userTileHasGrimeProperties(userTileWalls, &props)) {
+            if (props.FullWindow) {
+                if (props.West) grimeEnumW = -1;
+                if (props.North) grimeEnumN = -1;
+            } else if (props.Trim) {
+                if (props.West && props.North) {
+                    grimeEnumW = BTC_GrimeWall::NorthWestTrim;
+                    grimeEnumN = -1;
                 } else if (props.West) {
-                    grimeEnumW = BTC_GrimeWall::West;
+                    grimeEnumW = BTC_GrimeWall::WestTrim;
                 } else if (props.North) {
-                    grimeEnumN = BTC_GrimeWall::North;
+                    grimeEnumN = BTC_GrimeWall::NorthTrim;
+                } else if (props.SouthEast) {
+                    grimeEnumW = BTC_GrimeWall::SouthEastTrim;
                 }
+            } else if (props.DoubleLeft) {
+                if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleLeft;
+                else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleLeft;
+            } else if (props.DoubleRight) {
+                if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleRight;
+                else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleRight;
+            } else if (props.West) {
+                grimeEnumW = BTC_GrimeWall::West;
+            } else if (props.North) {
+                grimeEnumN = BTC_GrimeWall::North;
             }
         }
     }
     if (!userTileWalls2.isEmpty()) {
-        if (BuildingTile *btile = BuildingTilesMgr::instance()->get(userTileWalls2)) {
-            if (tileHasGrimeProperties(btile, &props)) {
-                if (props.FullWindow) {
-                    if (props.West) grimeEnumW = -1;
-                    if (props.North) grimeEnumN = -1;
-                } else if (props.Trim) {
-                    if (props.West && props.North) {
-                        grimeEnumW = BTC_GrimeWall::NorthWestTrim;
-                        grimeEnumN = -1;
-                    } else if (props.West) {
-                        grimeEnumW = BTC_GrimeWall::WestTrim;
-                    } else if (props.North) {
-                        grimeEnumN = BTC_GrimeWall::NorthTrim;
-                    } else if (props.SouthEast) {
-                        grimeEnumW = BTC_GrimeWall::SouthEastTrim;
-                    }
-                } else if (props.DoubleLeft) {
-                    if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleLeft;
-                    else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleLeft;
-                } else if (props.DoubleRight) {
-                    if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleRight;
-                    else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleRight;
+        if (userTileHasGrimeProperties(userTileWalls2, &props)) {
+            if (props.FullWindow) {
+                if (props.West) grimeEnumW = -1;
+                if (props.North) grimeEnumN = -1;
+            } else if (props.Trim) {
+                if (props.West && props.North) {
+                    grimeEnumW = BTC_GrimeWall::NorthWestTrim;
+                    grimeEnumN = -1;
                 } else if (props.West) {
-                    grimeEnumW = BTC_GrimeWall::West;
+                    grimeEnumW = BTC_GrimeWall::WestTrim;
                 } else if (props.North) {
-                    grimeEnumN = BTC_GrimeWall::North;
+                    grimeEnumN = BTC_GrimeWall::NorthTrim;
+                } else if (props.SouthEast) {
+                    grimeEnumW = BTC_GrimeWall::SouthEastTrim;
                 }
+            } else if (props.DoubleLeft) {
+                if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleLeft;
+                else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleLeft;
+            } else if (props.DoubleRight) {
+                if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleRight;
+                else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleRight;
+            } else if (props.West) {
+                grimeEnumW = BTC_GrimeWall::West;
+            } else if (props.North) {
+                grimeEnumN = BTC_GrimeWall::North;
             }
         }
     }
@@ -2819,56 +2832,52 @@ void BuildingFloor::Square::ReplaceWallGrime(BuildingTileEntry *grimeTile, const
     }
 
     if (!userTileWalls.isEmpty()) {
-        if (BuildingTile *btile = BuildingTilesMgr::instance()->get(userTileWalls)) {
-            if (tileHasGrimeProperties(btile, &props)) {
-                if (props.FullWindow) {
-                    if (props.West) grimeEnumW = -1;
-                    if (props.North) grimeEnumN = -1;
-                } else if (props.Trim) {
-                    if (props.West && props.North) {
-                        grimeEnumW = BTC_GrimeWall::NorthWestTrim;
-                        grimeEnumN = -1;
-                    } else if (props.West) {
-                        grimeEnumW = BTC_GrimeWall::WestTrim;
-                    } else if (props.North) {
-                        grimeEnumN = BTC_GrimeWall::NorthTrim;
-                    } else if (props.SouthEast) {
-                        grimeEnumW = BTC_GrimeWall::SouthEastTrim;
-                    }
-                } else if (props.DoubleLeft) {
-                    if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleLeft;
-                    else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleLeft;
-                } else if (props.DoubleRight) {
-                    if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleRight;
-                    else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleRight;
+        if (userTileHasGrimeProperties(userTileWalls, &props)) {
+            if (props.FullWindow) {
+                if (props.West) grimeEnumW = -1;
+                if (props.North) grimeEnumN = -1;
+            } else if (props.Trim) {
+                if (props.West && props.North) {
+                    grimeEnumW = BTC_GrimeWall::NorthWestTrim;
+                    grimeEnumN = -1;
+                } else if (props.West) {
+                    grimeEnumW = BTC_GrimeWall::WestTrim;
+                } else if (props.North) {
+                    grimeEnumN = BTC_GrimeWall::NorthTrim;
+                } else if (props.SouthEast) {
+                    grimeEnumW = BTC_GrimeWall::SouthEastTrim;
                 }
+            } else if (props.DoubleLeft) {
+                if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleLeft;
+                else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleLeft;
+            } else if (props.DoubleRight) {
+                if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleRight;
+                else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleRight;
             }
         }
     }
     if (!userTileWalls2.isEmpty()) {
-        if (BuildingTile *btile = BuildingTilesMgr::instance()->get(userTileWalls2)) {
-            if (tileHasGrimeProperties(btile, &props)) {
-                if (props.FullWindow) {
-                    if (props.West) grimeEnumW = -1;
-                    if (props.North) grimeEnumN = -1;
-                } else if (props.Trim) {
-                    if (props.West && props.North) {
-                        grimeEnumW = BTC_GrimeWall::NorthWestTrim;
-                        grimeEnumN = -1;
-                    } else if (props.West) {
-                        grimeEnumW = BTC_GrimeWall::WestTrim;
-                    } else if (props.North) {
-                        grimeEnumN = BTC_GrimeWall::NorthTrim;
-                    } else if (props.SouthEast) {
-                        grimeEnumW = BTC_GrimeWall::SouthEastTrim;
-                    }
-                } else if (props.DoubleLeft) {
-                    if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleLeft;
-                    else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleLeft;
-                } else if (props.DoubleRight) {
-                    if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleRight;
-                    else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleRight;
+        if (userTileHasGrimeProperties(userTileWalls2, &props)) {
+            if (props.FullWindow) {
+                if (props.West) grimeEnumW = -1;
+                if (props.North) grimeEnumN = -1;
+            } else if (props.Trim) {
+                if (props.West && props.North) {
+                    grimeEnumW = BTC_GrimeWall::NorthWestTrim;
+                    grimeEnumN = -1;
+                } else if (props.West) {
+                    grimeEnumW = BTC_GrimeWall::WestTrim;
+                } else if (props.North) {
+                    grimeEnumN = BTC_GrimeWall::NorthTrim;
+                } else if (props.SouthEast) {
+                    grimeEnumW = BTC_GrimeWall::SouthEastTrim;
                 }
+            } else if (props.DoubleLeft) {
+                if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleLeft;
+                else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleLeft;
+            } else if (props.DoubleRight) {
+                if (props.West) grimeEnumW = BTC_GrimeWall::WestDoubleRight;
+                else if (props.North) grimeEnumN = BTC_GrimeWall::NorthDoubleRight;
             }
         }
     }
@@ -21,8 +21,10 @@
 #include <QHash>
 #include <QList>
 #include <QMap>
+#include <QMutex>
 #include <QObject>
 #include <QRegion>
+#include <QSharedPointer>
 #include <QString>
 #include <QStringList>
 #include <QVector>
@@ -349,12 +351,20 @@ public:
 
     void check();
 
+    /**
+     * Returns the tile definitions last read.  Only the main thread reads the
+     * file again after it changed, other threads get whatever check() read
+     * last.
+     */
+    QSharedPointer<TileDefFile> tileDefFile();
+
 public slots:
     void fileChanged(const QString &path);
 
 public:
     Tiled::Internal::FileSystemWatcher *mWatcher;
-    TileDefFile *mTileDefFile;
+    QSharedPointer<TileDefFile> mTileDefFile;
+    QMutex mMutex;
     bool tileDefFileChecked;
     bool watching;
 };
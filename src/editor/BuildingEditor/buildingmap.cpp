@@ -323,10 +323,15 @@ Map *BuildingMap::mergedMap() const
 }
 
 void BuildingMap::loadNeededTilesets(Building *building)
+{
+    loadNeededTilesets(building->tilesetNames());
+}
+
+void BuildingMap::loadNeededTilesets(const QStringList &tilesetNames)
 {
     // If the building uses any tilesets that aren't in Tilesets.txt, then
     // try to load them in now.
-    foreach (QString tilesetName, building->tilesetNames()) {
+    foreach (QString tilesetName, tilesetNames) {
         if (!TileMetaInfoMgr::instance()->tileset(tilesetName)) {
             QString source = TileMetaInfoMgr::instance()->tilesDirectory() +
                     QLatin1Char('/') + tilesetName + QLatin1String(".png");
@@ -657,7 +662,7 @@ void BuildingMap::userTilesToLayer(BuildingFloor *floor,
         }
     }
 
-    layerGroup->regionAltered(layer); // possibly set mNeedsSynch
+    layerGroup->regionAltered(layer, bounds); // possibly set mNeedsSynch
 }
 
 void BuildingMap::floorAdded(BuildingFloor *floor)
@@ -1426,3 +1431,94 @@ void ShadowBuilding::resetUserTiles(BuildingFloor *floor)
         }
     }
 }
+
+/////
+
+BuildingMapMaker::~BuildingMapMaker()
+{
+}
+
+Map *BuildingMapMaker::makeMap(Building *building, QList<TileLayer*> &tileLayers,
+                               QList<QVector<Cell>> &cells)
+{
+    Map::Orientation orient = static_cast<Map::Orientation>(BuildingMap::defaultOrientation());
+
+    int maxLevel =  building->floorCount() - 1;
+    int extraForWalls = 1;
+    int extra = (orient == Map::LevelIsometric)
+            ? extraForWalls : maxLevel * 3 + extraForWalls;
+    QSize mapSize(building->width() + extra,
+                  building->height() + extra);
+
+    Map *map = new Map(orient,
+                       mapSize.width(), mapSize.height(),
+                       64, 32);
+
+    const QStringList sectionNames = BuildingMap::requiredLayerNames();
+
+    // BuildingMap's ShadowBuilding lays out its floors in this order too.
+    foreach (BuildingFloor *floor, building->floors())
+        floor->LayoutToSquares();
+
+    foreach (BuildingFloor *floor, building->floors()) {
+        int offset = (orient == Map::LevelIsometric)
+                ? 0 : (maxLevel - floor->level()) * 3;
+        QRect bounds = floor->bounds(1, 1);
+        QStringList grimeLayers = floor->grimeLayers();
+
+        foreach (QString name, layerNames(floor->level())) {
+            QString layerName = BuildingMap::tr("%1_%2").arg(floor->level()).arg(name);
+            TileLayer *tl = new TileLayer(layerName,
+                                          0, 0, mapSize.width(), mapSize.height());
+            map->addLayer(tl);
+            QVector<Cell> layerCells(mapSize.width() * mapSize.height());
+
+            // The automatically-generated tiles, as in BuildingSquaresToTileLayers().
+            int section = sectionNames.indexOf(name);
+            for (int x = bounds.left(); section != -1 && x <= bounds.right(); x++) {
+                for (int y = bounds.top(); y <= bounds.bottom(); y++) {
+                    const BuildingFloor::Square &square = floor->squares[x][y];
+                    BuildingTile *btile = square.mTiles[section];
+                    if (!btile) {
+                        BuildingTileEntry *entry = square.mEntries[section];
+                        if (!entry || entry->isNone())
+                            continue;
+                        btile = entry->tile(square.mEntryEnum[section]);
+                    }
+                    if (btile->isNone())
+                        continue;
+                    if (Tile *tile = tileFor(btile->mTilesetName, btile->mIndex))
+                        layerCells[(x + offset) + (y + offset) * mapSize.width()] = Cell(tile);
+                }
+            }
+
+            // The user-drawn tiles go over those, as in userTilesToLayer()
+            // and BuildingMap::mergedMap().
+            if (grimeLayers.contains(name)) {
+                for (int x = bounds.left(); x <= bounds.right(); x++) {
+                    for (int y = bounds.top(); y <= bounds.bottom(); y++) {
+                        QString tileName = floor->grimeAt(name, x, y);
+                        if (tileName.isEmpty())
+                            continue;
+                        QString tilesetName;
+                        int index = 0;
+                        if (!BuildingTilesMgr::parseTileName(tileName, tilesetName, index))
+                            tilesetName.clear(); // the missing tile
+                        if (Tile *tile = userTileFor(tilesetName, index))
+                            layerCells[x + y * mapSize.width()] = Cell(tile);
+                    }
+                }
+            }
+
+            tileLayers += tl;
+            cells += layerCells;
+        }
+    }
+
+    foreach (BuildingFloor *floor, building->floors())
+        BuildingMap::addRoomDefObjects(map, floor);
+
+    map->setProperties(building->properties());
+
+    return map;
+}
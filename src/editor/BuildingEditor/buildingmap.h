@@ -24,13 +24,16 @@
 #include <QRegion>
 #include <QSet>
 #include <QStringList>
+#include <QVector>
 
 class CompositeLayerGroup;
 class MapComposite;
 
 namespace Tiled {
+class Cell;
 class Map;
 class MapRenderer;
+class Tile;
 class TileLayer;
 class Tileset;
 }
@@ -153,9 +156,10 @@ public:
     Tiled::Map *mergedMap() const;
 
     static void loadNeededTilesets(Building *building);
+    static void loadNeededTilesets(const QStringList &tilesetNames);
 
     void addRoomDefObjects(Tiled::Map *map);
-    void addRoomDefObjects(Tiled::Map *map, BuildingFloor *floor);
+    static void addRoomDefObjects(Tiled::Map *map, BuildingFloor *floor);
 
     static int defaultOrientation();
 
@@ -235,6 +239,44 @@ private:
     QMap<BuildingFloor*,QMap<QString,QRegion> > pendingUserTilesToLayer; // floorTilesToLayer
 };
 
+/**
+ * Makes the same map as BuildingMap::mergedMap() with addRoomDefObjects() and
+ * the building's properties, but without a MapComposite or BuildingTilesMgr,
+ * so it may be used on any thread.  Subclasses decide which Tile each tile
+ * name turns into.
+ */
+class BuildingMapMaker
+{
+public:
+    virtual ~BuildingMapMaker();
+
+    /**
+     * Lays out every floor of \a building and returns its map, without any
+     * tilesets.  Setting a cell looks at the tile's tileset, so the cells of
+     * each of \a tileLayers are returned in \a cells instead.
+     */
+    Tiled::Map *makeMap(Building *building, QList<Tiled::TileLayer*> &tileLayers,
+                        QList<QVector<Tiled::Cell>> &cells);
+
+protected:
+    /**
+     * Returns the tile layer names on \a level, as BuildingMap::layerNames().
+     */
+    virtual QStringList layerNames(int level) = 0;
+
+    /**
+     * Returns the tile for a tile the building chose, as
+     * BuildingTilesMgr::tileFor() does.
+     */
+    virtual Tiled::Tile *tileFor(const QString &tilesetName, int index) = 0;
+
+    /**
+     * Returns the tile for a user-drawn tile, or 0 for an index past the end
+     * of the tileset.  A tileset that doesn't exist gives the missing tile.
+     */
+    virtual Tiled::Tile *userTileFor(const QString &tilesetName, int index) = 0;
+};
+
 } // namespace BuildingEditor
 
 #endif // BUILDINGMAP_H
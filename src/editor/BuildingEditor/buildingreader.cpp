@@ -360,6 +360,7 @@ private:
 
     friend class BuildingReader;
     void fix(Building *building);
+    void deleteUnfixed();
 
     FurnitureTiles *fixFurniture(FurnitureTiles *ftiles);
     QMap<FurnitureTiles*,FurnitureTiles*> fixedFurniture;
@@ -1237,6 +1238,11 @@ void BuildingReader::fix(Building *building)
     d->fix(building);
 }
 
+void BuildingReader::deleteUnfixed()
+{
+    d->deleteUnfixed();
+}
+
 void BuildingReaderPrivate::fix(Building *building)
 {
 //    BuildingTileEntry *entry = BuildingTilesMgr::instance()->noneTileEntry();
@@ -1291,6 +1297,28 @@ void BuildingReaderPrivate::fix(Building *building)
     qDeleteAll(deadTiles);
 }
 
+void BuildingReaderPrivate::deleteUnfixed()
+{
+    // The same entry or furniture may have been read more than once.
+    qDeleteAll(QSet<BuildingTileEntry*>(mEntries.begin(), mEntries.end()));
+    mEntries.clear();
+    mEntryMap.clear();
+
+    qDeleteAll(QSet<FurnitureTiles*>(mFurnitureTiles.begin(), mFurnitureTiles.end()));
+    mFurnitureTiles.clear();
+    mFakeFurnitureGroup.mTiles.clear();
+
+    qDeleteAll(mFakeBuildingTilesMgr.mTileByName);
+    mFakeBuildingTilesMgr.mTileByName.clear();
+    mFakeBuildingTilesMgr.mTiles.clear();
+
+    // FakeBuildingTilesMgr leaves the used categories to fix().
+    foreach (BuildingTileCategory *category, mFakeBuildingTilesMgr.mCategories) {
+        if (mFakeBuildingTilesMgr.mUsedCategories[category])
+            delete category;
+    }
+}
+
 FurnitureTiles *BuildingReaderPrivate::fixFurniture(FurnitureTiles *ftiles)
 {
     if (!fixedFurniture.contains(ftiles)) {
@@ -35,13 +35,23 @@ public:
 
     Building *read(const QString &fileName);
 
+    /**
+     * Reads a building from \a device.  \a path is the directory of the
+     * .tbx file.
+     */
+    Building *read(QIODevice *device, const QString &path);
+
     QString errorString() const;
 
     void fix(Building *building);
 
-private:
-    Building *read(QIODevice *device, const QString &path);
+    /**
+     * Deletes the tiles, tile entries and furniture the building that was
+     * read uses, for a building that was deleted without being fixed.
+     */
+    void deleteUnfixed();
 
+private:
     friend class BuildingReaderPrivate;
     BuildingReaderPrivate *d;
 };
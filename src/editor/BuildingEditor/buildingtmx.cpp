@@ -67,13 +67,26 @@ BuildingTMX::BuildingTMX()
 {
 }
 
-QStringList BuildingTMX::tileLayerNamesForLevel(int level)
+QStringList BuildingTMX::tileLayerNames() const
 {
     QStringList ret;
     foreach (LayerInfo layerInfo, mLayers) {
         if (layerInfo.mType != LayerInfo::Tile)
             continue;
-        QString layerName = layerInfo.mName;
+        ret += layerInfo.mName;
+    }
+    return ret;
+}
+
+QStringList BuildingTMX::tileLayerNamesForLevel(int level)
+{
+    return tileLayerNamesForLevel(tileLayerNames(), level);
+}
+
+QStringList BuildingTMX::tileLayerNamesForLevel(const QStringList &tileLayerNames, int level)
+{
+    QStringList ret;
+    foreach (QString layerName, tileLayerNames) {
         int level2;
         if (MapComposite::levelForLayer(layerName, &level2)) {
             if (level2 != level)
@@ -42,7 +42,15 @@ public:
 //    const QList<LayerInfo> &layers() const
 //    { return mLayers; }
 
+    QStringList tileLayerNames() const;
     QStringList tileLayerNamesForLevel(int level);
+
+    /**
+     * Returns the names of the layers in \a tileLayerNames that are on
+     * \a level, without their level prefix.  \a tileLayerNames is what
+     * tileLayerNames() returned, so this may be called from any thread.
+     */
+    static QStringList tileLayerNamesForLevel(const QStringList &tileLayerNames, int level);
     bool exportTMX(Building *building, const QString &fileName);
 
     QString txtName();
@@ -17,6 +17,7 @@
 
 #include "ingamemapfeaturegenerator.h"
 
+#include "batchmode.h"
 #include "generatelotsfailuredialog.h"
 #include "lotfilesmanager.h"
 #include "mainwindow.h"
@@ -105,8 +106,12 @@ bool InGameMapFeatureGenerator::generateWorld(WorldDocument *worldDoc, InGameMap
         for (const GenerateCellFailure &failure : mFailures) {
             errorList += QString(QStringLiteral("Cell %1,%2: %3")).arg(failure.cell->x()).arg(failure.cell->y()).arg(failure.error);
         }
-        GenerateLotsFailureDialog dialog(errorList, MainWindow::instance());
-        dialog.exec();
+        if (BatchMode::isActive()) {
+            BatchMode::printErrors(tr("Failed to generate some cells:"), errorList);
+        } else {
+            GenerateLotsFailureDialog dialog(errorList, MainWindow::instance());
+            dialog.exec();
+        }
     }
 
 #if 0
@@ -119,7 +124,8 @@ bool InGameMapFeatureGenerator::generateWorld(WorldDocument *worldDoc, InGameMap
     return true;
 
 errorExit:
-    QMessageBox::warning(MainWindow::instance(), tr("It's no good, Jim!"), mError);
+    if (!BatchMode::isActive())
+        QMessageBox::warning(MainWindow::instance(), tr("It's no good, Jim!"), mError);
     return false;
 }
 
@@ -467,6 +473,164 @@ public:
     }
 };
 
+/**
+ * Traces the outlines of a mask of squares, like OutlineGrid, but also finds
+ * the holes inside each outline.  Corners and turns follow OutlineGrid, so
+ * squares touching diagonally are joined into one polygon.  Rings are walked
+ * with a loop rather than recursion since a river can wind around a whole
+ * cell.
+ */
+class MaskOutline {
+public:
+    MaskOutline(int w, int h)
+        : W(w)
+        , H(h)
+        , mask(size_t(w * h), false)
+    {
+    }
+
+    void set(int x, int y) {
+        mask[size_t(x + y * W)] = true;
+    }
+
+    void set(const QRect& rect) {
+        const QRect r = rect & QRect(0, 0, W, H);
+        for (int y = r.top(); y <= r.bottom(); y++)
+            for (int x = r.left(); x <= r.right(); x++)
+                set(x, y);
+    }
+
+    bool isSet(int x, int y) const {
+        if (x < 0 || x >= W)
+            return false;
+        if (y < 0 || y >= H)
+            return false;
+        return mask[size_t(x + y * W)];
+    }
+
+    void trace(std::vector<pzPolygon>& polygons) {
+        edges.assign(size_t(W * H), 0);
+        for (int y = 0; y < H; y++) {
+            for (int x = 0; x < W; x++) {
+                if (!isSet(x, y))
+                    continue;
+                quint8 e = 0;
+                if (!isSet(x, y - 1))
+                    e |= EdgeN;
+                if (!isSet(x + 1, y))
+                    e |= EdgeE;
+                if (!isSet(x, y + 1))
+                    e |= EdgeS;
+                if (!isSet(x - 1, y))
+                    e |= EdgeW;
+                edges[size_t(x + y * W)] = e;
+            }
+        }
+
+        std::vector<int> polygonForLabel(size_t(label()), -1);
+
+        // Every ring has a north edge.  The first one found in a group of
+        // squares is on its outer ring, any later ones are on holes.
+        for (int y = 0; y < H; y++) {
+            for (int x = 0; x < W; x++) {
+                const quint8 e = edges[size_t(x + y * W)];
+                if (!(e & EdgeN) || (e & (EdgeN << 4)))
+                    continue;
+                int& index = polygonForLabel[size_t(labels[size_t(x + y * W)])];
+                if (index == -1) {
+                    index = int(polygons.size());
+                    polygons.emplace_back();
+                    polygons.back().outer = traceRing(x, y);
+                } else {
+                    polygons[size_t(index)].inner.push_back(traceRing(x, y));
+                }
+            }
+        }
+    }
+
+private:
+    enum { North, East, South, West };
+    enum { EdgeN = 1, EdgeE = 2, EdgeS = 4, EdgeW = 8 }; // traced edges are shifted left by 4
+
+    // Numbers the groups of squares touching each other, diagonals included.
+    int label() {
+        labels.assign(size_t(W * H), -1);
+        std::vector<int> stack;
+        int count = 0;
+        for (int i = 0; i < W * H; i++) {
+            if (!mask[size_t(i)] || labels[size_t(i)] != -1)
+                continue;
+            labels[size_t(i)] = count;
+            stack.push_back(i);
+            while (!stack.empty()) {
+                const int x = stack.back() % W, y = stack.back() / W;
+                stack.pop_back();
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        if (isSet(x + dx, y + dy) && labels[size_t(x + dx + (y + dy) * W)] == -1) {
+                            labels[size_t(x + dx + (y + dy) * W)] = count;
+                            stack.push_back(x + dx + (y + dy) * W);
+                        }
+                    }
+                }
+            }
+            count++;
+        }
+        return count;
+    }
+
+    // The edge leaving corner v in direction dir with its square on the right.
+    bool edgeAt(const QPoint& v, int dir, int& index, quint8& bit) const {
+        int x = v.x(), y = v.y();
+        switch (dir) {
+        case North: y -= 1; bit = EdgeW; break;
+        case East: bit = EdgeN; break;
+        case South: x -= 1; bit = EdgeE; break;
+        case West: x -= 1; y -= 1; bit = EdgeS; break;
+        }
+        if (!isSet(x, y))
+            return false;
+        index = x + y * W;
+        return edges[size_t(index)] & bit;
+    }
+
+    ClipperLib::Path traceRing(int x, int y) {
+        static const QPoint step[4] = { { 0, -1 }, { 1, 0 }, { 0, 1 }, { -1, 0 } };
+        ClipperLib::Path nodes;
+        nodes.push_back({ x, y });
+        QPoint v(x, y);
+        int dir = East;
+        int index = x + y * W;
+        quint8 bit = EdgeN;
+        while (true) {
+            edges[size_t(index)] |= quint8(bit << 4); // done
+            v += step[dir];
+            // turn left, continue, turn right
+            int next = -1;
+            for (int turn : { 3, 0, 1 }) {
+                if (edgeAt(v, (dir + turn) % 4, index, bit)) {
+                    next = (dir + turn) % 4;
+                    break;
+                }
+            }
+            if (next == -1 || (edges[size_t(index)] & (bit << 4)))
+                break;
+            if (next != dir)
+                nodes.push_back({ v.x(), v.y() });
+            dir = next;
+        }
+        // The ring started partway along a straight edge.
+        if (dir == East)
+            nodes.erase(nodes.begin());
+        return nodes;
+    }
+
+    int W, H;
+    std::vector<bool> mask;
+    std::vector<quint8> edges;
+    std::vector<int> labels;
+};
+
 } // namespace
 
 bool InGameMapFeatureGenerator::processObjectGroup(WorldCell *cell, ObjectGroup *objectGroup, int levelOffset, const QPoint &offset)
@@ -844,77 +1008,46 @@ bool InGameMapFeatureGenerator::doWater(WorldCell *cell, MapInfo *mapInfo)
 
     auto* layerGroup = mapComposite->layerGroupForLevel(0);
     layerGroup->prepareDrawing2();
+    layerGroup->flatten(bounds);
 
-    ClipperLib::Clipper clipper;
-    ClipperLib::Path path;
-
-    static QVector<const Tiled::Cell*> cells(40);
+    // Most squares use the same few tilesets, only compare the name when
+    // the tileset changes.
+    const Tileset *lastTileset = nullptr;
+    bool lastIsWater = false;
 
     auto isWaterAt = [&](int x, int y) {
-        cells.resize(0);
-        layerGroup->orderedCellsAt2({x, y}, cells);
-        for (auto* cell : qAsConst(cells)) {
-            if (cell->isEmpty())
+        const Tiled::Cell *cells;
+        int count = layerGroup->flatCellsAt({x, y}, cells);
+        for (int i = 0; i < count; i++) {
+            const Tiled::Cell &cell = cells[i];
+            if (cell.isEmpty() || cell.tile->id() >= 8)
                 continue;
-            if ((cell->tile->id() < 8) && (cell->tile->tileset()->name() == QStringLiteral("blends_natural_02"))) {
+            if (cell.tile->tileset() != lastTileset) {
+                lastTileset = cell.tile->tileset();
+                lastIsWater = lastTileset->name() == QLatin1String("blends_natural_02");
+            }
+            if (lastIsWater) {
                 return true;
             }
         }
         return false;
     };
 
+    MaskOutline outline(bounds.width(), bounds.height());
     for (int y = 0; y < bounds.height(); y++) {
         for (int x = 0; x < bounds.width(); x++) {
-            if (isWaterAt(x, y)) {
-#if 1
-                path.clear();
-                path << ClipperLib::IntPoint(x, y);
-                path << ClipperLib::IntPoint(x + 1, y);
-                path << ClipperLib::IntPoint(x + 1, y + 1);
-                path << ClipperLib::IntPoint(x, y + 1);
-                clipper.AddPath(path, ClipperLib::ptSubject, true);
-#else
-                // This should work...
-                int end = x + 1;
-                for (; end < bounds.width(); end++) {
-                    if (isWaterAt(end, y) == false)
-                        break;
-                }
-                path.clear();
-                path << ClipperLib::IntPoint(x, y);
-                path << ClipperLib::IntPoint(end, y);
-                path << ClipperLib::IntPoint(end, y + 1);
-                path << ClipperLib::IntPoint(x, y + 1);
-                clipper.AddPath(path, ClipperLib::ptSubject, true);
-                x = end - 1;
-#endif
-            }
+            if (isWaterAt(x, y))
+                outline.set(x, y);
         }
     }
 
-    ClipperLib::PolyTree polyTree;
-    if (clipper.Execute(ClipperLib::ctDifference, polyTree, ClipperLib::PolyFillType::pftPositive) == false) {
-        return true;
-    }
-
-    std::map<ClipperLib::PolyNode*,pzPolygon*> polyMap;
-    std::vector<pzPolygon*> allPolygons;
-    for (ClipperLib::PolyNode* node = polyTree.GetFirst(); node != nullptr; node = node->GetNext()) {
-        if (node->IsHole()) {
-            pzPolygon *outer = polyMap[node->Parent];
-            outer->inner.push_back(node->Contour);
-        } else {
-            pzPolygon* poly = new pzPolygon();
-            poly->outer = node->Contour;
-            polyMap[node] = poly;
-            allPolygons.push_back(poly);
-        }
-    }
+    std::vector<pzPolygon> allPolygons;
+    outline.trace(allPolygons);
 
-    for (pzPolygon *poly : allPolygons) {
+    for (pzPolygon &poly : allPolygons) {
         InGameMapFeature* feature = new InGameMapFeature(&cell->inGameMap());
         feature->properties().set(QStringLiteral("water"), QStringLiteral("river"));
-        ClipperLib::Path simple = poly->outer;
+        ClipperLib::Path simple = poly.outer;
         simplifyPolygon(simple);
         feature->mGeometry.mType = QStringLiteral("Polygon");
         InGameMapCoordinates coords;
@@ -923,8 +1056,8 @@ bool InGameMapFeatureGenerator::doWater(WorldCell *cell, MapInfo *mapInfo)
         }
         feature->mGeometry.mCoordinates += coords;
 
-        if (poly->inner.empty() == false) {
-            for (auto& hole : poly->inner) {
+        if (poly.inner.empty() == false) {
+            for (auto& hole : poly.inner) {
                 simple = hole;
                 simplifyPolygon(simple);
                 coords.clear();
@@ -938,7 +1071,6 @@ bool InGameMapFeatureGenerator::doWater(WorldCell *cell, MapInfo *mapInfo)
         mWorldDoc->addInGameMapFeature(cell, cell->inGameMap().features().size(), feature);
     }
 
-    qDeleteAll(allPolygons);
     return true;
 }
 
@@ -970,16 +1102,23 @@ bool InGameMapFeatureGenerator::doTrees(WorldCell *cell, MapInfo *mapInfo)
 
     auto* layerGroup = mapComposite->layerGroupForLevel(0);
     layerGroup->prepareDrawing2();
+    layerGroup->flatten(bounds);
 
-    static QVector<const Tiled::Cell*> cells(40);
+    const Tileset *lastTileset = nullptr;
+    bool lastIsTrees = false;
 
     auto isTreeAt = [&](int _x, int _y) {
-        cells.resize(0);
-        layerGroup->orderedCellsAt2({_x, _y}, cells);
-        for (auto* cell : qAsConst(cells)) {
-            if (cell->isEmpty())
+        const Tiled::Cell *cells;
+        int count = layerGroup->flatCellsAt({_x, _y}, cells);
+        for (int i = 0; i < count; i++) {
+            const Tiled::Cell &cell = cells[i];
+            if (cell.isEmpty() || cell.tile->id() < 8 || cell.tile->id() > 15)
                 continue;
-            if (cell->tile->id() >= 8 && cell->tile->id() <= 15 && cell->tile->tileset()->name() == QStringLiteral("vegetation_trees_01")) {
+            if (cell.tile->tileset() != lastTileset) {
+                lastTileset = cell.tile->tileset();
+                lastIsTrees = lastTileset->name() == QLatin1String("vegetation_trees_01");
+            }
+            if (lastIsTrees) {
                 return true;
             }
         }
@@ -1008,45 +1147,21 @@ bool InGameMapFeatureGenerator::doTrees(WorldCell *cell, MapInfo *mapInfo)
 
     };
 
-    ClipperLib::Clipper clipper;
-    ClipperLib::Path path;
-
+    MaskOutline outline(bounds.width(), bounds.height());
     for (int y = 0; y < bounds.height(); y++) {
         for (int x = 0; x < bounds.width(); x++) {
             if (trees[x + y * 300]) {
                 QRect box = getTreesNear(x, y);
                 if (box.size() != QSize(1, 1)) {
-                    path.clear();
                     box.adjust(-1, -1, 1, 1);
-                    box &= bounds;
-                    path << ClipperLib::IntPoint(box.left(), box.top());
-                    path << ClipperLib::IntPoint(box.right() + 1, box.top());
-                    path << ClipperLib::IntPoint(box.right() + 1, box.bottom() + 1);
-                    path << ClipperLib::IntPoint(box.left(), box.bottom() + 1);
-                    clipper.AddPath(path, ClipperLib::ptSubject, true);
+                    outline.set(box & bounds);
                 }
             }
         }
     }
 
-    ClipperLib::PolyTree polyTree;
-    if (clipper.Execute(ClipperLib::ctDifference, polyTree, ClipperLib::PolyFillType::pftPositive) == false) {
-        return true;
-    }
-
-    std::map<ClipperLib::PolyNode*,pzPolygon*> polyMap;
-    std::vector<pzPolygon*> allPolygons;
-    for (ClipperLib::PolyNode* node = polyTree.GetFirst(); node != nullptr; node = node->GetNext()) {
-        if (node->IsHole()) {
-            pzPolygon *outer = polyMap[node->Parent];
-            outer->inner.push_back(node->Contour);
-        } else {
-            pzPolygon* poly = new pzPolygon();
-            poly->outer = node->Contour;
-            polyMap[node] = poly;
-            allPolygons.push_back(poly);
-        }
-    }
+    std::vector<pzPolygon> allPolygons;
+    outline.trace(allPolygons);
 
 #if 0
     int nextID = 0;
@@ -1055,8 +1170,8 @@ bool InGameMapFeatureGenerator::doTrees(WorldCell *cell, MapInfo *mapInfo)
     }
 #endif
 
-    for (pzPolygon *poly : allPolygons) {
-        ClipperLib::Path simple = poly->outer;
+    for (pzPolygon &poly : allPolygons) {
+        ClipperLib::Path simple = poly.outer;
         simplifyPolygon(simple);
         if (simple.size() < 3) {
             continue;
@@ -1086,9 +1201,9 @@ bool InGameMapFeatureGenerator::doTrees(WorldCell *cell, MapInfo *mapInfo)
         }
         feature->mGeometry.mCoordinates += coords;
 
-        if (poly->inner.empty() == false) {
+        if (poly.inner.empty() == false) {
 #if 1
-            for (auto& hole : poly->inner) {
+            for (auto& hole : poly.inner) {
                 simple = hole;
                 simplifyPolygon(simple);
                 if (simple.size() < 3) {
@@ -1110,7 +1225,7 @@ bool InGameMapFeatureGenerator::doTrees(WorldCell *cell, MapInfo *mapInfo)
         mWorldDoc->addInGameMapFeature(cell, cell->inGameMap().features().size(), feature);
 
 #if 0
-        for (auto& hole : poly->inner) {
+        for (auto& hole : poly.inner) {
             InGameMapFeature* feature = new InGameMapFeature(&cell->inGameMap());
             feature->properties().set(QStringLiteral("natural"), QStringLiteral("forest"));
             feature->properties().set(QStringLiteral("hole"), nextID);
@@ -1127,6 +1242,5 @@ bool InGameMapFeatureGenerator::doTrees(WorldCell *cell, MapInfo *mapInfo)
 #endif
     }
 
-    qDeleteAll(allPolygons);
     return true;
 }
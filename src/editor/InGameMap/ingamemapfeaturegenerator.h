@@ -64,6 +64,9 @@ public:
 
     QString errorString() const { return mError; }
 
+    const QList<GenerateCellFailure> &failures() const
+    { return mFailures; }
+
 private:
     bool shouldGenerateCell(WorldCell *cell);
     bool generateCell(WorldCell *cell);
@@ -18,18 +18,19 @@
 #include "ingamemapimagedialog.h"
 #include "ui_ingamemapimagedialog.h"
 
+#include "ingamemapimagerenderer.h"
+
 #include "celldocument.h"
 #include "chunkmap.h"
 #include "documentmanager.h"
 #include "world.h"
 #include "worlddocument.h"
 
-#include "BuildingEditor/buildingtiles.h"
-
-#include <QBuffer>
 #include <QDebug>
 #include <QFileDialog>
+#include <QFileInfo>
 #include <QImage>
+#include <QMessageBox>
 
 InGameMapImageDialog::InGameMapImageDialog(QWidget *parent) :
     QDialog(parent),
@@ -113,148 +114,80 @@ void InGameMapImageDialog::createImage()
     IsoMetaGrid metaGrid;
     metaGrid.Create(inputPath);
     QSize worldSize(metaGrid.maxx - metaGrid.minx + 1, metaGrid.maxy - metaGrid.miny + 1);
-
-    QImage image(worldSize * 300, QImage::Format_RGBA8888);
-    image.fill(Qt::gray);
-
-    for (int cy = metaGrid.miny; cy <= metaGrid.maxy; cy++) {
-        for (int cx = metaGrid.minx; cx <= metaGrid.maxx; cx++) {
-            ui->statusLabel->setText(QStringLiteral("Creating Image (cell %1,%2)").arg(cx).arg(cy));
+    const int cellSize = IsoChunkMap::CellSize;
+
+    InGameMapImageRenderer renderer(inputPath);
+    mCellsDone = 0;
+    mCellCount = worldSize.width() * worldSize.height();
+
+    // A large world may not fit in memory as a single image, so optionally
+    // write a separate image for each row of cells.
+    if (ui->stripsCheckBox->isChecked()) {
+        QString stripPath = outputPath.left(outputPath.length() - 4) + QStringLiteral("_%1.png");
+        QImage image;
+        for (int cy = metaGrid.miny; cy <= metaGrid.maxy; cy++) {
+            if (!allocateImage(image, QSize(worldSize.width(), 1) * cellSize))
+                break;
+            for (int cx = metaGrid.minx; cx <= metaGrid.maxx; cx++) {
+                renderer.addCell(image, (cx - metaGrid.minx) * cellSize, 0, cx, cy);
+            }
+            if (!waitForRenderer(renderer, worldSize.width()))
+                break;
+            QString fileName = stripPath.arg(cy);
+            ui->statusLabel->setText(QStringLiteral("Writing %1").arg(QFileInfo(fileName).fileName()));
             qApp->processEvents();
-            if (mStop) {
-                qDeleteAll(IsoLot::InfoHeaders);
-                IsoLot::InfoHeaders.clear();
-                mStop = false;
-                return;
+            image.save(fileName);
+        }
+    } else {
+        QImage image;
+        if (allocateImage(image, worldSize * cellSize)) {
+            for (int cy = metaGrid.miny; cy <= metaGrid.maxy; cy++) {
+                for (int cx = metaGrid.minx; cx <= metaGrid.maxx; cx++) {
+                    renderer.addCell(image, (cx - metaGrid.minx) * cellSize,
+                                     (cy - metaGrid.miny) * cellSize, cx, cy);
+                }
+            }
+            if (waitForRenderer(renderer, mCellCount)) {
+                ui->statusLabel->setText(QStringLiteral("Writing PNG"));
+                qApp->processEvents();
+                image.save(outputPath);
             }
-            cellToImage(image, inputPath, metaGrid, cx, cy);
         }
     }
 
-    ui->statusLabel->setText(QStringLiteral("Writing PNG"));
-    qApp->processEvents();
-    image.save(outputPath);
+    qDeleteAll(IsoLot::InfoHeaders);
+    IsoLot::InfoHeaders.clear();
 }
 
-void InGameMapImageDialog::cellToImage(QImage &image, const QString &mapDirectory, IsoMetaGrid& metaGrid, int cellX, int cellY)
+bool InGameMapImageDialog::allocateImage(QImage &image, const QSize &size)
 {
-    QString filenameheader = QStringLiteral("%1/%2_%3.lotheader").arg(mapDirectory).arg(cellX).arg(cellY);
-    if (!IsoLot::InfoHeaders.contains(filenameheader)) {
-        return;
-    }
-    LotHeader* header = IsoLot::InfoHeaders[filenameheader];
-    QString filenamepack = QStringLiteral("%1/world_%2_%3.lotpack").arg(mapDirectory).arg(cellX).arg(cellY);
-    QFile file(filenamepack);
-    if (!file.open(QFile::ReadOnly)) {
-        return;
-    }
-
-    QBuffer buffer;
-    buffer.open(QBuffer::ReadWrite);
-    buffer.write(file.readAll());
-    file.close();
-    buffer.seek(0);
-
-    QDataStream in(&buffer);
-    in.setByteOrder(QDataStream::LittleEndian);
-
-    for (int chunkY = 0; chunkY < 300 / 10; chunkY++) {
-        for (int chunkX = 0; chunkX < 300 / 10; chunkX++) {
-            int index = chunkX * IsoChunkMap::ChunkGridWidth + chunkY;
-            buffer.seek(4 + index * 8);
-            qint64 pos;
-            in >> pos;
-            buffer.seek(pos);
-            int skip = 0;
-            for (int z = 0; z < header->levels; ++z) {
-                for (int x = 0; x < IsoChunkMap::ChunksPerWidth; ++x) {
-                    for (int y = 0; y < IsoChunkMap::ChunksPerWidth; ++y) {
-                        if (skip > 0) {
-                            --skip;
-                            continue;
-                        }
-                        int count = IsoLot::readInt(in);
-                        if (count == -1) {
-                            skip = IsoLot::readInt(in);
-                            if (skip > 0) {
-                                --skip;
-                            }
-                            continue;
-                        }
-                        int roomID = IsoLot::readInt(in);
-//                        roomIDs[x][y][z] = roomID;
-                        Q_ASSERT(count > 1 && count < 30);
-                        for (int n = 1; n < count; ++n) {
-                            int tileNameIndex = IsoLot::readInt(in);
-//                            this->data[x][y][z] += d;
-                            QString tileName = header->tilesUsed[tileNameIndex];
-                            BuildingEditor::BuildingTile buildingTile = header->buildingTiles[tileNameIndex];
-                            int pixelX = (cellX - metaGrid.minx) * 300 + chunkX * 10 + x;
-                            int pixelY = (cellY - metaGrid.miny) * 300 + chunkY * 10 + y;
-                            tileToImage(image, buildingTile, pixelX, pixelY);
-                        }
-                    }
-                }
-                break; // z=0 only
-            }
-        }
+    image = QImage(); // free the previous strip first
+    image = QImage(size, QImage::Format_RGB32);
+    if (image.isNull()) {
+        QMessageBox::warning(this, windowTitle(),
+                             tr("There isn't enough memory for a %1x%2 image.\n"
+                                "Try writing one image for each row of cells.")
+                             .arg(size.width()).arg(size.height()));
+        return false;
     }
+    image.fill(Qt::gray);
+    return true;
 }
 
-void InGameMapImageDialog::tileToImage(QImage &image, const BuildingEditor::BuildingTile &buildingTile, int pixelX, int pixelY)
+bool InGameMapImageDialog::waitForRenderer(InGameMapImageRenderer &renderer, int cellCount)
 {
-    if (buildingTile.mIndex == -1) {
-        return; // failed to parse the tile name
-    }
-    int tileIndex = buildingTile.mIndex;
-    if (buildingTile.mTilesetName.contains(QStringLiteral("_trees"))) {
-        image.setPixel(pixelX, pixelY, qRgb(38, 53, 22)); // normaltree
-    }
-    if (buildingTile.mTilesetName.contains(QStringLiteral("jumbo"))) {
-        image.setPixel(pixelX, pixelY, qRgb(38, 53, 22)); // jumbotree
-    }
-    if (buildingTile.mTilesetName.contains(QStringLiteral("_railroad"))) {
-        image.setPixel(pixelX, pixelY, qRgb(73, 58, 43)); // rails
-    }
-    if (buildingTile.mTilesetName.startsWith(QStringLiteral("vegetation"))) {
-        image.setPixel(pixelX, pixelY, qRgb(48, 73, 32)); // vegetation
-    }
-    if (buildingTile.mTilesetName.startsWith(QStringLiteral("blends_natural_01"))) {
-        if (tileIndex >= 0 && tileIndex <= 15) {
-            image.setPixel(pixelX, pixelY, qRgb(217, 207, 183)); // sand
-        }
-        if (tileIndex >= 16 && tileIndex <= 31) {
-            image.setPixel(pixelX, pixelY, qRgb(75, 88, 27)); // darkgrass
-        }
-        if (tileIndex >= 32 && tileIndex <= 47) {
-            image.setPixel(pixelX, pixelY, qRgb(97, 103, 36)); // medgrass
+    int cellsDone = mCellsDone;
+    while (renderer.isBusy()) {
+        ui->statusLabel->setText(QStringLiteral("Creating Image (%1 / %2 cells)")
+                                 .arg(cellsDone + cellCount - renderer.jobsInFlight())
+                                 .arg(mCellCount));
+        qApp->processEvents(QEventLoop::WaitForMoreEvents);
+        if (mStop) {
+            renderer.abort();
+            mStop = false;
+            return false;
         }
-        if (tileIndex >= 48 && tileIndex <= 63) {
-            image.setPixel(pixelX, pixelY, qRgb(127, 120, 45)); // litegrass
-        }
-        if (tileIndex >= 64 && tileIndex <= 79) {
-            image.setPixel(pixelX, pixelY, qRgb(91, 63, 21)); // dirt
-        }
-    }
-    if (buildingTile.mTilesetName.startsWith(QStringLiteral("blends_natural_02"))) {
-        image.setPixel(pixelX, pixelY, qRgb(108, 127, 131)); // water
-    }
-    if (buildingTile.mTilesetName.startsWith(QStringLiteral("blends_street_01"))) {
-        image.setPixel(pixelX, pixelY, qRgb(128, 128, 128)); // street
-    }
-    if (buildingTile.mTilesetName.startsWith(QStringLiteral("floors_exterior_tilesandstone"))) {
-        image.setPixel(pixelX, pixelY, qRgb(132, 81, 76)); // tilesand
-    }
-    if (buildingTile.mTilesetName.startsWith(QStringLiteral("floors_exterior_tilesandwood"))) {
-        image.setPixel(pixelX, pixelY, qRgb(132, 81, 76)); // tilesand
-    }
-    if (buildingTile.mTilesetName.startsWith(QStringLiteral("location_"))) {
-        image.setPixel(pixelX, pixelY, qRgb(132, 81, 76)); // tilesand
-    }
-    if (buildingTile.mTilesetName.startsWith(QStringLiteral("vegetation_farm"))) {
-        image.setPixel(pixelX, pixelY, qRgb(218, 165, 32)); // Corn
-    }
-    if (buildingTile.mTilesetName.startsWith(QStringLiteral("walls_"))) {
-        image.setPixel(pixelX, pixelY, qRgb(93, 44, 39)); // walls
     }
+    mCellsDone += cellCount;
+    return true;
 }
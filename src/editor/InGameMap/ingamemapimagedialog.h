@@ -20,11 +20,7 @@
 
 #include <QDialog>
 
-class IsoMetaGrid;
-
-namespace BuildingEditor {
-class BuildingTile;
-}
+class InGameMapImageRenderer;
 
 namespace Ui {
 class InGameMapImageDialog;
@@ -45,12 +41,14 @@ private slots:
 
 private:
     void createImage();
-    void cellToImage(QImage& image, const QString &mapDirectory, IsoMetaGrid &metaGrid, int cellX, int cellY);
-    void tileToImage(QImage& image, const BuildingEditor::BuildingTile &buildingTile, int pixelX, int pixelY);
+    bool allocateImage(QImage &image, const QSize &size);
+    bool waitForRenderer(InGameMapImageRenderer &renderer, int cellCount);
 
     Ui::InGameMapImageDialog *ui;
     bool mRunning = false;
     bool mStop = false;
+    int mCellsDone = 0;
+    int mCellCount = 0;
 };
 
 #endif // INGAMEMAPIMAGEDIALOG_H
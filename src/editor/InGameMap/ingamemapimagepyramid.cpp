@@ -0,0 +1,371 @@
+/*
+ * Copyright 2023, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ingamemapimagepyramid.h"
+
+#include "ingamemapimagerenderer.h"
+
+#include <quazip.h>
+#include <quazipfile.h>
+
+#include <QBuffer>
+#include <QDir>
+#include <QImageReader>
+
+#include <cstring>
+
+bool InGameMapImagePyramidPngSource::load(const QString &fileName)
+{
+    QImageReader reader(fileName);
+    if (!reader.read(&mImage)) {
+        mError = tr("Error reading %1\n%2")
+                .arg(QDir::toNativeSeparators(fileName))
+                .arg(reader.errorString());
+        return false;
+    }
+    if (mImage.format() != QImage::Format_RGB32)
+        mImage = mImage.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+    mNextRow = 0;
+    return true;
+}
+
+QImage InGameMapImagePyramidPngSource::nextBand()
+{
+    if (mNextRow >= mImage.height()) {
+        mImage = QImage();
+        return QImage();
+    }
+    // QImage::copy() would double the memory used, so the band shares the
+    // pixels of the source image instead.
+    int rows = qMin(InGameMapImagePyramid::TileSize, mImage.height() - mNextRow);
+    QImage band(mImage.constScanLine(mNextRow), mImage.width(), rows,
+                mImage.bytesPerLine(), mImage.format());
+    mNextRow += rows;
+    return band;
+}
+
+/////
+
+InGameMapImagePyramidLotPackSource::InGameMapImagePyramidLotPackSource()
+    : mRenderer(nullptr)
+    , mNextCellY(0)
+{
+}
+
+InGameMapImagePyramidLotPackSource::~InGameMapImagePyramidLotPackSource()
+{
+    delete mRenderer;
+    qDeleteAll(IsoLot::InfoHeaders);
+    IsoLot::InfoHeaders.clear();
+}
+
+bool InGameMapImagePyramidLotPackSource::load(const QString &mapDirectory)
+{
+    qDeleteAll(IsoLot::InfoHeaders);
+    IsoLot::InfoHeaders.clear();
+
+    mMapDirectory = mapDirectory;
+    mMetaGrid.Create(mapDirectory);
+    if (IsoLot::InfoHeaders.isEmpty()) {
+        mError = tr("There are no .lotheader files in %1")
+                .arg(QDir::toNativeSeparators(mapDirectory));
+        return false;
+    }
+
+    delete mRenderer;
+    mRenderer = new InGameMapImageRenderer(mapDirectory);
+    mNextCellY = mMetaGrid.miny;
+    return true;
+}
+
+QRect InGameMapImagePyramidLotPackSource::bounds() const
+{
+    const QRect cells = mMetaGrid.cellBounds();
+    return QRect(cells.topLeft() * IsoChunkMap::CellSize, cells.size() * IsoChunkMap::CellSize);
+}
+
+QSize InGameMapImagePyramidLotPackSource::size() const
+{
+    return mMetaGrid.cellBounds().size() * IsoChunkMap::CellSize;
+}
+
+QImage InGameMapImagePyramidLotPackSource::nextBand()
+{
+    if (mRenderer == nullptr || mNextCellY > mMetaGrid.maxy)
+        return QImage();
+
+    const int cellSize = IsoChunkMap::CellSize;
+    QImage band(mMetaGrid.cellBounds().width() * cellSize, cellSize, QImage::Format_RGB32);
+    if (band.isNull()) {
+        mError = tr("Out of memory");
+        return QImage();
+    }
+    band.fill(Qt::gray);
+    for (int cx = mMetaGrid.minx; cx <= mMetaGrid.maxx; cx++)
+        mRenderer->addCell(band, (cx - mMetaGrid.minx) * cellSize, 0, cx, mNextCellY);
+    while (mRenderer->isBusy())
+        qApp->processEvents(QEventLoop::ExcludeUserInputEvents | QEventLoop::WaitForMoreEvents);
+    ++mNextCellY;
+    return band;
+}
+
+/////
+
+InGameMapImagePyramidWorker::InGameMapImagePyramidWorker(InterruptibleThread *thread)
+    : BaseWorker(thread)
+{
+}
+
+InGameMapImagePyramidWorker::~InGameMapImagePyramidWorker()
+{
+    qDeleteAll(mTiles);
+}
+
+void InGameMapImagePyramidWorker::work()
+{
+    IN_WORKER_THREAD
+
+    if (mTiles.size()) {
+        InGameMapImagePyramidTile *tile = mTiles.takeFirst();
+        if (!aborted()) {
+            QBuffer buffer(&tile->mData);
+            buffer.open(QIODevice::WriteOnly);
+            tile->mSuccess = tile->mImage.save(&buffer, "PNG");
+        }
+        tile->mImage = QImage();
+        emit finished(tile);
+    }
+
+    if (mTiles.size()) scheduleWork();
+}
+
+void InGameMapImagePyramidWorker::addTile(InGameMapImagePyramidTile *tile)
+{
+    IN_WORKER_THREAD
+
+    mTiles += tile;
+    scheduleWork();
+}
+
+/////
+
+// Averages four premultiplied pixels, two channels at a time.
+static inline QRgb average4(QRgb a, QRgb b, QRgb c, QRgb d)
+{
+    const quint32 mask = 0x00FF00FF;
+    quint32 rb = (a & mask) + (b & mask) + (c & mask) + (d & mask) + 0x00020002;
+    quint32 ag = ((a >> 8) & mask) + ((b >> 8) & mask) + ((c >> 8) & mask) + ((d >> 8) & mask) + 0x00020002;
+    return ((rb >> 2) & mask) | (((ag >> 2) & mask) << 8);
+}
+
+InGameMapImagePyramid::InGameMapImagePyramid()
+    : QObject()
+    , mZip(nullptr)
+    , mNextWorkerForTile(0)
+    , mTilesInFlight(0)
+{
+    qRegisterMetaType<InGameMapImagePyramidTile*>("InGameMapImagePyramidTile*");
+}
+
+InGameMapImagePyramid::~InGameMapImagePyramid()
+{
+    stopWorkers();
+}
+
+bool InGameMapImagePyramid::write(InGameMapImagePyramidSource &source, QuaZip &zip)
+{
+    mZip = &zip;
+    mError.clear();
+
+    QSize size = source.size();
+    mLevels.clear();
+    for (int level = 0; level < MaxLevels; level++) {
+        Level L;
+        L.width = size.width() >> level;
+        L.height = size.height() >> level;
+        if (L.width == 0 || L.height == 0)
+            break;
+        L.rowCount = 0;
+        L.tileRow = 0;
+        L.hasOddRow = false;
+        L.oddRow.resize(L.width);
+        L.downsampled.resize(L.width / 2);
+        mLevels += L;
+        int columns = (L.width + TileSize - 1) / TileSize;
+        int rows = (L.height + TileSize - 1) / TileSize;
+        emit message(QStringLiteral("Creating images for level %1. width x height = %2 x %3").arg(level).arg(columns).arg(rows));
+        if (L.width <= TileSize && L.height <= TileSize)
+            break;
+    }
+
+    startWorkers();
+
+    int rowsRead = 0;
+    while (mError.isEmpty()) {
+        QImage band = source.nextBand();
+        if (band.isNull())
+            break;
+        Q_ASSERT(band.width() == size.width());
+        Q_ASSERT(band.depth() == 32);
+        int rowCount = qMin(band.height(), size.height() - rowsRead);
+        addRows(0, reinterpret_cast<const QRgb*>(band.constBits()),
+                band.bytesPerLine() / sizeof(QRgb), rowCount);
+        rowsRead += rowCount;
+    }
+    if (mError.isEmpty() && rowsRead < size.height()) {
+        mError = source.errorString().isEmpty() ? tr("Error reading the input image.")
+                                                : source.errorString();
+    }
+
+    // The last row of tiles in each level is only partly filled.
+    if (mError.isEmpty()) {
+        for (int level = 0; level < mLevels.size(); level++) {
+            if (mLevels[level].rowCount > 0)
+                writeTileRow(level);
+        }
+    }
+
+    while (mTilesInFlight > 0)
+        qApp->processEvents(QEventLoop::ExcludeUserInputEvents | QEventLoop::WaitForMoreEvents);
+    stopWorkers();
+    mLevels.clear();
+    mZip = nullptr;
+
+    return mError.isEmpty();
+}
+
+void InGameMapImagePyramid::addRows(int level, const QRgb *pixels, int stride, int rowCount)
+{
+    Level &L = mLevels[level];
+    const bool downsample = level + 1 < mLevels.size();
+    for (int y = 0; y < rowCount; y++) {
+        const QRgb *row = pixels + y * stride;
+        L.rows.resize((L.rowCount + 1) * L.width);
+        std::memcpy(L.rows.data() + L.rowCount * L.width, row, L.width * sizeof(QRgb));
+        ++L.rowCount;
+
+        // Each pair of rows becomes one row of the next level.  The last
+        // row of an image with an odd height is dropped.
+        if (downsample) {
+            if (L.hasOddRow) {
+                const QRgb *above = L.oddRow.constData();
+                QRgb *dest = L.downsampled.data();
+                for (int x = 0; x < L.downsampled.size(); x++) {
+                    dest[x] = average4(above[x * 2], above[x * 2 + 1],
+                                       row[x * 2], row[x * 2 + 1]);
+                }
+                L.hasOddRow = false;
+                addRows(level + 1, L.downsampled.constData(), L.downsampled.size(), 1);
+            } else {
+                std::memcpy(L.oddRow.data(), row, L.width * sizeof(QRgb));
+                L.hasOddRow = true;
+            }
+        }
+
+        if (L.rowCount == TileSize)
+            writeTileRow(level);
+    }
+}
+
+void InGameMapImagePyramid::writeTileRow(int level)
+{
+    Level &L = mLevels[level];
+    int columns = (L.width + TileSize - 1) / TileSize;
+    for (int col = 0; col < columns; col++) {
+        // Don't let the encoded tiles pile up if the workers fall behind.
+        while (mTilesInFlight >= mWorkers.size() * 4)
+            qApp->processEvents(QEventLoop::ExcludeUserInputEvents | QEventLoop::WaitForMoreEvents);
+
+        InGameMapImagePyramidTile *tile = new InGameMapImagePyramidTile;
+        tile->mFileName = QStringLiteral("%1/tile%2x%3.png").arg(level).arg(col).arg(L.tileRow);
+        tile->mSuccess = false;
+        // Tiles along the right and bottom edges are padded with transparent pixels.
+        tile->mImage = QImage(TileSize, TileSize, QImage::Format_ARGB32_Premultiplied);
+        tile->mImage.fill(0);
+        int width = qMin(TileSize, L.width - col * TileSize);
+        for (int y = 0; y < L.rowCount; y++) {
+            std::memcpy(tile->mImage.scanLine(y), L.rows.constData() + y * L.width + col * TileSize,
+                        width * sizeof(QRgb));
+        }
+
+        ++mTilesInFlight;
+        QMetaObject::invokeMethod(mWorkers[mNextWorkerForTile], "addTile",
+                                  Qt::QueuedConnection,
+                                  Q_ARG(InGameMapImagePyramidTile*, tile));
+        mNextWorkerForTile = (mNextWorkerForTile + 1) % mWorkers.size();
+    }
+    L.rows.resize(0);
+    L.rowCount = 0;
+    ++L.tileRow;
+}
+
+void InGameMapImagePyramid::tileEncoded(InGameMapImagePyramidTile *tile)
+{
+    IN_APP_THREAD
+
+    --mTilesInFlight;
+
+    if (mError.isEmpty()) {
+        if (!tile->mSuccess) {
+            mError = tr("Error creating %1").arg(tile->mFileName);
+        } else {
+            QuaZipFile file(mZip);
+            QuaZipNewInfo newInfo(tile->mFileName);
+            if (!file.open(QIODevice::WriteOnly, newInfo)) {
+                mError = tr("Error opening %1 in ZIP file").arg(tile->mFileName);
+            } else {
+                if (file.write(tile->mData) != tile->mData.size())
+                    mError = tr("Error writing %1 to ZIP file").arg(tile->mFileName);
+                file.close();
+                if (mError.isEmpty() && file.getZipError() != UNZ_OK)
+                    mError = tr("Error writing %1 to ZIP file").arg(tile->mFileName);
+            }
+        }
+    }
+
+    delete tile;
+}
+
+void InGameMapImagePyramid::startWorkers()
+{
+    stopWorkers();
+
+    mWorkerThreads.resize(qMax(1, QThread::idealThreadCount()));
+    mWorkers.resize(mWorkerThreads.size());
+    for (int i = 0; i < mWorkerThreads.size(); i++) {
+        mWorkerThreads[i] = new InterruptibleThread;
+        mWorkers[i] = new InGameMapImagePyramidWorker(mWorkerThreads[i]);
+        mWorkers[i]->moveToThread(mWorkerThreads[i]);
+        connect(mWorkers[i], &InGameMapImagePyramidWorker::finished,
+                this, &InGameMapImagePyramid::tileEncoded);
+        mWorkerThreads[i]->start();
+    }
+    mNextWorkerForTile = 0;
+}
+
+void InGameMapImagePyramid::stopWorkers()
+{
+    for (int i = 0; i < mWorkerThreads.size(); i++) {
+        mWorkerThreads[i]->interrupt(); // stop the long-running task
+        mWorkerThreads[i]->quit(); // exit the event loop
+        mWorkerThreads[i]->wait(); // wait for thread to terminate
+        delete mWorkerThreads[i];
+        delete mWorkers[i];
+    }
+    mWorkerThreads.clear();
+    mWorkers.clear();
+}
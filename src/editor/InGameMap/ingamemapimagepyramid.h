@@ -0,0 +1,189 @@
+/*
+ * Copyright 2023, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INGAMEMAPIMAGEPYRAMID_H
+#define INGAMEMAPIMAGEPYRAMID_H
+
+#include "chunkmap.h"
+#include "threads.h"
+
+#include <QImage>
+#include <QVector>
+
+class InGameMapImageRenderer;
+
+class QuaZip;
+
+/**
+ * Supplies the full-size image to InGameMapImagePyramid, one band of rows
+ * at a time from top to bottom.
+ */
+class InGameMapImagePyramidSource
+{
+public:
+    virtual ~InGameMapImagePyramidSource() {}
+
+    virtual QSize size() const = 0;
+
+    /**
+     * Returns the next rows of the image, each as wide as the whole image.
+     * The format must be QImage::Format_RGB32 or Format_ARGB32_Premultiplied.
+     * Returns a null image when there are no more rows or on error.
+     */
+    virtual QImage nextBand() = 0;
+
+    QString errorString() const
+    { return mError; }
+
+protected:
+    QString mError;
+};
+
+/**
+ * A single PNG file.  PNG files can't be decoded in parts, so the whole
+ * image is held in memory.
+ */
+class InGameMapImagePyramidPngSource : public InGameMapImagePyramidSource
+{
+    Q_DECLARE_TR_FUNCTIONS(InGameMapImagePyramidPngSource)
+
+public:
+    bool load(const QString &fileName);
+
+    QSize size() const override
+    { return mImage.size(); }
+
+    QImage nextBand() override;
+
+private:
+    QImage mImage;
+    int mNextRow = 0;
+};
+
+/**
+ * A directory of .lotheader and .lotpack files.  Each band is one row of
+ * cells drawn by InGameMapImageRenderer, so the full-size image never
+ * exists.
+ */
+class InGameMapImagePyramidLotPackSource : public InGameMapImagePyramidSource
+{
+    Q_DECLARE_TR_FUNCTIONS(InGameMapImagePyramidLotPackSource)
+
+public:
+    InGameMapImagePyramidLotPackSource();
+    ~InGameMapImagePyramidLotPackSource();
+
+    bool load(const QString &mapDirectory);
+
+    // In world squares.
+    QRect bounds() const;
+
+    QSize size() const override;
+    QImage nextBand() override;
+
+private:
+    QString mMapDirectory;
+    IsoMetaGrid mMetaGrid;
+    InGameMapImageRenderer *mRenderer;
+    int mNextCellY;
+};
+
+class InGameMapImagePyramidTile
+{
+public:
+    QImage mImage;
+    QString mFileName;
+    QByteArray mData; // PNG
+    bool mSuccess;
+};
+
+class InGameMapImagePyramidWorker : public BaseWorker
+{
+    Q_OBJECT
+public:
+    InGameMapImagePyramidWorker(InterruptibleThread *thread);
+    ~InGameMapImagePyramidWorker();
+
+signals:
+    void finished(InGameMapImagePyramidTile *tile);
+
+public slots:
+    void work();
+    void addTile(InGameMapImagePyramidTile *tile);
+
+private:
+    QList<InGameMapImagePyramidTile*> mTiles;
+};
+
+/**
+ * Writes the tiles of each level of an image pyramid to a zip file.
+ *
+ * Level 0 is the source image, each following level is half the size of the
+ * previous one.  Rows of pixels flow from the source down through all the
+ * levels as they are read, and a level only holds the rows of the tiles it
+ * hasn't written yet.  Tiles are PNG-encoded on worker threads, and written
+ * to the zip file on this thread.
+ */
+class InGameMapImagePyramid : public QObject
+{
+    Q_OBJECT
+public:
+    static const int TileSize = 256;
+    static const int MaxLevels = 5;
+
+    InGameMapImagePyramid();
+    ~InGameMapImagePyramid();
+
+    bool write(InGameMapImagePyramidSource &source, QuaZip &zip);
+
+    QString errorString() const
+    { return mError; }
+
+signals:
+    void message(const QString &text);
+
+private slots:
+    void tileEncoded(InGameMapImagePyramidTile *tile);
+
+private:
+    struct Level
+    {
+        int width;
+        int height;
+        QVector<QRgb> rows; // Rows of the next row of tiles
+        int rowCount;
+        int tileRow;
+        QVector<QRgb> oddRow; // Waiting for the row below it to be downsampled
+        bool hasOddRow;
+        QVector<QRgb> downsampled;
+    };
+
+    void addRows(int level, const QRgb *pixels, int stride, int rowCount);
+    void writeTileRow(int level);
+    void startWorkers();
+    void stopWorkers();
+
+    QVector<Level> mLevels;
+    QuaZip *mZip;
+    QVector<InterruptibleThread*> mWorkerThreads;
+    QVector<InGameMapImagePyramidWorker*> mWorkers;
+    int mNextWorkerForTile;
+    int mTilesInFlight;
+    QString mError;
+};
+
+#endif // INGAMEMAPIMAGEPYRAMID_H
@@ -18,6 +18,8 @@
 #include "ingamemapimagepyramidwindow.h"
 #include "ui_ingamemapimagepyramidwindow.h"
 
+#include "ingamemapimagepyramid.h"
+
 #include "celldocument.h"
 #include "documentmanager.h"
 #include "worlddocument.h"
@@ -27,8 +29,8 @@
 #include <quazipfile.h>
 
 #include <QFileDialog>
-
-#include <cmath>
+#include <QFileInfo>
+#include <QScopedPointer>
 
 InGameMapImagePyramidWindow::InGameMapImagePyramidWindow(QWidget *parent) :
     QMainWindow(parent),
@@ -39,6 +41,7 @@ InGameMapImagePyramidWindow::InGameMapImagePyramidWindow(QWidget *parent) :
     setAttribute(Qt::WA_DeleteOnClose, true);
 
     connect(ui->inputBrowseButton, &QToolButton::clicked, this, &InGameMapImagePyramidWindow::chooseInputFile);
+    connect(ui->inputDirectoryButton, &QToolButton::clicked, this, &InGameMapImagePyramidWindow::chooseInputDirectory);
     connect(ui->outputBrowseButton, &QToolButton::clicked, this, &InGameMapImagePyramidWindow::chooseOutputFile);
     connect(ui->createZipButton, &QPushButton::clicked, this, &InGameMapImagePyramidWindow::createZip);
 
@@ -73,6 +76,16 @@ void InGameMapImagePyramidWindow::chooseInputFile()
     ui->inputNameEdit->setText(fileName);
 }
 
+void InGameMapImagePyramidWindow::chooseInputDirectory()
+{
+    QString caption = QStringLiteral("Choose Map Directory");
+    const QString dir = QFileDialog::getExistingDirectory(this, caption, ui->inputNameEdit->text());
+    if (dir.isEmpty()) {
+        return;
+    }
+    ui->inputNameEdit->setText(QDir::toNativeSeparators(dir));
+}
+
 void InGameMapImagePyramidWindow::chooseOutputFile()
 {
     QString caption = QStringLiteral("Choose Output ZIP File");
@@ -89,10 +102,28 @@ void InGameMapImagePyramidWindow::createZip()
     ui->logText->clear();
     QString inputFileName = ui->inputNameEdit->text();
     log(QStringLiteral("Reading %1").arg(inputFileName));
-    QImage image(inputFileName);
-    if (image.isNull()) {
-        log(QStringLiteral("Error reading %1").arg(inputFileName));
-        return;
+
+    QScopedPointer<InGameMapImagePyramidSource> source;
+    if (QFileInfo(inputFileName).isDir()) {
+        auto *lotPackSource = new InGameMapImagePyramidLotPackSource;
+        source.reset(lotPackSource);
+        if (!lotPackSource->load(inputFileName)) {
+            log(lotPackSource->errorString());
+            return;
+        }
+        // The bounds are known exactly.
+        QRect bounds = lotPackSource->bounds();
+        ui->xMin->setValue(bounds.left());
+        ui->yMin->setValue(bounds.top());
+        ui->xMax->setValue(bounds.right() + 1);
+        ui->yMax->setValue(bounds.bottom() + 1);
+    } else {
+        auto *pngSource = new InGameMapImagePyramidPngSource;
+        source.reset(pngSource);
+        if (!pngSource->load(inputFileName)) {
+            log(pngSource->errorString());
+            return;
+        }
     }
 
     QuaZip zip(ui->outputNameEdit->text());
@@ -101,24 +132,12 @@ void InGameMapImagePyramidWindow::createZip()
         return;
     }
 
-    int tileSize = 256;
-    int levels = 5;
-    for (int level = 0; level < levels; level++) {
-        float width = float(image.width()) / (1 << level);
-        float height = float(image.height()) / (1 << level);
-        QImage scaledImage = image.scaled(width, height, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
-        int columns = std::ceil(width / tileSize);
-        int rows = std::ceil(height / tileSize);
-        log(QStringLiteral("Creating images for level %1. width x height = %2 x %3").arg(level).arg(columns).arg(rows));
-        for (int row = 0; row < rows; row++) {
-            for (int col = 0; col < columns; col++) {
-                QImage subImage = scaledImage.copy(col * tileSize, row * tileSize, tileSize, tileSize);
-                writeImageToZip(zip, subImage, col, row, level);
-            }
-        }
-        if (width <= tileSize && height <= tileSize) {
-            break;
-        }
+    InGameMapImagePyramid pyramid;
+    connect(&pyramid, &InGameMapImagePyramid::message, this, &InGameMapImagePyramidWindow::log);
+    if (!pyramid.write(*source, zip)) {
+        log(pyramid.errorString());
+        zip.close();
+        return;
     }
 
     writePyramidTxt(zip);
@@ -128,28 +147,6 @@ void InGameMapImagePyramidWindow::createZip()
     log(QStringLiteral("FINISHED."));
 }
 
-void InGameMapImagePyramidWindow::writeImageToZip(QuaZip &zip, const QImage &image, int col, int row, int level)
-{
-    QString fileName = QStringLiteral("%1/tile%2x%3.png").arg(level).arg(col).arg(row);
-
-    log(QStringLiteral("Adding %1 to ZIP").arg(fileName));
-
-//    zip.setCurrentFile(fileName);
-
-    QuaZipFile file(&zip);
-    QuaZipNewInfo newInfo(fileName);
-    if (file.open(QIODevice::WriteOnly, newInfo) == false) {
-        log(QStringLiteral("Error opening %1 in ZIP file").arg(fileName));
-        return;
-    }
-    if (image.save(&file, "PNG") == false) {
-        log(QStringLiteral("ERROR writing %1 to ZIP file").arg(fileName));
-        file.close();
-        return;
-    }
-    file.close();
-}
-
 void InGameMapImagePyramidWindow::writePyramidTxt(QuaZip &zip)
 {
     QString fileName = QStringLiteral("pyramid.txt");
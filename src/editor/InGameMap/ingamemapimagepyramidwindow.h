@@ -37,11 +37,11 @@ public:
 
 private slots:
     void chooseInputFile();
+    void chooseInputDirectory();
     void chooseOutputFile();
     void createZip();
 
 private:
-    void writeImageToZip(QuaZip& zip, const QImage &image, int col, int row, int level);
     void writePyramidTxt(QuaZip& zip);
     void log(const QString& str);
 
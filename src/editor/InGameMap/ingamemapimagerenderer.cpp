@@ -0,0 +1,259 @@
+/*
+ * Copyright 2023, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "ingamemapimagerenderer.h"
+
+#include "chunkmap.h"
+#include "lotpackfile.h"
+
+#include "BuildingEditor/buildingtiles.h"
+
+InGameMapImageWorker::InGameMapImageWorker(InterruptibleThread *thread)
+    : BaseWorker(thread)
+{
+}
+
+InGameMapImageWorker::~InGameMapImageWorker()
+{
+}
+
+void InGameMapImageWorker::work()
+{
+    IN_WORKER_THREAD
+
+    if (mJobs.size()) {
+        InGameMapImageJob *job = mJobs.takeFirst();
+        if (!aborted())
+            renderCell(job);
+        emit finished(job);
+    }
+
+    if (mJobs.size()) scheduleWork();
+}
+
+void InGameMapImageWorker::addJob(InGameMapImageJob *job)
+{
+    IN_WORKER_THREAD
+
+    mJobs += job;
+    scheduleWork();
+}
+
+void InGameMapImageWorker::renderCell(InGameMapImageJob *job)
+{
+    LotPackFile file;
+    if (!file.open(job->mLotPackPath))
+        return;
+
+    const QRgb *colors = job->mColors.constData();
+    const int colorCount = job->mColors.size();
+    const int chunkWidth = IsoChunkMap::ChunksPerWidth;
+
+    for (int chunkY = 0; chunkY < IsoChunkMap::ChunkGridWidth; chunkY++) {
+        for (int chunkX = 0; chunkX < IsoChunkMap::ChunkGridWidth; chunkX++) {
+            int index = chunkX * IsoChunkMap::ChunkGridWidth + chunkY;
+            // z=0 only
+            LotPackChunkReader chunk = file.chunk(index, chunkWidth, 1);
+            while (chunk.nextSquare()) {
+                // The last tile with a colour decides the colour of the square.
+                QRgb color = 0;
+                for (int n = 0; n < chunk.tileCount(); ++n) {
+                    int tileNameIndex = chunk.tileAt(n);
+                    if (tileNameIndex >= 0 && tileNameIndex < colorCount && colors[tileNameIndex] != 0)
+                        color = colors[tileNameIndex];
+                }
+                if (color == 0)
+                    continue;
+                int pixelX = chunkX * chunkWidth + chunk.x();
+                int pixelY = chunkY * chunkWidth + chunk.y();
+                QRgb *line = reinterpret_cast<QRgb*>(job->mBits + pixelY * job->mBytesPerLine);
+                line[pixelX] = color;
+            }
+        }
+    }
+}
+
+/////
+
+InGameMapImageRenderer::InGameMapImageRenderer(const QString &mapDirectory)
+    : QObject()
+    , mMapDirectory(mapDirectory)
+    , mNextWorkerForJob(0)
+{
+    qRegisterMetaType<InGameMapImageJob*>("InGameMapImageJob*");
+    startWorkers();
+}
+
+InGameMapImageRenderer::~InGameMapImageRenderer()
+{
+    stopWorkers();
+    qDeleteAll(mJobs);
+}
+
+bool InGameMapImageRenderer::addCell(QImage &image, int pixelX, int pixelY, int cellX, int cellY)
+{
+    IN_APP_THREAD
+
+    Q_ASSERT(image.format() == QImage::Format_RGB32);
+    Q_ASSERT(QRect(0, 0, image.width(), image.height()).contains(
+                 QRect(pixelX, pixelY, IsoChunkMap::CellSize, IsoChunkMap::CellSize)));
+
+    QString filenameheader = QStringLiteral("%1/%2_%3.lotheader").arg(mMapDirectory).arg(cellX).arg(cellY);
+    if (!IsoLot::InfoHeaders.contains(filenameheader)) {
+        return false;
+    }
+
+    InGameMapImageJob *job = new InGameMapImageJob;
+    job->mLotPackPath = QStringLiteral("%1/world_%2_%3.lotpack").arg(mMapDirectory).arg(cellX).arg(cellY);
+    job->mColors = tileColors(IsoLot::InfoHeaders[filenameheader]);
+    job->mBytesPerLine = image.bytesPerLine();
+    job->mBits = image.scanLine(pixelY) + pixelX * sizeof(QRgb);
+
+    mJobs.insert(job);
+    QMetaObject::invokeMethod(mWorkers[mNextWorkerForJob], "addJob",
+                              Qt::QueuedConnection,
+                              Q_ARG(InGameMapImageJob*, job));
+    mNextWorkerForJob = (mNextWorkerForJob + 1) % mWorkers.size();
+    return true;
+}
+
+void InGameMapImageRenderer::abort()
+{
+    IN_APP_THREAD
+
+    stopWorkers();
+    // Deliver any finished() signals that were already queued, then delete
+    // the jobs the workers never finished, including any whose addJob() call
+    // was still queued when the worker was stopped.
+    QCoreApplication::sendPostedEvents(this, QEvent::MetaCall);
+    qDeleteAll(mJobs);
+    mJobs.clear();
+    startWorkers();
+}
+
+void InGameMapImageRenderer::jobFinished(InGameMapImageJob *job)
+{
+    IN_APP_THREAD
+
+    mJobs.remove(job);
+    delete job;
+}
+
+// Every cell's .lotheader has its own list of tile names, but most names are
+// shared between cells, so the colour of each name is only worked out once.
+QVector<QRgb> InGameMapImageRenderer::tileColors(const LotHeader *header)
+{
+    QVector<QRgb> colors(header->tilesUsed.size(), 0);
+    for (int i = 0; i < header->tilesUsed.size() && i < header->buildingTiles.size(); i++) {
+        const QString &tileName = header->tilesUsed[i];
+        auto it = mColorByTileName.constFind(tileName);
+        if (it == mColorByTileName.constEnd())
+            it = mColorByTileName.insert(tileName, tileColor(header->buildingTiles[i]));
+        colors[i] = it.value();
+    }
+    return colors;
+}
+
+QRgb InGameMapImageRenderer::tileColor(const BuildingEditor::BuildingTile &buildingTile)
+{
+    if (buildingTile.mIndex == -1) {
+        return 0; // failed to parse the tile name
+    }
+    // When more than one of these matches, the last one wins.
+    const QString &tilesetName = buildingTile.mTilesetName;
+    int tileIndex = buildingTile.mIndex;
+    QRgb color = 0;
+    if (tilesetName.contains(QStringLiteral("_trees"))) {
+        color = qRgb(38, 53, 22); // normaltree
+    }
+    if (tilesetName.contains(QStringLiteral("jumbo"))) {
+        color = qRgb(38, 53, 22); // jumbotree
+    }
+    if (tilesetName.contains(QStringLiteral("_railroad"))) {
+        color = qRgb(73, 58, 43); // rails
+    }
+    if (tilesetName.startsWith(QStringLiteral("vegetation"))) {
+        color = qRgb(48, 73, 32); // vegetation
+    }
+    if (tilesetName.startsWith(QStringLiteral("blends_natural_01"))) {
+        if (tileIndex >= 0 && tileIndex <= 15) {
+            color = qRgb(217, 207, 183); // sand
+        }
+        if (tileIndex >= 16 && tileIndex <= 31) {
+            color = qRgb(75, 88, 27); // darkgrass
+        }
+        if (tileIndex >= 32 && tileIndex <= 47) {
+            color = qRgb(97, 103, 36); // medgrass
+        }
+        if (tileIndex >= 48 && tileIndex <= 63) {
+            color = qRgb(127, 120, 45); // litegrass
+        }
+        if (tileIndex >= 64 && tileIndex <= 79) {
+            color = qRgb(91, 63, 21); // dirt
+        }
+    }
+    if (tilesetName.startsWith(QStringLiteral("blends_natural_02"))) {
+        color = qRgb(108, 127, 131); // water
+    }
+    if (tilesetName.startsWith(QStringLiteral("blends_street_01"))) {
+        color = qRgb(128, 128, 128); // street
+    }
+    if (tilesetName.startsWith(QStringLiteral("floors_exterior_tilesandstone"))) {
+        color = qRgb(132, 81, 76); // tilesand
+    }
+    if (tilesetName.startsWith(QStringLiteral("floors_exterior_tilesandwood"))) {
+        color = qRgb(132, 81, 76); // tilesand
+    }
+    if (tilesetName.startsWith(QStringLiteral("location_"))) {
+        color = qRgb(132, 81, 76); // tilesand
+    }
+    if (tilesetName.startsWith(QStringLiteral("vegetation_farm"))) {
+        color = qRgb(218, 165, 32); // Corn
+    }
+    if (tilesetName.startsWith(QStringLiteral("walls_"))) {
+        color = qRgb(93, 44, 39); // walls
+    }
+    return color;
+}
+
+void InGameMapImageRenderer::startWorkers()
+{
+    mWorkerThreads.resize(qMax(1, QThread::idealThreadCount()));
+    mWorkers.resize(mWorkerThreads.size());
+    for (int i = 0; i < mWorkerThreads.size(); i++) {
+        mWorkerThreads[i] = new InterruptibleThread;
+        mWorkers[i] = new InGameMapImageWorker(mWorkerThreads[i]);
+        mWorkers[i]->moveToThread(mWorkerThreads[i]);
+        connect(mWorkers[i], &InGameMapImageWorker::finished,
+                this, &InGameMapImageRenderer::jobFinished);
+        mWorkerThreads[i]->start();
+    }
+    mNextWorkerForJob = 0;
+}
+
+void InGameMapImageRenderer::stopWorkers()
+{
+    for (int i = 0; i < mWorkerThreads.size(); i++) {
+        mWorkerThreads[i]->interrupt(); // stop the long-running task
+        mWorkerThreads[i]->quit(); // exit the event loop
+        mWorkerThreads[i]->wait(); // wait for thread to terminate
+        delete mWorkerThreads[i];
+        delete mWorkers[i];
+    }
+    mWorkerThreads.clear();
+    mWorkers.clear();
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright 2023, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef INGAMEMAPIMAGERENDERER_H
+#define INGAMEMAPIMAGERENDERER_H
+
+#include "threads.h"
+
+#include <QHash>
+#include <QImage>
+#include <QSet>
+#include <QVector>
+
+class LotHeader;
+
+namespace BuildingEditor {
+class BuildingTile;
+}
+
+/**
+ * One cell of the world image.  The worker writes the cell's pixels starting
+ * at mBits.  No other job touches those pixels, so several cells can be drawn
+ * into the same image at the same time.
+ */
+class InGameMapImageJob
+{
+public:
+    QString mLotPackPath;
+    QVector<QRgb> mColors; // Indexed by LotHeader::tilesUsed, 0 means no colour.
+    uchar *mBits;
+    int mBytesPerLine;
+};
+
+class InGameMapImageWorker : public BaseWorker
+{
+    Q_OBJECT
+public:
+    InGameMapImageWorker(InterruptibleThread *thread);
+    ~InGameMapImageWorker();
+
+signals:
+    void finished(InGameMapImageJob *job);
+
+public slots:
+    void work();
+    void addJob(InGameMapImageJob *job);
+
+private:
+    void renderCell(InGameMapImageJob *job);
+
+    QList<InGameMapImageJob*> mJobs; // owned by InGameMapImageRenderer
+};
+
+/**
+ * Draws the ground of each cell in a directory of .lotheader and .lotpack
+ * files into an image, one pixel per square.  Cells are decoded on worker
+ * threads.
+ */
+class InGameMapImageRenderer : public QObject
+{
+    Q_OBJECT
+public:
+    InGameMapImageRenderer(const QString &mapDirectory);
+    ~InGameMapImageRenderer();
+
+    /**
+     * Queues a cell to be drawn with its top-left corner at \a pixelX,\a pixelY.
+     * The image must be QImage::Format_RGB32 and must not be copied, resized
+     * or painted on until isBusy() returns false.
+     * Returns false if the cell has no .lotheader file.
+     */
+    bool addCell(QImage &image, int pixelX, int pixelY, int cellX, int cellY);
+
+    bool isBusy() const
+    { return !mJobs.isEmpty(); }
+
+    int jobsInFlight() const
+    { return mJobs.size(); }
+
+    /**
+     * Stops the workers, discarding any cells that haven't been drawn.
+     */
+    void abort();
+
+    /**
+     * The colour of a square containing the given tile, or 0 if the tile
+     * doesn't change the colour of the square.
+     */
+    static QRgb tileColor(const BuildingEditor::BuildingTile &buildingTile);
+
+private slots:
+    void jobFinished(InGameMapImageJob *job);
+
+private:
+    QVector<QRgb> tileColors(const LotHeader *header);
+    void startWorkers();
+    void stopWorkers();
+
+    QString mMapDirectory;
+    QHash<QString,QRgb> mColorByTileName;
+    QVector<InterruptibleThread*> mWorkerThreads;
+    QVector<InGameMapImageWorker*> mWorkers;
+    int mNextWorkerForJob;
+    QSet<InGameMapImageJob*> mJobs; // handed to a worker and not finished yet
+};
+
+#endif // INGAMEMAPIMAGERENDERER_H
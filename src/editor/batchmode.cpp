@@ -0,0 +1,747 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "batchmode.h"
+
+#include "bmptotmx.h"
+#include "defaultsfile.h"
+#include "lotfilesmanager.h"
+#include "mapcomposite.h"
+#include "mapmanager.h"
+#include "tilemetainfomgr.h"
+#include "tilesetmanager.h"
+#include "tmxtobmp.h"
+#include "world.h"
+#include "worldcell.h"
+#include "worlddocument.h"
+#include "worldreader.h"
+
+#include "InGameMap/ingamemapfeaturegenerator.h"
+
+#include "BuildingEditor/buildingtiles.h"
+#include "BuildingEditor/buildingtemplates.h"
+#include "BuildingEditor/buildingtmx.h"
+#include "BuildingEditor/furnituregroups.h"
+
+#include "tile.h"
+#include "tilelayer.h"
+#include "tileset.h"
+
+#include <QCommandLineParser>
+#include <QCoreApplication>
+#include <QDir>
+#include <QElapsedTimer>
+#include <QFileInfo>
+#include <QHash>
+#include <QSet>
+#include <QUndoStack>
+
+#include <cstdio>
+
+using namespace BuildingEditor;
+
+namespace {
+
+// The lookups TilesetImageCache and TilesetManager did before they indexed
+// their tilesets, kept to compare against the indexed ones.
+
+Tiled::Tileset *findMatchByScanning(const Tiled::TilesetImageCache *cache, Tiled::Tileset *ts,
+                                    const QString &imageSource, const QString &imageSource2x)
+{
+    for (Tiled::Tileset *candidate : cache->mTilesets) {
+        if (((candidate->imageSource() == imageSource) || (!imageSource2x.isEmpty() && (candidate->imageSource2x() == imageSource2x)))
+                && candidate->tileWidth() == ts->tileWidth()
+                && candidate->tileHeight() == ts->tileHeight()
+                && candidate->tileSpacing() == ts->tileSpacing()
+                && candidate->margin() == ts->margin()
+                && candidate->transparentColor() == ts->transparentColor()) {
+            return candidate;
+        }
+    }
+    return nullptr;
+}
+
+Tiled::Tileset *findTilesetByScanning(const QList<Tiled::Tileset*> &tilesets,
+                                      const Tiled::Internal::TilesetSpec &spec)
+{
+    for (Tiled::Tileset *tileset : tilesets) {
+        if (tileset->imageSource() == spec.imageSource
+                && tileset->tileWidth() == spec.tileWidth
+                && tileset->tileHeight() == spec.tileHeight
+                && tileset->tileSpacing() == spec.tileSpacing
+                && tileset->margin() == spec.margin)
+            return tileset;
+    }
+    return nullptr;
+}
+
+Tiled::Tileset *findTilesetByScanning(const QList<Tiled::Tileset*> &tilesets,
+                                      const QString &fileName)
+{
+    for (Tiled::Tileset *tileset : tilesets) {
+        if (tileset->fileName() == fileName)
+            return tileset;
+    }
+    return nullptr;
+}
+
+// The merges LotFilesCellGenerator::generateHeader() did before it only
+// compared nearby RoomRects and rooms, kept to check it still gives the same
+// rooms and buildings in the same order, so the room IDs written to the
+// .lotheader don't change.
+
+QList<QList<LotFile::RoomRect*> > mergeRoomRectsComparingAll(const QMap<int,QList<LotFile::RoomRect*> > &roomRectsByLevel)
+{
+    QList<QList<LotFile::RoomRect*> > rooms;
+    for (const QList<LotFile::RoomRect*> &rrList : roomRectsByLevel) {
+        QHash<LotFile::RoomRect*,int> roomOf;
+        for (LotFile::RoomRect *rr : rrList) {
+            if (!roomOf.contains(rr)) {
+                roomOf[rr] = rooms.size();
+                rooms += QList<LotFile::RoomRect*>() << rr;
+            }
+            if (!rr->name.contains(QLatin1Char('#')))
+                continue;
+            for (LotFile::RoomRect *comp : rrList) {
+                int room = roomOf[rr], other = roomOf.value(comp, -1);
+                if (comp == rr || other == room || !rr->inSameRoom(comp))
+                    continue;
+                if (other != -1) {
+                    for (LotFile::RoomRect *rr2 : std::as_const(rooms[other]))
+                        roomOf[rr2] = room;
+                    rooms[room] += rooms[other];
+                    rooms[other].clear();
+                } else {
+                    roomOf[comp] = room;
+                    rooms[room] += comp;
+                }
+            }
+        }
+    }
+    rooms.removeAll(QList<LotFile::RoomRect*>());
+    return rooms;
+}
+
+QList<QList<LotFile::Room*> > mergeRoomsComparingAll(const QList<LotFile::Room*> &roomList)
+{
+    QVector<int> buildingOf(roomList.size(), -1);
+    QList<QList<LotFile::Room*> > buildings;
+    for (int i = 0; i < roomList.size(); i++) {
+        if (buildingOf[i] == -1) {
+            buildingOf[i] = buildings.size();
+            buildings += QList<LotFile::Room*>() << roomList[i];
+        }
+        for (int j = 0; j < roomList.size(); j++) {
+            int building = buildingOf[i], other = buildingOf[j];
+            if (j == i || other == building || !roomList[i]->inSameBuilding(roomList[j]))
+                continue;
+            if (other != -1) {
+                for (LotFile::Room *r2 : std::as_const(buildings[other]))
+                    buildingOf[r2->ID] = building;
+                buildings[building] += buildings[other];
+                buildings[other].clear();
+            } else {
+                buildingOf[j] = building;
+                buildings[building] += roomList[j];
+            }
+        }
+    }
+    buildings.removeAll(QList<LotFile::Room*>());
+    return buildings;
+}
+
+} // namespace
+
+bool BatchMode::mActive = false;
+
+bool BatchMode::requested(int argc, char *argv[])
+{
+    for (int i = 1; i < argc; i++) {
+        if (!qstrcmp(argv[i], "--batch"))
+            return true;
+    }
+    return false;
+}
+
+void BatchMode::print(const QString &text)
+{
+    fprintf(stdout, "%s\n", qPrintable(text));
+    fflush(stdout);
+}
+
+void BatchMode::printError(const QString &text)
+{
+    fprintf(stderr, "%s\n", qPrintable(text));
+    fflush(stderr);
+}
+
+void BatchMode::printErrors(const QString &title, const QStringList &errors)
+{
+    printError(title);
+    for (const QString &error : errors)
+        printError(QLatin1String("    ") + error);
+}
+
+BatchMode::BatchMode()
+    : mWorldDoc(nullptr)
+{
+    mActive = true;
+}
+
+BatchMode::~BatchMode()
+{
+    delete mWorldDoc;
+    mActive = false;
+}
+
+int BatchMode::run(const QStringList &arguments)
+{
+    QCommandLineParser parser;
+    parser.setApplicationDescription(tr("Generates files from a world without displaying any windows."));
+    parser.addHelpOption();
+    parser.addOption(QCommandLineOption(QLatin1String("batch"),
+                                        tr("Run without the main window.")));
+    QCommandLineOption jobsOption(QLatin1String("jobs"),
+                                  tr("Number of cells to generate .lot files for at the same time."),
+                                  tr("N"));
+    parser.addOption(jobsOption);
+    QCommandLineOption changedOnlyOption(QLatin1String("changed-only"),
+                                         tr("Only generate .lot files for cells that changed since the last time."));
+    parser.addOption(changedOnlyOption);
+    parser.addPositionalArgument(QLatin1String("world"), tr("The .pzw file to load."));
+    parser.addPositionalArgument(QLatin1String("stages"),
+                                 tr("One or more of: generate-lots, tmx-to-bmp, bmp-to-tmx, "
+                                    "features-buildings, features-trees, features-water, load-maps, "
+                                    "time-gids, check-rooms."),
+                                 tr("stage..."));
+
+    if (!parser.parse(arguments)) {
+        printError(parser.errorText());
+        return ExitUsage;
+    }
+    if (parser.isSet(QLatin1String("help"))) {
+        print(parser.helpText());
+        return ExitSuccess;
+    }
+
+    QStringList positional = parser.positionalArguments();
+    if (positional.size() < 2) {
+        printError(tr("A world file and at least one stage are required."));
+        print(parser.helpText());
+        return ExitUsage;
+    }
+
+    if (parser.isSet(jobsOption)) {
+        bool ok;
+        int jobs = parser.value(jobsOption).toInt(&ok);
+        if (!ok || jobs < 1) {
+            printError(tr("Invalid --jobs value \"%1\".").arg(parser.value(jobsOption)));
+            return ExitUsage;
+        }
+        LotFilesManager::instance()->setWorkerCount(jobs);
+    }
+    LotFilesManager::instance()->setIncremental(parser.isSet(changedOnlyOption));
+
+    const QStringList stages = positional.mid(1);
+    static const QStringList knownStages = QStringList()
+            << QLatin1String("generate-lots")
+            << QLatin1String("tmx-to-bmp")
+            << QLatin1String("bmp-to-tmx")
+            << QLatin1String("features-buildings")
+            << QLatin1String("features-trees")
+            << QLatin1String("features-water")
+            << QLatin1String("load-maps")
+            << QLatin1String("time-gids")
+            << QLatin1String("check-rooms");
+    for (const QString &stage : stages) {
+        if (!knownStages.contains(stage)) {
+            printError(tr("Unknown stage \"%1\".").arg(stage));
+            return ExitUsage;
+        }
+    }
+
+    QElapsedTimer total;
+    total.start();
+
+    QElapsedTimer timer;
+    timer.start();
+    if (!initConfigFiles()) {
+        printError(mError);
+        return ExitSetupFailed;
+    }
+    print(tr("Read config files in %1 s").arg(timer.elapsed() / 1000.0, 0, 'f', 2));
+
+    timer.restart();
+    TileMetaInfoMgr::instance()->loadTilesets(true);
+    TilesetManager::instance()->waitForTilesets(TilesetManager::instance()->tilesets(), nullptr);
+    print(tr("Loaded tilesets in %1 s").arg(timer.elapsed() / 1000.0, 0, 'f', 2));
+
+    timer.restart();
+    if (!loadWorld(positional.first())) {
+        printError(mError);
+        return ExitSetupFailed;
+    }
+    print(tr("Read %1 in %2 s").arg(QDir::toNativeSeparators(mFileName))
+          .arg(timer.elapsed() / 1000.0, 0, 'f', 2));
+
+    int result = ExitSuccess;
+    for (const QString &stage : stages) {
+        timer.restart();
+        int stageResult = runStage(stage);
+        print(tr("%1: %2 in %3 s")
+              .arg(stage)
+              .arg((stageResult == ExitSuccess) ? tr("finished")
+                                                : (stageResult == ExitCellsFailed) ? tr("finished with errors")
+                                                                                   : tr("FAILED"))
+              .arg(timer.elapsed() / 1000.0, 0, 'f', 2));
+        if (stageResult == ExitStageFailed)
+            return ExitStageFailed;
+        if (stageResult != ExitSuccess)
+            result = stageResult;
+    }
+
+    // BMP To TMX and the feature generators change the world.
+    if (mWorldDoc->isModified()) {
+        if (!saveWorld()) {
+            printError(mError);
+            return ExitStageFailed;
+        }
+        print(tr("Saved %1").arg(QDir::toNativeSeparators(mFileName)));
+    }
+
+    print(tr("Total time %1 s").arg(total.elapsed() / 1000.0, 0, 'f', 2));
+    return result;
+}
+
+// This is MainWindow::InitConfigFiles() without the dialogs.
+bool BatchMode::initConfigFiles()
+{
+    QString tilesDirectory = TileMetaInfoMgr::instance()->tilesDirectory();
+    if (tilesDirectory.isEmpty() || !QDir(tilesDirectory).exists()) {
+        mError = tr("The Tiles Directory could not be found.  Please set it in the Preferences.");
+        return false;
+    }
+
+    if (!TileMetaInfoMgr::instance()->readTxt()) {
+        mError = tr("%1\n(while reading %2)")
+                .arg(TileMetaInfoMgr::instance()->errorString())
+                .arg(TileMetaInfoMgr::instance()->txtName());
+        return false;
+    }
+
+    if (!TileMetaInfoMgr::instance()->addNewTilesets()) {
+        mError = tr("%1\n(while adding new tilesets)")
+                .arg(TileMetaInfoMgr::instance()->errorString());
+        return false;
+    }
+
+    if (!BuildingTMX::instance()->readTxt()) {
+        mError = tr("Error while reading %1\n%2")
+                .arg(BuildingTMX::instance()->txtName())
+                .arg(BuildingTMX::instance()->errorString());
+        return false;
+    }
+
+    if (!BuildingTilesMgr::instance()->readTxt()) {
+        mError = tr("Error while reading %1\n%2")
+                .arg(BuildingTilesMgr::instance()->txtName())
+                .arg(BuildingTilesMgr::instance()->errorString());
+        return false;
+    }
+
+    if (!FurnitureGroups::instance()->readTxt()) {
+        mError = tr("Error while reading %1\n%2")
+                .arg(FurnitureGroups::instance()->txtName())
+                .arg(FurnitureGroups::instance()->errorString());
+        return false;
+    }
+
+    if (!BuildingTemplates::instance()->readTxt()) {
+        mError = tr("Error while reading %1\n%2")
+                .arg(BuildingTemplates::instance()->txtName())
+                .arg(BuildingTemplates::instance()->errorString());
+        return false;
+    }
+
+    return true;
+}
+
+bool BatchMode::loadWorld(const QString &fileName)
+{
+    mFileName = QFileInfo(fileName).absoluteFilePath();
+
+    WorldReader reader;
+    World *world = reader.readWorld(mFileName);
+    if (!world) {
+        mError = tr("Error reading %1\n%2")
+                .arg(QDir::toNativeSeparators(mFileName))
+                .arg(reader.errorString());
+        return false;
+    }
+
+    DefaultsFile::oldWorld(world);
+
+    mWorldDoc = new WorldDocument(world, mFileName);
+    return true;
+}
+
+bool BatchMode::saveWorld()
+{
+    QString error;
+    if (!mWorldDoc->save(mFileName, error)) {
+        mError = tr("Error saving %1\n%2")
+                .arg(QDir::toNativeSeparators(mFileName))
+                .arg(error);
+        return false;
+    }
+    mWorldDoc->undoStack()->setClean();
+    return true;
+}
+
+int BatchMode::runStage(const QString &stage)
+{
+    print(tr("%1: started").arg(stage));
+
+    if (stage == QLatin1String("generate-lots")) {
+        LotFilesManager *mgr = LotFilesManager::instance();
+        if (!mgr->generateWorld(mWorldDoc, LotFilesManager::GenerateAll)) {
+            printError(mgr->errorString());
+            return ExitStageFailed;
+        }
+        return mgr->failures().isEmpty() ? ExitSuccess : ExitCellsFailed;
+    }
+
+    if (stage == QLatin1String("tmx-to-bmp")) {
+        if (!TMXToBMP::hasInstance())
+            new TMXToBMP();
+        if (!TMXToBMP::instance().generateWorld(mWorldDoc, TMXToBMP::GenerateAll)) {
+            printError(TMXToBMP::instance().errorString());
+            return ExitStageFailed;
+        }
+        return ExitSuccess;
+    }
+
+    if (stage == QLatin1String("bmp-to-tmx")) {
+        if (!BMPToTMX::instance()->generateWorld(mWorldDoc, BMPToTMX::GenerateAll)) {
+            printError(BMPToTMX::instance()->errorString());
+            return ExitStageFailed;
+        }
+        return ExitSuccess;
+    }
+
+    if (stage == QLatin1String("load-maps"))
+        return loadMaps();
+
+    if (stage == QLatin1String("time-gids"))
+        return timeGidLookups();
+
+    if (stage == QLatin1String("check-rooms"))
+        return checkRoomMerge();
+
+    InGameMapFeatureGenerator::FeatureType type = InGameMapFeatureGenerator::FeatureBuilding;
+    if (stage == QLatin1String("features-trees"))
+        type = InGameMapFeatureGenerator::FeatureTree;
+    else if (stage == QLatin1String("features-water"))
+        type = InGameMapFeatureGenerator::FeatureWater;
+    InGameMapFeatureGenerator generator;
+    if (!generator.generateWorld(mWorldDoc, InGameMapFeatureGenerator::GenerateAll, type)) {
+        printError(generator.errorString());
+        return ExitStageFailed;
+    }
+    return generator.failures().isEmpty() ? ExitSuccess : ExitCellsFailed;
+}
+
+// Reads every map the world uses, as a benchmark of map and tileset loading.
+int BatchMode::loadMaps()
+{
+    World *world = mWorldDoc->world();
+    QStringList mapFilePaths;
+    QSet<QString> seen;
+    for (int y = 0; y < world->height(); y++) {
+        for (int x = 0; x < world->width(); x++) {
+            WorldCell *cell = world->cellAt(x, y);
+            QStringList paths;
+            if (!cell->mapFilePath().isEmpty())
+                paths += cell->mapFilePath();
+            for (WorldCellLot *lot : cell->lots())
+                paths += lot->mapName();
+            for (const QString &path : qAsConst(paths)) {
+                if (!seen.contains(path)) {
+                    seen.insert(path);
+                    mapFilePaths += path;
+                }
+            }
+        }
+    }
+
+    TilesetManager *tilesetMgr = TilesetManager::instance();
+    tilesetMgr->resetTilesetMatchTime();
+
+    QElapsedTimer timer;
+    timer.start();
+    int failures = 0;
+    for (const QString &path : qAsConst(mapFilePaths)) {
+        if (!MapManager::instance()->loadMap(path)) {
+            printError(MapManager::instance()->errorString());
+            ++failures;
+        }
+    }
+    tilesetMgr->waitForTilesets(tilesetMgr->tilesets(), nullptr);
+
+    print(tr("Loaded %1 maps in %2 s, %3 ms matching tilesets")
+          .arg(mapFilePaths.size() - failures)
+          .arg(timer.elapsed() / 1000.0, 0, 'f', 2)
+          .arg(tilesetMgr->tilesetMatchTime() / 1000000.0, 0, 'f', 2));
+
+    if (!compareTilesetMatching())
+        ++failures;
+    return failures ? ExitCellsFailed : ExitSuccess;
+}
+
+// Looks up every loaded tileset the way loading and reloading maps does,
+// once through the indexes and once by scanning every tileset as was done
+// before, and reports the time each took.
+bool BatchMode::compareTilesetMatching()
+{
+    TilesetManager *tilesetMgr = TilesetManager::instance();
+    Tiled::TilesetImageCache *cache = tilesetMgr->imageCache();
+    const QList<Tiled::Tileset*> tilesets = tilesetMgr->tilesets();
+
+    QElapsedTimer timer;
+    qint64 indexedTime = 0, scanTime = 0;
+    int mismatches = 0;
+    for (Tiled::Tileset *ts : tilesets) {
+        Tiled::Internal::TilesetSpec spec;
+        spec.imageSource = ts->imageSource();
+        spec.tileWidth = ts->tileWidth();
+        spec.tileHeight = ts->tileHeight();
+        spec.tileSpacing = ts->tileSpacing();
+        spec.margin = ts->margin();
+
+        timer.start();
+        Tiled::Tileset *indexed[3] = {
+            cache->findMatch(ts, ts->imageSource(), ts->imageSource2x()),
+            tilesetMgr->findTileset(spec),
+            ts->fileName().isEmpty() ? nullptr : tilesetMgr->findTileset(ts->fileName())
+        };
+        indexedTime += timer.nsecsElapsed();
+
+        timer.start();
+        Tiled::Tileset *scanned[3] = {
+            findMatchByScanning(cache, ts, ts->imageSource(), ts->imageSource2x()),
+            findTilesetByScanning(tilesets, spec),
+            ts->fileName().isEmpty() ? nullptr : findTilesetByScanning(tilesets, ts->fileName())
+        };
+        scanTime += timer.nsecsElapsed();
+
+        // Several tilesets may use the same image or file, so only check
+        // both lookups found a matching one.
+        if ((indexed[0] == nullptr) != (scanned[0] == nullptr)
+                || (indexed[1] == nullptr) != (scanned[1] == nullptr)
+                || (indexed[2] == nullptr) != (scanned[2] == nullptr))
+            ++mismatches;
+    }
+
+    print(tr("Matched %1 tilesets: %2 ms with the indexes, %3 ms scanning every tileset")
+          .arg(tilesets.size())
+          .arg(indexedTime / 1000000.0, 0, 'f', 3)
+          .arg(scanTime / 1000000.0, 0, 'f', 3));
+    if (mismatches) {
+        printError(tr("%1 tilesets were matched differently by the indexes").arg(mismatches));
+        return false;
+    }
+    return true;
+}
+
+// Looks up the gid of every cell in every cell's map with
+// LotFilesCellGenerator::cellToGid(), which uses a hash and remembers the last
+// tileset, and the way it did before, walking a map of every tileset.
+int BatchMode::timeGidLookups()
+{
+    World *world = mWorldDoc->world();
+    Tiled::Tile *missingTile = TilesetManager::instance()->missingTile();
+
+    LotFilesTileEnums tileEnums;
+    tileEnums.update();
+    LotFilesCellGenerator generator;
+    generator.setTileEnums(&tileEnums);
+
+    QElapsedTimer timer;
+    qint64 walkTime = 0, hashTime = 0;
+    qint64 lookups = 0;
+    int cellCount = 0, failures = 0, mismatches = 0;
+    QVector<const Tiled::Cell*> cells;
+    QVector<uint> walkGids, hashGids;
+    for (int y = 0; y < world->height(); y++) {
+        for (int x = 0; x < world->width(); x++) {
+            WorldCell *cell = world->cellAt(x, y);
+            if (cell->mapFilePath().isEmpty())
+                continue;
+            MapInfo *mapInfo = MapManager::instance()->loadMap(cell->mapFilePath());
+            if (!mapInfo) {
+                printError(MapManager::instance()->errorString());
+                ++failures;
+                continue;
+            }
+            MapComposite mapComposite(mapInfo);
+            while (mapComposite.waitingForMapsToLoad())
+                qApp->processEvents(QEventLoop::ExcludeUserInputEvents);
+
+            // The generator hands out the first gids, the old lookup walks
+            // the same ones.
+            QList<Tiled::Tileset*> tilesets;
+            for (MapComposite *mc : mapComposite.maps())
+                tilesets += mc->map()->tilesets();
+            if (!generator.handleTilesets(tilesets)) {
+                printError(generator.errorString());
+                ++failures;
+                continue;
+            }
+            QMap<const Tiled::Tileset*,uint> firstGidMap;
+            const QHash<const Tiled::Tileset*,uint> &firstGidHash = generator.tilesetToFirstGid();
+            for (auto it = firstGidHash.constBegin(); it != firstGidHash.constEnd(); ++it)
+                firstGidMap.insert(it.key(), it.value());
+
+            cells.resize(0);
+            const int width = mapInfo->width(), height = mapInfo->height();
+            for (CompositeLayerGroup *lg : mapComposite.layerGroups()) {
+                lg->prepareDrawing2();
+                lg->flatten(QRect(0, 0, width, height));
+                for (int ty = 0; ty < height; ty++) {
+                    for (int tx = 0; tx < width; tx++) {
+                        const Tiled::Cell *flatCells;
+                        int count = lg->flatCellsAt(QPoint(tx, ty), flatCells);
+                        for (int i = 0; i < count; i++) {
+                            if (flatCells[i].tile != missingTile)
+                                cells += &flatCells[i];
+                        }
+                    }
+                }
+            }
+
+            walkGids.resize(cells.size());
+            timer.start();
+            for (int i = 0; i < cells.size(); i++) {
+                const Tiled::Cell *c = cells[i];
+                const Tiled::Tileset *tileset = c->tile->tileset();
+                auto it = firstGidMap.constBegin();
+                while (it != firstGidMap.constEnd() && it.key() != tileset)
+                    ++it;
+                walkGids[i] = (it == firstGidMap.constEnd()) ? 0 : it.value() + c->tile->id();
+            }
+            walkTime += timer.nsecsElapsed();
+
+            hashGids.resize(cells.size());
+            timer.start();
+            for (int i = 0; i < cells.size(); i++)
+                hashGids[i] = generator.cellToGid(cells[i]);
+            hashTime += timer.nsecsElapsed();
+
+            if (walkGids != hashGids)
+                ++mismatches;
+            lookups += cells.size();
+            ++cellCount;
+
+            for (CompositeLayerGroup *lg : mapComposite.layerGroups())
+                lg->clearFlattened();
+        }
+    }
+
+    print(tr("Looked up %1 gids in %2 cells: %3 ms with the hash, %4 ms walking the map")
+          .arg(lookups)
+          .arg(cellCount)
+          .arg(hashTime / 1000000.0, 0, 'f', 2)
+          .arg(walkTime / 1000000.0, 0, 'f', 2));
+    if (mismatches)
+        printError(tr("The gids differed in %1 cells").arg(mismatches));
+    return (failures || mismatches) ? ExitCellsFailed : ExitSuccess;
+}
+
+// Merges the RoomRects of every cell into rooms and buildings with
+// LotFilesCellGenerator::generateHeader(), and checks the result against
+// comparing every RoomRect and room with every other.
+int BatchMode::checkRoomMerge()
+{
+    World *world = mWorldDoc->world();
+
+    LotFilesTileEnums tileEnums;
+    tileEnums.update();
+    LotFilesCellGenerator generator;
+    generator.setTileEnums(&tileEnums);
+
+    QElapsedTimer timer;
+    qint64 gridTime = 0, allPairsTime = 0;
+    int cellCount = 0, roomCount = 0, buildingCount = 0, failures = 0, mismatches = 0;
+    for (int y = 0; y < world->height(); y++) {
+        for (int x = 0; x < world->width(); x++) {
+            WorldCell *cell = world->cellAt(x, y);
+            if (cell->mapFilePath().isEmpty())
+                continue;
+            MapInfo *mapInfo = MapManager::instance()->loadMap(cell->mapFilePath());
+            if (!mapInfo) {
+                printError(MapManager::instance()->errorString());
+                ++failures;
+                continue;
+            }
+            MapComposite mapComposite(mapInfo);
+            while (mapComposite.waitingForMapsToLoad())
+                qApp->processEvents(QEventLoop::ExcludeUserInputEvents);
+
+            timer.start();
+            if (!generator.generateHeader(cell, &mapComposite)) {
+                printError(generator.errorString());
+                ++failures;
+                continue;
+            }
+            gridTime += timer.nsecsElapsed();
+
+            timer.start();
+            QList<QList<LotFile::RoomRect*> > rooms = mergeRoomRectsComparingAll(generator.roomRectsByLevel());
+            QList<QList<LotFile::Room*> > buildings = mergeRoomsComparingAll(generator.rooms());
+            allPairsTime += timer.nsecsElapsed();
+
+            bool same = rooms.size() == generator.rooms().size()
+                    && buildings.size() == generator.buildings().size();
+            for (int i = 0; same && i < rooms.size(); i++)
+                same = rooms[i] == generator.rooms()[i]->rects;
+            for (int i = 0; same && i < buildings.size(); i++)
+                same = buildings[i] == generator.buildings()[i]->RoomList;
+            if (!same) {
+                printError(tr("Cell %1,%2: the merge gave %3 rooms and %4 buildings, comparing every pair gave %5 rooms and %6 buildings")
+                           .arg(x).arg(y)
+                           .arg(generator.rooms().size())
+                           .arg(generator.buildings().size())
+                           .arg(rooms.size())
+                           .arg(buildings.size()));
+                ++mismatches;
+            }
+            roomCount += generator.rooms().size();
+            buildingCount += generator.buildings().size();
+            ++cellCount;
+        }
+    }
+
+    print(tr("Merged %1 rooms and %2 buildings in %3 cells: %4 ms for the header, %5 ms comparing every pair")
+          .arg(roomCount)
+          .arg(buildingCount)
+          .arg(cellCount)
+          .arg(gridTime / 1000000.0, 0, 'f', 2)
+          .arg(allPairsTime / 1000000.0, 0, 'f', 2));
+    if (mismatches)
+        printError(tr("The rooms or buildings differed in %1 cells").arg(mismatches));
+    return (failures || mismatches) ? ExitCellsFailed : ExitSuccess;
+}
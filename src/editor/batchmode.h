@@ -0,0 +1,95 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BATCHMODE_H
+#define BATCHMODE_H
+
+#include <QCoreApplication>
+#include <QStringList>
+
+class WorldDocument;
+
+/**
+ * Runs the world generation pipelines without the main window, so a world
+ * can be regenerated unattended:
+ *
+ *   PZWorldEd --batch [--jobs N] [--changed-only] world.pzw generate-lots ...
+ *
+ * The load-maps stage only reads the world's maps and reports how long that
+ * took, to measure map and tileset loading.  It then times finding every
+ * loaded tileset through TilesetManager's indexes against scanning all of
+ * them, as was done before the indexes.
+ *
+ * The time-gids stage times looking up the .lot gid of every cell in every
+ * cell's map, the way the .lot generator does it and the way it used to.
+ *
+ * The check-rooms stage checks the .lot generator merges each cell's
+ * RoomRects into the same rooms and buildings as comparing every pair would.
+ *
+ * While batch mode is active, the generators write their results and
+ * failures to the console instead of displaying dialogs.
+ */
+class BatchMode
+{
+    Q_DECLARE_TR_FUNCTIONS(BatchMode)
+
+public:
+    enum ExitCode {
+        ExitSuccess = 0,
+        ExitUsage = 1,
+        ExitSetupFailed = 2,
+        ExitStageFailed = 3,
+        ExitCellsFailed = 4
+    };
+
+    /**
+     * Returns true if the command line asks for batch mode.  This is checked
+     * before the QApplication is created.
+     */
+    static bool requested(int argc, char *argv[]);
+
+    static bool isActive()
+    { return mActive; }
+
+    static void print(const QString &text);
+    static void printError(const QString &text);
+    static void printErrors(const QString &title, const QStringList &errors);
+
+    BatchMode();
+    ~BatchMode();
+
+    int run(const QStringList &arguments);
+
+private:
+    bool initConfigFiles();
+    bool loadWorld(const QString &fileName);
+    bool saveWorld();
+    int runStage(const QString &stage);
+    int loadMaps();
+    bool compareTilesetMatching();
+    int timeGidLookups();
+    int checkRoomMerge();
+
+private:
+    WorldDocument *mWorldDoc;
+    QString mFileName;
+    QString mError;
+
+    static bool mActive;
+};
+
+#endif // BATCHMODE_H
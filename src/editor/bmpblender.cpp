@@ -34,8 +34,12 @@
 #include <QDir>
 #include <QFile>
 #include <QImage>
+#include <QSemaphore>
 #include <QSet>
 #include <QTextStream>
+#include <QThreadPool>
+
+#include <functional>
 
 using namespace Tiled;
 using namespace Tiled::Internal;
@@ -45,8 +49,9 @@ static QString STR_0Floor = QLatin1String("0_Floor");
 BmpBlender::BmpBlender(QObject *parent) :
     QObject(parent),
     mMap(nullptr),
-    mFakeTileGrid(nullptr),
+    mGridsCreated(false),
     mInitTilesLater(true),
+    mCompiled(false),
     mHack(false),
     mBlendEdgesEverywhere(false)
 {
@@ -55,8 +60,9 @@ BmpBlender::BmpBlender(QObject *parent) :
 BmpBlender::BmpBlender(Map *map, QObject *parent) :
     QObject(parent),
     mMap(map),
-    mFakeTileGrid(nullptr),
+    mGridsCreated(false),
     mInitTilesLater(true),
+    mCompiled(false),
     mHack(false),
     mBlendEdgesEverywhere(false)
 {
@@ -68,8 +74,6 @@ BmpBlender::~BmpBlender()
     qDeleteAll(mAliases);
     qDeleteAll(mRules);
     qDeleteAll(mBlendList);
-    qDeleteAll(mTileGrids);
-    delete mFakeTileGrid;
     qDeleteAll(mTileLayers);
 }
 
@@ -82,11 +86,12 @@ void BmpBlender::setMap(Map *map)
 
 void BmpBlender::recreate()
 {
-    if (mFakeTileGrid) {
-        qDeleteAll(mTileGrids);
+    if (mGridsCreated) {
         mTileGrids.clear();
-        delete mFakeTileGrid;
-        mFakeTileGrid = nullptr;
+        mFakeTileGrid.clear();
+        mBlendGrids.clear();
+        mGridsCreated = false;
+        mCompiled = false;
 
         qDeleteAll(mTileLayers);
         mTileLayers.clear();
@@ -141,9 +146,7 @@ void BmpBlender::flush(const MapRenderer *renderer, const QRect &rect, const QPo
         y1 -= 2;
         y2 += 2;
 
-        imagesToTileGrids(x1, y1, x2, y2);
-        addEdgeTiles(x1, y1, x2, y2);
-        tileGridsToLayers(x1, y1, x2, y2);
+        blend(x1, y1, x2, y2);
     }
 }
 
@@ -165,9 +168,7 @@ void BmpBlender::flush(const QRect &rect)
     y1 -= 2;
     y2 += 2;
 
-    imagesToTileGrids(x1, y1, x2, y2);
-    addEdgeTiles(x1, y1, x2, y2);
-    tileGridsToLayers(x1, y1, x2, y2);
+    blend(x1, y1, x2, y2);
 }
 
 void BmpBlender::tilesetAdded(Tileset *ts)
@@ -220,12 +221,14 @@ void BmpBlender::tilesToPixels(int x1, int y1, int x2, int y2)
 // and blends.
 bool BmpBlender::expectTile(const QString &layerName, int x, int y, Tile *tile)
 {
-    if (mBlendGrids.contains(layerName)) {
-        int index = x + y * mMap->width();
-        if (mBlendGrids[layerName].contains(index)) {
-            BlendWrapper *blendW = mBlendGrids[layerName][index];
-            return blendW->mBlendTiles.contains(tile);
-        }
+    if (!mGridsCreated)
+        return false;
+    int layer = mLayerIndex.value(layerName, -1);
+    if (layer == -1 || mBlendGrids[layer].isEmpty())
+        return false;
+    if (int blend = mBlendGrids[layer][x + y * mMap->width()]) {
+        BlendWrapper *blendW = mBlendList[blend - 1];
+        return blendW->mBlendTiles.contains(tile);
     }
     return false;
 }
@@ -251,9 +254,7 @@ void BmpBlender::testBlendEdgesEverywhere(bool enabled, QRegion& tileSelection)
     // First: blend with the setting the opposite of what it's being set to.
     mBlendEdgesEverywhere = !enabled;
     markDirty(0, 0, mMap->width() - 1, mMap->height() - 1);
-    imagesToTileGrids(x1, y1, x2, y2);
-    addEdgeTiles(x1, y1, x2, y2);
-    tileGridsToLayers(x1, y1, x2, y2);
+    blend(x1, y1, x2, y2);
 
     // Save the tile layers so we can compare them.
     QMap<QString,TileLayer*> tileLayers = mTileLayers;
@@ -262,9 +263,7 @@ void BmpBlender::testBlendEdgesEverywhere(bool enabled, QRegion& tileSelection)
     // Second: blend with the setting at the desired value.
     mBlendEdgesEverywhere = enabled;
     markDirty(0, 0, mMap->width() - 1, mMap->height() - 1);
-    imagesToTileGrids(x1, y1, x2, y2);
-    addEdgeTiles(x1, y1, x2, y2);
-    tileGridsToLayers(x1, y1, x2, y2);
+    blend(x1, y1, x2, y2);
 
     tileSelection = QRegion();
 
@@ -402,6 +401,7 @@ void BmpBlender::fromMap()
     mBlendEdgesEverywhere = mMap->bmpSettings()->isBlendEdgesEverywhere();
 
     mInitTilesLater = true;
+    mCompiled = false;
 
     mDirtyRegion = QRegion(QRect(QPoint(), mMap->size()));
 }
@@ -474,6 +474,8 @@ void BmpBlender::initTiles()
         }
     }
 
+    mCompiled = false;
+
     updateWarnings();
 
     // This list is for the benefit of PaintBMP().
@@ -486,30 +488,290 @@ void BmpBlender::initTiles()
     }
 }
 
-static bool adjacentToNonBlack(const QImage &image1, const QImage &image2, int x1, int y1)
+namespace {
+
+// Finds the rules for a color.  Neighbouring pixels are usually the same
+// color, so the last color looked up is remembered.
+class RuleLookup
 {
-    const QRgb black = qRgb(0, 0, 0);
-    QRect r(0, 0, image1.width(), image1.height());
-    for (int y = y1 - 2; y <= y1 + 2; y++) {
-        for (int x = x1 - 2; x <= x1 + 2; x++) {
-            if (!r.contains(x, y)) continue;
-            if (image1.pixel(x, y) != black || image2.pixel(x, y) != black)
-                return true;
+public:
+    RuleLookup(const QHash<QRgb,QVector<int> > &rules) :
+        mRules(rules),
+        mColor(0),
+        mResult(nullptr),
+        mValid(false)
+    {
+    }
+
+    const QVector<int> *find(QRgb color)
+    {
+        if (!mValid || color != mColor) {
+            auto it = mRules.constFind(color);
+            mResult = (it == mRules.constEnd()) ? nullptr : &it.value();
+            mColor = color;
+            mValid = true;
         }
+        return mResult;
     }
-    return false;
+
+private:
+    const QHash<QRgb,QVector<int> > &mRules;
+    QRgb mColor;
+    const QVector<int> *mResult;
+    bool mValid;
+};
+
+} // namespace
+
+void BmpBlender::createGrids()
+{
+    // Same order as mTileLayers.
+    mLayerNames = mRuleLayers + mBlendLayers;
+    mLayerNames.removeDuplicates();
+    mLayerNames.sort();
+    mLayerIndex.clear();
+    for (int i = 0; i < mLayerNames.size(); i++)
+        mLayerIndex[mLayerNames[i]] = i;
+
+    const int size = mMap->width() * mMap->height();
+    mTileGrids.resize(mLayerNames.size());
+    mBlendGrids.resize(mLayerNames.size());
+    for (int i = 0; i < mLayerNames.size(); i++) {
+        mTileGrids[i].fill(0, size);
+        if (mBlendLayers.contains(mLayerNames[i]))
+            mBlendGrids[i].fill(0, size);
+        else
+            mBlendGrids[i].clear();
+    }
+    mFakeTileGrid.fill(0, size);
+
+    mGridsCreated = true;
+    mCompiled = false;
 }
 
-void BmpBlender::imagesToTileGrids(int x1, int y1, int x2, int y2)
+quint16 BmpBlender::tileID(Tile *tile)
 {
-    if (mTileGrids.isEmpty()) {
-        foreach (QString layerName, mRuleLayers + mBlendLayers) {
-            if (!mTileGrids.contains(layerName))
-                mTileGrids[layerName] = new SparseTileGrid(mMap->width(), mMap->height());
+    auto it = mIDByTile.constFind(tile);
+    if (it != mIDByTile.constEnd())
+        return it.value();
+    Q_ASSERT(mTileByID.size() < 0xFFFF);
+    quint16 id = quint16(mTileByID.size());
+    mTileByID += tile;
+    mIDByTile[tile] = id;
+    return id;
+}
+
+QVector<quint16> BmpBlender::tileIDs(const QVector<Tile *> &tiles)
+{
+    QVector<quint16> ret(tiles.size());
+    for (int i = 0; i < tiles.size(); i++)
+        ret[i] = tileID(tiles[i]);
+    return ret;
+}
+
+QBitArray BmpBlender::tileIDMask(const QVector<Tile *> &tiles)
+{
+    QBitArray ret(mTileByID.size());
+    for (Tile *tile : tiles)
+        ret.setBit(mIDByTile[tile]);
+    return ret;
+}
+
+enum {
+    NeighborN = 1 << 0,
+    NeighborS = 1 << 1,
+    NeighborE = 1 << 2,
+    NeighborW = 1 << 3
+};
+
+// Turns the rules and blends into integer tile IDs and layer indices so that
+// blending an x,y needs no string comparisons or map lookups.
+void BmpBlender::compile()
+{
+    // IDs are never reused, so the grids stay valid when the tiles change.
+    if (mTileByID.isEmpty())
+        tileID(nullptr); // ID 0
+
+    mCompiledRules.resize(mRules.size());
+    mCompiledRulesByColor[0].clear();
+    mCompiledRulesByColor[1].clear();
+    mFloorTileToCompiledRule.clear();
+    for (int i = 0; i < mRules.size(); i++) {
+        RuleWrapper *ruleW = mRules[i];
+        CompiledRule &rule = mCompiledRules[i];
+        rule.mLayer = mLayerIndex.value(ruleW->mRule->targetLayer, -1);
+        rule.mColor = ruleW->mRule->color;
+        rule.mCondition = ruleW->mRule->condition;
+        rule.mTiles = tileIDs(ruleW->mTiles);
+        int bitmapIndex = ruleW->mRule->bitmapIndex;
+        if ((bitmapIndex == 0 || bitmapIndex == 1) && rule.mLayer != -1 && !rule.mTiles.isEmpty())
+            mCompiledRulesByColor[bitmapIndex][rule.mColor] += i;
+        if (ruleW->mRule->targetLayer == STR_0Floor) {
+            foreach (Tile *tile, ruleW->mTiles)
+                mFloorTileToCompiledRule[tile] = i;
+        }
+    }
+
+    // Every tile a blend refers to needs an ID before the masks are created.
+    foreach (BlendWrapper *blendW, mBlendList) {
+        tileIDs(blendW->mMainTiles);
+        tileIDs(blendW->mExcludeTiles);
+    }
+
+    mCompiledBlends.resize(mBlendList.size());
+    mCompiledBlendsByLayer.fill(QVector<int>(), mLayerNames.size());
+    for (int i = 0; i < mBlendList.size(); i++) {
+        BlendWrapper *blendW = mBlendList[i];
+        CompiledBlend &blend = mCompiledBlends[i];
+        blend.mMainTiles = tileIDMask(blendW->mMainTiles);
+        blend.mExcludeTiles = tileIDMask(blendW->mExcludeTiles);
+        blend.mBlendTiles = tileIDs(blendW->mBlendTiles);
+        blend.mExclude2 = !blendW->mBlend->exclude2.isEmpty();
+        switch (blendW->mBlend->dir) {
+        case BmpBlend::N:
+            blend.mRequired = NeighborN;
+            blend.mForbidden = NeighborW | NeighborE;
+            break;
+        case BmpBlend::S:
+            blend.mRequired = NeighborS;
+            blend.mForbidden = NeighborW | NeighborE;
+            break;
+        case BmpBlend::E:
+            blend.mRequired = NeighborE;
+            blend.mForbidden = NeighborN | NeighborS;
+            break;
+        case BmpBlend::W:
+            blend.mRequired = NeighborW;
+            blend.mForbidden = NeighborN | NeighborS;
+            break;
+        case BmpBlend::NE:
+            blend.mRequired = NeighborN | NeighborE;
+            blend.mForbidden = 0;
+            break;
+        case BmpBlend::SE:
+            blend.mRequired = NeighborS | NeighborE;
+            blend.mForbidden = 0;
+            break;
+        case BmpBlend::NW:
+            blend.mRequired = NeighborN | NeighborW;
+            blend.mForbidden = 0;
+            break;
+        case BmpBlend::SW:
+            blend.mRequired = NeighborS | NeighborW;
+            blend.mForbidden = 0;
+            break;
+        default:
+            continue; // never matches
+        }
+        int layer = mLayerIndex.value(blendW->mBlend->targetLayer, -1);
+        if (layer != -1)
+            mCompiledBlendsByLayer[layer] += i;
+    }
+
+    // The masks must be as large as the final number of tile IDs.
+    for (CompiledBlend &blend : mCompiledBlends) {
+        blend.mMainTiles.resize(mTileByID.size());
+        blend.mExcludeTiles.resize(mTileByID.size());
+    }
+
+    mBlendLayerIndices.clear();
+    foreach (QString layerName, mBlendLayers)
+        mBlendLayerIndices += mLayerIndex[layerName];
+
+    mCompiled = true;
+}
+
+namespace {
+
+// Runs func(y1, y2) on bands of rows, one band on the calling thread and the
+// rest on the global thread pool, and returns when every band is done.
+class BmpBlenderBand : public QRunnable
+{
+public:
+    BmpBlenderBand(const std::function<void(int,int)> &func, int y1, int y2, QSemaphore *done) :
+        mFunc(func),
+        mY1(y1),
+        mY2(y2),
+        mDone(done)
+    {
+    }
+
+    void run() override
+    {
+        mFunc(mY1, mY2);
+        mDone->release();
+    }
+
+private:
+    const std::function<void(int,int)> &mFunc;
+    int mY1;
+    int mY2;
+    QSemaphore *mDone;
+};
+
+void runBands(int y1, int y2, int bandCount, const std::function<void(int,int)> &func)
+{
+    const int rows = y2 - y1 + 1;
+    QSemaphore done;
+    for (int i = 1; i < bandCount; i++) {
+        int bandY1 = y1 + rows * i / bandCount;
+        int bandY2 = y1 + rows * (i + 1) / bandCount - 1;
+        QThreadPool::globalInstance()->start(new BmpBlenderBand(func, bandY1, bandY2, &done));
+    }
+    func(y1, y1 + rows / bandCount - 1);
+    done.acquire(bandCount - 1);
+}
+
+} // namespace
+
+// Every x,y in the first pass depends only on the images at that x,y, and
+// the second pass only reads the first pass's results within 1 of an x,y (and
+// the images within 2).  So each pass is split into bands of rows that are
+// blended at the same time, and the second pass starts once the first is
+// finished everywhere.  The result doesn't depend on the number of bands.
+void BmpBlender::blend(int x1, int y1, int x2, int y2)
+{
+    if (!mGridsCreated)
+        createGrids();
+    if (!mCompiled)
+        compile();
+
+    x1 = qBound(0, x1, mMap->width() - 1);
+    x2 = qBound(0, x2, mMap->width() - 1);
+    y1 = qBound(0, y1, mMap->height() - 1);
+    y2 = qBound(0, y2, mMap->height() - 1);
+
+    const int rows = y2 - y1 + 1;
+    int bandCount = 1;
+    if ((x2 - x1 + 1) * rows >= MinParallelArea)
+        bandCount = qBound(1, rows / MinBandRows, QThread::idealThreadCount());
+
+    if (bandCount == 1) {
+        imagesToTileGrids(x1, y1, x2, y2);
+        addEdgeTiles(x1, y1, x2, y2);
+    } else {
+        runBands(y1, y2, bandCount, [&](int bandY1, int bandY2) {
+            imagesToTileGrids(x1, bandY1, x2, bandY2);
+        });
+        // Edge tiles in 0_Floor would change the neighbours of the next x,y
+        // as they are added, so only the order of a single band gives the
+        // same result.
+        int floorIndex = mLayerIndex.value(STR_0Floor, -1);
+        if (mBlendLayerIndices.contains(floorIndex)) {
+            addEdgeTiles(x1, y1, x2, y2);
+        } else {
+            runBands(y1, y2, bandCount, [&](int bandY1, int bandY2) {
+                addEdgeTiles(x1, bandY1, x2, bandY2);
+            });
         }
-        mFakeTileGrid = new SparseTileGrid(mMap->width(), mMap->height());
     }
 
+    // TileLayer::setCell() isn't thread-safe.
+    tileGridsToLayers(x1, y1, x2, y2);
+}
+
+void BmpBlender::imagesToTileGrids(int x1, int y1, int x2, int y2)
+{
     const QRgb black = qRgb(0, 0, 0);
 
     // Hack - If a pixel is black, and the user-drawn map tile in 0_Floor is
@@ -522,33 +784,44 @@ void BmpBlender::imagesToTileGrids(int x1, int y1, int x2, int y2)
     y1 = qBound(0, y1, mMap->height() - 1);
     y2 = qBound(0, y2, mMap->height() - 1);
 
-    Cell emptyCell;
+    QVector<quint16*> tileGrids(mTileGrids.size());
+    for (int i = 0; i < mTileGrids.size(); i++)
+        tileGrids[i] = mTileGrids[i].data();
+    QVector<quint16*> blendGrids;
+    for (QVector<quint16> &blendGrid : mBlendGrids) {
+        if (!blendGrid.isEmpty())
+            blendGrids += blendGrid.data();
+    }
+    quint16 *fakeTileGrid = mFakeTileGrid.data();
+
+    const MapBmp &bmpMain = mMap->rbmpMain();
+    const MapBmp &bmpVeg = mMap->rbmpVeg();
+    const QRgb *colorsMain = bmpMain.colorTable().constData();
+    const QRgb *colorsVeg = bmpVeg.colorTable().constData();
+    RuleLookup rulesMain(mCompiledRulesByColor[0]);
+    RuleLookup rulesVeg(mCompiledRulesByColor[1]);
+    const int width = mMap->width();
 
     for (int y = y1; y <= y2; y++) {
+        const quint16 *lineMain = bmpMain.indexLine(y);
+        const quint16 *lineVeg = bmpVeg.indexLine(y);
+        const quint32 *randsMain = bmpMain.rands().line(y);
+        const quint32 *randsVeg = bmpVeg.rands().line(y);
         for (int x = x1; x <= x2; x++) {
-            for (Tiled::SparseTileGrid *tileGrid : qAsConst(mTileGrids)) {
-                tileGrid->replace(x, y, emptyCell);
-            }
-            mFakeTileGrid->replace(x, y, emptyCell);
-            for (BlendGrid &blendGrid : mBlendGrids) {
-                blendGrid.remove(x + y * mMap->width());
-            }
-
-            QRgb col = mMap->rbmpMain().pixel(x, y);
-            QRgb col2 = mMap->rbmpVeg().pixel(x, y);
-
-            if (mRuleByColor.contains(col)) {
-                foreach (RuleWrapper *ruleW, mRuleByColor[col]) {
-                    if (ruleW->mRule->bitmapIndex != 0)
-                        continue;
-                    auto it = mTileGrids.find(ruleW->mRule->targetLayer);
-                    if (it == mTileGrids.end()) /*if (!mTileGrids.contains(ruleW->mRule->targetLayer))*/
-                        continue;
-                    Tiled::SparseTileGrid *tileGrid = it.value();
-                    if (!ruleW->mTiles.size())
-                        continue;
-                    Tile *tile = ruleW->mTiles[mMap->bmp(0).rand(x, y) % ruleW->mTiles.size()];
-                    tileGrid->replace(x, y, Cell(tile));
+            const int index = x + y * width;
+            for (quint16 *tileGrid : qAsConst(tileGrids))
+                tileGrid[index] = 0;
+            fakeTileGrid[index] = 0;
+            for (quint16 *blendGrid : qAsConst(blendGrids))
+                blendGrid[index] = 0;
+
+            QRgb col = colorsMain[lineMain[x]];
+            QRgb col2 = colorsVeg[lineVeg[x]];
+
+            if (const QVector<int> *rules = rulesMain.find(col)) {
+                for (int ruleIndex : *rules) {
+                    const CompiledRule &rule = mCompiledRules.at(ruleIndex);
+                    tileGrids[rule.mLayer][index] = rule.mTiles[randsMain[x] % rule.mTiles.size()];
                 }
             }
 
@@ -556,31 +829,24 @@ void BmpBlender::imagesToTileGrids(int x1, int y1, int x2, int y2)
             // one of the Rules.txt tiles, pretend that that pixel exists in the image.
             if (floorLayer && col == black) {
                 if (Tile *tile = floorLayer->cellAt(x, y).tile) {
-                    if (mFloorTileToRule.contains(tile)) {
-                        RuleWrapper *ruleW = mFloorTileToRule[tile];
-                        if (ruleW->mTiles.size()) {
-                            Tile *tile = ruleW->mTiles[mMap->bmp(0).rand(x, y) % ruleW->mTiles.count()];
-                            mFakeTileGrid->replace(x, y, Cell(tile));
-                        }
-                        col = ruleW->mRule->color;
+                    auto it = mFloorTileToCompiledRule.constFind(tile);
+                    if (it != mFloorTileToCompiledRule.constEnd()) {
+                        const CompiledRule &rule = mCompiledRules.at(it.value());
+                        if (rule.mTiles.size())
+                            fakeTileGrid[index] = rule.mTiles[randsMain[x] % rule.mTiles.size()];
+                        col = rule.mColor;
                     }
                 }
             }
 
-            if (col2 != black && mRuleByColor.contains(col2)) {
-                foreach (RuleWrapper *ruleW, mRuleByColor[col2]) {
-                    if (ruleW->mRule->bitmapIndex != 1)
-                        continue;
-                    if (ruleW->mRule->condition != col && ruleW->mRule->condition != black)
-                        continue;
-                    auto it = mTileGrids.find(ruleW->mRule->targetLayer);
-                    if (it == mTileGrids.end() /*!mTileGrids.contains(ruleW->mRule->targetLayer)*/)
-                        continue;
-                    Tiled::SparseTileGrid *tileGrid = it.value();
-                    if (!ruleW->mTiles.size())
-                        continue;
-                    Tile *tile = ruleW->mTiles[mMap->bmp(1).rand(x, y) % ruleW->mTiles.size()];
-                    tileGrid->replace(x, y, Cell(tile)); /*mTileGrids[ruleW->mRule->targetLayer]->replace(x, y, Cell(tile))*/
+            if (col2 != black) {
+                if (const QVector<int> *rules = rulesVeg.find(col2)) {
+                    for (int ruleIndex : *rules) {
+                        const CompiledRule &rule = mCompiledRules.at(ruleIndex);
+                        if (rule.mCondition != col && rule.mCondition != black)
+                            continue;
+                        tileGrids[rule.mLayer][index] = rule.mTiles[randsVeg[x] % rule.mTiles.size()];
+                    }
                 }
             }
         }
@@ -594,9 +860,18 @@ void BmpBlender::addEdgeTiles(int x1, int y1, int x2, int y2)
     y1 = qBound(0, y1, mMap->height() - 1);
     y2 = qBound(0, y2, mMap->height() - 1);
 
-    if (mTileGrids.contains(STR_0Floor) == false)
+    int floorIndex = mLayerIndex.value(STR_0Floor, -1);
+    if (floorIndex == -1)
         return;
-    SparseTileGrid *grid = mTileGrids[STR_0Floor];
+
+    QVector<quint16*> tileGrids(mTileGrids.size());
+    QVector<quint16*> blendGrids(mBlendGrids.size());
+    for (int i = 0; i < mTileGrids.size(); i++) {
+        tileGrids[i] = mTileGrids[i].data();
+        blendGrids[i] = mBlendGrids[i].isEmpty() ? nullptr : mBlendGrids[i].data();
+    }
+    const quint16 *grid = tileGrids[floorIndex];
+    const quint16 *fakeTileGrid = mFakeTileGrid.constData();
 
     QMap<QString,TileLayer*> mapLayers;
     foreach (QString layerName, mBlendExclude2Layers) {
@@ -605,54 +880,91 @@ void BmpBlender::addEdgeTiles(int x1, int y1, int x2, int y2)
             mapLayers[layerName] = mMap->layerAt(n)->asTileLayer();
     }
 
-    QVector<Tile*> neighbors(9);
+    const int width = mMap->width();
+    const int height = mMap->height();
+
+    // An empty x,y gets blend tiles only if any pixel within 2 of it in
+    // either image is not black.
+    QRect nonBlackBounds = QRect(x1 - 2, y1 - 2, x2 - x1 + 5, y2 - y1 + 5) & QRect(0, 0, width, height);
+    QVector<quint8> nonBlack;
+    if (!mBlendEdgesEverywhere) {
+        // Black is always color 0.
+        const MapBmp &bmpMain = mMap->rbmpMain();
+        const MapBmp &bmpVeg = mMap->rbmpVeg();
+        nonBlack.resize(nonBlackBounds.width() * nonBlackBounds.height());
+        quint8 *dest = nonBlack.data();
+        for (int y = nonBlackBounds.top(); y <= nonBlackBounds.bottom(); y++) {
+            const quint16 *lineMain = bmpMain.indexLine(y);
+            const quint16 *lineVeg = bmpVeg.indexLine(y);
+            for (int x = nonBlackBounds.left(); x <= nonBlackBounds.right(); x++)
+                *dest++ = (lineMain[x] != 0 || lineVeg[x] != 0) ? 1 : 0;
+        }
+    }
+    auto adjacentToNonBlack = [&](int x, int y) -> bool
+    {
+        int nx1 = qMax(x - 2, nonBlackBounds.left()), nx2 = qMin(x + 2, nonBlackBounds.right());
+        int ny1 = qMax(y - 2, nonBlackBounds.top()), ny2 = qMin(y + 2, nonBlackBounds.bottom());
+        for (int ny = ny1; ny <= ny2; ny++) {
+            const quint8 *row = nonBlack.constData() + (ny - nonBlackBounds.top()) * nonBlackBounds.width();
+            for (int nx = nx1; nx <= nx2; nx++) {
+                if (row[nx - nonBlackBounds.left()])
+                    return true;
+            }
+        }
+        return false;
+    };
 
-    const Cell emptyCell;
+    const MapRands &randsMain = mMap->rbmpMain().rands();
+
+    quint16 neighbors[9];
 
     for (int y = y1; y <= y2; y++) {
         for (int x = x1; x <= x2; x++) {
-            Tile *tile = grid->at(x, y).tile;
-            if ((tile == nullptr) && ((mBlendEdgesEverywhere == true) ||
-                                      adjacentToNonBlack(mMap->rbmpMain().rimage(), mMap->rbmpVeg().rimage(), x, y))) {
-                tile = mFakeTileGrid->at(x, y).tile;
+            const int index = x + y * width;
+            quint16 tile = grid[index];
+            if ((tile == 0) && ((mBlendEdgesEverywhere == true) || adjacentToNonBlack(x, y))) {
+                tile = fakeTileGrid[index];
             }
 
-            for (int dy = -1; dy <= +1; dy++)
-                for (int dx = -1; dx <= +1; dx++)
-                    neighbors[(dx + 1) + (dy + 1) * 3] = getNeighbouringTile(x + dx, y + dy);
+            for (int dy = -1; dy <= +1; dy++) {
+                for (int dx = -1; dx <= +1; dx++) {
+                    int nx = x + dx, ny = y + dy;
+                    quint16 &neighbor = neighbors[(dx + 1) + (dy + 1) * 3];
+                    if (nx < 0 || ny < 0 || nx >= width || ny >= height) {
+                        neighbor = 0;
+                        continue;
+                    }
+                    int nindex = nx + ny * width;
+                    neighbor = grid[nindex] ? grid[nindex] : fakeTileGrid[nindex];
+                }
+            }
 
-            foreach (QString layerName, mBlendLayers) {
-                BlendWrapper *blendW = getBlendRule(x, y, tile, layerName, neighbors);
-                if (blendW != nullptr) {
+            for (int layer : qAsConst(mBlendLayerIndices)) {
+                int blend = getBlendRule(layer, tile, neighbors);
+                if (blend != -1 && mCompiledBlends.at(blend).mExclude2) {
+                    BlendWrapper *blendW = mBlendList.at(blend);
                     for (int i = 0; i < blendW->mBlend->exclude2.size(); i += 2) {
-                        if (mapLayers.contains(blendW->mBlend->exclude2[i + 1])) {
-                            TileLayer *mapLayer = mapLayers[blendW->mBlend->exclude2[i + 1]];
-                            if (Tile *tile = mapLayer->cellAt(x, y).tile) {
-                                if (blendW->mExclude2Tiles[i/2].contains(tile)) {
-                                    blendW = nullptr;
-                                    break;
-                                }
+                        TileLayer *mapLayer = mapLayers.value(blendW->mBlend->exclude2[i + 1]);
+                        if (mapLayer == nullptr)
+                            continue;
+                        if (Tile *tile = mapLayer->cellAt(x, y).tile) {
+                            if (blendW->mExclude2Tiles.at(i/2).contains(tile)) {
+                                blend = -1;
+                                break;
                             }
                         }
                     }
                 }
-                if (blendW == nullptr) {
-                    mTileGrids[layerName]->replace(x, y, emptyCell);
-                    if (true/*mHack*/) {
-                        int index = x + y * mMap->width();
-                        mBlendGrids[layerName].remove(index);
-                    }
+                if (blend == -1) {
+                    tileGrids[layer][index] = 0;
+                    blendGrids[layer][index] = 0;
                     continue;
                 }
-                const QVector<Tile*> tiles = blendW->mBlendTiles;
+                const QVector<quint16> &tiles = mCompiledBlends.at(blend).mBlendTiles;
                 if (tiles.size()) {
-                    Tile *tile = tiles[mMap->bmp(0).rand(x, y) % tiles.size()];
-                    mTileGrids[layerName]->replace(x, y, Cell(tile));
-                }
-                if (true/*mHack*/) {
-                    int index = x + y * mMap->width();
-                    mBlendGrids[layerName][index] = blendW;
+                    tileGrids[layer][index] = tiles[randsMain.at(x, y) % tiles.size()];
                 }
+                blendGrids[layer][index] = quint16(blend + 1);
             }
         }
     }
@@ -677,16 +989,19 @@ void BmpBlender::tileGridsToLayers(int x1, int y1, int x2, int y2)
     y2 = qBound(0, y2, mMap->height() - 1);
 
     const Cell emptyCell;
+    const int width = mMap->width();
 
-    foreach (QString layerName, mTileLayers.keys()) {
-        SparseTileGrid *grid = mTileGrids[layerName];
+    for (int layer = 0; layer < mLayerNames.size(); layer++) {
+        const QString &layerName = mLayerNames[layer];
+        const quint16 *grid = mTileGrids[layer].constData();
+        const quint16 *blendGrid = mBlendGrids[layer].isEmpty() ? nullptr : mBlendGrids[layer].constData();
         TileLayer *tl = mTileLayers[layerName];
-        BlendGrid &blendGrid = mBlendGrids[layerName];
         int n = mMap->indexOfLayer(layerName, Layer::TileLayerType);
         TileLayer *mapLayer = (n == -1) ? nullptr : mMap->layerAt(n)->asTileLayer();
         for (int y = y1; y <= y2; y++) {
             for (int x = x1; x <= x2; x++) {
-                Tile *tile = grid->at(x, y).tile;
+                const int index = x + y * width;
+                Tile *tile = mTileByID[grid[index]];
                 if (tile == nullptr) {
                     tl->setCell(x, y, emptyCell);
                     continue;
@@ -694,15 +1009,12 @@ void BmpBlender::tileGridsToLayers(int x1, int y1, int x2, int y2)
                 // If the blend tile that is in the map is the expected one,
                 // don't override it.  This prevents a map tile which should
                 // be there from being overriden by this automatic one.
-                if (mapLayer != nullptr) {
-                    int index = x + y * mMap->width();
-                    if (blendGrid.contains(index)) {
-                        BlendWrapper *blendW = blendGrid[index];
-                        Tile *tile = mapLayer->cellAt(x, y).tile;
-                        if (blendW->mBlendTiles.contains(tile)) {
-                            tl->setCell(x, y, emptyCell);
-                            continue;
-                        }
+                if (mapLayer != nullptr && blendGrid != nullptr && blendGrid[index] != 0) {
+                    BlendWrapper *blendW = mBlendList[blendGrid[index] - 1];
+                    Tile *tile = mapLayer->cellAt(x, y).tile;
+                    if (blendW->mBlendTiles.contains(tile)) {
+                        tl->setCell(x, y, emptyCell);
+                        continue;
                     }
                 }
                 tl->setCell(x, y, Cell(tile));
@@ -796,17 +1108,20 @@ void BmpBlender::updateWarnings()
         ++blendIndex;
     }
 
-    for (int y = 0; y < mMap->rbmpMain().height(); y++) {
-        for (int x = 0; x < mMap->rbmpMain().width(); x++) {
-            QRgb color = mMap->rbmpMain().pixel(x, y);
-            if (color != qRgb(0,0,0) && !mRuleByColor.contains(color)) {
-                warnings += tr("Map BMP image #%1 contains unknown color %2,%3,%4 at %5,%6")
-                        .arg(0).arg(qRed(color)).arg(qGreen(color)).arg(qBlue(color)).arg(x).arg(y);
-            }
-            color = mMap->rbmpVeg().pixel(x, y);
-            if (color != qRgb(0,0,0) && !mRuleByColor.contains(color)) {
-                warnings += tr("Map BMP image #%1 contains unknown color %2,%3,%4 at %5,%6")
-                        .arg(1).arg(qRed(color)).arg(qGreen(color)).arg(qBlue(color)).arg(x).arg(y);
+    for (int i = 0; i < 2; i++) {
+        const MapBmp &bmp = mMap->rbmp(i);
+        const QVector<QRgb> &colors = bmp.colorTable();
+        QBitArray known(colors.size());
+        for (int n = 0; n < colors.size(); n++)
+            known.setBit(n, colors[n] == qRgb(0,0,0) || mRuleByColor.contains(colors[n]));
+        for (int y = 0; y < bmp.height(); y++) {
+            const quint16 *line = bmp.indexLine(y);
+            for (int x = 0; x < bmp.width(); x++) {
+                if (!known.testBit(line[x])) {
+                    QRgb color = colors[line[x]];
+                    warnings += tr("Map BMP image #%1 contains unknown color %2,%3,%4 at %5,%6")
+                            .arg(i).arg(qRed(color)).arg(qGreen(color)).arg(qBlue(color)).arg(x).arg(y);
+                }
             }
         }
     }
@@ -817,77 +1132,36 @@ void BmpBlender::updateWarnings()
     }
 }
 
-Tile *BmpBlender::getNeighbouringTile(int x, int y)
+int BmpBlender::getBlendRule(int layer, quint16 tile, const quint16 *neighbors) const
 {
-    if (x < 0 || y < 0 || x >= mMap->width() || y >= mMap->height())
-        return nullptr;
-    SparseTileGrid *grid = mTileGrids[STR_0Floor];
-    Tile *tile = grid->at(x, y).tile;
-    if (!tile)
-        tile = mFakeTileGrid->at(x, y).tile;
-    return tile;
-}
+    if ((mBlendEdgesEverywhere == false) && (tile == 0))
+        return -1;
 
-BmpBlender::BlendWrapper *BmpBlender::getBlendRule(int x, int y, Tile *tile,
-                                   const QString &layer,
-                                   const QVector<Tile*> &neighbors)
-{
-    if ((mBlendEdgesEverywhere == false) && (tile == nullptr))
-        return nullptr;
+    const quint16 n = neighbors[1];
+    const quint16 w = neighbors[3];
+    const quint16 e = neighbors[5];
+    const quint16 s = neighbors[7];
 
-    BlendWrapper *lastBlend = nullptr;
+    int lastBlend = -1;
 
-#define NEIGHBOR(X,Y) neighbors[((X) - x + 1) + ((Y) - y + 1) * 3]
-
-    foreach (BlendWrapper *blendW, mBlendsByLayer[layer]) {
-        QVector<Tile*> &mainTiles = blendW->mMainTiles;
-        if (mainTiles.contains(tile))
+    for (int index : mCompiledBlendsByLayer[layer]) {
+        const CompiledBlend &blend = mCompiledBlends[index];
+        const QBitArray &mainTiles = blend.mMainTiles;
+        if (mainTiles.testBit(tile))
             continue;
-        if (blendW->mExcludeTiles.contains(tile))
+        if (blend.mExcludeTiles.testBit(tile))
             continue;
-        bool bPass = false;
-        switch (blendW->mBlend->dir) {
-        case BmpBlend::N:
-            bPass = mainTiles.contains(NEIGHBOR(x, y - 1)) &&
-                    !mainTiles.contains(NEIGHBOR(x - 1, y)) &&
-                    !mainTiles.contains(NEIGHBOR(x + 1, y));
-            break;
-        case BmpBlend::S:
-            bPass = mainTiles.contains(NEIGHBOR(x, y + 1)) &&
-                    !mainTiles.contains(NEIGHBOR(x - 1, y)) &&
-                    !mainTiles.contains(NEIGHBOR(x + 1, y));
-            break;
-        case BmpBlend::E:
-            bPass = mainTiles.contains(NEIGHBOR(x + 1, y)) &&
-                    !mainTiles.contains(NEIGHBOR(x, y - 1)) &&
-                    !mainTiles.contains(NEIGHBOR(x, y + 1));
-            break;
-        case BmpBlend::W:
-            bPass = mainTiles.contains(NEIGHBOR(x - 1, y)) &&
-                    !mainTiles.contains(NEIGHBOR(x, y - 1)) &&
-                    !mainTiles.contains(NEIGHBOR(x, y + 1));
-            break;
-        case BmpBlend::NE:
-            bPass = mainTiles.contains(NEIGHBOR(x, y - 1)) &&
-                    mainTiles.contains(NEIGHBOR(x + 1, y));
-            break;
-        case BmpBlend::SE:
-            bPass = mainTiles.contains(NEIGHBOR(x, y + 1)) &&
-                    mainTiles.contains(NEIGHBOR(x + 1, y));
-            break;
-        case BmpBlend::NW:
-            bPass = mainTiles.contains(NEIGHBOR(x, y - 1)) &&
-                    mainTiles.contains(NEIGHBOR(x - 1, y));
-            break;
-        case BmpBlend::SW:
-            bPass = mainTiles.contains(NEIGHBOR(x, y + 1)) &&
-                    mainTiles.contains(NEIGHBOR(x - 1, y));
-            break;
-        default:
-            break;
-        }
-        if (bPass)
-            lastBlend = blendW;
+        quint8 mask = 0;
+        if (mainTiles.testBit(n))
+            mask |= NeighborN;
+        if (mainTiles.testBit(s))
+            mask |= NeighborS;
+        if (mainTiles.testBit(e))
+            mask |= NeighborE;
+        if (mainTiles.testBit(w))
+            mask |= NeighborW;
+        if ((mask & blend.mRequired) == blend.mRequired && (mask & blend.mForbidden) == 0)
+            lastBlend = index;
     }
 
     return lastBlend;
@@ -18,7 +18,9 @@
 #ifndef BMPBLENDER_H
 #define BMPBLENDER_H
 
+#include <QBitArray>
 #include <QCoreApplication>
+#include <QHash>
 #include <QMap>
 #include <QRegion>
 #include <QRgb>
@@ -32,7 +34,6 @@ class BmpBlend;
 class BmpRule;
 class Map;
 class MapRenderer;
-class SparseTileGrid;
 class Tile;
 class TileLayer;
 class Tileset;
@@ -167,25 +168,38 @@ private:
     QList<Tile *> tileNameToTiles(const QString& name);
     QList<Tile *> tileNamesToTiles(const QStringList &names);
     void initTiles();
+    void createGrids();
+    void compile();
+    quint16 tileID(Tile *tile);
+    QVector<quint16> tileIDs(const QVector<Tile*> &tiles);
+    QBitArray tileIDMask(const QVector<Tile*> &tiles);
+    void blend(int x1, int y1, int x2, int y2);
     void imagesToTileGrids(int x1, int y1, int x2, int y2);
     void addEdgeTiles(int x1, int y1, int x2, int y2);
     void tileGridsToLayers(int x1, int y1, int x2, int y2);
     QString resolveAlias(const QString &tileName, int randForPos) const;
 
+    // Smaller areas are blended on the calling thread only.
+    static const int MinParallelArea = 128 * 128;
+    static const int MinBandRows = 16;
+
     Map *mMap;
-    QMap<QString,SparseTileGrid*> mTileGrids;
-    SparseTileGrid *mFakeTileGrid;
     QMap<QString,TileLayer*> mTileLayers;
 
+    // The grids are indexed by layer, in the same order as mTileLayers.
+    // Each grid holds a tile ID for every x,y in the map.
+    QStringList mLayerNames;
+    QHash<QString,int> mLayerIndex;
+    QVector<QVector<quint16> > mTileGrids;
+    QVector<quint16> mFakeTileGrid;
+    bool mGridsCreated;
+
     QStringList mTilesetNames;
     QStringList mTileNames;
     QMap<QString,Tile*> mTileByName;
     bool mInitTilesLater;
 
-    Tile *getNeighbouringTile(int x, int y);
-    class BlendWrapper;
-    BlendWrapper *getBlendRule(int x, int y, Tile *tile, const QString &layer,
-                               const QVector<Tile *> &neighbors);
+    int getBlendRule(int layer, quint16 tile, const quint16 *neighbors) const;
 
     class AliasWrapper
     {
@@ -236,11 +250,43 @@ private:
     QMap<QString,QList<BlendWrapper*> > mBlendsByLayer;
     QSet<QString> mBlendExclude2Layers;
 
+    // The rules and blends in a form that is quick to test against each
+    // x,y.  Tiles are identified by their index in mTileByID, 0 is no tile.
+    // See compile().
+    class CompiledRule
+    {
+    public:
+        int mLayer;
+        QRgb mColor;
+        QRgb mCondition;
+        QVector<quint16> mTiles;
+    };
+
+    class CompiledBlend
+    {
+    public:
+        QBitArray mMainTiles; // indexed by tile ID
+        QBitArray mExcludeTiles; // indexed by tile ID
+        QVector<quint16> mBlendTiles;
+        quint8 mRequired; // NeighborN etc which must be main tiles
+        quint8 mForbidden; // NeighborN etc which must not be main tiles
+        bool mExclude2;
+    };
+
+    QVector<Tile*> mTileByID;
+    QHash<Tile*,quint16> mIDByTile;
+    QVector<CompiledRule> mCompiledRules; // same order as mRules
+    QHash<QRgb,QVector<int> > mCompiledRulesByColor[2]; // by bitmap index
+    QHash<Tile*,int> mFloorTileToCompiledRule;
+    QVector<CompiledBlend> mCompiledBlends; // same order as mBlendList
+    QVector<QVector<int> > mCompiledBlendsByLayer;
+    QVector<int> mBlendLayerIndices; // mBlendLayers
+    bool mCompiled;
+
     QSet<Tile*> mKnownBlendTiles;
     bool mHack;
     bool mBlendEdgesEverywhere;
-    typedef QHash<int,BlendWrapper*> BlendGrid;
-    QMap<QString,BlendGrid> mBlendGrids; // blend at each x,y
+    QVector<QVector<quint16> > mBlendGrids; // index into mBlendList + 1 at each x,y
 
     QRegion mDirtyRegion;
 
@@ -17,6 +17,7 @@
 
 #include "bmptotmx.h"
 
+#include "batchmode.h"
 #include "bmpblender.h"
 #include "bmptotmxconfirmdialog.h"
 #include "mainwindow.h"
@@ -137,7 +138,8 @@ bool BMPToTMX::generateWorld(WorldDocument *worldDoc, BMPToTMX::GenerateMode mod
             }
         }
     }
-    if (!fileNames.isEmpty()) {
+    // In batch mode existing files are always overwritten.
+    if (!fileNames.isEmpty() && !BatchMode::isActive()) {
         BMPToTMXConfirmDialog dialog(fileNames, MainWindow::instance());
         if (settings.updateExisting)
             dialog.updateExisting();
@@ -204,8 +206,9 @@ bool BMPToTMX::generateWorld(WorldDocument *worldDoc, BMPToTMX::GenerateMode mod
     // While displaying this, the MapManager's FileSystemWatcher might see some
     // changed .tmx files, which results in the PROGRESS dialog being displayed.
     // It's a bit odd to see the PROGRESS dialog blocked behind this messagebox.
-    QMessageBox::information(MainWindow::instance(),
-                             tr("BMP To TMX"), tr("Finished!"));
+    if (!BatchMode::isActive())
+        QMessageBox::information(MainWindow::instance(),
+                                 tr("BMP To TMX"), tr("Finished!"));
     return true;
 
 errorExit:
@@ -431,9 +434,13 @@ void BMPToTMX::reportUnknownColors()
                             .arg(map[rgb].xy[i].x())
                             .arg(map[rgb].xy[i].y());
             }
-            UnknownColorsDialog dialog(QFileInfo(imagePath).fileName(),
-                                       unknown, MainWindow::instance());
-            dialog.exec();
+            if (BatchMode::isActive()) {
+                BatchMode::printErrors(tr("Unknown colors in %1:").arg(QFileInfo(imagePath).fileName()), unknown);
+            } else {
+                UnknownColorsDialog dialog(QFileInfo(imagePath).fileName(),
+                                           unknown, MainWindow::instance());
+                dialog.exec();
+            }
         }
         QMap<QRgb,UnknownColor> &mapVeg = mUnknownVegColors[imagePath];
         if (mapVeg.size()) {
@@ -449,8 +456,12 @@ void BMPToTMX::reportUnknownColors()
             QString suffix = QFileInfo(imagePath).suffix();
             QString fileName = QFileInfo(imagePath).completeBaseName()
                          + QLatin1String("_veg.") + suffix;
-            UnknownColorsDialog dialog(fileName, unknown, MainWindow::instance());
-            dialog.exec();
+            if (BatchMode::isActive()) {
+                BatchMode::printErrors(tr("Unknown colors in %1:").arg(fileName), unknown);
+            } else {
+                UnknownColorsDialog dialog(fileName, unknown, MainWindow::instance());
+                dialog.exec();
+            }
         }
     }
 }
@@ -673,8 +684,8 @@ bool BMPToTMX::WriteMap(WorldCell *cell, int bmpIndex)
         QImage bmpVeg = images->mBmpVeg;
         int ix = (cell->x() - images->mBounds.x()) * 300;
         int iy = (cell->y() - images->mBounds.y()) * 300;
-        rbmpMain.rimage() = bmp.copy(ix, iy, 300, 300).convertToFormat(QImage::Format_ARGB32);
-        rbmpVeg.rimage() = bmpVeg.copy(ix, iy, 300, 300).convertToFormat(QImage::Format_ARGB32);
+        rbmpMain.setImage(bmp, ix, iy);
+        rbmpVeg.setImage(bmpVeg, ix, iy);
 
         if (settings.warnUnknownColors) {
             const QRgb black = qRgb(0, 0, 0);
@@ -725,8 +736,8 @@ bool BMPToTMX::WriteMap(WorldCell *cell, int bmpIndex)
     }
 
     if (!settings.copyPixels) {
-        map.rbmpMain().rimage().fill(qRgb(0, 0, 0));
-        map.rbmpVeg().rimage().fill(qRgb(0, 0, 0));
+        map.rbmpMain().fill(qRgb(0, 0, 0));
+        map.rbmpVeg().fill(qRgb(0, 0, 0));
     }
 
     QString filePath = tmxNameForCell(cell, cell->world()->bmps().at(bmpIndex));
@@ -787,12 +798,16 @@ bool BMPToTMX::UpdateMap(WorldCell *cell, int bmpIndex)
 
     int ix = (cell->x() - images->mBounds.x()) * 300;
     int iy = (cell->y() - images->mBounds.y()) * 300;
-    QPainter painter(&rbmpMain.rimage());
+    QImage imageMain = rbmpMain.toImage();
+    QPainter painter(&imageMain);
     painter.drawImage(0, 0, bmp, ix, iy, 300, 300);
     painter.end();
-    QPainter painter2(&rbmpVeg.rimage());
+    rbmpMain.setImage(imageMain);
+    QImage imageVeg = rbmpVeg.toImage();
+    QPainter painter2(&imageVeg);
     painter2.drawImage(0, 0, bmpVeg, ix, iy, 300, 300);
     painter2.end();
+    rbmpVeg.setImage(imageVeg);
 
     MapWriter writer;
     MapWriter::LayerDataFormat format = MapWriter::CSV;
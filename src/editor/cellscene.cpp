@@ -1324,8 +1324,11 @@ exposed = QRect(); // FIXME: flush area covered by whole VBOTiles
             }
         }
     } else {
-        mLayerGroup->prepareDrawing(mRenderer, option->exposedRect.toAlignedRect());
-        mRenderer->drawTileLayerGroup(p, mLayerGroup, option->exposedRect);
+        ZLevelRenderer *renderer = dynamic_cast<ZLevelRenderer*>(mRenderer);
+        if (renderer == nullptr || !mRenderCache.paint(p, renderer, mLayerGroup, option->exposedRect)) {
+            mLayerGroup->prepareDrawing(mRenderer, option->exposedRect.toAlignedRect());
+            mRenderer->drawTileLayerGroup(p, mLayerGroup, option->exposedRect);
+        }
     }
 
 #ifdef _DEBUG
@@ -4460,6 +4463,7 @@ void CellScene::setLayerOpacity(int level, TileLayer *tl, qreal opacity)
 {
     if (mTileLayerGroupItems.contains(level) && (mTileLayerGroupItems[level]->layerGroup()->layers().indexOf(tl) != -1)) {
         mTileLayerGroupItems[level]->layerGroup()->setLayerOpacity(tl, opacity);
+        mTileLayerGroupItems[level]->clearRenderCache();
         mTileLayerGroupItems[level]->update();
     }
 }
@@ -4485,6 +4489,8 @@ void CellScene::setHighlightRoomPosition(const QPoint &tilePos)
     if (buildingRgn - roomRgn != mMapComposite->suppressRegion() ||
             document()->currentLevel() != mMapComposite->suppressLevel()) {
         mMapComposite->setSuppressRegion(buildingRgn - roomRgn, document()->currentLevel());
+        foreach (CompositeLayerGroupItem *item, mTileLayerGroupItems)
+            item->clearRenderCache();
         update();
     }
     mHighlightRoomPosition = tilePos;
@@ -5277,6 +5283,10 @@ void CellScene::handlePendingUpdates()
         foreach (CompositeLayerGroupItem *item, mPendingGroupItems)
             item->layerGroup()->synch();
     }
+    if (mPendingFlags & (Synch | Paint)) {
+        foreach (CompositeLayerGroupItem *item, mPendingGroupItems)
+            item->clearRenderCache();
+    }
     if (mPendingFlags & Bounds) {
         // Calc bounds *after* setting scene rect?
         foreach (CompositeLayerGroupItem *item, mPendingGroupItems)
@@ -5395,8 +5405,10 @@ void CellScene::roadsChanged()
     mMapComposite->generateRoadLayers(QPoint(cell()->x() * 300, cell()->y() * 300),
                                       world()->roads());
     if (mMapComposite->tileLayersForLevel(0))
-        if (mTileLayerGroupItems.contains(0))
+        if (mTileLayerGroupItems.contains(0)) {
+            mTileLayerGroupItems[0]->clearRenderCache();
             mTileLayerGroupItems[0]->update();
+        }
 }
 
 // Called when our MapComposite adds a sub-map asynchronously.
@@ -5521,8 +5533,11 @@ void CellScene::tilesetChanged(Tileset *tileset)
     if (!mMapComposite)
         return;
 
-    if (mMapComposite->isTilesetUsed(tileset))
+    if (mMapComposite->isTilesetUsed(tileset)) {
+        foreach (CompositeLayerGroupItem *item, mTileLayerGroupItems)
+            item->clearRenderCache();
         update();
+    }
 }
 
 bool CellScene::mapAboutToChange(MapInfo *mapInfo)
@@ -21,6 +21,7 @@
 #include "basegraphicsscene.h"
 
 #include "sceneoverlay.h"
+#include "tilerendercache.h"
 #include "worldcell.h"
 
 #include "map.h"
@@ -464,6 +465,9 @@ public:
 
     CompositeLayerGroup *layerGroup() const { return mLayerGroup; }
 
+    void clearRenderCache()
+    { mRenderCache.clear(); }
+
 private:
     CellScene *mScene;
     CompositeLayerGroup *mLayerGroup;
@@ -471,6 +475,7 @@ private:
     QRectF mBoundingRect;
     friend class LayerGroupVBO;
     std::array<LayerGroupVBO*,9> mVBO;
+    TileRenderCache mRenderCache;
 };
 
 class AdjacentMap : public QObject
@@ -1,26 +1,12 @@
 #include "chunkmap.h"
 
+#include "lotpackfile.h"
+
 #include <qmath.h>
-#include <QBuffer>
-#include <QDataStream>
 #include <QDebug>
 #include <QDir>
 #include <QFile>
 
-#if defined(Q_OS_WIN) && (_MSC_VER >= 1600)
-// Hmmmm.  libtiled.dll defines the MapRands class as so:
-// class TILEDSHARED_EXPORT MapRands : public QVector<QVector<quint32> >
-// Suddenly I'm getting a 'multiply-defined symbol' error.
-// I found the solution here:
-// http://www.archivum.info/qt-interest@trolltech.com/2005-12/00242/RE-Linker-Problem-while-using-QMap.html
-#if QT_VERSION >= 060000
-// QVector is an alias for QList
-template class __declspec(dllimport) QList<QList<quint32> >;
-#else
-template class __declspec(dllimport) QVector<QVector<quint32> >;
-#endif
-#endif
-
 /////
 
 int IsoGridSquare::IDMax = -1;
@@ -362,103 +348,43 @@ IsoLot::IsoLot(QString directory, int cX, int cY, int wX, int wY, IsoChunk *ch)
 
     ch->lotheader = info;
 
-    data.resize(IsoChunkMap::ChunksPerWidth);
-    for (int x = 0; x < data.size(); x++) {
-        data[x].resize(IsoChunkMap::ChunksPerWidth);
-        for (int y = 0; y < data[x].size(); y++)
-            data[x][y].resize(info->levels);
-    }
-
-    roomIDs.resize(IsoChunkMap::ChunksPerWidth);
-    for (int x = 0; x < data.size(); x++) {
-        roomIDs[x].resize(IsoChunkMap::ChunksPerWidth);
-        for (int y = 0; y < data[x].size(); y++)
-            roomIDs[x][y].fill(-1, info->levels);
-    }
+    int squareCount = IsoChunkMap::ChunksPerWidth * IsoChunkMap::ChunksPerWidth * info->levels;
+    roomIDs.fill(-1, squareCount);
+    tileStarts.fill(0, squareCount);
+    tileCounts.fill(0, squareCount);
 
     {
         QString filenamepack = QString::fromLatin1("%1/world_%2_%3.lotpack").arg(directory).arg(wX).arg(wY);
-        QBuffer *fo = CellLoader::instance()->openLotPackFile(filenamepack);
+        LotPackFile *fo = CellLoader::instance()->openLotPackFile(filenamepack);
         if (!fo)
             return; // exception!
 
-        QDataStream in(fo);
-        in.setByteOrder(QDataStream::LittleEndian);
-
 //        qDebug() << "reading chunk" << wX << wY << "from" << filenamepack;
 
-        int skip = 0;
-
         int lwx = this->wx - (wX * IsoChunkMap::ChunkGridWidth);
         int lwy = this->wy - (wY * IsoChunkMap::ChunkGridWidth);
         int index = lwx * IsoChunkMap::ChunkGridWidth + lwy;
-        fo->seek(4 + index * 8);
-        qint64 pos;
-        in >> pos;
-        fo->seek(pos);
-        for (int z = 0; z < info->levels; ++z) {
-            for (int x = 0; x < IsoChunkMap::ChunksPerWidth; ++x) {
-                for (int y = 0; y < IsoChunkMap::ChunksPerWidth; ++y) {
-                    if (skip > 0) {
-                        --skip;
-                    } else {
-                        int count = readInt(in);
-                        if (count == -1) {
-                            skip = readInt(in);
-                            if (skip > 0) {
-                                --skip;
-                            }
-                        }  else {
-#if 0
-                            if (count <= 1)
-                                continue;
-#endif
-                            int room = readInt(in);
-                            roomIDs[x][y][z] = room;
+        LotPackChunkReader chunk = fo->chunk(index, IsoChunkMap::ChunksPerWidth, info->levels);
+        while (chunk.nextSquare()) {
+            int square = indexOf(chunk.x(), chunk.y(), chunk.z());
+            roomIDs[square] = chunk.roomID();
 
-                            if (count <= 1) {
-                                int brk = 1;
-                            }
-
-                            Q_ASSERT(count > 1 && count < 30);
+            Q_ASSERT(chunk.tileCount() > 0 && chunk.tileCount() < 29);
 
-                            for (int n = 1; n < count; ++n) {
-                                int d = readInt(in);
-
-                                this->data[x][y][z] += d;
-                            }
-                        }
-                    }
-                }
-            }
+            tileStarts[square] = data.size();
+            tileCounts[square] = chunk.tileCount();
+            for (int n = 0; n < chunk.tileCount(); ++n)
+                data += chunk.tileAt(n);
         }
     }
 }
 
-unsigned char IsoLot::readByte(QDataStream &in)
+int IsoLot::indexOf(int x, int y, int z) const
 {
-    quint8 b;
-    in >> b;
-    return b;
-}
-
-int IsoLot::readInt(QDataStream &in)
-{
-    qint32 ret;
-    in >> ret;
-    return ret;
-}
-
-QString IsoLot::readString(QDataStream &in)
-{
-    QString ret;
-    quint8 ch;
-    while (!in.atEnd()) {
-        in >> ch;
-        if (ch == '\n') break;
-        ret += QLatin1Char(ch);
-    }
-    return ret;
+    Q_ASSERT(x >= 0 && x < IsoChunkMap::ChunksPerWidth);
+    Q_ASSERT(y >= 0 && y < IsoChunkMap::ChunksPerWidth);
+    Q_ASSERT(z >= 0 && z < info->levels);
+    return (z * IsoChunkMap::ChunksPerWidth + x) * IsoChunkMap::ChunksPerWidth + y;
 }
 
 /////
@@ -525,33 +451,37 @@ IsoCell *CellLoader::LoadCellBinaryChunk(IsoWorld *world, int wx, int wy)
     return cell;
 }
 
-QBuffer *CellLoader::openLotPackFile(const QString &name)
+LotPackFile *CellLoader::openLotPackFile(const QString &name)
 {
-    if (BufferByName.contains(name))
-        return BufferByName[name];
+    if (LotPackFile *file = FileByName.value(name)) {
+        OpenLotPackFiles.removeOne(file);
+        OpenLotPackFiles += file;
+        return file;
+    }
 
-    while (OpenLotPackFiles.size() > 10) {
-        BufferByName.remove(BufferByName.key(OpenLotPackFiles.first()));
-        delete OpenLotPackFiles.takeFirst();
+    // The files are memory-mapped, so keeping many open costs address space
+    // and file handles but not RAM.
+    while (OpenLotPackFiles.size() >= 64) {
+        LotPackFile *file = OpenLotPackFiles.takeFirst();
+        FileByName.remove(file->filePath());
+        delete file;
     }
-    QFile f(name);
-    if (!f.open(QFile::ReadOnly))
-        return 0;
 
-    QBuffer *b = new QBuffer();
-    b->open(QBuffer::ReadWrite);
-    b->write(f.readAll());
-    b->seek(0);
-    OpenLotPackFiles += b;
-    BufferByName[name] = b;
-    return b;
+    LotPackFile *file = new LotPackFile;
+    if (!file->open(name)) {
+        delete file;
+        return 0;
+    }
+    OpenLotPackFiles += file;
+    FileByName[name] = file;
+    return file;
 }
 
 void CellLoader::reset()
 {
     qDeleteAll(OpenLotPackFiles);
     OpenLotPackFiles.clear();
-    BufferByName.clear();
+    FileByName.clear();
 }
 
 /////
@@ -599,11 +529,12 @@ void IsoCell::PlaceLot(IsoLot *lot, int sx, int sy, int sz, IsoChunk *ch, int WX
                     if (z < 0)
                         continue;
 
-                    QList<int> ints = lot->data[(x - (WX + sx))][(y - (WY + sy))][(z - sz)];
+                    int lx = x - (WX + sx), ly = y - (WY + sy), lz = z - sz;
+                    const int *ints = lot->tiles(lx, ly, lz);
                     IsoGridSquare *square = 0;
-                    if (ints.isEmpty())
+                    int s = lot->tileCount(lx, ly, lz);
+                    if (s == 0)
                         continue;
-                    int s = ints.size();
                     int n = 0;
 
                     if (square == 0)  {
@@ -644,7 +575,7 @@ void IsoCell::PlaceLot(IsoLot *lot, int sx, int sy, int sz, IsoChunk *ch, int WX
                         square->setZ(z);
 
 #if 1
-                        int roomID = lot->roomIDs[x - WX][y - WY][z];
+                        int roomID = lot->roomID(x - WX, y - WY, z);
 #else
                         int roomID = ch->lotheader->getRoomAt(x, y, z);
 #endif
@@ -662,7 +593,7 @@ void IsoCell::PlaceLot(IsoLot *lot, int sx, int sy, int sz, IsoChunk *ch, int WX
 #if 1
                     square->tiles.clear();
                     for (n = 0; n < s; ++n) {
-                        QString tile = lot->info->tilesUsed[ints.at(n)];
+                        QString tile = lot->info->tilesUsed[ints[n]];
                         square->tiles += tile;
 #else
                     for (n = 0; n < s; ++n) {
@@ -798,22 +729,19 @@ void IsoMetaGrid::Create(const QString &directory)
             if (IsoLot::InfoHeaders.contains(filenameheader))
                 continue;
 
-            QFile fo(filenameheader);
-            if (!fo.exists())
-                continue;
-            if (!fo.open(QFile::ReadOnly))
+            LotPackFile fo;
+            if (!fo.open(filenameheader))
                 continue;
 
             LotHeader *info = new LotHeader;
 
-            QDataStream in(&fo);
-            in.setByteOrder(QDataStream::LittleEndian);
+            LotFileReader in = fo.reader();
 
-            info->version = IsoLot::readInt(in);
-            int tilecount = IsoLot::readInt(in);
+            info->version = in.readInt();
+            int tilecount = in.readInt();
 
             for (int n = 0; n < tilecount; ++n) {
-                QString str = IsoLot::readString(in);
+                QString str = in.readString();
                 str = str.trimmed();
                 info->tilesUsed += str;
 
@@ -826,29 +754,29 @@ void IsoMetaGrid::Create(const QString &directory)
                 }
             }
 
-            IsoLot::readByte(in);
+            in.readByte();
 
-            info->width = IsoLot::readInt(in);
-            info->height = IsoLot::readInt(in);
-            info->levels = IsoLot::readInt(in);
+            info->width = in.readInt();
+            info->height = in.readInt();
+            info->levels = in.readInt();
 
             Q_ASSERT(info->width == IsoChunkMap::ChunksPerWidth);
             Q_ASSERT(info->height == IsoChunkMap::ChunksPerWidth);
             Q_ASSERT(info->levels == 15);
 
-            int numRooms = IsoLot::readInt(in);
+            int numRooms = in.readInt();
 
             for (int n = 0; n < numRooms; ++n) {
-                QString str = IsoLot::readString(in);
+                QString str = in.readString();
                 RoomDef *def = new RoomDef(n, str);
-                def->level = IsoLot::readInt(in);
+                def->level = in.readInt();
 
-                int rects = IsoLot::readInt(in);
+                int rects = in.readInt();
                 for (int rc = 0; rc < rects; ++rc) {
-                    int x = IsoLot::readInt(in);
-                    int y = IsoLot::readInt(in);
-                    int w = IsoLot::readInt(in);
-                    int h = IsoLot::readInt(in);
+                    int x = in.readInt();
+                    int y = in.readInt();
+                    int w = in.readInt();
+                    int h = in.readInt();
                     RoomRect *rect = new RoomRect(x + wX * IsoChunkMap::CellSize,
                                                   y + wY * IsoChunkMap::CellSize,
                                                   w, h);
@@ -860,11 +788,11 @@ void IsoMetaGrid::Create(const QString &directory)
 
                 info->Rooms[def->ID] = def;
                 def->CalculateBounds();
-                int nObjects = IsoLot::readInt(in);
+                int nObjects = in.readInt();
                 for (int m = 0; m < nObjects; ++m) {
-                    int e = IsoLot::readInt(in);
-                    int x = IsoLot::readInt(in);
-                    int y = IsoLot::readInt(in);
+                    int e = in.readInt();
+                    int x = in.readInt();
+                    int y = in.readInt();
                     Q_UNUSED(e) Q_UNUSED(x) Q_UNUSED(y)
 #if 0
                     def->objects += new MetaObject(e,
@@ -876,13 +804,13 @@ void IsoMetaGrid::Create(const QString &directory)
 
             }
 
-            int numBuildings = IsoLot::readInt(in);
+            int numBuildings = in.readInt();
 
             for (int n = 0; n < numBuildings; ++n) {
                 BuildingDef *def = new BuildingDef(n);
-                int numbRooms = IsoLot::readInt(in);
+                int numbRooms = in.readInt();
                 for (int x = 0; x < numbRooms; ++x) {
-                    RoomDef *rr = info->Rooms[IsoLot::readInt(in)];
+                    RoomDef *rr = info->Rooms[in.readInt()];
                     rr->building = def;
                     def->rooms += rr;
                 }
@@ -894,7 +822,7 @@ void IsoMetaGrid::Create(const QString &directory)
 
             for (int x = 0; x < 30; ++x) {
                 for (int y = 0; y < 30; ++y) {
-                    int zombieDensity = IsoLot::readByte(in);
+                    int zombieDensity = in.readByte();
                     Q_UNUSED(zombieDensity)
 //                    ch.getChunk(x, y).setZombieIntensity(zombieDensity);
                 }
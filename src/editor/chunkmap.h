@@ -9,8 +9,6 @@
 #include <QStringList>
 #include <QVector>
 
-class QBuffer;
-
 class BuildingDef;
 class IsoCell;
 class IsoChunk;
@@ -18,6 +16,7 @@ class IsoChunkMap;
 class IsoRoom;
 class IsoWorld;
 class LotHeader;
+class LotPackFile;
 class RoomDef;
 class SliceY;
 
@@ -259,16 +258,27 @@ class IsoLot
 public:
     IsoLot(QString directory, int cX, int cY, int wX, int wY, IsoChunk *ch);
 
-    static unsigned char readByte(QDataStream &in);
-    static int readInt(QDataStream &in);
-    static QString readString(QDataStream &in);
+    int roomID(int x, int y, int z) const
+    { return roomIDs[indexOf(x, y, z)]; }
+
+    int tileCount(int x, int y, int z) const
+    { return tileCounts[indexOf(x, y, z)]; }
+
+    // Indices into info->tilesUsed.
+    const int *tiles(int x, int y, int z) const
+    { return data.constData() + tileStarts[indexOf(x, y, z)]; }
 
     static QMap<QString,LotHeader*> InfoHeaders;
-    QVector<QVector<QVector<int> > > roomIDs;
-    QVector<QVector<QVector<QList<int> > > > data;
+    QVector<int> roomIDs;
+    QVector<int> tileStarts;
+    QVector<int> tileCounts;
+    QVector<int> data;
     LotHeader *info;
     int wx;
     int wy;
+
+private:
+    int indexOf(int x, int y, int z) const;
 };
 
 class IsoCell
@@ -302,11 +312,11 @@ public:
     static void LoadCellBinaryChunkForLater(IsoCell *cell, int wx, int wy, IsoChunk *chunk);
     static IsoCell *LoadCellBinaryChunk(IsoWorld *world, /*IsoSpriteManager &spr, */int wx, int wy);
 
-    QBuffer *openLotPackFile(const QString &name);
+    LotPackFile *openLotPackFile(const QString &name);
     void reset();
 
-    QList<QBuffer*> OpenLotPackFiles;
-    QMap<QString,QBuffer*> BufferByName;
+    QList<LotPackFile*> OpenLotPackFiles; // most-recently used last
+    QMap<QString,LotPackFile*> FileByName;
 
     static CellLoader *mInstance;
 };
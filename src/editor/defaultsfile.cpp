@@ -17,6 +17,7 @@
 
 #include "defaultsfile.h"
 
+#include "batchmode.h"
 #include "mainwindow.h"
 #include "preferences.h"
 #include "simplefile.h"
@@ -30,10 +31,13 @@ void DefaultsFile::newWorld(World *world)
 {
     DefaultsFile file;
     if (!file.read(file.txtPath())) {
-        QMessageBox::critical(MainWindow::instance(), tr("It's no good, Jim!"),
-                              tr("%1\n(while reading %2)")
-                              .arg(file.errorString())
-                              .arg(file.txtName()));
+        QString error = tr("%1\n(while reading %2)")
+                .arg(file.errorString())
+                .arg(file.txtName());
+        if (BatchMode::isActive())
+            BatchMode::printError(error);
+        else
+            QMessageBox::critical(MainWindow::instance(), tr("It's no good, Jim!"), error);
         return;
     }
 
@@ -62,10 +66,13 @@ void DefaultsFile::oldWorld(World *world)
 {
     DefaultsFile file;
     if (!file.read(file.txtPath())) {
-        QMessageBox::critical(MainWindow::instance(), tr("It's no good, Jim!"),
-                              tr("%1\n(while reading %2)")
-                              .arg(file.errorString())
-                              .arg(file.txtName()));
+        QString error = tr("%1\n(while reading %2)")
+                .arg(file.errorString())
+                .arg(file.txtName());
+        if (BatchMode::isActive())
+            BatchMode::printError(error);
+        else
+            QMessageBox::critical(MainWindow::instance(), tr("It's no good, Jim!"), error);
         return;
     }
 
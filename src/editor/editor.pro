@@ -61,6 +61,7 @@ OBJECTS_DIR = .obj
 
 SOURCES += main.cpp\
     InGameMap/ingamemapimagedialog.cpp \
+    InGameMap/ingamemapimagerenderer.cpp \
     generatelotsfailuredialog.cpp \
     loadthumbnailsdialog.cpp \
         mainwindow.cpp \
@@ -68,6 +69,7 @@ SOURCES += main.cpp\
     InGameMap/ingamemapcell.cpp \
     InGameMap/ingamemapdock.cpp \
     InGameMap/ingamemapfeaturegenerator.cpp \
+    InGameMap/ingamemapimagepyramid.cpp \
     InGameMap/ingamemapimagepyramidwindow.cpp \
     InGameMap/ingamemappropertiesform.cpp \
     InGameMap/ingamemappropertydialog.cpp \
@@ -79,6 +81,7 @@ SOURCES += main.cpp\
     tilesetstxtfile.cpp \
     worldview.cpp \
     worldscene.cpp \
+    worldmosaic.cpp \
     world.cpp \
     worlddocument.cpp \
     worldcell.cpp \
@@ -87,10 +90,12 @@ SOURCES += main.cpp\
     document.cpp \
     documentmanager.cpp \
     celldocument.cpp \
+    mapcache.cpp \
     mapcomposite.cpp \
     mapsdock.cpp \
     preferences.cpp \
     mapimagemanager.cpp \
+    thumbnailpack.cpp \
     undoredo.cpp \
     undodock.cpp \
     mapmanager.cpp \
@@ -120,6 +125,9 @@ SOURCES += main.cpp\
     copypastedialog.cpp \
     clipboard.cpp \
     lotfilesmanager.cpp \
+    lotfilesmanifest.cpp \
+    lotpackfile.cpp \
+    lotpackwriter.cpp \
     road.cpp \
     roadsdock.cpp \
     simplefile.cpp \
@@ -131,6 +139,8 @@ SOURCES += main.cpp\
     resizeworlddialog.cpp \
     newworlddialog.cpp \
     tilemetainfomgr.cpp \
+    tilerendercache.cpp \
+    tilesetatlascache.cpp \
     tilesetmanager.cpp \
     BuildingEditor/furnituregroups.cpp \
     BuildingEditor/buildingtmx.cpp \
@@ -144,6 +154,7 @@ SOURCES += main.cpp\
     BuildingEditor/buildingroomdef.cpp \
     BuildingEditor/buildingtemplates.cpp \
     threads.cpp \
+    batchmode.cpp \
     bmpblender.cpp \
     lotpackwindow.cpp \
     chunkmap.cpp \
@@ -171,11 +182,13 @@ SOURCES += main.cpp\
 
 HEADERS  += mainwindow.h \
     InGameMap/ingamemapimagedialog.h \
+    InGameMap/ingamemapimagerenderer.h \
     generatelotsfailuredialog.h \
     InGameMap/clipper.hpp \
     InGameMap/ingamemapcell.h \
     InGameMap/ingamemapdock.h \
     InGameMap/ingamemapfeaturegenerator.h \
+    InGameMap/ingamemapimagepyramid.h \
     InGameMap/ingamemapimagepyramidwindow.h \
     InGameMap/ingamemappropertiesform.h \
     InGameMap/ingamemappropertydialog.h \
@@ -188,6 +201,7 @@ HEADERS  += mainwindow.h \
     tilesetstxtfile.h \
     worldview.h \
     worldscene.h \
+    worldmosaic.h \
     world.h \
     worlddocument.h \
     worldcell.h \
@@ -196,10 +210,12 @@ HEADERS  += mainwindow.h \
     document.h \
     documentmanager.h \
     celldocument.h \
+    mapcache.h \
     mapcomposite.h \
     mapsdock.h \
     preferences.h \
     mapimagemanager.h \
+    thumbnailpack.h \
     undoredo.h \
     undodock.h \
     mapmanager.h \
@@ -227,6 +243,9 @@ HEADERS  += mainwindow.h \
     copypastedialog.h \
     clipboard.h \
     lotfilesmanager.h \
+    lotfilesmanifest.h \
+    lotpackfile.h \
+    lotpackwriter.h \
     road.h \
     roadsdock.h \
     simplefile.h \
@@ -238,6 +257,8 @@ HEADERS  += mainwindow.h \
     resizeworlddialog.h \
     newworlddialog.h \
     tilemetainfomgr.h \
+    tilerendercache.h \
+    tilesetatlascache.h \
     tilesetmanager.h \
     BuildingEditor/furnituregroups.h \
     BuildingEditor/buildingtmx.h \
@@ -251,6 +272,7 @@ HEADERS  += mainwindow.h \
     BuildingEditor/buildingroomdef.h \
     BuildingEditor/buildingtemplates.h \
     threads.h \
+    batchmode.h \
     bmpblender.h \
     lotpackwindow.h \
     chunkmap.h \
@@ -11,6 +11,7 @@
 #include <QImageReader>
 #include <QMessageBox>
 #include <QPushButton>
+#include <QSettings>
 
 GenerateLotsDialog::GenerateLotsDialog(WorldDocument *worldDoc, QWidget *parent) :
     QDialog(parent),
@@ -40,6 +41,9 @@ GenerateLotsDialog::GenerateLotsDialog(WorldDocument *worldDoc, QWidget *parent)
     ui->xOrigin->setValue(settings.worldOrigin.x());
     ui->yOrigin->setValue(settings.worldOrigin.y());
 
+    QSettings qsettings;
+    ui->incrementalCheckBox->setChecked(qsettings.value(QLatin1String("GenerateLotsDialog/Incremental"), false).toBool());
+
     connect(ui->buttonBox->button(QDialogButtonBox::Apply), &QAbstractButton::clicked,
             this, &GenerateLotsDialog::apply);
 }
@@ -49,6 +53,11 @@ GenerateLotsDialog::~GenerateLotsDialog()
     delete ui;
 }
 
+bool GenerateLotsDialog::isIncremental() const
+{
+    return ui->incrementalCheckBox->isChecked();
+}
+
 void GenerateLotsDialog::exportBrowse()
 {
     QString f = QFileDialog::getExistingDirectory(this, tr("Choose the .lot Folder"),
@@ -103,6 +112,9 @@ void GenerateLotsDialog::accept()
     if (settings != mWorldDoc->world()->getGenerateLotsSettings())
         mWorldDoc->changeGenerateLotsSettings(settings);
 
+    QSettings qsettings;
+    qsettings.setValue(QLatin1String("GenerateLotsDialog/Incremental"), isIncremental());
+
     QDialog::accept();
 }
 
@@ -17,6 +17,8 @@ public:
     explicit GenerateLotsDialog(WorldDocument *worldDoc, QWidget *parent = 0);
     ~GenerateLotsDialog();
 
+    bool isIncremental() const;
+
 private slots:
     void exportBrowse();
     void spawnBrowse();
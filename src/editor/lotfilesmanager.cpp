@@ -17,6 +17,7 @@
 
 #include "lotfilesmanager.h"
 
+#include "batchmode.h"
 #include "bmpblender.h"
 #include "generatelotsfailuredialog.h"
 #include "mainwindow.h"
@@ -49,6 +50,9 @@
 #include <QMessageBox>
 #include <QRandomGenerator>
 #include <QRgb>
+#include <QScopedPointer>
+
+#include <algorithm>
 
 using namespace Tiled;
 
@@ -78,11 +82,24 @@ void LotFilesManager::deleteInstance()
 
 LotFilesManager::LotFilesManager(QObject *parent)
     : QObject(parent)
+    , mWorldDoc(nullptr)
+    , mWorkerCount(qMax(1, QThread::idealThreadCount()))
+    , mNextWorkerForJob(0)
+    , mJobsInFlight(0)
+    , mIncremental(false)
+    , mSkippedCells(0)
 {
+    qRegisterMetaType<LotFilesJob*>("LotFilesJob*");
 }
 
 LotFilesManager::~LotFilesManager()
 {
+    stopWorkers();
+}
+
+void LotFilesManager::setWorkerCount(int count)
+{
+    mWorkerCount = qMax(1, count);
 }
 
 bool LotFilesManager::generateWorld(WorldDocument *worldDoc, GenerateMode mode)
@@ -125,29 +142,58 @@ bool LotFilesManager::generateWorld(WorldDocument *worldDoc, GenerateMode mode)
 
     mStats = LotFile::Stats();
 
+    // The workers can't use TileMetaInfoMgr.
+    mTileEnums.update();
+
+    mSkippedCells = 0;
+    mHashCache.clear();
+    if (mIncremental) {
+        progress.update(QLatin1String("Checking for changed cells"));
+        mTileDefsHash = LotFilesManifest::hashTileDefs(lotSettings);
+    }
+
     progress.update(QLatin1String("Generating .lot files"));
 
     World *world = worldDoc->world();
 
     mFailures.clear();
 
+    QList<WorldCell*> cells;
     if (mode == GenerateSelected) {
-        for (WorldCell *cell : worldDoc->selectedCells()) {
-            if (!generateCell(cell)) {
-//                return false;
-            }
-        }
+        cells = worldDoc->selectedCells();
     } else {
         for (int y = 0; y < world->height(); y++) {
             for (int x = 0; x < world->width(); x++) {
-                WorldCell* cell = world->cellAt(x, y);
-                if (!generateCell(cell)) {
-//                    return false;
-                }
+                cells += world->cellAt(x, y);
             }
         }
     }
 
+    // Maps are loaded on this thread, one cell at a time.  Once a cell's maps
+    // are loaded, the cell is handed to a worker thread which generates the
+    // files for that cell while the next cell's maps are loaded.
+    // Every cell in flight holds all its maps in memory, so don't load more
+    // cells than there are workers to process them.
+    startWorkers();
+    int cellsDone = 0;
+    for (WorldCell *cell : cells) {
+        while (mJobsInFlight >= mWorkers.size())
+            qApp->processEvents(QEventLoop::ExcludeUserInputEvents | QEventLoop::WaitForMoreEvents);
+        progress.update(tr("Generating .lot files (%1 / %2)")
+                        .arg(++cellsDone).arg(cells.size()));
+        if (LotFilesJob *job = loadCell(cell)) {
+            ++mJobsInFlight;
+            QMetaObject::invokeMethod(mWorkers[mNextWorkerForJob], "addJob",
+                                      Qt::QueuedConnection,
+                                      Q_ARG(LotFilesJob*, job));
+            mNextWorkerForJob = (mNextWorkerForJob + 1) % mWorkers.size();
+        }
+    }
+    while (mJobsInFlight > 0)
+        qApp->processEvents(QEventLoop::ExcludeUserInputEvents | QEventLoop::WaitForMoreEvents);
+    stopWorkers();
+    mHashCache.clear();
+
     progress.release();
 
     if (!mFailures.isEmpty()) {
@@ -155,8 +201,12 @@ bool LotFilesManager::generateWorld(WorldDocument *worldDoc, GenerateMode mode)
         for (const GenerateCellFailure& failure : mFailures) {
             errorList += QString(QStringLiteral("Cell %1,%2: %3")).arg(failure.cell->x()).arg(failure.cell->y()).arg(failure.error);
         }
-        GenerateLotsFailureDialog dialog(errorList, MainWindow::instance());
-        dialog.exec();
+        if (BatchMode::isActive()) {
+            BatchMode::printErrors(tr("Failed to generate some cells:"), errorList);
+        } else {
+            GenerateLotsFailureDialog dialog(errorList, MainWindow::instance());
+            dialog.exec();
+        }
     }
 
     QString stats = tr("Finished!\n\nBuildings: %1\nRooms: %2\nRoom rects: %3\nRoom objects: %4")
@@ -164,69 +214,95 @@ bool LotFilesManager::generateWorld(WorldDocument *worldDoc, GenerateMode mode)
             .arg(mStats.numRooms)
             .arg(mStats.numRoomRects)
             .arg(mStats.numRoomObjects);
-    QMessageBox::information(MainWindow::instance(),
-                             tr("Generate Lot Files"), stats);
+    if (mIncremental)
+        stats += tr("\nUnchanged cells skipped: %1").arg(mSkippedCells);
+    if (BatchMode::isActive())
+        BatchMode::print(stats);
+    else
+        QMessageBox::information(MainWindow::instance(),
+                                 tr("Generate Lot Files"), stats);
 
     return true;
 }
 
-bool LotFilesManager::generateCell(WorldCell *cell)
+void LotFilesManager::jobFinished(LotFilesJob *job)
+{
+    IN_APP_THREAD
+
+    mStats.numBuildings += job->mStats.numBuildings;
+    mStats.numRooms += job->mStats.numRooms;
+    mStats.numRoomRects += job->mStats.numRoomRects;
+    mStats.numRoomObjects += job->mStats.numRoomObjects;
+    mFailures += job->mFailures;
+
+    // A cell generated with errors isn't recorded as up to date, so the next
+    // incremental run tries it again.
+    if (job->mSuccess && job->mFailures.isEmpty() && job->mManifest) {
+        QString manifestPath = LotFilesManifest::manifestPath(job->mCell, job->mSettings);
+        if (!job->mManifest->write(manifestPath))
+            mFailures += GenerateCellFailure(job->mCell, job->mManifest->errorString());
+    }
+
+    // The MapComposite and map references must be released on this thread.
+    delete job;
+
+    --mJobsInFlight;
+}
+
+LotFilesJob *LotFilesManager::loadCell(WorldCell *cell)
 {
-//    if (cell->x() != 5 || cell->y() != 3) return true;
+//    if (cell->x() != 5 || cell->y() != 3) return nullptr;
     if (cell->mapFilePath().isEmpty())
-        return true;
+        return nullptr;
 
     if (cell->x() * 30 + 30 > ZombieSpawnMap.width() ||
             cell->y() * 30 + 30 > ZombieSpawnMap.height()) {
         QString mError = tr("The Zombie Spawn Map doesn't cover cell %1,%2.")
                 .arg(cell->x()).arg(cell->y());
         mFailures += GenerateCellFailure(cell, mError);
-        return false;
+        return nullptr;
     }
 
-#if 0
-    // Don't regenerate the .lot files unless the cell's map is newer than
-    // the .lot files.
-    // TODO: check the modification time of all the lots included by the map.
-    // TODO: check for roads changing
-    {
-    QFileInfo mapFileInfo(cell->mapFilePath());
-    QString fileName = tr("world_%1_%2.lotpack")
-            .arg(cell->x())
-            .arg(cell->y());
-    QString lotsDirectory = Preferences::instance()->lotsDirectory();
-    QFileInfo lotFileInfo(lotsDirectory + QLatin1Char('/') + fileName);
-    if (lotFileInfo.exists() && mapFileInfo.exists() &&
-            (mapFileInfo.lastModified() < lotFileInfo.lastModified()))
-        return true;
+    QScopedPointer<LotFilesManifest> manifest;
+    if (mIncremental) {
+        manifest.reset(new LotFilesManifest);
+        manifest->setInputs(cell, mWorldDoc->world()->getGenerateLotsSettings(),
+                            ZombieSpawnMap, mTileDefsHash);
+        if (isCellUpToDate(cell, *manifest)) {
+            ++mSkippedCells;
+            return nullptr;
+        }
     }
-#endif
 
-#if 1
-    PROGRESS progress(tr("Loading maps (%1,%2)")
-                      .arg(cell->x()).arg(cell->y()));
+    // Forget about the previous run in case this one fails.  A full run
+    // doesn't record a new manifest, so the next incremental run will
+    // regenerate this cell.
+    QFile::remove(LotFilesManifest::manifestPath(cell, mWorldDoc->world()->getGenerateLotsSettings()));
 
     MapInfo *mapInfo = MapManager::instance()->loadMap(cell->mapFilePath(),
                                                        QString(), true);
     if (!mapInfo) {
         QString mError = MapManager::instance()->errorString();
         mFailures += GenerateCellFailure(cell, mError);
-        return false;
+        return nullptr;
     }
 
-    DelayedMapLoader mapLoader;
-    mapLoader.addMap(mapInfo);
+    QScopedPointer<LotFilesJob> job(new LotFilesJob(cell, mWorldDoc->world()->getGenerateLotsSettings(),
+                                                    ZombieSpawnMap, &mTileEnums));
+    job->mMapLoader->addMap(mapInfo);
 
     WorldCellLotList lots;
+    bool lotsFailed = false;
     for (WorldCellLot *lot : cell->lots()) {
         if (MapInfo *info = MapManager::instance()->loadMap(lot->mapName(),
                                                             QString(), true,
                                                             MapManager::PriorityMedium)) {
-            mapLoader.addMap(info);
+            job->mMapLoader->addMap(info);
             lots += lot;
         } else {
             mFailures += GenerateCellFailure(cell, MapManager::instance()->errorString());
-//            return false;
+            lotsFailed = true;
+//            return nullptr;
         }
     }
 
@@ -235,13 +311,13 @@ bool LotFilesManager::generateCell(WorldCell *cell)
     while (mapInfo->isLoading())
         qApp->processEvents(QEventLoop::ExcludeUserInputEvents);
 
-    MapComposite staticMapComposite(mapInfo);
-    MapComposite *mapComposite = &staticMapComposite;
-    while (mapComposite->waitingForMapsToLoad() || mapLoader.isLoading())
+    job->mMapComposite = new MapComposite(mapInfo);
+    MapComposite *mapComposite = job->mMapComposite;
+    while (mapComposite->waitingForMapsToLoad() || job->mMapLoader->isLoading())
         qApp->processEvents(QEventLoop::ExcludeUserInputEvents);
-    if (!mapLoader.errorString().isEmpty()) {
-        mError = mapLoader.errorString();
-        return false;
+    if (!job->mMapLoader->errorString().isEmpty()) {
+        mFailures += GenerateCellFailure(cell, job->mMapLoader->errorString());
+        return nullptr;
     }
 
     for (WorldCellLot *lot : lots) {
@@ -253,48 +329,200 @@ bool LotFilesManager::generateCell(WorldCell *cell)
     mapComposite->generateRoadLayers(QPoint(cell->x() * 300, cell->y() * 300),
                                      cell->world()->roads());
 
-    progress.update(tr("Generating .lot files (%1,%2)")
-                      .arg(cell->x()).arg(cell->y()));
-#else
-    MapInfo *mapInfo = MapManager::instance()->loadMap(cell->mapFilePath());
-    if (!mapInfo) {
-        mError = MapManager::instance()->errorString();
-        return false;
+    // Check for missing tilesets.
+    for (MapComposite *mc : mapComposite->maps()) {
+        if (mc->map()->hasUsedMissingTilesets()) {
+            QString mError = tr("Some tilesets are missing in a map in cell %1,%2:\n%3")
+                    .arg(cell->x()).arg(cell->y()).arg(mc->mapInfo()->path());
+            mFailures += GenerateCellFailure(cell, mError);
+            return nullptr;
+        }
     }
 
-    PROGRESS progress(tr("Generating .lot files (%1,%2)")
-                      .arg(cell->x()).arg(cell->y()));
+    // The worker flushes the blenders, see prepareDrawing2().
+    mapComposite->setBmpBlendersFlushedElsewhere();
 
-    MapComposite staticMapComposite(mapInfo);
-    MapComposite *mapComposite = &staticMapComposite;
-    while (mapComposite->waitingForMapsToLoad())
-        qApp->processEvents(QEventLoop::ExcludeUserInputEvents);
-    mapComposite->generateRoadLayers(QPoint(cell->x() * 300, cell->y() * 300),
-                                     cell->world()->roads());
+    // The missing lot isn't among the manifest's map files, so the cell
+    // would look up to date once the lot could be loaded.
+    if (manifest && !lotsFailed) {
+        manifest->setMapFiles(mapComposite, mHashCache);
+        job->mManifest = manifest.take();
+    }
 
-    foreach (WorldCellLot *lot, cell->lots()) {
-        if (MapInfo *info = MapManager::instance()->loadMap(lot->mapName())) {
-            mapComposite->addMap(info, lot->pos(), lot->level());
-        } else {
-            mError = MapManager::instance()->errorString();
+    return job.take();
+}
+
+bool LotFilesManager::isCellUpToDate(WorldCell *cell, LotFilesManifest &current)
+{
+    const GenerateLotsSettings &lotSettings = mWorldDoc->world()->getGenerateLotsSettings();
+    for (const QString &path : LotFilesManifest::outputPaths(cell, lotSettings)) {
+        if (!QFileInfo(path).exists())
             return false;
-        }
     }
-#endif
+    LotFilesManifest previous;
+    if (!previous.read(LotFilesManifest::manifestPath(cell, lotSettings)))
+        return false;
+    return previous.isUpToDate(current, mHashCache);
+}
 
+void LotFilesManager::startWorkers()
+{
+    stopWorkers();
+
+    mWorkerThreads.resize(mWorkerCount);
+    mWorkers.resize(mWorkerThreads.size());
+    for (int i = 0; i < mWorkerThreads.size(); i++) {
+        mWorkerThreads[i] = new InterruptibleThread;
+        mWorkers[i] = new LotFilesWorker(mWorkerThreads[i], i);
+        mWorkers[i]->moveToThread(mWorkerThreads[i]);
+        connect(mWorkers[i], &LotFilesWorker::finished,
+                this, &LotFilesManager::jobFinished);
+        mWorkerThreads[i]->start();
+    }
+    mNextWorkerForJob = 0;
+    mJobsInFlight = 0;
+}
 
-    // Check for missing tilesets.
-    for (MapComposite *mc : mapComposite->maps()) {
-        if (mc->map()->hasUsedMissingTilesets()) {
-            QString mError = tr("Some tilesets are missing in a map in cell %1,%2:\n%3")
-                    .arg(cell->x()).arg(cell->y()).arg(mc->mapInfo()->path());
-            mFailures += GenerateCellFailure(cell, mError);
-            return false;
-        }
+void LotFilesManager::stopWorkers()
+{
+    for (int i = 0; i < mWorkerThreads.size(); i++) {
+        mWorkerThreads[i]->interrupt(); // stop the long-running task
+        mWorkerThreads[i]->quit(); // exit the event loop
+        mWorkerThreads[i]->wait(); // wait for thread to terminate
+        delete mWorkerThreads[i];
+        delete mWorkers[i];
+    }
+    mWorkerThreads.clear();
+    mWorkers.clear();
+}
+
+/////
+
+void LotFilesTileEnums::update()
+{
+    TileMetaInfoMgr *mgr = TileMetaInfoMgr::instance();
+    mValues = mgr->tileEnumValues();
+    mWest.clear();
+    mNorth.clear();
+    const QMap<QString,int> enums = mgr->enums();
+    for (auto it = enums.constBegin(); it != enums.constEnd(); ++it) {
+        if (mgr->isEnumWest(it.key()))
+            mWest += it.value();
+        if (mgr->isEnumNorth(it.key()))
+            mNorth += it.value();
     }
+}
+
+int LotFilesTileEnums::tileEnumValue(Tile *tile) const
+{
+    auto it = mValues.constFind(tile->tileset()->name());
+    if (it == mValues.constEnd())
+        return -1;
+    return it->value(TilesetMetaInfo::key(tile), -1);
+}
+
+/////
+
+LotFilesJob::LotFilesJob(WorldCell *cell, const GenerateLotsSettings &settings,
+                         const QImage &zombieSpawnMap, const LotFilesTileEnums *tileEnums)
+    : mCell(cell)
+    , mSettings(settings)
+    , mZombieSpawnMap(zombieSpawnMap)
+    , mTileEnums(tileEnums)
+    , mMapLoader(new DelayedMapLoader)
+    , mMapComposite(nullptr)
+    , mManifest(nullptr)
+    , mSuccess(false)
+{
+}
+
+LotFilesJob::~LotFilesJob()
+{
+    delete mManifest;
+    delete mMapComposite;
+    delete mMapLoader;
+}
+
+/////
+
+LotFilesWorker::LotFilesWorker(InterruptibleThread *thread, int id)
+    : BaseWorker(thread)
+    , mID(id)
+{
+}
+
+LotFilesWorker::~LotFilesWorker()
+{
+}
+
+void LotFilesWorker::work()
+{
+    IN_WORKER_THREAD
+
+    if (mJobs.size()) {
+        LotFilesJob *job = mJobs.takeFirst();
+        if (!aborted())
+            job->mSuccess = mGenerator.generateCell(job);
+        emit finished(job);
+    }
+
+    if (mJobs.size()) scheduleWork();
+}
+
+void LotFilesWorker::addJob(LotFilesJob *job)
+{
+    IN_WORKER_THREAD
+
+    mJobs += job;
+    scheduleWork();
+}
+
+/////
+
+LotFilesCellGenerator::LotFilesCellGenerator()
+    : mTileEnums(nullptr)
+    , mLastTileset(nullptr)
+    , mLastFirstGid(0)
+    , mJumboTreeTileset(nullptr)
+    , mJumboTreeGid(0)
+    , MaxLevel(15)
+    , Version(0)
+{
+}
+
+LotFilesCellGenerator::~LotFilesCellGenerator()
+{
+    clear();
+}
+
+void LotFilesCellGenerator::clear()
+{
+    qDeleteAll(mRoomRects);
+    qDeleteAll(roomList);
+    qDeleteAll(buildingList);
+    qDeleteAll(ZoneList);
+
+    mRoomRects.clear();
+    mRoomRectByLevel.clear();
+    roomList.clear();
+    buildingList.clear();
+    ZoneList.clear();
+    TileMap.resize(0); // keep the capacity for the next cell
+}
+
+bool LotFilesCellGenerator::generateCell(LotFilesJob *job)
+{
+    WorldCell *cell = job->mCell;
+    MapComposite *mapComposite = job->mMapComposite;
+    MapInfo *mapInfo = mapComposite->mapInfo();
+
+    mSettings = job->mSettings;
+    ZombieSpawnMap = job->mZombieSpawnMap;
+    setTileEnums(job->mTileEnums);
+    mStats = LotFile::Stats();
 
     if (!generateHeader(cell, mapComposite)) {
-        mFailures += GenerateCellFailure(cell, mError);
+        job->mFailures += GenerateCellFailure(cell, mError);
         return false;
     }
 
@@ -303,9 +531,9 @@ bool LotFilesManager::generateCell(WorldCell *cell)
         for (CompositeLayerGroup *lg : mapComposite->layerGroups()) {
             lg->prepareDrawing2();
         }
-        const GenerateLotsSettings &lotSettings = mWorldDoc->world()->getGenerateLotsSettings();
         Navigate::ChunkDataFile cdf;
-        cdf.fromMap(cell->x(), cell->y(), mapComposite, mRoomRectByLevel[0], lotSettings);
+        cdf.fromMap(cell->x(), cell->y(), mapComposite, mRoomRectByLevel[0], mSettings);
+        job->mStats = mStats;
         return true;
     }
 
@@ -315,109 +543,239 @@ bool LotFilesManager::generateCell(WorldCell *cell)
     int mapHeight = mapInfo->height();
 
     // Resize the grid and cleanup data from the previous cell.
-    mGridData.resize(mapWidth);
-    for (int x = 0; x < mapWidth; x++) {
-        mGridData[x].resize(mapHeight);
-        for (int y = 0; y < mapHeight; y++)
-            mGridData[x][y].fill(LotFile::Square(), MaxLevel);
-    }
+    mGrid.reset(mapWidth, mapHeight, MaxLevel);
 
     Tile *missingTile = Tiled::Internal::TilesetManager::instance()->missingTile();
-    QVector<const Tiled::Cell *> cells(40);
     for (CompositeLayerGroup *lg : mapComposite->layerGroups()) {
         lg->prepareDrawing2();
         int d = (mapInfo->orientation() == Map::Isometric) ? -3 : 0;
         d *= lg->level();
+        lg->flatten(QRect(d, d, mapWidth - d, mapHeight - d));
         for (int y = d; y < mapHeight; y++) {
             for (int x = d; x < mapWidth; x++) {
-                cells.resize(0);
-                lg->orderedCellsAt2(QPoint(x, y), cells);
-                for (const Tiled::Cell *cell : cells) {
+                int lx = x, ly = y;
+                if (mapInfo->orientation() == Map::Isometric) {
+                    lx = x + lg->level() * 3;
+                    ly = y + lg->level() * 3;
+                }
+                if (lx >= mapWidth) continue;
+                if (ly >= mapHeight) continue;
+                const Tiled::Cell *cells;
+                int count = lg->flatCellsAt(QPoint(x, y), cells);
+                mSquareGids.resize(0);
+                for (int i = 0; i < count; i++) {
+                    const Tiled::Cell *cell = &cells[i];
                     if (cell->tile == missingTile) continue;
-                    int lx = x, ly = y;
-                    if (mapInfo->orientation() == Map::Isometric) {
-                        lx = x + lg->level() * 3;
-                        ly = y + lg->level() * 3;
-                    }
-                    if (lx >= mapWidth) continue;
-                    if (ly >= mapHeight) continue;
-                    LotFile::Entry *e = new LotFile::Entry(cellToGid(cell));
-                    mGridData[lx][ly][lg->level()].Entries.append(e);
-                    TileMap[e->gid]->used = true;
+                    uint gid = cellToGid(cell);
+                    mSquareGids += gid;
+                    TileMap[gid].used = true;
                 }
+                if (!mSquareGids.isEmpty())
+                    mGrid.setEntries(lx, ly, lg->level(), mSquareGids.constData(), mSquareGids.size());
             }
         }
+        // The ChunkDataFile below reuses level 0.
+        if (lg->level() != 0)
+            lg->clearFlattened();
     }
 
     generateBuildingObjects(mapWidth, mapHeight);
 
     generateJumboTrees(cell, mapComposite);
 
-    generateHeaderAux(cell, mapComposite);
+    if (!generateHeaderAux(cell, mapComposite)) {
+        job->mFailures += GenerateCellFailure(cell, mError);
+        return false;
+    }
 
     /////
 
-    const GenerateLotsSettings &lotSettings = mWorldDoc->world()->getGenerateLotsSettings();
-
     QString fileName = tr("world_%1_%2.lotpack")
-            .arg(lotSettings.worldOrigin.x() + cell->x())
-            .arg(lotSettings.worldOrigin.y() + cell->y());
-
-    QString lotsDirectory = lotSettings.exportDir;
-    QFile file(lotsDirectory + QLatin1Char('/') + fileName);
-    if (!file.open(QIODevice::WriteOnly /*| QIODevice::Text*/)) {
-        QString mError = tr("Could not open file for writing.");
-        mFailures += GenerateCellFailure(cell, mError);
-        return false;
-    }
+            .arg(mSettings.worldOrigin.x() + cell->x())
+            .arg(mSettings.worldOrigin.y() + cell->y());
 
-    QDataStream out(&file);
-    out.setByteOrder(QDataStream::LittleEndian);
+    QString lotsDirectory = mSettings.exportDir;
 
     int WorldDiv = CELL_WIDTH / CHUNK_WIDTH;
-    // C# 'long' is signed 64-bit integer
-    out << qint32(WorldDiv * WorldDiv);
-    for (int m = 0; m < WorldDiv * WorldDiv; m++)
-        out << qint64(m);
-
-    QList<qint64> PositionMap;
+    mLotPackWriter.begin(WorldDiv * WorldDiv);
 
     for (int x = 0; x < mapInfo->width() / CHUNK_WIDTH; x++) {
         for (int y = 0; y < mapInfo->height() / CHUNK_HEIGHT; y++) {
-            PositionMap += file.pos();
-            if (!generateChunk(out, cell, mapComposite, x, y)) {
-                mFailures += GenerateCellFailure(cell, QLatin1String("generateChunk() failed"));
+            mLotPackWriter.beginChunk();
+            if (!generateChunk(mLotPackWriter, cell, mapComposite, x, y)) {
+                job->mFailures += GenerateCellFailure(cell, QLatin1String("generateChunk() failed"));
                 return false;
             }
         }
     }
 
-    file.seek(4);
-    for (int m = 0; m < WorldDiv * WorldDiv; m++)
-        out << qint64(PositionMap[m]);
-
-    file.close();
+    if (!mLotPackWriter.write(lotsDirectory + QLatin1Char('/') + fileName)) {
+        job->mFailures += GenerateCellFailure(cell, mLotPackWriter.errorString());
+        return false;
+    }
 
     Navigate::ChunkDataFile cdf;
-    cdf.fromMap(cell->x(), cell->y(), mapComposite, mRoomRectByLevel[0], lotSettings);
+    cdf.fromMap(cell->x(), cell->y(), mapComposite, mRoomRectByLevel[0], mSettings);
+
+    job->mStats = mStats;
 
     return true;
 }
 
-bool LotFilesManager::generateHeader(WorldCell *cell, MapComposite *mapComposite)
+// Size of a RectGrid bucket in squares.
+#define GRID_BUCKET 10
+
+namespace {
+
+// QRect::intersects() treats rectangles with a negative size as if they were
+// normalized, so a rectangle is looked up by the squares between its edges.
+QRect coverRect(const QRect &r)
 {
-    Q_UNUSED(cell)
+    return QRect(QPoint(qMin(r.left(), r.right()), qMin(r.top(), r.bottom())),
+                 QPoint(qMax(r.left(), r.right()), qMax(r.top(), r.bottom())));
+}
 
-    qDeleteAll(mRoomRects);
-    qDeleteAll(roomList);
-    qDeleteAll(buildingList);
-    qDeleteAll(ZoneList);
+/**
+ * Values stored in buckets by the squares of the rectangle they cover, to
+ * find the ones near a rectangle without looking at every one.
+ */
+class RectGrid
+{
+public:
+    explicit RectGrid(const QRect &bounds) :
+        mBounds(bounds),
+        mColumns(bounds.isEmpty() ? 0 : (bounds.width() + GRID_BUCKET - 1) / GRID_BUCKET),
+        mRows(bounds.isEmpty() ? 0 : (bounds.height() + GRID_BUCKET - 1) / GRID_BUCKET),
+        mBuckets(mColumns * mRows)
+    {
+    }
 
-    mRoomRects.clear();
-    mRoomRectByLevel.clear();
-    roomList.clear();
-    buildingList.clear();
-    ZoneList.clear();
+    void insert(const QRect &r, int value)
+    {
+        int x1, y1, x2, y2;
+        if (!bucketRange(r, x1, y1, x2, y2))
+            return;
+        for (int y = y1; y <= y2; y++)
+            for (int x = x1; x <= x2; x++)
+                mBuckets[x + y * mColumns] += value;
+    }
+
+    // Appends the values in the buckets that \a r touches.  A value may be
+    // appended more than once, and need not be near \a r.
+    void values(const QRect &r, QVector<int> &result) const
+    {
+        int x1, y1, x2, y2;
+        if (!bucketRange(r, x1, y1, x2, y2))
+            return;
+        for (int y = y1; y <= y2; y++)
+            for (int x = x1; x <= x2; x++)
+                result += mBuckets[x + y * mColumns];
+    }
+
+private:
+    bool bucketRange(const QRect &r, int &x1, int &y1, int &x2, int &y2) const
+    {
+        QRect cover = coverRect(r) & mBounds;
+        if (cover.isEmpty())
+            return false;
+        x1 = (cover.left() - mBounds.left()) / GRID_BUCKET;
+        y1 = (cover.top() - mBounds.top()) / GRID_BUCKET;
+        x2 = (cover.right() - mBounds.left()) / GRID_BUCKET;
+        y2 = (cover.bottom() - mBounds.top()) / GRID_BUCKET;
+        return true;
+    }
+
+    QRect mBounds;
+    int mColumns;
+    int mRows;
+    QVector<QVector<int>> mBuckets;
+};
+
+/**
+ * Disjoint sets of the RoomRects or Rooms being merged.  Each set keeps its
+ * members in the order they were merged, and the index of the room or
+ * building it will become, or -1.
+ */
+class MergeSets
+{
+public:
+    explicit MergeSets(int count) :
+        mParent(count),
+        mSize(count, 1),
+        mHead(count),
+        mTail(count),
+        mNext(count, -1),
+        mGroup(count, -1)
+    {
+        for (int i = 0; i < count; i++)
+            mParent[i] = mHead[i] = mTail[i] = i;
+    }
+
+    int group(int i)
+    {
+        return mGroup[find(i)];
+    }
+
+    void setGroup(int i, int group)
+    {
+        mGroup[find(i)] = group;
+    }
+
+    // Appends the members of j's set to i's set, which keeps its group.
+    void merge(int i, int j)
+    {
+        int a = find(i), b = find(j);
+        Q_ASSERT(a != b);
+        mNext[mTail[a]] = mHead[b];
+        int head = mHead[a], tail = mTail[b], group = mGroup[a];
+        if (mSize[a] < mSize[b])
+            std::swap(a, b);
+        mParent[b] = a;
+        mSize[a] += mSize[b];
+        mHead[a] = head;
+        mTail[a] = tail;
+        mGroup[a] = group;
+    }
+
+    QVector<int> members(int i)
+    {
+        QVector<int> result;
+        for (int m = mHead[find(i)]; m != -1; m = mNext[m])
+            result += m;
+        return result;
+    }
+
+private:
+    int find(int i)
+    {
+        while (mParent[i] != i) {
+            mParent[i] = mParent[mParent[i]];
+            i = mParent[i];
+        }
+        return i;
+    }
+
+    QVector<int> mParent;
+    QVector<int> mSize;
+    QVector<int> mHead;
+    QVector<int> mTail;
+    QVector<int> mNext;
+    QVector<int> mGroup;
+};
+
+void sortUnique(QVector<int> &v)
+{
+    std::sort(v.begin(), v.end());
+    v.erase(std::unique(v.begin(), v.end()), v.end());
+}
+
+} // namespace
+
+bool LotFilesCellGenerator::generateHeader(WorldCell *cell, MapComposite *mapComposite)
+{
+    Q_UNUSED(cell)
+
+    clear();
 
     // Create the set of all tilesets used by the map and its sub-maps.
     QList<Tileset*> tilesets;
@@ -432,57 +790,64 @@ bool LotFilesManager::generateHeader(WorldCell *cell, MapComposite *mapComposite
     tilesets += mJumboTreeTileset;
     QScopedPointer<Tiled::Tileset> scoped(mJumboTreeTileset);
 
-    qDeleteAll(TileMap.values());
-    TileMap.clear();
-    TileMap[0] = new LotFile::Tile;
-
-    mTilesetToFirstGid.clear();
-    uint firstGid = 1;
-    for (Tileset *tileset : tilesets) {
-        if (!handleTileset(tileset, firstGid))
-            return false;
-    }
+    if (!handleTilesets(tilesets))
+        return false;
+    mJumboTreeGid = mTilesetToFirstGid.value(mJumboTreeTileset);
 
     if (!processObjectGroups(cell, mapComposite))
         return false;
 
     // Merge adjacent RoomRects on the same level into rooms.
     // Only RoomRects with matching names and with # in the name are merged.
-    for (int level : mRoomRectByLevel.keys()) {
-        QList<LotFile::RoomRect*> rrList = mRoomRectByLevel[level];
-        for (LotFile::RoomRect *rr : rrList) {
-            if (rr->room == nullptr) {
-                rr->room = new LotFile::Room(rr->nameWithoutSuffix(),
-                                             rr->floor);
-                rr->room->rects += rr;
-                roomList += rr->room;
+    // Each RoomRect is only compared with the ones near it, but in the same
+    // order as comparing every pair, so the rooms and their IDs are the same.
+    QVector<int> nearby;
+    for (const QList<LotFile::RoomRect*> &rrList : std::as_const(mRoomRectByLevel)) {
+        QRect bounds;
+        for (LotFile::RoomRect *rr : rrList)
+            bounds |= coverRect(rr->bounds());
+        RectGrid grid(bounds);
+        for (int i = 0; i < rrList.size(); i++)
+            grid.insert(rrList[i]->bounds(), i);
+
+        MergeSets sets(rrList.size());
+        QVector<int> firstRect; // of each room, in the order they were created
+        QVector<bool> mergedAway;
+        for (int i = 0; i < rrList.size(); i++) {
+            LotFile::RoomRect *rr = rrList[i];
+            if (sets.group(i) == -1) {
+                sets.setGroup(i, firstRect.size());
+                firstRect += i;
+                mergedAway += false;
             }
             if (!rr->name.contains(QLatin1Char('#')))
                 continue;
-            for (LotFile::RoomRect *comp : rrList) {
-                if (comp == rr)
+            nearby.clear();
+            grid.values(rr->bounds().adjusted(-1, -1, 1, 1), nearby);
+            sortUnique(nearby);
+            for (int j : std::as_const(nearby)) {
+                if (j == i || sets.group(j) == sets.group(i))
                     continue;
-                if (comp->room == rr->room)
-                    continue;
-                if (rr->inSameRoom(comp)) {
-                    if (comp->room != nullptr) {
-                        LotFile::Room *room = comp->room;
-                        for (LotFile::RoomRect *rr2 : room->rects) {
-                            Q_ASSERT(rr2->room == room);
-                            Q_ASSERT(!rr->room->rects.contains(rr2));
-                            rr2->room = rr->room;
-                        }
-                        rr->room->rects += room->rects;
-                        roomList.removeOne(room);
-                        delete room;
-                    } else {
-                        comp->room = rr->room;
-                        rr->room->rects += comp;
-                        Q_ASSERT(rr->room->rects.count(comp) == 1);
-                    }
+                if (rr->inSameRoom(rrList[j])) {
+                    if (sets.group(j) != -1)
+                        mergedAway[sets.group(j)] = true;
+                    sets.merge(i, j);
                 }
             }
         }
+
+        for (int n = 0; n < firstRect.size(); n++) {
+            if (mergedAway[n])
+                continue;
+            LotFile::RoomRect *rr = rrList[firstRect[n]];
+            LotFile::Room *room = new LotFile::Room(rr->nameWithoutSuffix(),
+                                                    rr->floor);
+            for (int i : sets.members(firstRect[n])) {
+                rrList[i]->room = room;
+                room->rects += rrList[i];
+            }
+            roomList += room;
+        }
     }
     for (int i = 0; i < roomList.size(); i++)
         roomList[i]->ID = i;
@@ -492,53 +857,66 @@ bool LotFilesManager::generateHeader(WorldCell *cell, MapComposite *mapComposite
     // Merge adjacent rooms into buildings.
     // Rooms on different levels that overlap in x/y are merged into the
     // same buliding.
-    for (LotFile::Room *r : roomList) {
-        if (r->building == nullptr) {
-            r->building = new LotFile::Building();
-            buildingList += r->building;
-            r->building->RoomList += r;
+    // As with RoomRects, only rooms with a RoomRect near one of the room's
+    // RoomRects are compared, in the same order as before.
+    QRect bounds;
+    for (LotFile::Room *r : std::as_const(roomList))
+        for (LotFile::RoomRect *rr : std::as_const(r->rects))
+            bounds |= coverRect(rr->bounds());
+    RectGrid grid(bounds);
+    for (LotFile::Room *r : std::as_const(roomList))
+        for (LotFile::RoomRect *rr : std::as_const(r->rects))
+            grid.insert(rr->bounds(), r->ID);
+
+    MergeSets sets(roomList.size());
+    QVector<int> firstRoom; // of each building, in the order they were created
+    QVector<bool> mergedAway;
+    for (int i = 0; i < roomList.size(); i++) {
+        LotFile::Room *r = roomList[i];
+        if (sets.group(i) == -1) {
+            sets.setGroup(i, firstRoom.size());
+            firstRoom += i;
+            mergedAway += false;
         }
-        for (LotFile::Room *comp : roomList) {
-            if (comp == r)
-                continue;
-            if (r->building == comp->building)
+        nearby.clear();
+        for (LotFile::RoomRect *rr : std::as_const(r->rects))
+            grid.values(rr->bounds().adjusted(-1, -1, 1, 1), nearby);
+        sortUnique(nearby);
+        for (int j : std::as_const(nearby)) {
+            if (j == i || sets.group(j) == sets.group(i))
                 continue;
-
-            if (r->inSameBuilding(comp)) {
-                if (comp->building != nullptr) {
-                    LotFile::Building *b = comp->building;
-                    for (LotFile::Room *r2 : b->RoomList) {
-                        Q_ASSERT(r2->building == b);
-                        Q_ASSERT(!r->building->RoomList.contains(r2));
-                        r2->building = r->building;
-                    }
-                    r->building->RoomList += b->RoomList;
-                    buildingList.removeOne(b);
-                    delete b;
-                } else {
-                    comp->building = r->building;
-                    r->building->RoomList += comp;
-                    Q_ASSERT(r->building->RoomList.count(comp) == 1);
-                }
+            if (r->inSameBuilding(roomList[j])) {
+                if (sets.group(j) != -1)
+                    mergedAway[sets.group(j)] = true;
+                sets.merge(i, j);
             }
         }
     }
+
+    for (int n = 0; n < firstRoom.size(); n++) {
+        if (mergedAway[n])
+            continue;
+        LotFile::Building *building = new LotFile::Building();
+        for (int i : sets.members(firstRoom[n])) {
+            roomList[i]->building = building;
+            building->RoomList += roomList[i];
+        }
+        buildingList += building;
+    }
     mStats.numBuildings += buildingList.size();
 
     return true;
 }
 
-bool LotFilesManager::generateHeaderAux(WorldCell *cell, MapComposite *mapComposite)
+bool LotFilesCellGenerator::generateHeaderAux(WorldCell *cell, MapComposite *mapComposite)
 {
     Q_UNUSED(mapComposite)
 
-    const GenerateLotsSettings &lotSettings = mWorldDoc->world()->getGenerateLotsSettings();
-
     QString fileName = tr("%1_%2.lotheader")
-            .arg(lotSettings.worldOrigin.x() + cell->x())
-            .arg(lotSettings.worldOrigin.y() + cell->y());
+            .arg(mSettings.worldOrigin.x() + cell->x())
+            .arg(mSettings.worldOrigin.y() + cell->y());
 
-    QString lotsDirectory = mWorldDoc->world()->getGenerateLotsSettings().exportDir;
+    QString lotsDirectory = mSettings.exportDir;
     QFile file(lotsDirectory + QLatin1Char('/') + fileName);
     if (!file.open(QIODevice::WriteOnly /*| QIODevice::Text*/)) {
         mError = tr("Could not open file for writing.");
@@ -552,20 +930,17 @@ bool LotFilesManager::generateHeaderAux(WorldCell *cell, MapComposite *mapCompos
     out << qint32(Version);
 
     int tilecount = 0;
-    for (LotFile::Tile *tile : TileMap) {
-        if (tile->used) {
-            tile->id = tilecount;
+    for (LotFile::Tile &tile : TileMap) {
+        if (tile.used) {
+            tile.id = tilecount;
             tilecount++;
-            if (tile->name.startsWith(QLatin1String("jumbo_tree_01"))) {
-                int nnn = 0;
-            }
         }
     }
     out << qint32(tilecount);
 
-    for (LotFile::Tile *tile : TileMap) {
-        if (tile->used) {
-            SaveString(out, tile->name);
+    for (const LotFile::Tile &tile : qAsConst(TileMap)) {
+        if (tile.used) {
+            SaveString(out, tile.name);
         }
     }
 
@@ -649,7 +1024,7 @@ bool LotFilesManager::generateHeaderAux(WorldCell *cell, MapComposite *mapCompos
     return true;
 }
 
-bool LotFilesManager::generateChunk(QDataStream &out, WorldCell *cell,
+bool LotFilesCellGenerator::generateChunk(LotPackWriter &out, WorldCell *cell,
                                     MapComposite *mapComposite, int cx, int cy)
 {
     Q_UNUSED(cell)
@@ -664,35 +1039,39 @@ bool LotFilesManager::generateChunk(QDataStream &out, WorldCell *cell,
             for (int y = 0; y < CHUNK_HEIGHT; y++) {
                 int gx = cx * CHUNK_WIDTH + x;
                 int gy = cy * CHUNK_HEIGHT + y;
-                const QList<LotFile::Entry*> &entries = mGridData[gx][gy][z].Entries;
-                if (entries.count() == 0)
+                int count = mGrid.count(gx, gy, z);
+                if (count == 0) {
                     notdonecount++;
-                else {
-                    if (notdonecount > 0) {
-                        out << qint32(-1);
-                        out << qint32(notdonecount);
-                    }
-                    notdonecount = 0;
-                    out << qint32(entries.count() + 1);
-                    out << qint32(getRoomID(gx, gy, z));
+                    continue;
                 }
-                foreach (LotFile::Entry *entry, entries) {
-                    Q_ASSERT(TileMap[entry->gid]);
-                    Q_ASSERT(TileMap[entry->gid]->id != -1);
-                    out << qint32(TileMap[entry->gid]->id);
+                // Skipped squares, then the tile count + 1, the room ID and
+                // the tile IDs, written as a single run.
+                mChunkInts.resize(0);
+                if (notdonecount > 0) {
+                    mChunkInts += -1;
+                    mChunkInts += notdonecount;
                 }
+                notdonecount = 0;
+                mChunkInts += count + 1;
+                mChunkInts += getRoomID(gx, gy, z);
+                const qint32 *gids = mGrid.entries(gx, gy, z);
+                for (int i = 0; i < count; i++) {
+                    Q_ASSERT(TileMap.at(gids[i]).id != -1);
+                    mChunkInts += TileMap.at(gids[i]).id;
+                }
+                out.writeInts(mChunkInts.constData(), mChunkInts.size());
             }
         }
     }
     if (notdonecount > 0) {
-        out << qint32(-1);
-        out << qint32(notdonecount);
+        out.writeInt(-1);
+        out.writeInt(notdonecount);
     }
 
     return true;
 }
 
-void LotFilesManager::generateBuildingObjects(int mapWidth, int mapHeight)
+void LotFilesCellGenerator::generateBuildingObjects(int mapWidth, int mapHeight)
 {
     foreach (LotFile::Room *room, roomList) {
         foreach (LotFile::RoomRect *rr, room->rects)
@@ -700,19 +1079,20 @@ void LotFilesManager::generateBuildingObjects(int mapWidth, int mapHeight)
     }
 }
 
-void LotFilesManager::generateBuildingObjects(int mapWidth, int mapHeight,
+void LotFilesCellGenerator::generateBuildingObjects(int mapWidth, int mapHeight,
                                               LotFile::Room *room, LotFile::RoomRect *rr)
 {
     for (int x = rr->x; x < rr->x + rr->w; x++) {
         for (int y = rr->y; y < rr->y + rr->h; y++) {
 
             // Remember the room at each position in the map.
-            mGridData[x][y][room->floor].roomID = room->ID;
+            mGrid.setRoomID(x, y, room->floor, room->ID);
 
             /* Examine every tile inside the room.  If the tile's metaEnum >= 0
                then create a new RoomObject for it. */
-            foreach (LotFile::Entry *entry, mGridData[x][y][room->floor].Entries) {
-                int metaEnum = TileMap[entry->gid]->metaEnum;
+            const qint32 *gids = mGrid.entries(x, y, room->floor);
+            for (int i = 0, n = mGrid.count(x, y, room->floor); i < n; i++) {
+                int metaEnum = TileMap.at(gids[i]).metaEnum;
                 if (metaEnum >= 0) {
                     LotFile::RoomObject object;
                     object.x = x;
@@ -729,9 +1109,10 @@ void LotFilesManager::generateBuildingObjects(int mapWidth, int mapHeight,
     int y = rr->y + rr->h;
     if (y < mapHeight) {
         for (int x = rr->x; x < rr->x + rr->w; x++) {
-            foreach (LotFile::Entry *entry, mGridData[x][y][room->floor].Entries) {
-                int metaEnum = TileMap[entry->gid]->metaEnum;
-                if (metaEnum >= 0 && TileMetaInfoMgr::instance()->isEnumNorth(metaEnum)) {
+            const qint32 *gids = mGrid.entries(x, y, room->floor);
+            for (int i = 0, n = mGrid.count(x, y, room->floor); i < n; i++) {
+                int metaEnum = TileMap.at(gids[i]).metaEnum;
+                if (metaEnum >= 0 && mTileEnums->isEnumNorth(metaEnum)) {
                     LotFile::RoomObject object;
                     object.x = x;
                     object.y = y - 1;
@@ -747,9 +1128,10 @@ void LotFilesManager::generateBuildingObjects(int mapWidth, int mapHeight,
     int x = rr->x + rr->w;
     if (x < mapWidth) {
         for (int y = rr->y; y < rr->y + rr->h; y++) {
-            foreach (LotFile::Entry *entry, mGridData[x][y][room->floor].Entries) {
-                int metaEnum = TileMap[entry->gid]->metaEnum;
-                if (metaEnum >= 0 && TileMetaInfoMgr::instance()->isEnumWest(metaEnum)) {
+            const qint32 *gids = mGrid.entries(x, y, room->floor);
+            for (int i = 0, n = mGrid.count(x, y, room->floor); i < n; i++) {
+                int metaEnum = TileMap.at(gids[i]).metaEnum;
+                if (metaEnum >= 0 && mTileEnums->isEnumWest(metaEnum)) {
                     LotFile::RoomObject object;
                     object.x = x - 1;
                     object.y = y;
@@ -762,7 +1144,7 @@ void LotFilesManager::generateBuildingObjects(int mapWidth, int mapHeight,
     }
 }
 
-void LotFilesManager::generateJumboTrees(WorldCell *cell, MapComposite *mapComposite)
+void LotFilesCellGenerator::generateJumboTrees(WorldCell *cell, MapComposite *mapComposite)
 {
     const quint8 JUMBO_ZONE = 1;
     const quint8 PREVENT_JUMBO = 2;
@@ -831,7 +1213,7 @@ void LotFilesManager::generateJumboTrees(WorldCell *cell, MapComposite *mapCompo
     for (int y = 0; y < 300; y++) {
         for (int x = 0; x < 300; x++) {
             // Prevent jumbo trees near any second-story tiles
-            if (!mGridData[x][y][1].Entries.isEmpty()) {
+            if (mGrid.count(x, y, 1) > 0) {
                 for (int yy = y; yy <= y + 4; yy++) {
                     for (int xx = x; xx <= x + 4; xx++) {
                         if (xx >= 0 && xx < 300 && yy >= 0 && yy < 300)
@@ -841,9 +1223,10 @@ void LotFilesManager::generateJumboTrees(WorldCell *cell, MapComposite *mapCompo
             }
 
             // Prevent jumbo trees near non-floor, non-vegetation (fences, etc)
-            foreach (LotFile::Entry *e, mGridData[x][y][0].Entries) {
-                LotFile::Tile *tile = TileMap[e->gid];
-                if (!floorVegTiles.contains(tile->name)) {
+            const qint32 *gids = mGrid.entries(x, y, 0);
+            for (int i = 0, n = mGrid.count(x, y, 0); i < n; i++) {
+                const LotFile::Tile &tile = TileMap.at(gids[i]);
+                if (!floorVegTiles.contains(tile.name)) {
                     for (int yy = y - 1; yy <= y + 1; yy++) {
                         for (int xx = x - 1; xx <= x + 1; xx++) {
                             if (xx >= 0 && xx < 300 && yy >= 0 && yy < 300)
@@ -888,9 +1271,10 @@ void LotFilesManager::generateJumboTrees(WorldCell *cell, MapComposite *mapCompo
     QList<QPoint> allTreePos;
     for (int y = 0; y < 300; y++) {
         for (int x = 0; x < 300; x++) {
-            foreach (LotFile::Entry *e, mGridData[x][y][0].Entries) {
-                LotFile::Tile *tile = TileMap[e->gid];
-                if (treeTiles.contains(tile->name)) {
+            const qint32 *gids = mGrid.entries(x, y, 0);
+            for (int i = 0, n = mGrid.count(x, y, 0); i < n; i++) {
+                const LotFile::Tile &tile = TileMap.at(gids[i]);
+                if (treeTiles.contains(tile.name)) {
                     allTreePos += QPoint(x, y);
                     break;
                 }
@@ -923,21 +1307,22 @@ void LotFilesManager::generateJumboTrees(WorldCell *cell, MapComposite *mapCompo
     for (int y = 0; y < 300; y++) {
         for (int x = 0; x < 300; x++) {
             if (grid[x][y] == JUMBO_TREE) {
-                foreach (LotFile::Entry *e, mGridData[x][y][0].Entries) {
-                    LotFile::Tile *tile = TileMap[e->gid];
-                    if (treeTiles.contains(tile->name)) {
-                        e->gid = mTilesetToFirstGid[mJumboTreeTileset];
-                        TileMap[e->gid]->used = true;
+                qint32 *gids = mGrid.entries(x, y, 0);
+                for (int i = 0, n = mGrid.count(x, y, 0); i < n; i++) {
+                    const LotFile::Tile &tile = TileMap.at(gids[i]);
+                    if (treeTiles.contains(tile.name)) {
+                        gids[i] = mJumboTreeGid;
+                        TileMap[mJumboTreeGid].used = true;
                         break;
                     }
                 }
             }
             if (grid[x][y] == REMOVE_TREE) {
-                for (int i = 0; i < mGridData[x][y][0].Entries.size(); i++) {
-                    LotFile::Entry *e = mGridData[x][y][0].Entries[i];
-                    LotFile::Tile *tile = TileMap[e->gid];
-                    if (treeTiles.contains(tile->name)) {
-                        mGridData[x][y][0].Entries.removeAt(i);
+                const qint32 *gids = mGrid.entries(x, y, 0);
+                for (int i = 0, n = mGrid.count(x, y, 0); i < n; i++) {
+                    const LotFile::Tile &tile = TileMap.at(gids[i]);
+                    if (treeTiles.contains(tile.name)) {
+                        mGrid.removeEntry(x, y, 0, i);
                         break;
                     }
                 }
@@ -955,7 +1340,7 @@ static QString nameOfTileset(const Tileset *tileset)
     return name;
 }
 
-bool LotFilesManager::handleTileset(const Tiled::Tileset *tileset, uint &firstGid)
+bool LotFilesCellGenerator::handleTileset(const Tiled::Tileset *tileset, uint &firstGid)
 {
     if (!tileset->fileName().isEmpty()) {
         mError = tr("Only tileset image files supported, not external tilesets");
@@ -966,34 +1351,49 @@ bool LotFilesManager::handleTileset(const Tiled::Tileset *tileset, uint &firstGi
 
     // TODO: Verify that two tilesets sharing the same name are identical
     // between maps.
-    QMap<const Tileset*,uint>::const_iterator i = mTilesetToFirstGid.begin();
-    QMap<const Tileset*,uint>::const_iterator i_end = mTilesetToFirstGid.end();
-    while (i != i_end) {
-        QString name2 = nameOfTileset(i.key());
-        if (name == name2) {
-            mTilesetToFirstGid.insert(tileset, i.value());
-            return true;
-        }
-        ++i;
+    QHash<QString,uint>::const_iterator it = mFirstGidByTilesetName.constFind(name);
+    if (it != mFirstGidByTilesetName.constEnd()) {
+        mTilesetToFirstGid.insert(tileset, it.value());
+        return true;
     }
 
+    // Gids are handed out sequentially, so TileMap stays dense.
+    Q_ASSERT(uint(TileMap.size()) == firstGid);
+    TileMap.resize(firstGid + tileset->tileCount());
     for (int i = 0; i < tileset->tileCount(); ++i) {
         int localID = i;
-        int ID = firstGid + localID;
-        LotFile::Tile *tile = new LotFile::Tile(name + QLatin1String("_") + QString::number(localID));
-        tile->metaEnum = TileMetaInfoMgr::instance()->tileEnumValue(tileset->tileAt(i));
-        TileMap[ID] = tile;
+        LotFile::Tile &tile = TileMap[firstGid + localID];
+        tile.name = name + QLatin1String("_") + QString::number(localID);
+        tile.metaEnum = mTileEnums->tileEnumValue(tileset->tileAt(i));
     }
 
     mTilesetToFirstGid.insert(tileset, firstGid);
+    mFirstGidByTilesetName.insert(name, firstGid);
     firstGid += tileset->tileCount();
 
     return true;
 }
 
-int LotFilesManager::getRoomID(int x, int y, int z)
+// Tilesets with the same name share their gids.
+bool LotFilesCellGenerator::handleTilesets(const QList<Tileset*> &tilesets)
 {
-    return mGridData[x][y][z].roomID;
+    // Gid 0 is for cells whose tileset wasn't found.
+    TileMap.resize(1);
+
+    mTilesetToFirstGid.clear();
+    mFirstGidByTilesetName.clear();
+    mLastTileset = nullptr;
+    uint firstGid = 1;
+    for (Tileset *tileset : tilesets) {
+        if (!handleTileset(tileset, firstGid))
+            return false;
+    }
+    return true;
+}
+
+int LotFilesCellGenerator::getRoomID(int x, int y, int z)
+{
+    return mGrid.roomID(x, y, z);
 #if 0
     int n = 0;
     foreach (LotFile::Room *room, roomList) {
@@ -1011,21 +1411,23 @@ int LotFilesManager::getRoomID(int x, int y, int z)
 #endif
 }
 
-uint LotFilesManager::cellToGid(const Cell *cell)
+uint LotFilesCellGenerator::cellToGid(const Cell *cell)
 {
-    Tileset *tileset = cell->tile->tileset();
-
-    QMap<const Tileset*,uint>::const_iterator i = mTilesetToFirstGid.begin();
-    QMap<const Tileset*,uint>::const_iterator i_end = mTilesetToFirstGid.end();
-    while (i != i_end && i.key() != tileset)
-        ++i;
-    if (i == i_end) // tileset not found
-        return 0;
+    const Tileset *tileset = cell->tile->tileset();
+
+    // Neighbouring cells nearly always use the same tileset.
+    if (tileset != mLastTileset) {
+        QHash<const Tileset*,uint>::const_iterator it = mTilesetToFirstGid.constFind(tileset);
+        if (it == mTilesetToFirstGid.constEnd()) // tileset not found
+            return 0;
+        mLastTileset = tileset;
+        mLastFirstGid = it.value();
+    }
 
-    return i.value() + cell->tile->id();
+    return mLastFirstGid + cell->tile->id();
 }
 
-bool LotFilesManager::processObjectGroups(WorldCell *cell, MapComposite *mapComposite)
+bool LotFilesCellGenerator::processObjectGroups(WorldCell *cell, MapComposite *mapComposite)
 {
     foreach (Layer *layer, mapComposite->map()->layers()) {
         if (ObjectGroup *og = layer->asObjectGroup()) {
@@ -1042,7 +1444,7 @@ bool LotFilesManager::processObjectGroups(WorldCell *cell, MapComposite *mapComp
     return true;
 }
 
-bool LotFilesManager::processObjectGroup(WorldCell *cell, ObjectGroup *objectGroup,
+bool LotFilesCellGenerator::processObjectGroup(WorldCell *cell, ObjectGroup *objectGroup,
                                          int levelOffset, const QPoint &offset)
 {
     int level;
@@ -1098,7 +1500,7 @@ bool LotFilesManager::processObjectGroup(WorldCell *cell, ObjectGroup *objectGro
     return true;
 }
 
-void LotFilesManager::resolveProperties(PropertyHolder *ph, PropertyList &result)
+void LotFilesCellGenerator::resolveProperties(PropertyHolder *ph, PropertyList &result)
 {
     foreach (PropertyTemplate *pt, ph->templates())
         resolveProperties(pt, result);
@@ -19,8 +19,18 @@
 #define LOTFILESMANAGER_H
 
 #include "gidmapper.h"
+#include "lotfilesmanifest.h"
+#include "lotpackwriter.h"
+#include "threads.h"
+#include "world.h"
 
+#include <QHash>
+#include <QImage>
 #include <QObject>
+#include <QSet>
+#include <QVector>
+
+#include <algorithm>
 
 class BMPToTMXImages;
 class MapComposite;
@@ -34,6 +44,7 @@ class WorldCell;
 
 namespace Tiled {
 class ObjectGroup;
+class Tile;
 }
 
 #define CELL_WIDTH 300
@@ -78,39 +89,87 @@ public:
     int h;
 };
 
-class Entry
+/**
+ * The tiles and room of every square in a cell.  Each square's gids are a
+ * run in one packed array, so filling the grid doesn't allocate anything
+ * per-square and the memory is reused from one cell to the next.
+ */
+class Grid
 {
 public:
-    Entry(int gid) :
-        gid(gid)
+    Grid() :
+        mWidth(0),
+        mHeight(0),
+        mLevels(0)
     {
     }
 
-    int gid;
-};
-
-class Square
-{
-public:
-    Square() :
-        roomID(-1)
+    void reset(int width, int height, int levels)
     {
+        mWidth = width;
+        mHeight = height;
+        mLevels = levels;
+        int size = width * height * levels;
+        mOffset.fill(0, size);
+        mCount.fill(0, size);
+        mRoomID.fill(-1, size);
+        mGids.resize(0);
+    }
 
+    // A square's gids can only be set once per cell.
+    void setEntries(int x, int y, int z, const qint32 *gids, int count)
+    {
+        int index = indexOf(x, y, z);
+        Q_ASSERT(mCount[index] == 0);
+        int start = mGids.size();
+        mGids.resize(start + count);
+        std::copy(gids, gids + count, mGids.data() + start);
+        mOffset[index] = start;
+        mCount[index] = count;
     }
-    ~Square()
+
+    int count(int x, int y, int z) const
+    { return mCount[indexOf(x, y, z)]; }
+
+    const qint32 *entries(int x, int y, int z) const
+    { return mGids.constData() + mOffset[indexOf(x, y, z)]; }
+
+    qint32 *entries(int x, int y, int z)
+    { return mGids.data() + mOffset[indexOf(x, y, z)]; }
+
+    void removeEntry(int x, int y, int z, int i)
     {
-        qDeleteAll(Entries);
+        int index = indexOf(x, y, z);
+        Q_ASSERT(i >= 0 && i < mCount[index]);
+        qint32 *gids = mGids.data() + mOffset[index];
+        std::copy(gids + i + 1, gids + mCount[index], gids + i);
+        --mCount[index];
     }
-    Square &operator=(const Square &other)
+
+    int roomID(int x, int y, int z) const
+    { return mRoomID[indexOf(x, y, z)]; }
+
+    void setRoomID(int x, int y, int z, int roomID)
+    { mRoomID[indexOf(x, y, z)] = roomID; }
+
+private:
+    // Squares in a chunk column are adjacent, which is the order
+    // generateChunk() writes them in.
+    int indexOf(int x, int y, int z) const
     {
-        qDeleteAll(Entries);
-        Entries = other.Entries;
-        roomID = other.roomID;
-        return *this;
+        Q_ASSERT(x >= 0 && x < mWidth);
+        Q_ASSERT(y >= 0 && y < mHeight);
+        Q_ASSERT(z >= 0 && z < mLevels);
+        return (z * mWidth + x) * mHeight + y;
     }
 
-    QList<Entry*> Entries;
-    int roomID;
+    int mWidth;
+    int mHeight;
+    int mLevels;
+    QVector<qint32> mOffset;
+    QVector<qint32> mCount;
+    QVector<qint32> mRoomID;
+    QVector<qint32> mGids;
 };
 
 class Zone
@@ -304,80 +363,243 @@ private:
     QString mError;
 };
 
-class LotFilesManager : public QObject
+struct GenerateCellFailure
+{
+    WorldCell* cell;
+    QString error;
+
+    GenerateCellFailure(WorldCell* cell, const QString& error)
+        : cell(cell)
+        , error(error)
+    {
+    }
+};
+
+/**
+ * The metaEnum of every tile that has one, copied from TileMetaInfoMgr on the
+ * main thread before any cell is handed to a LotFilesWorker, which only read
+ * it.
+ */
+class LotFilesTileEnums
 {
-    Q_OBJECT
 public:
-    
-    static LotFilesManager *instance();
-    static void deleteInstance();
+    void update();
 
-    enum GenerateMode {
-        GenerateAll,
-        GenerateSelected
-    };
+    int tileEnumValue(Tiled::Tile *tile) const;
 
-    struct GenerateCellFailure
-    {
-        WorldCell* cell;
-        QString error;
+    bool isEnumWest(int enumValue) const
+    { return mWest.contains(enumValue); }
 
-        GenerateCellFailure(WorldCell* cell, const QString& error)
-            : cell(cell)
-            , error(error)
-        {
-        }
-    };
+    bool isEnumNorth(int enumValue) const
+    { return mNorth.contains(enumValue); }
 
-    bool generateWorld(WorldDocument *worldDoc, GenerateMode mode);
-    bool generateCell(WorldCell *cell);
+private:
+    QHash<QString,QHash<QString,int>> mValues; // tileset name, "column,row"
+    QSet<int> mWest;
+    QSet<int> mNorth;
+};
+
+/**
+ * A single cell whose maps have been loaded by LotFilesManager and which is
+ * waiting to be (or has been) processed by a LotFilesWorker.
+ */
+class LotFilesJob
+{
+public:
+    LotFilesJob(WorldCell *cell, const GenerateLotsSettings &settings,
+                const QImage &zombieSpawnMap, const LotFilesTileEnums *tileEnums);
+    ~LotFilesJob();
+
+    WorldCell *mCell;
+    GenerateLotsSettings mSettings;
+    QImage mZombieSpawnMap;
+    const LotFilesTileEnums *mTileEnums;
+    DelayedMapLoader *mMapLoader;
+    MapComposite *mMapComposite;
+    LotFilesManifest *mManifest; // Only when generating changed cells
+
+    // Results
+    bool mSuccess;
+    LotFile::Stats mStats;
+    QList<GenerateCellFailure> mFailures;
+
+private:
+    Q_DISABLE_COPY(LotFilesJob)
+};
+
+/**
+ * This class holds all the per-cell state needed to write the .lotheader,
+ * .lotpack and chunkdata files for one cell.  Each LotFilesWorker owns one of
+ * these so that several cells can be generated at the same time.
+ * The cell's maps must already be loaded.
+ */
+class LotFilesCellGenerator
+{
+    Q_DECLARE_TR_FUNCTIONS(LotFilesCellGenerator)
+
+public:
+    LotFilesCellGenerator();
+    ~LotFilesCellGenerator();
+
+    bool generateCell(LotFilesJob *job);
     bool generateHeader(WorldCell *cell, MapComposite *mapComposite);
     bool generateHeaderAux(WorldCell *cell, MapComposite *mapComposite);
-    bool generateChunk(QDataStream &out, WorldCell *cell, MapComposite *mapComposite, int cx, int cy);
+    bool generateChunk(LotPackWriter &out, WorldCell *cell, MapComposite *mapComposite, int cx, int cy);
     void generateBuildingObjects(int mapWidth, int mapHeight);
     void generateBuildingObjects(int mapWidth, int mapHeight,
                                  LotFile::Room *room, LotFile::RoomRect *rr);
     void generateJumboTrees(WorldCell *cell, MapComposite *mapComposite);
 
     bool handleTileset(const Tiled::Tileset *tileset, uint &firstGid);
+    bool handleTilesets(const QList<Tiled::Tileset*> &tilesets);
+    uint cellToGid(const Tiled::Cell *cell);
+
+    void setTileEnums(const LotFilesTileEnums *tileEnums)
+    { mTileEnums = tileEnums; }
+
+    const QHash<const Tiled::Tileset*,uint> &tilesetToFirstGid() const
+    { return mTilesetToFirstGid; }
 
     int getRoomID(int x, int y, int z);
 
+    // The results of generateHeader().
+    const QMap<int,QList<LotFile::RoomRect*> > &roomRectsByLevel() const
+    { return mRoomRectByLevel; }
+    const QList<LotFile::Room*> &rooms() const
+    { return roomList; }
+    const QList<LotFile::Building*> &buildings() const
+    { return buildingList; }
+
     QString errorString() const { return mError; }
 
-signals:
-        
 private:
-    uint cellToGid(const Tiled::Cell *cell);
     bool processObjectGroups(WorldCell *cell, MapComposite *mapComposite);
     bool processObjectGroup(WorldCell *cell, Tiled::ObjectGroup *objectGroup,
                             int levelOffset, const QPoint &offset);
     void resolveProperties(PropertyHolder *ph, PropertyList &result);
+    void clear();
 
 private:
-    Q_DISABLE_COPY(LotFilesManager)
-
-    explicit LotFilesManager(QObject *parent = 0);
-    ~LotFilesManager();
+    Q_DISABLE_COPY(LotFilesCellGenerator)
 
-    static LotFilesManager *mInstance;
-
-    WorldDocument *mWorldDoc;
+    GenerateLotsSettings mSettings;
+    QImage ZombieSpawnMap;
+    const LotFilesTileEnums *mTileEnums;
     QList<LotFile::Zone*> ZoneList;
-    QMap<const Tiled::Tileset*,uint> mTilesetToFirstGid;
+    QHash<const Tiled::Tileset*,uint> mTilesetToFirstGid;
+    QHash<QString,uint> mFirstGidByTilesetName;
+    const Tiled::Tileset *mLastTileset; // cellToGid() cache
+    uint mLastFirstGid;
     Tiled::Tileset *mJumboTreeTileset;
-    QMap<int,LotFile::Tile*> TileMap;
-    QVector<QVector<QVector<LotFile::Square> > > mGridData;
+    uint mJumboTreeGid;
+    QVector<LotFile::Tile> TileMap; // indexed by gid
+    LotFile::Grid mGrid;
+    QVector<qint32> mSquareGids;
+    LotPackWriter mLotPackWriter;
+    QVector<qint32> mChunkInts;
     int MaxLevel;
     int Version;
     QList<LotFile::RoomRect*> mRoomRects;
     QMap<int,QList<LotFile::RoomRect*> > mRoomRectByLevel;
     QList<LotFile::Room*> roomList;
     QList<LotFile::Building*> buildingList;
+    LotFile::Stats mStats;
+    QString mError;
+};
+
+class LotFilesWorker : public BaseWorker
+{
+    Q_OBJECT
+public:
+    LotFilesWorker(InterruptibleThread *thread, int id);
+    ~LotFilesWorker();
+
+signals:
+    void finished(LotFilesJob *job);
+
+public slots:
+    void work();
+    void addJob(LotFilesJob *job);
+
+private:
+    QList<LotFilesJob*> mJobs;
+    LotFilesCellGenerator mGenerator;
+    int mID;
+};
+
+class LotFilesManager : public QObject
+{
+    Q_OBJECT
+public:
+    
+    static LotFilesManager *instance();
+    static void deleteInstance();
+
+    enum GenerateMode {
+        GenerateAll,
+        GenerateSelected
+    };
+
+    bool generateWorld(WorldDocument *worldDoc, GenerateMode mode);
+
+    /**
+     * Sets the number of cells that are generated at the same time.
+     * Defaults to QThread::idealThreadCount().
+     */
+    void setWorkerCount(int count);
+    int workerCount() const
+    { return mWorkerCount; }
+
+    /**
+     * When set, cells whose .lotmanifest shows that none of their inputs
+     * changed since the last run are skipped.
+     */
+    void setIncremental(bool incremental)
+    { mIncremental = incremental; }
+    bool isIncremental() const
+    { return mIncremental; }
+
+    QString errorString() const { return mError; }
+
+    const QList<GenerateCellFailure> &failures() const
+    { return mFailures; }
+
+signals:
+
+private slots:
+    void jobFinished(LotFilesJob *job);
+
+private:
+    LotFilesJob *loadCell(WorldCell *cell);
+    bool isCellUpToDate(WorldCell *cell, LotFilesManifest &current);
+    void startWorkers();
+    void stopWorkers();
+
+private:
+    Q_DISABLE_COPY(LotFilesManager)
+
+    explicit LotFilesManager(QObject *parent = 0);
+    ~LotFilesManager();
+
+    static LotFilesManager *mInstance;
+
+    WorldDocument *mWorldDoc;
     QImage ZombieSpawnMap;
+    LotFilesTileEnums mTileEnums;
     LotFile::Stats mStats;
     QList<GenerateCellFailure> mFailures;
     QString mError;
+
+    QVector<InterruptibleThread*> mWorkerThreads;
+    QVector<LotFilesWorker*> mWorkers;
+    int mWorkerCount;
+    int mNextWorkerForJob;
+    int mJobsInFlight;
+
+    bool mIncremental;
+    LotFilesHashCache mHashCache;
+    QByteArray mTileDefsHash;
+    int mSkippedCells;
 };
 
 #endif // LOTFILESMANAGER_H
@@ -0,0 +1,293 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lotfilesmanifest.h"
+
+#include "mapcomposite.h"
+#include "mapmanager.h"
+#include "road.h"
+#include "tilemetainfomgr.h"
+#include "world.h"
+#include "worldcell.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QImage>
+#include <QRgb>
+#include <QSet>
+
+// Increase this whenever LotFilesManager changes the files it writes, so that
+// every cell is generated again.
+#define MANIFEST_VERSION 1
+#define MANIFEST_MAGIC "LOTM"
+
+QByteArray LotFilesHashCache::hashFile(const QString &filePath)
+{
+    QHash<QString,QByteArray>::const_iterator it = mHashes.find(filePath);
+    if (it != mHashes.end())
+        return *it;
+
+    QByteArray result;
+    QFile file(filePath);
+    if (file.open(QIODevice::ReadOnly)) {
+        QCryptographicHash hash(QCryptographicHash::Md5);
+        if (hash.addData(&file))
+            result = hash.result();
+    }
+    mHashes[filePath] = result;
+    return result;
+}
+
+/////
+
+LotFilesManifest::LotFilesManifest()
+{
+}
+
+QString LotFilesManifest::manifestPath(WorldCell *cell, const GenerateLotsSettings &settings)
+{
+    return settings.exportDir + QString::fromLatin1("/%1_%2.lotmanifest")
+            .arg(settings.worldOrigin.x() + cell->x())
+            .arg(settings.worldOrigin.y() + cell->y());
+}
+
+QStringList LotFilesManifest::outputPaths(WorldCell *cell, const GenerateLotsSettings &settings)
+{
+    int x = settings.worldOrigin.x() + cell->x();
+    int y = settings.worldOrigin.y() + cell->y();
+    QStringList paths;
+    paths += settings.exportDir + QString::fromLatin1("/%1_%2.lotheader").arg(x).arg(y);
+    paths += settings.exportDir + QString::fromLatin1("/world_%1_%2.lotpack").arg(x).arg(y);
+    paths += settings.exportDir + QString::fromLatin1("/chunkdata_%1_%2.bin").arg(x).arg(y);
+    return paths;
+}
+
+QByteArray LotFilesManifest::hashTileDefs(const GenerateLotsSettings &settings)
+{
+    QCryptographicHash hash(QCryptographicHash::Md5);
+
+    // See IsoGridSquare::loadTileDefFiles()
+    QDir dir(settings.tileDefFolder);
+    QStringList filters(QLatin1String("*.tiles"));
+    QStringList files = dir.entryList(filters, QDir::Files, QDir::Name);
+    files += TileMetaInfoMgr::instance()->txtPath(); // room-object enums
+    for (const QString &fileName : files) {
+        if (fileName.endsWith(QLatin1String("_4.tiles")))
+            continue;
+        QFile file(dir.filePath(fileName));
+        if (!file.open(QIODevice::ReadOnly))
+            continue;
+        hash.addData(fileName.toUtf8());
+        hash.addData(&file);
+    }
+
+    return hash.result();
+}
+
+void LotFilesManifest::setInputs(WorldCell *cell, const GenerateLotsSettings &settings,
+                                 const QImage &zombieSpawnMap, const QByteArray &tileDefsHash)
+{
+    {
+        QByteArray bytes;
+        QDataStream out(&bytes, QIODevice::WriteOnly);
+        out << qint32(MANIFEST_VERSION);
+        out << settings.exportDir << settings.zombieSpawnMap << settings.tileDefFolder;
+        out << settings.worldOrigin;
+        mSettingsHash = QCryptographicHash::hash(bytes, QCryptographicHash::Md5);
+    }
+
+    // The cell's own map, the lots placed in the cell and the cell's objects
+    // (Forest zones decide where jumbo trees go).
+    {
+        QByteArray bytes;
+        QDataStream out(&bytes, QIODevice::WriteOnly);
+        out << cell->mapFilePath();
+        out << qint32(cell->lots().size());
+        for (WorldCellLot *lot : cell->lots()) {
+            out << lot->mapName() << lot->pos() << qint32(lot->level());
+        }
+        out << qint32(cell->objects().size());
+        for (WorldCellObject *obj : cell->objects()) {
+            out << (obj->type() ? obj->type()->name() : QString());
+            out << obj->x() << obj->y() << obj->width() << obj->height();
+            out << qint32(obj->level());
+            out << qint32(obj->points().size());
+            for (const WorldCellObjectPoint &pt : obj->points()) {
+                out << double(pt.x) << double(pt.y);
+            }
+        }
+        mCellHash = QCryptographicHash::hash(bytes, QCryptographicHash::Md5);
+    }
+
+    // See MapComposite::generateRoadLayers()
+    {
+        QByteArray bytes;
+        QDataStream out(&bytes, QIODevice::WriteOnly);
+        QRect cellRect(cell->x() * 300, cell->y() * 300, 300, 300);
+        for (Road *road : cell->world()->roads()) {
+            if (!road->bounds().intersects(cellRect))
+                continue;
+            out << road->start() << road->end() << qint32(road->width());
+            out << road->tileName();
+            if (TrafficLines *lines = road->trafficLines()) {
+                out << lines->name;
+                out << lines->inner.ns << lines->inner.we << lines->inner.nw << lines->inner.sw;
+                out << lines->outer.ns << lines->outer.we << lines->outer.ne << lines->outer.se;
+            }
+        }
+        mRoadsHash = QCryptographicHash::hash(bytes, QCryptographicHash::Md5);
+    }
+
+    // See LotFilesCellGenerator::generateHeaderAux()
+    {
+        QByteArray bytes;
+        for (int x = 0; x < 30; x++) {
+            for (int y = 0; y < 30; y++) {
+                QRgb pixel = zombieSpawnMap.pixel(cell->x() * 30 + x,
+                                                  cell->y() * 30 + y);
+                bytes += char(qRed(pixel));
+            }
+        }
+        mSpawnMapHash = QCryptographicHash::hash(bytes, QCryptographicHash::Md5);
+    }
+
+    mTileDefsHash = tileDefsHash;
+}
+
+void LotFilesManifest::setMapFiles(MapComposite *mapComposite, LotFilesHashCache &cache)
+{
+    mMapFiles.clear();
+    QSet<QString> seen;
+    for (MapComposite *mc : mapComposite->maps()) {
+        const QString &path = mc->mapInfo()->path();
+        if (path.isEmpty() || seen.contains(path))
+            continue;
+        seen += path;
+        QFileInfo info(path);
+        MapFile mapFile;
+        mapFile.path = path;
+        mapFile.size = info.size();
+        mapFile.modified = info.lastModified().toMSecsSinceEpoch();
+        mapFile.hash = cache.hashFile(path);
+        mMapFiles += mapFile;
+    }
+}
+
+bool LotFilesManifest::isUpToDate(const LotFilesManifest &current, LotFilesHashCache &cache) const
+{
+    if (mSettingsHash != current.mSettingsHash ||
+            mCellHash != current.mCellHash ||
+            mRoadsHash != current.mRoadsHash ||
+            mSpawnMapHash != current.mSpawnMapHash ||
+            mTileDefsHash != current.mTileDefsHash)
+        return false;
+
+    if (mMapFiles.isEmpty())
+        return false;
+
+    for (const MapFile &mapFile : mMapFiles) {
+        QFileInfo info(mapFile.path);
+        if (!info.exists())
+            return false;
+        // Only read the file when it looks like it changed.  Saving a map
+        // without changing it shouldn't cause the cell to be generated again.
+        if (info.size() == mapFile.size &&
+                info.lastModified().toMSecsSinceEpoch() == mapFile.modified)
+            continue;
+        if (cache.hashFile(mapFile.path) != mapFile.hash)
+            return false;
+    }
+
+    return true;
+}
+
+bool LotFilesManifest::read(const QString &filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly)) {
+        mError = file.errorString();
+        return false;
+    }
+
+    QDataStream in(&file);
+    in.setByteOrder(QDataStream::LittleEndian);
+
+    char magic[4];
+    if (in.readRawData(magic, 4) != 4 || QByteArray(magic, 4) != MANIFEST_MAGIC) {
+        mError = tr("This isn't a .lotmanifest file.");
+        return false;
+    }
+
+    qint32 version;
+    in >> version;
+    if (version != MANIFEST_VERSION) {
+        mError = tr("Unknown .lotmanifest version %1.").arg(version);
+        return false;
+    }
+
+    in >> mSettingsHash >> mCellHash >> mRoadsHash >> mSpawnMapHash >> mTileDefsHash;
+
+    qint32 count;
+    in >> count;
+    mMapFiles.clear();
+    for (int i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+        MapFile mapFile;
+        in >> mapFile.path >> mapFile.size >> mapFile.modified >> mapFile.hash;
+        mMapFiles += mapFile;
+    }
+
+    if (in.status() != QDataStream::Ok) {
+        mError = tr("Error reading %1.").arg(QDir::toNativeSeparators(filePath));
+        mMapFiles.clear();
+        return false;
+    }
+
+    return true;
+}
+
+bool LotFilesManifest::write(const QString &filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        mError = file.errorString();
+        return false;
+    }
+
+    QDataStream out(&file);
+    out.setByteOrder(QDataStream::LittleEndian);
+
+    out.writeRawData(MANIFEST_MAGIC, 4);
+    out << qint32(MANIFEST_VERSION);
+
+    out << mSettingsHash << mCellHash << mRoadsHash << mSpawnMapHash << mTileDefsHash;
+
+    out << qint32(mMapFiles.size());
+    for (const MapFile &mapFile : qAsConst(mMapFiles)) {
+        out << mapFile.path << mapFile.size << mapFile.modified << mapFile.hash;
+    }
+
+    if (out.status() != QDataStream::Ok) {
+        mError = tr("Error writing %1.").arg(QDir::toNativeSeparators(filePath));
+        return false;
+    }
+
+    return true;
+}
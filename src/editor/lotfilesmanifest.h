@@ -0,0 +1,109 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOTFILESMANIFEST_H
+#define LOTFILESMANIFEST_H
+
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QHash>
+#include <QStringList>
+#include <QVector>
+
+class GenerateLotsSettings;
+class MapComposite;
+class WorldCell;
+
+class QImage;
+
+/**
+ * Remembers the content hash of files so that a file shared by many cells
+ * (such as a building lot) is only read once during a single run.
+ */
+class LotFilesHashCache
+{
+public:
+    QByteArray hashFile(const QString &filePath);
+
+    void clear()
+    { mHashes.clear(); }
+
+private:
+    QHash<QString,QByteArray> mHashes;
+};
+
+/**
+ * Records everything a cell's .lotheader, .lotpack and chunkdata files were
+ * generated from: the cell's map and every sub-map, the cell's lots and
+ * objects, the roads crossing the cell, the cell's part of the Zombie Spawn
+ * Map, the tile definitions and the Generate Lots settings.
+ * When the manifest written by the previous run matches the current inputs,
+ * the cell's files don't need to be generated again.
+ */
+class LotFilesManifest
+{
+    Q_DECLARE_TR_FUNCTIONS(LotFilesManifest)
+
+public:
+    LotFilesManifest();
+
+    static QString manifestPath(WorldCell *cell, const GenerateLotsSettings &settings);
+    static QStringList outputPaths(WorldCell *cell, const GenerateLotsSettings &settings);
+    static QByteArray hashTileDefs(const GenerateLotsSettings &settings);
+
+    /**
+     * Sets the inputs that are known before the cell's maps are loaded.
+     */
+    void setInputs(WorldCell *cell, const GenerateLotsSettings &settings,
+                   const QImage &zombieSpawnMap, const QByteArray &tileDefsHash);
+
+    /**
+     * Records the cell's map and all its sub-maps after they are loaded.
+     */
+    void setMapFiles(MapComposite *mapComposite, LotFilesHashCache &cache);
+
+    /**
+     * Returns true if this (previously-saved) manifest has the same inputs as
+     * \a current and none of the recorded map files have changed since.
+     */
+    bool isUpToDate(const LotFilesManifest &current, LotFilesHashCache &cache) const;
+
+    bool read(const QString &filePath);
+    bool write(const QString &filePath);
+
+    QString errorString() const
+    { return mError; }
+
+private:
+    struct MapFile
+    {
+        QString path;
+        qint64 size;
+        qint64 modified;
+        QByteArray hash;
+    };
+
+    QByteArray mSettingsHash;
+    QByteArray mCellHash;
+    QByteArray mRoadsHash;
+    QByteArray mSpawnMapHash;
+    QByteArray mTileDefsHash;
+    QVector<MapFile> mMapFiles;
+    QString mError;
+};
+
+#endif // LOTFILESMANIFEST_H
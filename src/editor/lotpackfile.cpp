@@ -0,0 +1,141 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lotpackfile.h"
+
+QString LotFileReader::readString()
+{
+    const uchar *start = mPtr;
+    while (mPtr < mEnd && *mPtr != '\n')
+        ++mPtr;
+    QString ret = QString::fromLatin1(reinterpret_cast<const char*>(start), int(mPtr - start));
+    if (mPtr < mEnd)
+        ++mPtr; // skip '\n'
+    return ret;
+}
+
+/////
+
+LotPackChunkReader::LotPackChunkReader(const uchar *start, const uchar *end,
+                                       int chunkWidth, int levels) :
+    mReader(start, end),
+    mChunkWidth(chunkWidth),
+    mSquare(0),
+    mSquareCount(chunkWidth * chunkWidth * levels),
+    mSkip(0),
+    mX(0),
+    mY(0),
+    mZ(0),
+    mRoomID(-1),
+    mTileCount(0),
+    mTiles(nullptr)
+{
+}
+
+bool LotPackChunkReader::nextSquare()
+{
+    // Squares are stored by level, then x, then y.  A count of -1 is followed
+    // by the number of empty squares, including the current one.
+    while (mSquare < mSquareCount) {
+        int square = mSquare++;
+        if (mSkip > 0) {
+            --mSkip;
+            continue;
+        }
+        int count = mReader.readInt();
+        if (mReader.overflow())
+            break;
+        if (count == -1) {
+            mSkip = mReader.readInt();
+            if (mSkip > 0)
+                --mSkip;
+            continue;
+        }
+        mRoomID = mReader.readInt();
+        mTileCount = count - 1;
+        mTiles = mReader.skipInts(mTileCount);
+        if (mReader.overflow())
+            break;
+        int perLevel = mChunkWidth * mChunkWidth;
+        mZ = square / perLevel;
+        mX = (square % perLevel) / mChunkWidth;
+        mY = square % mChunkWidth;
+        return true;
+    }
+    mSquare = mSquareCount;
+    return false;
+}
+
+/////
+
+LotPackFile::LotPackFile() :
+    mData(nullptr),
+    mSize(0)
+{
+}
+
+LotPackFile::~LotPackFile()
+{
+    close();
+}
+
+bool LotPackFile::open(const QString &filePath)
+{
+    close();
+    mFile.setFileName(filePath);
+    if (!mFile.open(QFile::ReadOnly))
+        return false;
+    mSize = mFile.size();
+    if (mSize > 0)
+        mData = mFile.map(0, mSize);
+    if (mData == nullptr) {
+        mFile.close();
+        mSize = 0;
+        return false;
+    }
+    return true;
+}
+
+void LotPackFile::close()
+{
+    if (mData != nullptr)
+        mFile.unmap(mData);
+    mData = nullptr;
+    mSize = 0;
+    if (mFile.isOpen())
+        mFile.close();
+}
+
+int LotPackFile::chunkCount() const
+{
+    LotFileReader in = reader();
+    int count = in.readInt();
+    if (in.overflow() || count < 0 || !in.canRead(qint64(count) * 8))
+        return 0;
+    return count;
+}
+
+LotPackChunkReader LotPackFile::chunk(int index, int chunkWidth, int levels) const
+{
+    const uchar *end = mData + mSize;
+    if (index < 0 || index >= chunkCount())
+        return LotPackChunkReader(end, end, chunkWidth, levels);
+    qint64 pos = qFromLittleEndian<qint64>(mData + 4 + qint64(index) * 8);
+    if (pos < 0 || pos > mSize)
+        return LotPackChunkReader(end, end, chunkWidth, levels);
+    return LotPackChunkReader(mData + pos, end, chunkWidth, levels);
+}
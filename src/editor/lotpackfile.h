@@ -0,0 +1,176 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOTPACKFILE_H
+#define LOTPACKFILE_H
+
+#include <QFile>
+#include <QString>
+#include <QtEndian>
+
+/**
+ * Reads little-endian values from a block of memory, such as a
+ * memory-mapped .lotheader or .lotpack file.  Reading past the end returns
+ * zeros and sets the overflow flag instead of crashing on a corrupt file.
+ */
+class LotFileReader
+{
+public:
+    LotFileReader(const uchar *start, const uchar *end) :
+        mPtr(start),
+        mEnd(end),
+        mOverflow(false)
+    {
+    }
+
+    bool atEnd() const
+    { return mPtr >= mEnd; }
+
+    bool overflow() const
+    { return mOverflow; }
+
+    bool canRead(qint64 bytes) const
+    { return mEnd - mPtr >= bytes; }
+
+    quint8 readByte()
+    {
+        if (!canRead(1)) {
+            mOverflow = true;
+            return 0;
+        }
+        return *mPtr++;
+    }
+
+    qint32 readInt()
+    {
+        if (!canRead(4)) {
+            mOverflow = true;
+            mPtr = mEnd;
+            return 0;
+        }
+        qint32 value = qFromLittleEndian<qint32>(mPtr);
+        mPtr += 4;
+        return value;
+    }
+
+    qint64 readLong()
+    {
+        if (!canRead(8)) {
+            mOverflow = true;
+            mPtr = mEnd;
+            return 0;
+        }
+        qint64 value = qFromLittleEndian<qint64>(mPtr);
+        mPtr += 8;
+        return value;
+    }
+
+    // Reads a newline-terminated Latin-1 string.
+    QString readString();
+
+    // Returns a pointer to the next 'count' qint32 values and skips over them.
+    const uchar *skipInts(int count)
+    {
+        if (count < 0 || !canRead(qint64(count) * 4)) {
+            mOverflow = true;
+            mPtr = mEnd;
+            return nullptr;
+        }
+        const uchar *ret = mPtr;
+        mPtr += count * 4;
+        return ret;
+    }
+
+private:
+    const uchar *mPtr;
+    const uchar *mEnd;
+    bool mOverflow;
+};
+
+/**
+ * Decodes the squares of one .lotpack chunk.  Empty squares are skipped.
+ */
+class LotPackChunkReader
+{
+public:
+    LotPackChunkReader(const uchar *start, const uchar *end, int chunkWidth, int levels);
+
+    /**
+     * Moves to the next square with tiles.  Returns false when there are no
+     * more squares in the chunk.
+     */
+    bool nextSquare();
+
+    int x() const { return mX; }
+    int y() const { return mY; }
+    int z() const { return mZ; }
+    int roomID() const { return mRoomID; }
+    int tileCount() const { return mTileCount; }
+
+    // Index into the .lotheader's list of tile names.
+    int tileAt(int n) const
+    { return qFromLittleEndian<qint32>(mTiles + n * 4); }
+
+private:
+    LotFileReader mReader;
+    int mChunkWidth;
+    int mSquare;
+    int mSquareCount;
+    int mSkip;
+    int mX;
+    int mY;
+    int mZ;
+    int mRoomID;
+    int mTileCount;
+    const uchar *mTiles;
+};
+
+/**
+ * A memory-mapped .lotpack or .lotheader file.  Nothing is copied out of
+ * the file, the operating system pages in only the parts that are read.
+ */
+class LotPackFile
+{
+public:
+    LotPackFile();
+    ~LotPackFile();
+
+    bool open(const QString &filePath);
+    void close();
+
+    bool isOpen() const
+    { return mData != nullptr; }
+
+    QString filePath() const
+    { return mFile.fileName(); }
+
+    LotFileReader reader() const
+    { return LotFileReader(mData, mData + mSize); }
+
+    // .lotpack only
+    int chunkCount() const;
+    LotPackChunkReader chunk(int index, int chunkWidth, int levels) const;
+
+private:
+    Q_DISABLE_COPY(LotPackFile)
+
+    QFile mFile;
+    uchar *mData;
+    qint64 mSize;
+};
+
+#endif // LOTPACKFILE_H
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "lotpackwriter.h"
+
+#include <QDir>
+#include <QSaveFile>
+
+#include <algorithm>
+
+LotPackWriter::LotPackWriter()
+    : mChunkCount(0)
+{
+}
+
+void LotPackWriter::begin(int chunkCount)
+{
+    mChunkCount = chunkCount;
+    mChunkStart.resize(0);
+    mData.resize(0);
+    mError.clear();
+}
+
+void LotPackWriter::beginChunk()
+{
+    Q_ASSERT(mChunkStart.size() < mChunkCount);
+    mChunkStart += mData.size();
+}
+
+void LotPackWriter::writeInts(const qint32 *values, int count)
+{
+    int start = mData.size();
+    mData.resize(start + count);
+    qint32 *dest = mData.data() + start;
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+    std::copy(values, values + count, dest);
+#else
+    for (int i = 0; i < count; i++)
+        dest[i] = qToLittleEndian(values[i]);
+#endif
+}
+
+bool LotPackWriter::write(const QString &filePath)
+{
+    if (mChunkStart.size() != mChunkCount) {
+        mError = tr("Expected %1 chunks but got %2.")
+                .arg(mChunkCount).arg(mChunkStart.size());
+        return false;
+    }
+
+    // The index is known now that every chunk's size is known.
+    QByteArray index(sizeof(qint32) + mChunkCount * sizeof(qint64), Qt::Uninitialized);
+    char *p = index.data();
+    qToLittleEndian<qint32>(mChunkCount, p);
+    p += sizeof(qint32);
+    const qint64 dataStart = index.size();
+    for (int i = 0; i < mChunkCount; i++) {
+        qToLittleEndian<qint64>(dataStart + qint64(mChunkStart[i]) * sizeof(qint32), p);
+        p += sizeof(qint64);
+    }
+
+    QSaveFile file(filePath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        mError = tr("Could not open file for writing.\n%1\n%2")
+                .arg(QDir::toNativeSeparators(filePath))
+                .arg(file.errorString());
+        return false;
+    }
+
+    const qint64 dataSize = qint64(mData.size()) * sizeof(qint32);
+    if (file.write(index) != index.size() ||
+            file.write(reinterpret_cast<const char*>(mData.constData()), dataSize) != dataSize ||
+            !file.commit()) {
+        mError = tr("Error writing file.\n%1\n%2")
+                .arg(QDir::toNativeSeparators(filePath))
+                .arg(file.errorString());
+        return false;
+    }
+
+    return true;
+}
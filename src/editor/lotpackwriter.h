@@ -0,0 +1,71 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef LOTPACKWRITER_H
+#define LOTPACKWRITER_H
+
+#include <QCoreApplication>
+#include <QtEndian>
+#include <QVector>
+
+/**
+ * Builds a world_X_Y.lotpack file in memory and writes it out in one go.
+ *
+ * The file is a qint32 chunk count, a qint64 file offset for each chunk,
+ * then the chunks themselves, which are nothing but qint32 values.  All
+ * values are little-endian.
+ */
+class LotPackWriter
+{
+    Q_DECLARE_TR_FUNCTIONS(LotPackWriter)
+
+public:
+    LotPackWriter();
+
+    /**
+     * Discards any previous contents.  The memory is kept for the next file.
+     */
+    void begin(int chunkCount);
+
+    /**
+     * Must be called before writing each chunk, in the order the chunks
+     * appear in the index.
+     */
+    void beginChunk();
+
+    void writeInt(qint32 value)
+    { mData += qToLittleEndian(value); }
+
+    void writeInts(const qint32 *values, int count);
+
+    /**
+     * Writes the file to a temporary file which replaces \a filePath only
+     * once everything was written successfully.
+     */
+    bool write(const QString &filePath);
+
+    QString errorString() const
+    { return mError; }
+
+private:
+    int mChunkCount;
+    QVector<int> mChunkStart; // index into mData
+    QVector<qint32> mData; // little-endian
+    QString mError;
+};
+
+#endif // LOTPACKWRITER_H
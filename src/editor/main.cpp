@@ -16,6 +16,7 @@
  */
 
 #include <QApplication>
+#include "batchmode.h"
 #include "mainwindow.h"
 
 #ifdef ZOMBOID
@@ -40,6 +41,12 @@ int main(int argc, char *argv[])
 #if ZOMBOID
     QCoreApplication::setAttribute(Qt::AA_ShareOpenGLContexts);
 #endif
+
+    // Batch mode never shows a window, so don't require a display.
+    const bool batchMode = BatchMode::requested(argc, argv);
+    if (batchMode && qEnvironmentVariableIsEmpty("QT_QPA_PLATFORM"))
+        qputenv("QT_QPA_PLATFORM", "offscreen");
+
     QApplication a(argc, argv);
 
     a.setOrganizationName(QLatin1String("TheIndieStone"));
@@ -58,6 +65,19 @@ int main(int argc, char *argv[])
     QImageReader::setAllocationLimit(0);
 #endif
 
+    if (batchMode) {
+        int ret;
+        {
+            BatchMode batch;
+            ret = batch.run(a.arguments());
+        }
+        Preferences::deleteInstance();
+        MapManager::deleteInstance();
+        TileMetaInfoMgr::deleteInstance();
+        TilesetManager::deleteInstance();
+        return ret;
+    }
+
     MainWindow w;
     w.show();
 
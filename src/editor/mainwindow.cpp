@@ -1451,6 +1451,7 @@ static void generateLots(MainWindow *mainWin, Document *doc,
     GenerateLotsDialog dialog(worldDoc, mainWin);
     if (dialog.exec() != QDialog::Accepted)
         return;
+    LotFilesManager::instance()->setIncremental(dialog.isIncremental());
     if (!LotFilesManager::instance()->generateWorld(worldDoc, mode)) {
         QMessageBox::warning(mainWin, mainWin->tr("Lot Generation Failed!"),
                              LotFilesManager::instance()->errorString());
@@ -0,0 +1,961 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mapcache.h"
+
+#include "preferences.h"
+
+#include "gidmapper.h"
+#include "map.h"
+#include "mapobject.h"
+#include "objectgroup.h"
+#include "tile.h"
+#include "tilelayer.h"
+#include "tileset.h"
+
+#include <QBuffer>
+#include <QColor>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+#include <QSet>
+#include <QtEndian>
+
+#include <algorithm>
+#include <functional>
+
+using namespace Tiled;
+
+#define MAP_CACHE_MAGIC 0x4D415043 // "MAPC"
+#define BUILDING_CACHE_MAGIC 0x54425843 // "TBXC"
+#define MAP_CACHE_VERSION 1
+
+// Larger than any map or layer the editor creates, smaller than anything
+// that would overflow.
+#define MAP_CACHE_MAX_AREA (4096 * 4096)
+
+namespace {
+
+// The same flags as in GidMapper.
+const uint FlippedHorizontallyFlag   = 0x80000000;
+const uint FlippedVerticallyFlag     = 0x40000000;
+const uint FlippedAntiDiagonallyFlag = 0x20000000;
+
+void writeProperties(QDataStream &out, const Properties &properties)
+{
+    out << qint32(properties.size());
+    for (auto it = properties.constBegin(); it != properties.constEnd(); ++it)
+        out << it.key() << it.value();
+}
+
+// Runs of equal values, as little-endian (length, value) pairs of quint32.
+template <typename T>
+void writeRuns(QDataStream &out, const T *values, int count)
+{
+    QVector<quint32> runs;
+    int i = 0;
+    while (i < count) {
+        const T value = values[i];
+        const int start = i;
+        while (i < count && values[i] == value)
+            ++i;
+        runs += qToLittleEndian(quint32(i - start));
+        runs += qToLittleEndian(quint32(value));
+    }
+    out << qint32(runs.size() / 2);
+    out.writeRawData(reinterpret_cast<const char*>(runs.constData()),
+                     runs.size() * int(sizeof(quint32)));
+}
+
+bool validArea(int width, int height)
+{
+    return width >= 0 && height >= 0 && qint64(width) * height <= MAP_CACHE_MAX_AREA;
+}
+
+class MapCacheReader
+{
+public:
+    MapCacheReader(const uchar *data, QBuffer *buffer) :
+        mData(data),
+        mBuffer(buffer),
+        in(buffer),
+        mMap(nullptr),
+        mSharedTilesets(nullptr),
+        mBuilding(nullptr)
+    {
+    }
+
+    Map *readMap(const QFileInfo &mapFileInfo);
+    MapCache::CachedBuilding *readBuilding(const QByteArray &tbxHash,
+                                           const MapCache::SharedTilesets &tilesets);
+
+private:
+    bool ok() const
+    { return in.status() == QDataStream::Ok; }
+
+    bool readHeader(quint32 expectedMagic);
+    Map *readBody();
+    Properties readProperties();
+    Tileset *readTileset();
+    Tileset *readSharedTileset();
+    Layer *readLayer(GidMapper &gidMapper);
+    bool readTileLayerCells(TileLayer *tileLayer, GidMapper &gidMapper);
+    bool sharedGidsToCells();
+    MapObject *readObject();
+    void readBmpSettings();
+    bool readBmp(int index);
+    bool readNoBlend();
+
+    template <typename T>
+    bool readRuns(T *values, int count);
+
+    const uchar *mData;
+    QBuffer *mBuffer;
+    QDataStream in;
+    Map *mMap;
+    const MapCache::SharedTilesets *mSharedTilesets;
+    MapCache::CachedBuilding *mBuilding;
+    QVector<const MapCache::SharedTileset*> mShared; // in the map's order
+    QVector<uint> mSharedFirstGids;
+    QVector<uint> mGids;
+    QVector<Cell> mCells;
+};
+
+Map *MapCacheReader::readMap(const QFileInfo &mapFileInfo)
+{
+    if (!readHeader(MAP_CACHE_MAGIC))
+        return nullptr;
+
+    QString filePath;
+    qint64 size, lastModified;
+    in >> filePath >> size >> lastModified;
+    if (!ok() || filePath != mapFileInfo.absoluteFilePath()
+            || size != mapFileInfo.size()
+            || lastModified != mapFileInfo.lastModified().toMSecsSinceEpoch())
+        return nullptr;
+
+    return readBody();
+}
+
+MapCache::CachedBuilding *MapCacheReader::readBuilding(const QByteArray &tbxHash,
+                                                       const MapCache::SharedTilesets &tilesets)
+{
+    if (!readHeader(BUILDING_CACHE_MAGIC))
+        return nullptr;
+
+    QByteArray hash, configStamp;
+    in >> hash >> configStamp;
+    if (!ok() || hash != tbxHash || configStamp != tilesets.configStamp)
+        return nullptr;
+
+    mSharedTilesets = &tilesets;
+    MapCache::CachedBuilding *building = new MapCache::CachedBuilding;
+    building->generation = tilesets.generation;
+    mBuilding = building;
+    building->map = readBody();
+    if (building->map == nullptr) {
+        delete building;
+        return nullptr;
+    }
+    return building;
+}
+
+bool MapCacheReader::readHeader(quint32 expectedMagic)
+{
+    quint32 magic, version;
+    in >> magic >> version;
+    if (!ok() || magic != expectedMagic || version != MAP_CACHE_VERSION)
+        return false;
+    in.setVersion(QDataStream::Qt_5_0);
+    return true;
+}
+
+Map *MapCacheReader::readBody()
+{
+    qint32 orientation, width, height, tileWidth, tileHeight;
+    in >> orientation >> width >> height >> tileWidth >> tileHeight;
+    if (!ok() || !validArea(width, height))
+        return nullptr;
+
+    mMap = new Map(Map::Orientation(orientation), width, height, tileWidth, tileHeight);
+    mMap->setProperties(readProperties());
+
+    bool valid = true;
+    qint32 count;
+    in >> count;
+    for (int i = 0; i < count && valid && ok(); i++) {
+        if (Tileset *tileset = mSharedTilesets ? readSharedTileset() : readTileset())
+            mMap->addTileset(tileset);
+        else
+            valid = false;
+    }
+
+    // The writer numbered the tilesets the same way.  Shared tilesets are
+    // only used by the main thread, their snapshot is used instead.
+    GidMapper gidMapper;
+    if (!mSharedTilesets)
+        gidMapper = GidMapper(mMap->tilesets());
+
+    in >> count;
+    for (int i = 0; i < count && valid && ok(); i++) {
+        if (Layer *layer = readLayer(gidMapper))
+            mMap->addLayer(layer);
+        else
+            valid = false;
+    }
+
+    if (valid && ok())
+        readBmpSettings();
+
+    for (int i = 0; i < 2 && valid && ok(); i++)
+        valid = readBmp(i);
+
+    in >> count;
+    for (int i = 0; i < count && valid && ok(); i++)
+        valid = readNoBlend();
+
+    if (!valid || !ok()) {
+        // The tilesets are not owned by the map
+        if (mBuilding) {
+            // Objects waiting for takeMap() aren't in their group yet.
+            qDeleteAll(mBuilding->objects);
+            mBuilding->objects.clear();
+        } else {
+            qDeleteAll(mMap->tilesets());
+        }
+        delete mMap;
+        mMap = nullptr;
+    }
+
+    return mMap;
+}
+
+Properties MapCacheReader::readProperties()
+{
+    Properties properties;
+    qint32 count;
+    in >> count;
+    for (int i = 0; i < count && ok(); i++) {
+        QString name, value;
+        in >> name >> value;
+        properties.insert(name, value);
+    }
+    return properties;
+}
+
+Tileset *MapCacheReader::readTileset()
+{
+    QString name, imageSource;
+    qint32 tileWidth, tileHeight, tileSpacing, margin, imageWidth, imageHeight;
+    QPoint tileOffset;
+    QColor transparentColor;
+    in >> name >> tileWidth >> tileHeight >> tileSpacing >> margin >> tileOffset
+       >> transparentColor >> imageSource >> imageWidth >> imageHeight;
+    if (!ok() || tileWidth <= 0 || tileHeight <= 0)
+        return nullptr;
+
+    Tileset *tileset = new Tileset(name, tileWidth, tileHeight, tileSpacing, margin);
+    tileset->setTileOffset(tileOffset);
+    if (transparentColor.isValid())
+        tileset->setTransparentColor(transparentColor);
+    tileset->loadFromNothing(QSize(imageWidth, imageHeight), imageSource);
+    tileset->setProperties(readProperties());
+
+    qint32 count;
+    in >> count;
+    for (int i = 0; i < count && ok(); i++) {
+        qint32 id;
+        in >> id;
+        Properties properties = readProperties();
+        if (id >= 0 && id < tileset->tileCount())
+            tileset->tileAt(id)->setProperties(properties);
+    }
+
+    return tileset;
+}
+
+Tileset *MapCacheReader::readSharedTileset()
+{
+    QString name;
+    qint32 tileCount;
+    in >> name >> tileCount;
+    if (!ok())
+        return nullptr;
+
+    // The gids depend on the number of tiles, which changes if the
+    // tileset image was resized.
+    auto it = mSharedTilesets->byName.constFind(name);
+    if (it == mSharedTilesets->byName.constEnd() || it->tiles.size() != tileCount)
+        return nullptr;
+    mSharedFirstGids += mShared.isEmpty() ? 1 : mSharedFirstGids.last() + mShared.last()->tiles.size();
+    mShared += &*it;
+    mBuilding->tilesetNames += name;
+    return it->tileset;
+}
+
+Layer *MapCacheReader::readLayer(GidMapper &gidMapper)
+{
+    qint32 type, x, y, width, height;
+    QString name;
+    float opacity;
+    bool visible;
+    in >> type >> name >> x >> y >> width >> height >> opacity >> visible;
+    if (!ok() || !validArea(width, height))
+        return nullptr;
+
+    Layer *layer;
+    if (type == Layer::TileLayerType)
+        layer = new TileLayer(name, x, y, width, height);
+    else if (type == Layer::ObjectGroupType)
+        layer = new ObjectGroup(name, x, y, width, height);
+    else
+        return nullptr;
+    layer->setOpacity(opacity);
+    layer->setVisible(visible);
+    layer->setProperties(readProperties());
+
+    if (TileLayer *tileLayer = layer->asTileLayer()) {
+        if (!readTileLayerCells(tileLayer, gidMapper)) {
+            delete layer;
+            return nullptr;
+        }
+    } else if (ObjectGroup *objectGroup = layer->asObjectGroup()) {
+        QColor color;
+        qint32 count;
+        in >> color >> count;
+        if (color.isValid())
+            objectGroup->setColor(color);
+        for (int i = 0; i < count && ok(); i++) {
+            MapObject *object = readObject();
+            if (mBuilding) {
+                // Kept in order for takeMap().
+                mBuilding->objectGroups += objectGroup;
+                mBuilding->objects += object;
+            } else {
+                objectGroup->addObject(object);
+            }
+        }
+    }
+
+    return layer;
+}
+
+bool MapCacheReader::readTileLayerCells(TileLayer *tileLayer, GidMapper &gidMapper)
+{
+    const int count = tileLayer->width() * tileLayer->height();
+    mGids.resize(count);
+    if (!readRuns(mGids.data(), count))
+        return false;
+
+    mCells.fill(Cell(), count);
+    if (mBuilding) {
+        if (!sharedGidsToCells())
+            return false;
+        mBuilding->tileLayers += tileLayer;
+        mBuilding->cells += mCells;
+        return true;
+    }
+
+    uint badGid;
+    if (!gidMapper.gidsToCells(mGids.constData(), count, mCells.data(), badGid))
+        return false;
+
+    tileLayer->setCells(mCells);
+    return true;
+}
+
+// Like GidMapper::gidsToCells(), but with the tiles in the snapshot.
+bool MapCacheReader::sharedGidsToCells()
+{
+    const uint flags = FlippedHorizontallyFlag |
+                       FlippedVerticallyFlag |
+                       FlippedAntiDiagonallyFlag;
+    const uint *firstGids = mSharedFirstGids.constData();
+    const int tilesetCount = mSharedFirstGids.size();
+
+    uint prevGid = 0;
+    Cell prevCell;
+    for (int i = 0; i < mGids.size(); i++) {
+        const uint gid = mGids[i];
+        if (gid == prevGid) {
+            mCells[i] = prevCell;
+            continue;
+        }
+
+        Cell cell;
+        cell.flippedHorizontally = (gid & FlippedHorizontallyFlag);
+        cell.flippedVertically = (gid & FlippedVerticallyFlag);
+        cell.flippedAntiDiagonally = (gid & FlippedAntiDiagonallyFlag);
+        const uint tileGid = gid & ~flags;
+
+        if (tileGid != 0) {
+            const int ts = int(std::upper_bound(firstGids, firstGids + tilesetCount, tileGid) - firstGids) - 1;
+            if (ts < 0)
+                return false;
+            const QVector<Tile*> &tiles = mShared[ts]->tiles;
+            const uint tileId = tileGid - firstGids[ts];
+            if (tileId >= uint(tiles.size()))
+                return false;
+            cell.tile = tiles[tileId];
+        }
+
+        mCells[i] = cell;
+        prevGid = gid;
+        prevCell = cell;
+    }
+    return true;
+}
+
+MapObject *MapCacheReader::readObject()
+{
+    QString name, type;
+    QPointF pos;
+    QSizeF size;
+    qint32 tilesetIndex, tileID;
+    bool visible;
+    in >> name >> type >> pos >> size >> tilesetIndex >> tileID >> visible;
+
+    MapObject *object = new MapObject(name, type, pos, size);
+    Tile *tile = nullptr;
+    if (mSharedTilesets) {
+        if (tilesetIndex >= 0 && tilesetIndex < mShared.size()
+                && tileID >= 0 && tileID < mShared[tilesetIndex]->tiles.size())
+            tile = mShared[tilesetIndex]->tiles[tileID];
+    } else if (tilesetIndex >= 0 && tilesetIndex < mMap->tilesets().size() && tileID >= 0) {
+        tile = mMap->tilesets().at(tilesetIndex)->tileAt(tileID);
+    }
+    object->setTile(tile);
+    object->setVisible(visible);
+    object->setProperties(readProperties());
+
+    qint32 shape;
+    QPolygonF polygon;
+    in >> shape >> polygon;
+    object->setPolygon(polygon);
+    object->setShape(MapObject::Shape(shape));
+
+    return object;
+}
+
+void MapCacheReader::readBmpSettings()
+{
+    BmpSettings *settings = mMap->rbmpSettings();
+
+    QString rulesFile, blendsFile;
+    bool blendEdgesEverywhere;
+    in >> rulesFile >> blendsFile >> blendEdgesEverywhere;
+    settings->setRulesFile(rulesFile);
+    settings->setBlendsFile(blendsFile);
+    settings->setBlendEdgesEverywhere(blendEdgesEverywhere);
+
+    QList<BmpAlias*> aliases;
+    qint32 count;
+    in >> count;
+    for (int i = 0; i < count && ok(); i++) {
+        QString name;
+        QStringList tiles;
+        in >> name >> tiles;
+        aliases += new BmpAlias(name, tiles);
+    }
+    settings->setAliases(aliases);
+
+    QList<BmpRule*> rules;
+    in >> count;
+    for (int i = 0; i < count && ok(); i++) {
+        QString label, targetLayer;
+        qint32 bitmapIndex;
+        quint32 color, condition;
+        QStringList tileChoices;
+        in >> label >> bitmapIndex >> color >> tileChoices >> targetLayer >> condition;
+        rules += new BmpRule(label, bitmapIndex, color, tileChoices, targetLayer, condition);
+    }
+    settings->setRules(rules);
+
+    QList<BmpBlend*> blends;
+    in >> count;
+    for (int i = 0; i < count && ok(); i++) {
+        QString targetLayer, mainTile, blendTile;
+        qint32 dir;
+        QStringList exclusions, exclude2;
+        in >> targetLayer >> mainTile >> blendTile >> dir >> exclusions >> exclude2;
+        blends += new BmpBlend(targetLayer, mainTile, blendTile,
+                               BmpBlend::Direction(dir), exclusions, exclude2);
+    }
+    settings->setBlends(blends);
+}
+
+bool MapCacheReader::readBmp(int index)
+{
+    MapBmp &bmp = mMap->rbmp(index);
+
+    quint32 seed;
+    QVector<QRgb> colors;
+    in >> seed >> colors;
+    if (!ok())
+        return false;
+    if (bmp.rands().seed() != seed)
+        bmp.rrands().setSeed(seed);
+
+    const int count = bmp.width() * bmp.height();
+    quint16 *pixels = bmp.indexLine(0);
+    if (!readRuns(pixels, count))
+        return false;
+
+    // The new bmp's color table only has black in it, so the cached indices
+    // are mapped to it like the colors in a .tmx file.
+    QVector<quint16> colorIndex(colors.size());
+    for (int i = 0; i < colors.size(); i++)
+        colorIndex[i] = bmp.colorIndex(colors[i]);
+    for (int i = 0; i < count; i++) {
+        if (pixels[i] >= colorIndex.size())
+            return false;
+        pixels[i] = colorIndex[pixels[i]];
+    }
+
+    return true;
+}
+
+bool MapCacheReader::readNoBlend()
+{
+    QString layerName;
+    in >> layerName;
+    if (!ok())
+        return false;
+
+    MapNoBlend *noBlend = mMap->noBlend(layerName);
+    const int width = noBlend->width();
+    QVector<quint8> bits(width * noBlend->height());
+    if (!readRuns(bits.data(), bits.size()))
+        return false;
+
+    for (int i = 0; i < bits.size(); i++) {
+        if (bits[i])
+            noBlend->set(i % width, i / width, true);
+    }
+    return true;
+}
+
+// The runs are used directly from the memory-mapped file.
+template <typename T>
+bool MapCacheReader::readRuns(T *values, int count)
+{
+    qint32 runCount;
+    in >> runCount;
+    if (!ok() || runCount < 0)
+        return false;
+
+    const qint64 size = qint64(runCount) * 2 * sizeof(quint32);
+    if (size > mBuffer->bytesAvailable())
+        return false;
+    const uchar *runs = mData + mBuffer->pos();
+    if (in.skipRawData(size) != size)
+        return false;
+
+    int n = 0;
+    for (int i = 0; i < runCount; i++, runs += 2 * sizeof(quint32)) {
+        const quint32 length = qFromLittleEndian<quint32>(runs);
+        const T value = T(qFromLittleEndian<quint32>(runs + sizeof(quint32)));
+        if (length > quint32(count - n))
+            return false;
+        std::fill(values + n, values + n + length, value);
+        n += int(length);
+    }
+    return n == count;
+}
+
+// Everything after the header, see MapCacheReader::readBody().  Shared
+// tilesets are written by name only.
+void writeMapParameters(QDataStream &out, const Map *map)
+{
+    out << qint32(map->orientation()) << qint32(map->width()) << qint32(map->height())
+        << qint32(map->tileWidth()) << qint32(map->tileHeight());
+    writeProperties(out, map->properties());
+}
+
+void writeLayerParameters(QDataStream &out, const Layer *layer)
+{
+    out << qint32(layer->type()) << layer->name()
+        << qint32(layer->x()) << qint32(layer->y())
+        << qint32(layer->width()) << qint32(layer->height())
+        << layer->opacity() << layer->isVisible();
+    writeProperties(out, layer->properties());
+}
+
+void writeObject(QDataStream &out, const MapObject *object, int tilesetIndex, int tileID)
+{
+    out << object->name() << object->type()
+        << object->position() << object->size()
+        << qint32(tilesetIndex) << qint32(tileID)
+        << object->isVisible();
+    writeProperties(out, object->properties());
+    out << qint32(object->shape()) << object->polygon();
+}
+
+// Everything after the layers.
+void writeBmps(QDataStream &out, const Map *map)
+{
+    const BmpSettings *settings = map->bmpSettings();
+    out << settings->rulesFile() << settings->blendsFile()
+        << settings->isBlendEdgesEverywhere();
+    out << qint32(settings->aliases().size());
+    for (BmpAlias *alias : settings->aliases())
+        out << alias->name << alias->tiles;
+    out << qint32(settings->rules().size());
+    for (BmpRule *rule : settings->rules()) {
+        out << rule->label << qint32(rule->bitmapIndex) << quint32(rule->color)
+            << rule->tileChoices << rule->targetLayer << quint32(rule->condition);
+    }
+    out << qint32(settings->blends().size());
+    for (BmpBlend *blend : settings->blends()) {
+        out << blend->targetLayer << blend->mainTile << blend->blendTile
+            << qint32(blend->dir) << blend->ExclusionList << blend->exclude2;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        const MapBmp bmp = map->bmp(i);
+        out << quint32(bmp.rands().seed()) << bmp.colorTable();
+        writeRuns(out, bmp.indexLine(0), bmp.width() * bmp.height());
+    }
+
+    const QList<MapNoBlend*> noBlends = map->noBlends();
+    out << qint32(noBlends.size());
+    QVector<quint8> bits;
+    for (MapNoBlend *noBlend : noBlends) {
+        out << noBlend->layerName();
+        bits.resize(noBlend->width() * noBlend->height());
+        quint8 *bit = bits.data();
+        for (int y = 0; y < noBlend->height(); y++) {
+            for (int x = 0; x < noBlend->width(); x++)
+                *bit++ = noBlend->get(x, y);
+        }
+        writeRuns(out, bits.constData(), bits.size());
+    }
+}
+
+void writeBody(QDataStream &out, const Map *map)
+{
+    writeMapParameters(out, map);
+
+    const QList<Tileset*> tilesets = map->tilesets();
+    out << qint32(tilesets.size());
+    for (Tileset *tileset : tilesets) {
+        out << tileset->name() << qint32(tileset->tileWidth()) << qint32(tileset->tileHeight())
+            << qint32(tileset->tileSpacing()) << qint32(tileset->margin())
+            << tileset->tileOffset() << tileset->transparentColor()
+            << tileset->imageSource()
+            << qint32(tileset->imageWidth()) << qint32(tileset->imageHeight());
+        writeProperties(out, tileset->properties());
+
+        QList<Tile*> tiles;
+        for (int i = 0; i < tileset->tileCount(); i++) {
+            if (!tileset->tileAt(i)->properties().isEmpty())
+                tiles += tileset->tileAt(i);
+        }
+        out << qint32(tiles.size());
+        for (Tile *tile : qAsConst(tiles)) {
+            out << qint32(tile->id());
+            writeProperties(out, tile->properties());
+        }
+    }
+
+    GidMapper gidMapper(tilesets);
+    QVector<uint> gids;
+
+    out << qint32(map->layerCount());
+    for (Layer *layer : map->layers()) {
+        writeLayerParameters(out, layer);
+
+        if (TileLayer *tileLayer = layer->asTileLayer()) {
+            gids.resize(tileLayer->width() * tileLayer->height());
+            uint *gid = gids.data();
+            for (int y = 0; y < tileLayer->height(); y++) {
+                for (int x = 0; x < tileLayer->width(); x++)
+                    *gid++ = gidMapper.cellToGid(tileLayer->cellAt(x, y));
+            }
+            writeRuns(out, gids.constData(), gids.size());
+        } else if (ObjectGroup *objectGroup = layer->asObjectGroup()) {
+            out << objectGroup->color() << qint32(objectGroup->objectCount());
+            for (MapObject *object : objectGroup->objects()) {
+                Tile *tile = object->tile();
+                writeObject(out, object, tile ? tilesets.indexOf(tile->tileset()) : -1,
+                            tile ? tile->id() : -1);
+            }
+        }
+    }
+
+    writeBmps(out, map);
+}
+
+template <typename T>
+T *readCacheFile(const QString &mapFilePath, const std::function<T*(MapCacheReader&)> &read)
+{
+    QFileInfo info = MapCache::cacheFileInfo(mapFilePath);
+    if (info.filePath().isEmpty() || !info.exists())
+        return nullptr;
+
+    QFile file(info.absoluteFilePath());
+    if (!file.open(QIODevice::ReadOnly))
+        return nullptr;
+
+    const qint64 size = file.size();
+    uchar *data = (size > 0) ? file.map(0, size) : nullptr;
+    if (data == nullptr)
+        return nullptr;
+
+    QByteArray bytes = QByteArray::fromRawData(reinterpret_cast<const char*>(data), size);
+    QBuffer buffer(&bytes);
+    buffer.open(QIODevice::ReadOnly);
+
+    MapCacheReader reader(data, &buffer);
+    T *result = read(reader);
+
+    buffer.close();
+    file.unmap(data);
+    return result;
+}
+
+bool openCacheFile(QSaveFile &file, const QString &mapFilePath)
+{
+    QFileInfo info = MapCache::cacheFileInfo(mapFilePath);
+    if (info.filePath().isEmpty())
+        return false;
+
+    // Other threads might be reading the old file, so it is replaced rather
+    // than overwritten.
+    file.setFileName(info.absoluteFilePath());
+    return file.open(QIODevice::WriteOnly);
+}
+
+bool commitCacheFile(QSaveFile &file, const QDataStream &out)
+{
+    if (out.status() != QDataStream::Ok) {
+        file.cancelWriting();
+        return false;
+    }
+    return file.commit();
+}
+
+} // namespace
+
+/////
+
+Map *MapCache::read(const QString &mapFilePath)
+{
+    return readCacheFile<Map>(mapFilePath, [&](MapCacheReader &reader) {
+        return reader.readMap(QFileInfo(mapFilePath));
+    });
+}
+
+bool MapCache::write(const QFileInfo &mapFileInfo, const Map *map)
+{
+    if (!canCache(map))
+        return false;
+
+    QSaveFile file;
+    if (!openCacheFile(file, mapFileInfo.absoluteFilePath()))
+        return false;
+
+    QDataStream out(&file);
+    out << quint32(MAP_CACHE_MAGIC);
+    out << quint32(MAP_CACHE_VERSION);
+    out.setVersion(QDataStream::Qt_5_0);
+
+    out << mapFileInfo.absoluteFilePath();
+    out << qint64(mapFileInfo.size());
+    out << qint64(mapFileInfo.lastModified().toMSecsSinceEpoch());
+
+    writeBody(out, map);
+
+    return commitCacheFile(file, out);
+}
+
+MapCache::CachedBuilding *MapCache::readBuilding(const QString &tbxFilePath,
+                                                 const QByteArray &tbxHash,
+                                                 const SharedTilesets &tilesets)
+{
+    return readCacheFile<CachedBuilding>(tbxFilePath, [&](MapCacheReader &reader) {
+        return reader.readBuilding(tbxHash, tilesets);
+    });
+}
+
+MapCache::CachedBuilding::~CachedBuilding()
+{
+    if (map) {
+        qDeleteAll(objects);
+        delete map;
+    }
+}
+
+Map *MapCache::CachedBuilding::takeMap()
+{
+    for (int i = 0; i < tileLayers.size(); i++)
+        tileLayers[i]->setCells(cells[i]);
+    for (int i = 0; i < objects.size(); i++)
+        objectGroups[i]->addObject(objects[i]);
+    tileLayers.clear();
+    cells.clear();
+    objectGroups.clear();
+    objects.clear();
+
+    Map *result = map;
+    map = nullptr;
+    return result;
+}
+
+bool MapCache::writeBuilding(const QString &tbxFilePath, const QByteArray &tbxHash,
+                             const SharedTilesets &tilesets, const CachedBuilding &building)
+{
+    // The tiles are numbered with the snapshot, the tilesets themselves
+    // belong to the main thread.  A map using the missing tileset or a
+    // tileset that isn't shared anymore might change without the .tbx file
+    // changing.
+    const Map *map = building.map;
+    if (map == nullptr || map->imageLayerCount() != 0
+            || building.tilesetNames.size() != map->tilesets().size())
+        return false;
+    QVector<const SharedTileset*> shared;
+    QVector<uint> firstGids;
+    QHash<Tile*,QPair<int,int>> tileIndex; // tileset index and tile ID
+    for (const QString &name : building.tilesetNames) {
+        const auto it = tilesets.byName.constFind(name);
+        if (it == tilesets.byName.constEnd())
+            return false;
+        for (int i = 0; i < it->tiles.size(); i++)
+            tileIndex.insert(it->tiles[i], qMakePair(shared.size(), i));
+        firstGids += shared.isEmpty() ? 1 : firstGids.last() + shared.last()->tiles.size();
+        shared += &*it;
+    }
+
+    QSaveFile file;
+    if (!openCacheFile(file, tbxFilePath))
+        return false;
+
+    QDataStream out(&file);
+    out << quint32(BUILDING_CACHE_MAGIC);
+    out << quint32(MAP_CACHE_VERSION);
+    out.setVersion(QDataStream::Qt_5_0);
+
+    out << tbxHash << tilesets.configStamp;
+
+    writeMapParameters(out, map);
+
+    out << qint32(shared.size());
+    for (int i = 0; i < shared.size(); i++)
+        out << building.tilesetNames[i] << qint32(shared[i]->tiles.size());
+
+    QVector<uint> gids;
+
+    out << qint32(map->layerCount());
+    for (Layer *layer : map->layers()) {
+        writeLayerParameters(out, layer);
+
+        if (TileLayer *tileLayer = layer->asTileLayer()) {
+            const int index = building.tileLayers.indexOf(tileLayer);
+            if (index == -1) {
+                file.cancelWriting();
+                return false;
+            }
+            const QVector<Cell> &cells = building.cells[index];
+            gids.resize(cells.size());
+            for (int i = 0; i < cells.size(); i++) {
+                const Cell &cell = cells[i];
+                uint gid = 0;
+                if (cell.tile) {
+                    const auto it = tileIndex.constFind(cell.tile);
+                    if (it == tileIndex.constEnd()) {
+                        file.cancelWriting();
+                        return false;
+                    }
+                    gid = firstGids[it->first] + it->second;
+                    if (cell.flippedHorizontally)
+                        gid |= FlippedHorizontallyFlag;
+                    if (cell.flippedVertically)
+                        gid |= FlippedVerticallyFlag;
+                    if (cell.flippedAntiDiagonally)
+                        gid |= FlippedAntiDiagonallyFlag;
+                }
+                gids[i] = gid;
+            }
+            writeRuns(out, gids.constData(), gids.size());
+        } else if (ObjectGroup *objectGroup = layer->asObjectGroup()) {
+            // Objects with a tile may still be waiting for takeMap().
+            QList<MapObject*> objects = objectGroup->objects();
+            for (int i = 0; i < building.objects.size(); i++) {
+                if (building.objectGroups[i] == objectGroup)
+                    objects += building.objects[i];
+            }
+            out << objectGroup->color() << qint32(objects.size());
+            for (MapObject *object : qAsConst(objects)) {
+                int tilesetIndex = -1, tileID = -1;
+                if (Tile *tile = object->tile()) {
+                    const auto it = tileIndex.constFind(tile);
+                    if (it == tileIndex.constEnd()) {
+                        file.cancelWriting();
+                        return false;
+                    }
+                    tilesetIndex = it->first;
+                    tileID = it->second;
+                }
+                writeObject(out, object, tilesetIndex, tileID);
+            }
+        }
+    }
+
+    writeBmps(out, map);
+
+    return commitCacheFile(file, out);
+}
+
+QByteArray MapCache::hash(const QByteArray &data)
+{
+    return QCryptographicHash::hash(data, QCryptographicHash::Sha1);
+}
+
+QByteArray MapCache::configStamp(const QStringList &filePaths)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    for (const QString &filePath : filePaths) {
+        QFileInfo info(filePath);
+        hash.addData(filePath.toUtf8());
+        hash.addData(QByteArray::number(info.size()));
+        hash.addData(QByteArray::number(info.lastModified().toMSecsSinceEpoch()));
+    }
+    return hash.result();
+}
+
+bool MapCache::canCache(const Map *map)
+{
+    for (Tileset *tileset : map->tilesets()) {
+        if (tileset->isExternal())
+            return false;
+    }
+    return map->imageLayerCount() == 0;
+}
+
+QFileInfo MapCache::cacheFileInfo(const QString &mapFilePath)
+{
+    // One directory for every map, rather than a file next to each thumbnail.
+    const QString directory = Preferences::instance()->configPath(QLatin1String("mapcache"));
+    if (!QFileInfo::exists(directory) && !QDir().mkpath(directory))
+        return QFileInfo();
+    const QByteArray key = hash(QFileInfo(mapFilePath).absoluteFilePath().toUtf8());
+    return QFileInfo(directory + QLatin1Char('/') + QString::fromLatin1(key.toHex()) +
+                     QLatin1String(".mapcache"));
+}
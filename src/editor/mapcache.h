@@ -0,0 +1,172 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MAPCACHE_H
+#define MAPCACHE_H
+
+#include <QByteArray>
+#include <QFileInfo>
+#include <QHash>
+#include <QSet>
+#include <QString>
+#include <QStringList>
+#include <QVector>
+
+#include "tilelayer.h"
+
+namespace Tiled {
+class Map;
+class MapObject;
+class ObjectGroup;
+class Tile;
+class Tileset;
+}
+
+/**
+ * A binary copy of a parsed .tmx file.  Every map's cache is kept in the
+ * mapcache directory of the config directory, named by a hash of the map's
+ * path.  The cache records the path, size and modification time of the .tmx
+ * file and is ignored once any of them changes.
+ *
+ * Tile layers and bmp images are stored as runs of equal values, so reading
+ * a cached map is mostly memcpy-like work on a memory-mapped file instead of
+ * XML parsing, base64 decoding and inflating.
+ *
+ * The map made from a .tbx file is cached the same way.  That map's cells
+ * point to TileMetaInfoMgr's tilesets, which are stored by name and looked up
+ * again when reading.  It is keyed by a hash of the .tbx file and of the
+ * config files that decide which tiles a building uses, rather than by the
+ * .tbx file's modification time.
+ *
+ * The read and write functions may be called from any thread.  Reading and
+ * writing a building only use the tiles in a SharedTilesets snapshot and
+ * never the Tileset objects themselves, which belong to the main thread.
+ */
+class MapCache
+{
+public:
+    /**
+     * Returns the map cached for \a mapFilePath, or 0 if there is no cache
+     * file or it is out of date or unreadable.  The caller owns the map
+     * and its tilesets, as with MapReader::readMap().
+     */
+    static Tiled::Map *read(const QString &mapFilePath);
+
+    /**
+     * Writes \a map to the cache.  \a mapFileInfo must be taken before the
+     * map was read, so a .tmx file saved while it was being read doesn't
+     * leave a cache that looks up to date.  Maps that can't be cached are
+     * ignored.  Returns false if nothing was written.
+     */
+    static bool write(const QFileInfo &mapFileInfo, const Tiled::Map *map);
+
+    /**
+     * Maps using external tilesets or image layers depend on other files,
+     * so they are always read from the .tmx file.
+     */
+    static bool canCache(const Tiled::Map *map);
+
+    /**
+     * A tileset a cached building map may use, with its tiles as they were
+     * when the snapshot was taken.
+     */
+    struct SharedTileset
+    {
+        Tiled::Tileset *tileset;
+        QVector<Tiled::Tile*> tiles;
+        bool missing; // Tileset::isMissing()
+    };
+
+    /**
+     * The tilesets a cached building map may use, by name, and a stamp of
+     * the config files the building was turned into a map with.  The rest
+     * is what a reader thread needs to turn a building into a map itself.
+     * The generation changes whenever the snapshot is taken again.
+     */
+    struct SharedTilesets
+    {
+        SharedTilesets() :
+            missingTile(nullptr),
+            missingTileset(nullptr),
+            generation(0)
+        {
+        }
+
+        QHash<QString,SharedTileset> byName;
+        QByteArray configStamp;
+        Tiled::Tile *missingTile;
+        Tiled::Tileset *missingTileset;
+        QStringList tmxLayerNames; // BuildingTMX::tileLayerNames()
+        QString tilesDirectory;
+        QSet<QString> unloadable; // tilesets that failed to load
+        int generation;
+    };
+
+    /**
+     * A building map read by readBuilding() or made on a reader thread.
+     * Setting cells and adding tile objects looks at the tiles' tilesets, so
+     * that is left to takeMap(), which must be called on the main thread
+     * while the snapshot of the given generation is still current.
+     */
+    struct CachedBuilding
+    {
+        CachedBuilding() :
+            map(nullptr),
+            generation(0)
+        {
+        }
+
+        ~CachedBuilding();
+
+        Tiled::Map *takeMap();
+
+        Tiled::Map *map;
+        QList<Tiled::TileLayer*> tileLayers;
+        QList<QVector<Tiled::Cell>> cells;
+        QList<Tiled::ObjectGroup*> objectGroups;
+        QList<Tiled::MapObject*> objects;
+        QStringList tilesetNames; // the map's tilesets, empty for the missing one
+        int generation;
+    };
+
+    /**
+     * Returns the map cached for the .tbx file whose contents hash to
+     * \a tbxHash, or 0 if there is none or a tileset isn't in \a tilesets.
+     * The map doesn't own its tilesets.
+     */
+    static CachedBuilding *readBuilding(const QString &tbxFilePath, const QByteArray &tbxHash,
+                                        const SharedTilesets &tilesets);
+
+    /**
+     * Writes the map made for a .tbx file before takeMap() is called.  Maps
+     * using tiles that aren't in \a tilesets are ignored.
+     */
+    static bool writeBuilding(const QString &tbxFilePath, const QByteArray &tbxHash,
+                              const SharedTilesets &tilesets, const CachedBuilding &building);
+
+    static QByteArray hash(const QByteArray &data);
+
+    /**
+     * Returns a hash of the paths, sizes and modification times of the
+     * given files.
+     */
+    static QByteArray configStamp(const QStringList &filePaths);
+
+    static QFileInfo cacheFileInfo(const QString &mapFilePath);
+};
+
+#endif // MAPCACHE_H
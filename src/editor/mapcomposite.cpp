@@ -99,6 +99,7 @@ CompositeLayerGroup::CompositeLayerGroup(MapComposite *owner, int level)
     , mAnyVisibleLayers(false)
     , mNeedsSynch(true)
     , mNoBlendCell(Tiled::Internal::TilesetManager::instance()->noBlendTile())
+    , mFlatGarbage(0)
 #if 1 // ROAD_CRUD
     , mRoadLayer0(0)
     , mRoadLayer1(0)
@@ -155,6 +156,9 @@ void CompositeLayerGroup::addTileLayer(TileLayer *layer, int index)
     if (layer->name() == QLatin1String("0_FloorOverlay"))
         mRoadLayer1 = layer;
 #endif // ROAD_CRUD
+
+    updateLayerFlags();
+    clearFlattened();
 }
 
 void CompositeLayerGroup::removeTileLayer(TileLayer *layer)
@@ -191,6 +195,9 @@ void CompositeLayerGroup::removeTileLayer(TileLayer *layer)
     if (layer == mRoadLayer1)
         mRoadLayer1 = 0;
 #endif // ROAD_CRUD
+
+    updateLayerFlags();
+    clearFlattened();
 }
 
 void CompositeLayerGroup::prepareDrawing(const MapRenderer *renderer, const QRect &rect)
@@ -215,6 +222,14 @@ void CompositeLayerGroup::prepareDrawing(const MapRenderer *renderer, const QRec
 static QLatin1String sFloor("0_Floor"); // FIXME: thread safe?
 static QLatin1String sAboveLot("_AboveLot");
 
+// Layer names are checked once here instead of for every square.
+void CompositeLayerGroup::updateLayerFlags()
+{
+    mAboveLotLayers.resize(mLayers.size());
+    for (int index = 0; index < mLayers.size(); index++)
+        mAboveLotLayers[index] = mLayers[index]->name().contains(sAboveLot);
+}
+
 bool CompositeLayerGroup::orderedCellsAt(const QPoint &pos,
                                          QVector<const Cell *> &cells,
                                          QVector<qreal> &opacities) const
@@ -278,7 +293,7 @@ bool CompositeLayerGroup::orderedCellsAt(const QPoint &pos,
             cell = &emptyCell;
         if (mOwner->parent() != nullptr && mOwner->parent()->showLotFloorsOnly()) {
             bool isFloor = !mLevel && !index && (tl->name() == sFloor);
-            if (!isFloor && !tl->name().contains(sAboveLot)) {
+            if (!isFloor && !mAboveLotLayers[index]) {
                 cell = &emptyCell;
             }
         }
@@ -297,7 +312,7 @@ bool CompositeLayerGroup::orderedCellsAt(const QPoint &pos,
 #endif // BUILDINGED
         if (index && suppressRgn.contains(rootPos))
             cell = &emptyCell;
-        if (!cell->isEmpty() && (root == mOwner) && tl->name().contains(sAboveLot)) {
+        if (!cell->isEmpty() && (root == mOwner) && mAboveLotLayers[index]) {
             aboveLotCells += cell;
             aboveLotOpacities += mLayerOpacity[index];
             cell = &emptyCell;
@@ -424,7 +439,7 @@ bool CompositeLayerGroup::orderedCellsAt2(const QPoint &pos, QVector<const Cell
                 cell = &tlBlendOver->cellAt(subPos);
             }
 #endif // BUILDINGED
-            if (!cell->isEmpty() && (root == mOwner) && tl->name().contains(sAboveLot)) {
+            if (!cell->isEmpty() && (root == mOwner) && mAboveLotLayers[index]) {
                 aboveLotCells += cell;
                 continue;
             }
@@ -454,6 +469,58 @@ bool CompositeLayerGroup::orderedCellsAt2(const QPoint &pos, QVector<const Cell
     return !cells.isEmpty();
 }
 
+void CompositeLayerGroup::flatten(const QRect &rect)
+{
+    clearFlattened();
+    if (rect.isEmpty())
+        return;
+    mFlatBounds = rect;
+    mFlatOffsets.fill(0, rect.width() * rect.height());
+    mFlatCounts.fill(0, rect.width() * rect.height());
+    flattenSquares(rect);
+}
+
+void CompositeLayerGroup::clearFlattened()
+{
+    mFlatBounds = QRect();
+    mFlatOffsets.clear();
+    mFlatCounts.clear();
+    mFlatCells.clear();
+    mFlatGarbage = 0;
+}
+
+void CompositeLayerGroup::flattenSquares(const QRect &rect)
+{
+    QVector<const Cell*> cells;
+    for (int y = rect.top(); y <= rect.bottom(); y++) {
+        int index = (rect.left() - mFlatBounds.x()) + (y - mFlatBounds.y()) * mFlatBounds.width();
+        for (int x = rect.left(); x <= rect.right(); x++, index++) {
+            cells.resize(0);
+            orderedCellsAt2(QPoint(x, y), cells);
+            Q_ASSERT(cells.size() <= 0xFFFF);
+            mFlatGarbage += mFlatCounts[index];
+            mFlatOffsets[index] = mFlatCells.size();
+            mFlatCounts[index] = cells.size();
+            for (const Cell *cell : qAsConst(cells))
+                mFlatCells += *cell;
+        }
+    }
+}
+
+void CompositeLayerGroup::compactFlattened()
+{
+    QVector<Cell> compacted;
+    compacted.reserve(mFlatCells.size() - mFlatGarbage);
+    for (int index = 0; index < mFlatOffsets.size(); index++) {
+        const Cell *cells = mFlatCells.constData() + mFlatOffsets[index];
+        mFlatOffsets[index] = compacted.size();
+        for (int i = 0; i < mFlatCounts[index]; i++)
+            compacted += cells[i];
+    }
+    mFlatCells.swap(compacted);
+    mFlatGarbage = 0;
+}
+
 void CompositeLayerGroup::prepareDrawingNoBmpBlender(const MapRenderer *renderer, const QRect &rect)
 {
     mPreparedSubMapLayers.resize(0);
@@ -531,7 +598,7 @@ bool CompositeLayerGroup::orderedCellsAt3(const QPoint &pos, QVector<TilePlusLay
                     cell = &tlBmpBlend->cellAt(subPos);
                 }
             }
-            if (!cell->isEmpty() && (root == mOwner) && tl->name().contains(sAboveLot)) {
+            if (!cell->isEmpty() && (root == mOwner) && mAboveLotLayers[index]) {
                 aboveLotCells += TilePlusLayer(tl->name(), cell->tile, mVisibleLayers[index], mLayerOpacity[index]);
                 continue;
             }
@@ -789,7 +856,10 @@ bool CompositeLayerGroup::setBmpBlendLayers(const QList<TileLayer *> &layers)
         }
     }
 
-    return old != mBmpBlendLayers;
+    if (old == mBmpBlendLayers)
+        return false;
+    clearFlattened();
+    return true;
 }
 
 #ifdef BUILDINGED
@@ -870,6 +940,9 @@ void CompositeLayerGroup::layerRenamed(TileLayer *layer)
 
     const QString name = MapComposite::layerNameWithoutPrefix(layer);
     mLayersByName[name].append(layer);
+
+    updateLayerFlags();
+    clearFlattened();
 }
 
 bool CompositeLayerGroup::setLayerOpacity(const QString &layerName, qreal opacity)
@@ -914,7 +987,7 @@ void CompositeLayerGroup::synchSubMapLayerOpacity(const QString &layerName, qrea
     }
 }
 
-bool CompositeLayerGroup::regionAltered(Tiled::TileLayer *tl)
+bool CompositeLayerGroup::regionAltered(Tiled::TileLayer *tl, const QRect &rect)
 {
     QMargins m;
     maxMargins(mDrawMargins, tl->drawMargins(), m);
@@ -941,6 +1014,17 @@ bool CompositeLayerGroup::regionAltered(Tiled::TileLayer *tl)
         return true;
     }
 #endif
+    if (!mFlatBounds.isEmpty()) {
+        // The stacks are in the coordinates passed to orderedCellsAt2().
+        if (rect.isEmpty()) {
+            clearFlattened();
+        } else {
+            flattenSquares(rect.translated(mOwner->orientAdjustTiles() * mLevel)
+                           & mFlatBounds);
+            if (mFlatGarbage > mFlatCells.size() / 2)
+                compactFlattened();
+        }
+    }
     return false;
 }
 
@@ -1358,6 +1442,16 @@ QList<MapComposite *> MapComposite::maps()
     return ret;
 }
 
+void MapComposite::setBmpBlendersFlushedElsewhere()
+{
+    for (MapComposite *mc : maps()) {
+        disconnect(mc->mBmpBlender, &Internal::BmpBlender::layersRecreated,
+                   mc, &MapComposite::bmpBlenderLayersRecreated);
+        connect(mc->mBmpBlender, &Internal::BmpBlender::layersRecreated,
+                mc, &MapComposite::bmpBlenderLayersRecreated, Qt::DirectConnection);
+    }
+}
+
 void MapComposite::setOrigin(const QPoint &origin)
 {
     mPos = origin;
@@ -110,6 +110,32 @@ public:
     void prepareDrawing2();
     bool orderedCellsAt2(const QPoint &pos, QVector<const Tiled::Cell*>& cells) const;
 
+    /**
+     * Resolves orderedCellsAt2() for every square in \a rect in one pass and
+     * keeps the results in flat arrays, so code visiting every square of a
+     * level doesn't resolve the layers, bmp blending, roads and sub-maps
+     * again for each square.  prepareDrawing2() must be called first.
+     * The stacks are discarded when the layers change, and updated by
+     * regionAltered() when it is given the altered area.
+     */
+    void flatten(const QRect &rect);
+    bool isFlattened(const QRect &rect) const
+    { return !rect.isEmpty() && mFlatBounds.contains(rect); }
+    void clearFlattened();
+
+    /**
+     * Sets \a cells to the cells flatten() found at \a pos and returns how
+     * many there are.  Returns 0 outside the flattened area.
+     */
+    int flatCellsAt(const QPoint &pos, const Tiled::Cell *&cells) const
+    {
+        if (!mFlatBounds.contains(pos))
+            return 0;
+        int index = (pos.x() - mFlatBounds.x()) + (pos.y() - mFlatBounds.y()) * mFlatBounds.width();
+        cells = mFlatCells.constData() + mFlatOffsets[index];
+        return mFlatCounts[index];
+    }
+
     void prepareDrawingNoBmpBlender(const Tiled::MapRenderer *renderer, const QRect &rect);
 
     void prepareDrawing3(const Tiled::MapRenderer *renderer, const QRect &rect);
@@ -127,9 +153,14 @@ public:
 
     MapComposite *owner() const { return mOwner; }
 
-    bool regionAltered(Tiled::TileLayer *tl);
+    bool regionAltered(Tiled::TileLayer *tl, const QRect &rect = QRect());
 
-    void setNeedsSynch(bool synch) { mNeedsSynch = synch; }
+    void setNeedsSynch(bool synch)
+    {
+        mNeedsSynch = synch;
+        if (synch)
+            clearFlattened();
+    }
     bool needsSynch() const { return mNeedsSynch; }
     bool isLayerEmpty(int index) const;
     void synch();
@@ -178,6 +209,10 @@ public:
 #endif
 
 private:
+    void updateLayerFlags();
+    void flattenSquares(const QRect &rect);
+    void compactFlattened();
+
     MapComposite *mOwner;
     bool mAnyVisibleLayers;
     bool mNeedsSynch;
@@ -187,6 +222,7 @@ private:
     QVector<bool> mVisibleLayers;
     QVector<bool> mEmptyLayers;
     QVector<qreal> mLayerOpacity;
+    QVector<bool> mAboveLotLayers;
     int mMaxFloorLayer;
     QMap<QString,QVector<Tiled::Layer*> > mLayersByName;
     QVector<bool> mSavedVisibleLayers;
@@ -212,6 +248,15 @@ private:
     QVector<Tiled::TileLayer*> mBmpBlendLayers;
     QVector<Tiled::MapNoBlend*> mNoBlends;
     Tiled::Cell mNoBlendCell;
+
+    // See flatten().  Each square has an offset and count into mFlatCells.
+    // Squares updated by regionAltered() get new cells at the end of
+    // mFlatCells, the old ones are garbage until compactFlattened().
+    QRect mFlatBounds;
+    QVector<quint32> mFlatOffsets;
+    QVector<quint16> mFlatCounts;
+    QVector<Tiled::Cell> mFlatCells;
+    int mFlatGarbage;
 #ifdef BUILDINGED
     QVector<Tiled::TileLayer*> mBlendOverLayers;
     struct ToolLayer
@@ -396,6 +441,13 @@ public:
     int changeCount() const
     { return mChangeCount; }
 
+    /**
+     * For composites handed to another thread, which flushes the BmpBlenders
+     * itself: the blend layers are then updated on that thread before it
+     * continues, rather than later on this one.
+     */
+    void setBmpBlendersFlushedElsewhere();
+
 signals:
     void layerGroupAdded(int level);
     void layerAddedToGroup(int index);
@@ -33,6 +33,7 @@
 #include "progress.h"
 #include "staggeredrenderer.h"
 #include "tilelayer.h"
+#include "tilerendercache.h"
 #include "tilesetmanager.h"
 #include "zlevelrenderer.h"
 
@@ -44,6 +45,7 @@
 #include <QImageReader>
 #include <QMessageBox>
 #include <QPainterPath>
+#include <QTimer>
 
 #ifdef QT_NO_DEBUG
 inline QNoDebug noise() { return QNoDebug(); }
@@ -56,6 +58,15 @@ using namespace Tiled::Internal;
 
 const int IMAGE_WIDTH = 512;
 
+#ifdef WORLDED
+#define THUMBNAIL_PACK_NAME "worlded-thumbnails"
+#else
+#define THUMBNAIL_PACK_NAME "tilezed-thumbnails"
+#endif
+
+// How long after a thumbnail is stored the pack's index is written.
+#define THUMBNAIL_INDEX_DELAY 5000
+
 MapImageManager *MapImageManager::mInstance = NULL;
 
 MapImageManager::MapImageManager() :
@@ -63,14 +74,22 @@ MapImageManager::MapImageManager() :
     mExpectMapImage(0),
     mRenderMapComposite(0),
     mDeferralDepth(0),
-    mDeferralQueued(false)
+    mDeferralQueued(false),
+    mThumbnailIndexQueued(false)
 {
+    QString thumbnailsDirectory = Preferences::instance()->thumbnailsDirectory();
+    if (thumbnailsDirectory.isEmpty() || !QFileInfo::exists(thumbnailsDirectory))
+        thumbnailsDirectory = Preferences::instance()->configPath(QLatin1String("thumbnails"));
+    if (!mThumbnailPack.open(thumbnailsDirectory, QLatin1String(THUMBNAIL_PACK_NAME)))
+        mError = tr("Couldn't open the thumbnail pack.\n%1").arg(mThumbnailPack.errorString());
+
+    qRegisterMetaType<ThumbnailPack::Entry>("ThumbnailPack::Entry");
     mImageReaderThreads.resize(4);
     mImageReaderWorkers.resize(mImageReaderThreads.size());
     mNextThreadForJob = 0;
     for (int i = 0; i < mImageReaderWorkers.size(); i++) {
         mImageReaderThreads[i] = new InterruptibleThread;
-        mImageReaderWorkers[i] = new MapImageReaderWorker(mImageReaderThreads[i]);
+        mImageReaderWorkers[i] = new MapImageReaderWorker(mImageReaderThreads[i], &mThumbnailPack);
         mImageReaderWorkers[i]->moveToThread(mImageReaderThreads[i]);
         connect(mImageReaderWorkers[i], &MapImageReaderWorker::imageLoaded,
                 this, &MapImageManager::imageLoadedByThread);
@@ -119,6 +138,8 @@ MapImageManager::~MapImageManager()
     mImageRenderThread->wait();
     delete mImageRenderWorker;
     delete mImageRenderThread;
+
+    mThumbnailPack.close();
 }
 
 MapImageManager *MapImageManager::instance()
@@ -186,10 +207,9 @@ MapImage *MapImageManager::getMapImage(const QString &mapName, const QString &re
 
     if (data.threadLoad || data.threadRender) {
         if (data.threadLoad) {
-            QString imageFileName = imageFileInfo(mapFilePath).canonicalFilePath();
             QMetaObject::invokeMethod(mImageReaderWorkers[mNextThreadForJob],
                                       "addJob", Qt::QueuedConnection,
-                                      Q_ARG(QString,imageFileName),
+                                      Q_ARG(ThumbnailPack::Entry,data.thumbnail),
                                       Q_ARG(MapImage*,mapImage));
             mNextThreadForJob = (mNextThreadForJob + 1) % mImageReaderWorkers.size();
         }
@@ -273,35 +293,26 @@ MapImageManager::ImageData MapImageManager::generateMapImage(const QString &mapF
     }
 #endif
 
-    QFileInfo fileInfo(mapFilePath);
-    QFileInfo imageInfo = imageFileInfo(mapFilePath);
-    QFileInfo imageDataInfo = imageDataFileInfo(imageInfo);
-    if (!force && imageInfo.exists() && imageDataInfo.exists() && (fileInfo.lastModified() < imageInfo.lastModified())) {
-        QImageReader reader(imageInfo.absoluteFilePath());
-        if (!reader.size().isValid())
-            QMessageBox::warning(MainWindow::instance(), tr("Error Loading Image"),
-                                 tr("An error occurred trying to read a map thumbnail image.\n") + imageInfo.absoluteFilePath());
-        if (reader.size().width() == IMAGE_WIDTH) {
-            ImageData data = readImageData(imageDataInfo);
-            // If the image was originally created with some tilesets missing,
-            // try to recreate the image in case those tileset issues were
-            // resolved.
-            if (data.missingTilesets)
-                data.valid = false;
-            if (data.valid) {
-                foreach (QString source, data.sources) {
-                    QFileInfo sourceInfo(source);
-                    if (sourceInfo.exists() && (sourceInfo.lastModified() > imageInfo.lastModified())) {
-                        data.valid = false;
-                        break;
-                    }
-                }
-            }
-            if (data.valid) {
-                data.threadLoad = true;
-                data.size = reader.size();
-                return data;
-            }
+    // The pack checks the contents of the map and its sub-maps haven't
+    // changed since the thumbnail was stored.
+    ThumbnailPack::Entry thumbnail;
+    if (!force && mThumbnailPack.find(mapFilePath, thumbnail)) {
+        // If the image was originally created with some tilesets missing,
+        // try to recreate the image in case those tileset issues were
+        // resolved.
+        if (thumbnail.imageSize.width() == IMAGE_WIDTH && !thumbnail.missingTilesets) {
+            ImageData data;
+            data.scale = thumbnail.scale;
+            data.levelZeroBounds = thumbnail.levelZeroBounds;
+            data.sources = thumbnail.sources;
+            data.missingTilesets = thumbnail.missingTilesets;
+            data.mapSize = thumbnail.mapSize;
+            data.tileSize = thumbnail.tileSize;
+            data.size = thumbnail.imageSize;
+            data.thumbnail = thumbnail;
+            data.valid = true;
+            data.threadLoad = true;
+            return data;
         }
     }
 
@@ -621,6 +632,8 @@ void MapImageManager::mapChanged(MapInfo *mapInfo)
 
 void MapImageManager::mapFileChanged(MapInfo *mapInfo)
 {
+    mThumbnailPack.sourceChanged(mapInfo->path());
+
     QMap<QString,MapImage*>::iterator it_begin = mMapImages.begin();
     QMap<QString,MapImage*>::iterator it_end = mMapImages.end();
     QMap<QString,MapImage*>::iterator it;
@@ -698,20 +711,22 @@ void MapImageManager::imageRenderedByThread(MapImageData imgData, MapImage *mapI
     mapImage->mTileSize = imgData.tileSize;
     mapImage->mLoaded = true;
 
-    ImageData data;
-    data.image = mapImage->image();
-    data.levelZeroBounds = mapImage->levelZeroBounds();
-    data.scale = mapImage->scale();
+    ThumbnailPack::Entry thumbnail;
+    thumbnail.levelZeroBounds = mapImage->levelZeroBounds();
+    thumbnail.scale = mapImage->scale();
     foreach (MapInfo *mapInfo, mapImage->sources())
-        data.sources += mapInfo->path();
-    data.missingTilesets = mapImage->isMissingTilesets();
-    data.mapSize = imgData.mapSize;
-    data.tileSize = imgData.tileSize;
-
-    QFileInfo imageInfo = imageFileInfo(mapImage->mapInfo()->path());
-    QFileInfo imageDataInfo = imageDataFileInfo(imageInfo);
-    data.image.save(imageInfo.absoluteFilePath());
-    writeImageData(imageDataInfo, data);
+        thumbnail.sources += mapInfo->path();
+    thumbnail.missingTilesets = mapImage->isMissingTilesets();
+    thumbnail.mapSize = imgData.mapSize;
+    thumbnail.tileSize = imgData.tileSize;
+    mThumbnailPack.insert(mapImage->mapInfo()->path(), thumbnail, mapImage->image());
+
+    // Many thumbnails are rendered one after the other when a world is
+    // opened, write the index once they're done.
+    if (!mThumbnailIndexQueued) {
+        mThumbnailIndexQueued = true;
+        QTimer::singleShot(THUMBNAIL_INDEX_DELAY, this, &MapImageManager::writeThumbnailIndex);
+    }
 
     if (mDeferralDepth > 0)
         mDeferredMapImages += mapImage;
@@ -719,6 +734,13 @@ void MapImageManager::imageRenderedByThread(MapImageData imgData, MapImage *mapI
         emit mapImageChanged(mapImage);
 }
 
+void MapImageManager::writeThumbnailIndex()
+{
+    mThumbnailIndexQueued = false;
+    if (!mThumbnailPack.writeIndex())
+        mError = tr("Couldn't write the thumbnail index.\n%1").arg(mThumbnailPack.errorString());
+}
+
 void MapImageManager::renderJobDone(MapComposite *mapComposite)
 {
     Q_ASSERT(mapComposite == mRenderMapComposite);
@@ -1029,8 +1051,9 @@ void MapImage::chopIntoPieces()
 
 /////
 
-MapImageReaderWorker::MapImageReaderWorker(InterruptibleThread *thread) :
-    BaseWorker(thread)
+MapImageReaderWorker::MapImageReaderWorker(InterruptibleThread *thread, const ThumbnailPack *pack) :
+    BaseWorker(thread),
+    mPack(pack)
 {
 }
 
@@ -1051,11 +1074,8 @@ void MapImageReaderWorker::work()
 
         Job job = mJobs.takeAt(0);
 
-        QImage *image = new QImage(job.imageFileName);
-#ifdef WORLDED
-        if (!image->isNull())
-            *image = image->convertToFormat(QImage::Format_ARGB4444_Premultiplied);
-#endif // WORLDED
+        // WorldEd stores its thumbnails as ARGB4444 already.
+        QImage *image = new QImage(mPack->image(job.thumbnail));
 
 #ifndef QT_NO_DEBUG
         Sleep::msleep(250);
@@ -1064,11 +1084,11 @@ void MapImageReaderWorker::work()
     }
 }
 
-void MapImageReaderWorker::addJob(const QString &imageFileName, MapImage *mapImage)
+void MapImageReaderWorker::addJob(const ThumbnailPack::Entry &thumbnail, MapImage *mapImage)
 {
     IN_WORKER_THREAD
 
-    mJobs += Job(imageFileName, mapImage);
+    mJobs += Job(thumbnail, mapImage);
     scheduleWork();
 }
 
@@ -1161,6 +1181,56 @@ void MapImageRenderWorker::resume(MapImage *mapImage)
     scheduleWork();
 }
 
+// Draws the layer groups of a LevelIsometric map in bands of rows.  The cells
+// of a few bands are collected on this thread, which owns the map, and then
+// those bands are drawn at the same time on the thread pool.
+static bool drawLayerGroupsInBands(const ZLevelRenderer *renderer,
+                                   const QList<CompositeLayerGroup*> &layerGroups,
+                                   QPainter &painter, const QSize &imageSize)
+{
+    const QTransform sceneToImage = painter.transform();
+    const QTransform imageToScene = sceneToImage.inverted();
+    const int threads = qMax(1, QThread::idealThreadCount());
+    // More bands than threads, so only part of the map's cells are
+    // collected at once.
+    const int bandCount = threads * 4;
+
+    for (int first = 0; first < bandCount; first += threads) {
+        QVector<TileRenderJob> jobs;
+        QVector<int> tops;
+        for (int band = first; band < qMin(first + threads, bandCount); band++) {
+            const int y1 = imageSize.height() * band / bandCount;
+            const int y2 = imageSize.height() * (band + 1) / bandCount;
+            if (y2 <= y1)
+                continue;
+            TileRenderJob job;
+            const QRectF sceneRect = imageToScene.mapRect(QRectF(0, y1, imageSize.width(), y2 - y1));
+            for (CompositeLayerGroup *layerGroup : layerGroups)
+                renderer->collectTileLayerGroup(layerGroup, sceneRect, job.draws);
+            job.image = new QImage(imageSize.width(), y2 - y1, QImage::Format_ARGB32_Premultiplied);
+            job.image->fill(Qt::transparent);
+            job.transform = sceneToImage * QTransform::fromTranslate(0, -y1);
+            job.renderHints = painter.renderHints();
+            jobs += job;
+            tops += y1;
+        }
+        if (!(renderer->mAbortDrawing && *renderer->mAbortDrawing))
+            TileRenderCache::render(renderer, jobs);
+
+        painter.save();
+        painter.resetTransform();
+        for (int i = 0; i < jobs.size(); i++) {
+            painter.drawImage(QPoint(0, tops[i]), *jobs[i].image);
+            delete jobs[i].image;
+        }
+        painter.restore();
+
+        if (renderer->mAbortDrawing && *renderer->mAbortDrawing)
+            return false;
+    }
+    return true;
+}
+
 MapImageData MapImageRenderWorker::generateMapImage(MapComposite *mapComposite)
 {
     Map *map = mapComposite->map();
@@ -1214,19 +1284,39 @@ MapImageData MapImageRenderWorker::generateMapImage(MapComposite *mapComposite)
                            QPainter::Antialiasing);
     painter.setTransform(QTransform::fromScale(scale, scale).translate(-sceneRect.left(), -sceneRect.top()));
 
+    // Tile layers outside the level groups are drawn one at a time, in order.
+    ZLevelRenderer *zRenderer = (map->orientation() == Map::LevelIsometric)
+            ? static_cast<ZLevelRenderer*>(renderer) : nullptr;
+    QList<CompositeLayerGroup*> layerGroups;
     foreach (MapComposite::ZOrderItem zo, mapComposite->zOrder()) {
-        if (zo.group) {
-            renderer->drawTileLayerGroup(&painter, zo.group);
-        } else if (TileLayer *tl = zo.layer->asTileLayer()) {
-            if (tl->name().contains(QLatin1String("NoRender")))
-                continue;
-            renderer->drawTileLayer(&painter, tl);
-        }
-        if (aborted()) {
+        if (zo.group)
+            layerGroups += zo.group;
+        else if (TileLayer *tl = zo.layer->asTileLayer())
+            if (!tl->name().contains(QLatin1String("NoRender")))
+                zRenderer = nullptr;
+    }
+
+    if (zRenderer) {
+        if (!drawLayerGroupsInBands(zRenderer, layerGroups, painter, image.size())) {
             painter.end();
             delete renderer;
             return MapImageData();
         }
+    } else {
+        foreach (MapComposite::ZOrderItem zo, mapComposite->zOrder()) {
+            if (zo.group) {
+                renderer->drawTileLayerGroup(&painter, zo.group);
+            } else if (TileLayer *tl = zo.layer->asTileLayer()) {
+                if (tl->name().contains(QLatin1String("NoRender")))
+                    continue;
+                renderer->drawTileLayer(&painter, tl);
+            }
+            if (aborted()) {
+                painter.end();
+                delete renderer;
+                return MapImageData();
+            }
+        }
     }
 
     painter.end();
@@ -24,6 +24,8 @@
 #include <QObject>
 #include <QStringList>
 
+#include "thumbnailpack.h"
+
 class MapComposite;
 class MapInfo;
 
@@ -37,7 +39,7 @@ class MapImageReaderWorker : public BaseWorker
 {
     Q_OBJECT
 public:
-    MapImageReaderWorker(InterruptibleThread *thread);
+    MapImageReaderWorker(InterruptibleThread *thread, const ThumbnailPack *pack);
 
     ~MapImageReaderWorker();
 
@@ -46,20 +48,21 @@ signals:
 
 public slots:
     void work();
-    void addJob(const QString &imageFileName, MapImage *mapImage);
+    void addJob(const ThumbnailPack::Entry &thumbnail, MapImage *mapImage);
 
 private:
     class Job {
     public:
-        Job(const QString &imageFileName, MapImage *mapImage) :
-            imageFileName(imageFileName),
+        Job(const ThumbnailPack::Entry &thumbnail, MapImage *mapImage) :
+            thumbnail(thumbnail),
             mapImage(mapImage)
         {
         }
 
-        QString imageFileName;
+        ThumbnailPack::Entry thumbnail;
         MapImage *mapImage;
     };
+    const ThumbnailPack *mPack;
     QList<Job> mJobs;
 };
 
@@ -86,6 +89,7 @@ public:
 
 #include <QMetaType>
 Q_DECLARE_METATYPE(MapImageData) // for QueuedConnection
+Q_DECLARE_METATYPE(ThumbnailPack::Entry) // for QueuedConnection
 
 class MapImageRenderWorker : public BaseWorker
 {
@@ -225,6 +229,9 @@ public:
     QString errorString() const
     { return mError; }
 
+    static QFileInfo imageFileInfo(const QString &mapFilePath);
+    static QFileInfo imageDataFileInfo(const QFileInfo &imageFileInfo);
+
 protected:
     struct ImageData
     {
@@ -244,6 +251,7 @@ protected:
         QSize mapSize;
         QSize tileSize;
         QSize size;
+        ThumbnailPack::Entry thumbnail; // for threadLoad
 
         bool threadLoad;
         bool threadRender;
@@ -283,18 +291,19 @@ private slots:
     void mapFailedToLoad(MapInfo *mapInfo);
 
     void processDeferrals();
+    void writeThumbnailIndex();
 
 private:
     Q_DISABLE_COPY(MapImageManager)
     MapImageManager();
     ~MapImageManager();
 
-    QFileInfo imageFileInfo(const QString &mapFilePath);
-    QFileInfo imageDataFileInfo(const QFileInfo &imageFileInfo);
-
     QMap<QString,MapImage*> mMapImages;
     QString mError;
 
+    ThumbnailPack mThumbnailPack;
+    bool mThumbnailIndexQueued;
+
     QVector<InterruptibleThread*> mImageReaderThreads;
     QVector<MapImageReaderWorker*> mImageReaderWorkers;
     int mNextThreadForJob;
@@ -17,6 +17,7 @@
 
 #include "mapmanager.h"
 
+#include "mapcache.h"
 #include "mapcomposite.h"
 #include "preferences.h"
 #include "progress.h"
@@ -35,12 +36,15 @@
 using namespace SharedTools;
 
 #include "BuildingEditor/building.h"
+#include "BuildingEditor/buildingfloor.h"
 #include "BuildingEditor/buildingreader.h"
 #include "BuildingEditor/buildingmap.h"
 #include "BuildingEditor/buildingobjects.h"
 #include "BuildingEditor/buildingtiles.h"
+#include "BuildingEditor/buildingtmx.h"
 #include "BuildingEditor/furnituregroups.h"
 
+#include <QBuffer>
 #include <QDebug>
 #include <QDir>
 #include <QFile>
@@ -76,7 +80,7 @@ MapManager::MapManager() :
     mDeferralDepth(0),
     mDeferralQueued(false),
     mWaitingForMapInfo(nullptr),
-    mNextThreadForJob(0)
+    mBuildingTilesetsDirty(true)
 #ifdef WORLDED
     , mReferenceEpoch(0)
 #endif
@@ -89,19 +93,21 @@ MapManager::MapManager() :
     connect(&mChangedFilesTimer, &QTimer::timeout,
             this, &MapManager::fileChangedTimeout);
 
-    qRegisterMetaType<MapInfo*>("BuildingEditor::Building*");
     qRegisterMetaType<MapInfo*>("MapInfo*");
+    qRegisterMetaType<MapCache::CachedBuilding*>("MapCache::CachedBuilding*");
 
-    mMapReaderThread.resize(4);
+    mMapReaderThread.resize(qMax(1, QThread::idealThreadCount()));
     mMapReaderWorker.resize(mMapReaderThread.size());
     for (int i = 0; i < mMapReaderThread.size(); i++) {
         mMapReaderThread[i] = new InterruptibleThread;
-        mMapReaderWorker[i] = new MapReaderWorker(mMapReaderThread[i], i);
+        mMapReaderWorker[i] = new MapReaderWorker(mMapReaderThread[i], &mMapReaderQueue);
         mMapReaderWorker[i]->moveToThread(mMapReaderThread[i]);
         connect(mMapReaderWorker[i], qOverload<Map*,MapInfo*>(&MapReaderWorker::loaded),
                 this, &MapManager::mapLoadedByThread);
-        connect(mMapReaderWorker[i], qOverload<BuildingEditor::Building*,MapInfo*>(&MapReaderWorker::loaded),
-                this, &MapManager::buildingLoadedByThread);
+        connect(mMapReaderWorker[i], &MapReaderWorker::tilesetsNeeded,
+                this, &MapManager::tilesetsNeededByThread);
+        connect(mMapReaderWorker[i], &MapReaderWorker::buildingMapLoaded,
+                this, &MapManager::buildingMapLoadedByThread);
         connect(mMapReaderWorker[i], &MapReaderWorker::failedToLoad,
                 this, &MapManager::failedToLoadByThread);
         mMapReaderThread[i]->start();
@@ -111,6 +117,8 @@ MapManager::MapManager() :
             this, &MapManager::metaTilesetAdded);
     connect(TileMetaInfoMgr::instance(), &TileMetaInfoMgr::tilesetRemoved,
             this, &MapManager::metaTilesetRemoved);
+    connect(TilesetManager::instance(), &TilesetManager::tilesetChanged,
+            this, &MapManager::tilesetChanged);
 }
 
 MapManager::~MapManager()
@@ -201,10 +209,7 @@ MapInfo *MapManager::loadMap(const QString &mapName, const QString &relativeTo,
     if (!mapInfo)
         return nullptr;
     if (mapInfo->mLoading) {
-        foreach (MapReaderWorker *w, mMapReaderWorker)
-            QMetaObject::invokeMethod(w, "possiblyRaisePriority",
-                                      Qt::QueuedConnection, Q_ARG(MapInfo*,mapInfo),
-                                      Q_ARG(int,priority));
+        mMapReaderQueue.raisePriority(mapInfo, priority);
         if (!asynch) {
             noise() << "WAITING FOR MAP" << mapName << "with priority" << priority;
             Q_ASSERT(mWaitingForMapInfo == nullptr);
@@ -217,6 +222,9 @@ MapInfo *MapManager::loadMap(const QString &mapName, const QString &relativeTo,
                     break;
                 }
             }
+            // Read it here unless a worker has started on it already.
+            if (mapInfo->mLoading && mMapReaderQueue.takeJob(mapInfo))
+                loadMapOnThisThread(mapInfo);
             while (mapInfo->mLoading) {
                 qApp->processEvents(QEventLoop::ExcludeUserInputEvents);
             }
@@ -227,38 +235,20 @@ MapInfo *MapManager::loadMap(const QString &mapName, const QString &relativeTo,
         return mapInfo;
     }
     mapInfo->mLoading = true;
-    QMetaObject::invokeMethod(mMapReaderWorker[mNextThreadForJob], "addJob",
-                              Qt::QueuedConnection, Q_ARG(MapInfo*,mapInfo),
-                              Q_ARG(int,priority));
-    mNextThreadForJob = (mNextThreadForJob + 1) % mMapReaderThread.size();
 
-    if (asynch)
+    if (asynch) {
+        addJob(mapInfo, priority);
         return mapInfo;
+    }
 
-    // Wow.  Had a map *finish loading* after the PROGRESS call below displayed
-    // the dialog and started processing events but before the qApp->processEvents()
-    // call below, resulting in a hang because mWaitingForMapInfo wasn't set until
-    // after the PROGRESS call.
+    // Reading the map here rather than on a worker thread means it doesn't
+    // wait behind other jobs.
     Q_ASSERT(mWaitingForMapInfo == nullptr);
     mWaitingForMapInfo = mapInfo;
 
     PROGRESS progress(tr("Reading %1").arg(fileInfoMap.completeBaseName()));
-    foreach (MapReaderWorker *w, mMapReaderWorker)
-        QMetaObject::invokeMethod(w, "possiblyRaisePriority",
-                                  Qt::QueuedConnection, Q_ARG(MapInfo*,mapInfo),
-                                  Q_ARG(int,priority));
-    noise() << "WAITING FOR MAP" << mapName << "with priority" << priority;
-    for (int i = 0; i < mDeferredMaps.size(); i++) {
-        MapDeferral md = mDeferredMaps[i];
-        if (md.mapInfo == mapInfo) {
-            mDeferredMaps.removeAt(i);
-            mapLoadedByThread(md.map, md.mapInfo);
-            break;
-        }
-    }
-    while (mapInfo->mLoading) {
-        qApp->processEvents(QEventLoop::ExcludeUserInputEvents);
-    }
+    noise() << "READING MAP" << mapName << "with priority" << priority;
+    loadMapOnThisThread(mapInfo);
     mWaitingForMapInfo = nullptr;
     if (mapInfo->map())
         return mapInfo;
@@ -680,6 +670,11 @@ void MapManager::fileChangedTimeout()
 #endif
 
     foreach (const QString &path, mChangedFiles) {
+        if (mBuildingConfigFiles.contains(path)) {
+            noise() << "MapManager::fileChanged" << path;
+            mBuildingTilesetsDirty = true;
+            continue;
+        }
         if (mMapInfo.contains(path)) {
             noise() << "MapManager::fileChanged" << path;
             mFileSystemWatcher->removePath(path);
@@ -691,10 +686,7 @@ void MapManager::fileChangedTimeout()
                     Q_ASSERT(!mapInfo->isBeingEdited());
                     if (!mapInfo->isLoading()) {
                         mapInfo->mLoading = true; // FIXME: seems weird to change this for a loaded map
-                        QMetaObject::invokeMethod(mMapReaderWorker[mNextThreadForJob], "addJob",
-                                                  Qt::QueuedConnection, Q_ARG(MapInfo*,mapInfo),
-                                                  Q_ARG(int,PriorityLow));
-                        mNextThreadForJob = (mNextThreadForJob + 1) % mMapReaderThread.size();
+                        addJob(mapInfo, PriorityLow);
                     }
                 }
                 {
@@ -715,6 +707,7 @@ void MapManager::fileChangedTimeout()
 void MapManager::metaTilesetAdded(Tileset *tileset)
 {
     Q_UNUSED(tileset)
+    mBuildingTilesetsDirty = true;
     foreach (MapInfo *mapInfo, mMapInfo) {
         if (mapInfo->map() && mapInfo->path().endsWith(QLatin1String(".tbx"))
                 && mapInfo->map()->hasUsedMissingTilesets())
@@ -725,6 +718,7 @@ void MapManager::metaTilesetAdded(Tileset *tileset)
 void MapManager::metaTilesetRemoved(Tileset *tileset)
 {
     Q_UNUSED(tileset)
+    mBuildingTilesetsDirty = true;
     foreach (MapInfo *mapInfo, mMapInfo) {
         if (mapInfo->map() && mapInfo->path().endsWith(QLatin1String(".tbx"))
                 && mapInfo->map()->usedTilesets().contains(tileset))
@@ -790,37 +784,33 @@ void MapManager::mapLoadedByThread(Map *map, MapInfo *mapInfo)
     emit mapLoaded(mapInfo);
 }
 
-void MapManager::buildingLoadedByThread(Building *building, MapInfo *mapInfo)
+void MapManager::tilesetsNeededByThread(const QStringList &tilesetNames, MapInfo *mapInfo)
 {
-    MapManagerDeferral deferral;
-
-    BuildingReader reader;
-    reader.fix(building);
-
-    BuildingMap::loadNeededTilesets(building);
+    loadBuildingTilesets(tilesetNames);
+    addJob(mapInfo, (mapInfo == mWaitingForMapInfo) ? PriorityHigh : PriorityMedium);
+}
 
-    BuildingMap bmap(building);
-    Map *map = bmap.mergedMap();
-    bmap.addRoomDefObjects(map);
+void MapManager::buildingMapLoadedByThread(MapCache::CachedBuilding *cached, MapInfo *mapInfo)
+{
+    // The reader thread used a snapshot of the tilesets.  If one of them was
+    // removed or changed since, the tiles it picked might be gone, so the
+    // map is made again on a reader thread.
+    updateBuildingTilesets();
+    if (cached->generation != mBuildingTilesets.generation) {
+        delete cached;
+        addJob(mapInfo, (mapInfo == mWaitingForMapInfo) ? PriorityHigh : PriorityMedium);
+        return;
+    }
 
-#if 0
-    map->setProperty(QStringLiteral("Legend"), QStringLiteral("CommunityServices"));
-    map->setProperty(QStringLiteral("File"), QFileInfo(mapInfo->path()).fileName());
-#else
-    map->setProperties(building->properties());
-#endif
+    Map *map = cached->takeMap();
+    delete cached;
 
-    delete building;
+    MapManagerDeferral deferral;
 
     QSet<Tileset*> usedTilesets = map->usedTilesets();
     usedTilesets.remove(TilesetManager::instance()->missingTileset());
-
     TileMetaInfoMgr::instance()->loadTilesets({ usedTilesets.begin(), usedTilesets.end() });
 
-    // The map references TileMetaInfoMgr's tilesets, but we add a reference
-    // to them ourself below.
-    TilesetManager::instance()->removeReferences(map->tilesets());
-
     mapLoadedByThread(map, mapInfo);
 }
 
@@ -831,6 +821,114 @@ void MapManager::failedToLoadByThread(const QString error, MapInfo *mapInfo)
     emit mapFailedToLoad(mapInfo);
 }
 
+void MapManager::addJob(MapInfo *mapInfo, int priority)
+{
+    if (mapInfo->path().endsWith(QLatin1String(".tbx")))
+        updateBuildingTilesets();
+    mMapReaderQueue.addJob(mapInfo, priority);
+    // Any idle worker will do.  Busy workers check the queue again when they
+    // finish their current job.
+    foreach (MapReaderWorker *w, mMapReaderWorker)
+        QMetaObject::invokeMethod(w, "workAvailable", Qt::QueuedConnection);
+}
+
+void MapManager::loadMapOnThisThread(MapInfo *mapInfo)
+{
+    QString error;
+    if (mapInfo->path().endsWith(QLatin1String(".tbx"))) {
+        updateBuildingTilesets();
+        QStringList neededTilesets;
+        MapCache::CachedBuilding *cached = MapReaderWorker::loadBuilding(mapInfo, buildingTilesets(),
+                                                                         neededTilesets, error);
+        if (!cached && !neededTilesets.isEmpty()) {
+            // Those that still can't be loaded aren't asked for again.
+            loadBuildingTilesets(neededTilesets);
+            updateBuildingTilesets();
+            cached = MapReaderWorker::loadBuilding(mapInfo, buildingTilesets(),
+                                                   neededTilesets, error);
+        }
+        if (cached)
+            buildingMapLoadedByThread(cached, mapInfo);
+        else
+            failedToLoadByThread(error, mapInfo);
+    } else {
+        if (Map *map = MapReaderWorker::loadMap(mapInfo, error))
+            mapLoadedByThread(map, mapInfo);
+        else
+            failedToLoadByThread(error, mapInfo);
+    }
+}
+
+void MapManager::updateBuildingTilesets()
+{
+    if (!mBuildingTilesetsDirty)
+        return;
+
+    // The reader threads use the building's own tiles rather than
+    // BuildingTilesMgr's, so only these decide which tiles a building uses.
+    const QStringList configFiles = {
+        TileMetaInfoMgr::instance()->txtPath(),
+        BuildingTMX::instance()->txtPath(),
+        TileMetaInfoMgr::instance()->tilesDirectory() + QLatin1String("/newtiledefinitions.tiles")
+    };
+    if (configFiles != mBuildingConfigFiles) {
+        mFileSystemWatcher->removePaths(mBuildingConfigFiles);
+        mFileSystemWatcher->addPaths(configFiles);
+        mBuildingConfigFiles = configFiles;
+    }
+
+    // Read newtiledefinitions.tiles again if it changed, the reader threads
+    // only use what was read last.
+    getTileDefWatcher()->check();
+
+    QMutexLocker locker(&mBuildingTilesetsMutex);
+    mBuildingTilesets.byName.clear();
+    for (Tileset *tileset : TileMetaInfoMgr::instance()->tilesets()) {
+        MapCache::SharedTileset &shared = mBuildingTilesets.byName[tileset->name()];
+        shared.tileset = tileset;
+        shared.tiles.resize(tileset->tileCount());
+        for (int i = 0; i < tileset->tileCount(); i++)
+            shared.tiles[i] = tileset->tileAt(i);
+        shared.missing = tileset->isMissing();
+    }
+    mBuildingTilesets.configStamp = MapCache::configStamp(configFiles);
+    mBuildingTilesets.missingTile = TilesetManager::instance()->missingTile();
+    mBuildingTilesets.missingTileset = TilesetManager::instance()->missingTileset();
+    mBuildingTilesets.tmxLayerNames = BuildingTMX::instance()->tileLayerNames();
+    mBuildingTilesets.tilesDirectory = TileMetaInfoMgr::instance()->tilesDirectory();
+    mBuildingTilesets.unloadable = mBuildingTilesetsUnloadable;
+    mBuildingTilesets.generation++;
+    mBuildingTilesetsDirty = false;
+}
+
+void MapManager::loadBuildingTilesets(const QStringList &tilesetNames)
+{
+    BuildingMap::loadNeededTilesets(tilesetNames);
+    foreach (QString tilesetName, tilesetNames) {
+        if (!TileMetaInfoMgr::instance()->tileset(tilesetName))
+            mBuildingTilesetsUnloadable += tilesetName;
+    }
+    mBuildingTilesetsDirty = true;
+}
+
+void MapManager::tilesetChanged(Tileset *tileset)
+{
+    // A tileset gets more tiles once its image is loaded.
+    if (mBuildingTilesetsDirty)
+        return;
+    const auto it = mBuildingTilesets.byName.constFind(tileset->name());
+    if (it == mBuildingTilesets.byName.constEnd() || it->tileset != tileset)
+        return;
+    if (it->tiles.size() != tileset->tileCount() || it->missing != tileset->isMissing())
+        mBuildingTilesetsDirty = true;
+}
+
+MapCache::SharedTilesets MapManager::buildingTilesets()
+{
+    QMutexLocker locker(&mBuildingTilesetsMutex);
+    return mBuildingTilesets;
+}
+
 void MapManager::deferThreadResults(bool defer)
 {
     if (defer) {
@@ -864,78 +962,127 @@ void MapManager::processDeferrals()
 
 /////
 
-MapReaderWorker::MapReaderWorker(InterruptibleThread *thread, int id) :
-    BaseWorker(thread),
-    mID(id)
+void MapReaderQueue::addJob(MapInfo *mapInfo, int priority)
 {
+    QMutexLocker locker(&mMutex);
+    insertJob(mapInfo, priority);
+    debugJobs("add job");
 }
 
-MapReaderWorker::~MapReaderWorker()
+MapInfo *MapReaderQueue::takeJob()
 {
+    QMutexLocker locker(&mMutex);
+    if (mJobs.isEmpty())
+        return nullptr;
+    debugJobs("take job");
+    return mJobs.takeFirst().mapInfo;
 }
 
-void MapReaderWorker::work()
+bool MapReaderQueue::takeJob(MapInfo *mapInfo)
 {
-    IN_WORKER_THREAD
-
-    if (mJobs.size()) {
-        if (aborted()) {
-            mJobs.clear();
-            return;
+    QMutexLocker locker(&mMutex);
+    for (int i = 0; i < mJobs.size(); i++) {
+        if (mJobs[i].mapInfo == mapInfo) {
+            mJobs.removeAt(i);
+            debugJobs("steal job");
+            return true;
         }
+    }
+    return false;
+}
 
-        Job job = mJobs.takeFirst();
-        debugJobs("take job");
-
-        if (job.mapInfo->path().endsWith(QLatin1String(".tbx"))) {
-            Building *building = loadBuilding(job.mapInfo);
-            if (building)
-                emit loaded(building, job.mapInfo);
-            else
-                emit failedToLoad(mError, job.mapInfo);
-        } else {
-//            noise() << "READING STARTED" << job.mapInfo->path();
-            Map *map = loadMap(job.mapInfo);
-//            noise() << "READING FINISHED" << job.mapInfo->path();
-            if (map)
-                emit loaded(map, job.mapInfo);
-            else
-                emit failedToLoad(mError, job.mapInfo);
+void MapReaderQueue::raisePriority(MapInfo *mapInfo, int priority)
+{
+    QMutexLocker locker(&mMutex);
+    for (int i = 0; i < mJobs.size(); i++) {
+        if (mJobs[i].mapInfo == mapInfo) {
+            if (mJobs[i].priority < priority) {
+                mJobs.removeAt(i);
+                insertJob(mapInfo, priority);
+                debugJobs("raise priority");
+            }
+            break;
         }
-
-//        QCoreApplication::processEvents(); // handle changing job priority
     }
-
-    if (mJobs.size()) scheduleWork();
 }
 
-void MapReaderWorker::addJob(MapInfo *mapInfo, int priority)
+bool MapReaderQueue::isEmpty()
 {
-    IN_WORKER_THREAD
+    QMutexLocker locker(&mMutex);
+    return mJobs.isEmpty();
+}
 
+void MapReaderQueue::insertJob(MapInfo *mapInfo, int priority)
+{
     int index = 0;
     while ((index < mJobs.size()) && (mJobs[index].priority >= priority))
         ++index;
-
     mJobs.insert(index, Job(mapInfo, priority));
-    debugJobs("add job");
-    scheduleWork();
 }
 
-void MapReaderWorker::possiblyRaisePriority(MapInfo *mapInfo, int priority)
+void MapReaderQueue::debugJobs(const char *msg)
+{
+#ifndef QT_NO_DEBUG
+    QStringList out;
+    foreach (Job job, mJobs) {
+        out += QString::fromLatin1("    %1 priority=%2\n").arg(QFileInfo(job.mapInfo->path()).fileName()).arg(job.priority);
+    }
+    noise() << "MapReaderQueue: " << msg << "\n" << out;
+#else
+    Q_UNUSED(msg)
+#endif
+}
+
+/////
+
+MapReaderWorker::MapReaderWorker(InterruptibleThread *thread, MapReaderQueue *queue) :
+    BaseWorker(thread),
+    mQueue(queue)
+{
+}
+
+MapReaderWorker::~MapReaderWorker()
+{
+}
+
+void MapReaderWorker::work()
 {
     IN_WORKER_THREAD
 
-    for (int i = 0; i < mJobs.size(); i++) {
-        if (mJobs[i].mapInfo == mapInfo && mJobs[i].priority < priority) {
-            int j;
-            for (j = i - 1; j >= 0 && mJobs[j].priority < priority; j--) {}
-            mJobs[i].priority = priority;
-            mJobs.move(i, j + 1);
-            debugJobs("raise priority");
-            break;
+    if (aborted())
+        return;
+
+    if (MapInfo *mapInfo = mQueue->takeJob()) {
+        QString error;
+        if (mapInfo->path().endsWith(QLatin1String(".tbx"))) {
+            QStringList neededTilesets;
+            MapCache::CachedBuilding *cached = loadBuilding(mapInfo, MapManager::instance()->buildingTilesets(),
+                                                            neededTilesets, error);
+            if (cached)
+                emit buildingMapLoaded(cached, mapInfo);
+            else if (!neededTilesets.isEmpty())
+                emit tilesetsNeeded(neededTilesets, mapInfo);
+            else
+                emit failedToLoad(error, mapInfo);
+        } else {
+//            noise() << "READING STARTED" << mapInfo->path();
+            Map *map = loadMap(mapInfo, error);
+//            noise() << "READING FINISHED" << mapInfo->path();
+            if (map)
+                emit loaded(map, mapInfo);
+            else
+                emit failedToLoad(error, mapInfo);
         }
     }
+
+    if (!mQueue->isEmpty()) scheduleWork();
+}
+
+void MapReaderWorker::workAvailable()
+{
+    IN_WORKER_THREAD
+
+    scheduleWork();
 }
 
 class MapReaderWorker_MapReader : public MapReader
@@ -955,30 +1102,150 @@ protected:
     }
 };
 
-Map *MapReaderWorker::loadMap(MapInfo *mapInfo)
+Map *MapReaderWorker::loadMap(MapInfo *mapInfo, QString &error)
 {
+    if (Map *map = MapCache::read(mapInfo->path()))
+        return map;
+
+    // Taken before reading, in case the file is saved while it is read.
+    QFileInfo mapFileInfo(mapInfo->path());
+
     MapReaderWorker_MapReader reader;
 //    reader.setTilesetImageCache(TilesetManager::instance()->imageCache()); // not thread-safe class
     Map *map = reader.readMap(mapInfo->path());
-    if (!map)
-        mError = reader.errorString();
+    if (!map) {
+        error = reader.errorString();
+        return map;
+    }
+    MapCache::write(mapFileInfo, map);
     return map;
 }
 
-Building *MapReaderWorker::loadBuilding(MapInfo *mapInfo)
+namespace {
+
+// Picks the tiles the way BuildingTilesMgr::tileFor() and
+// BuildingMap::userTilesToLayer() do, but from the snapshot.
+class SharedTilesetsMapMaker : public BuildingMapMaker
 {
-    BuildingReader reader;
-    Building *building = reader.read(mapInfo->path());
-    if (!building)
-        mError = reader.errorString();
-    return building;
-}
+public:
+    SharedTilesetsMapMaker(const MapCache::SharedTilesets &tilesets) :
+        mTilesets(tilesets),
+        mMissingTileUsed(false)
+    {
+    }
+
+    QStringList mUsedTilesetNames;
+    bool mMissingTileUsed;
 
-void MapReaderWorker::debugJobs(const char *msg)
+protected:
+    QStringList layerNames(int level) override
+    {
+        return BuildingTMX::tileLayerNamesForLevel(mTilesets.tmxLayerNames, level);
+    }
+
+    Tile *tileFor(const QString &tilesetName, int index) override
+    {
+        const auto it = mTilesets.byName.constFind(tilesetName);
+        if (it == mTilesets.byName.constEnd())
+            return missingTile();
+        if (index >= it->tiles.size())
+            return it->missing ? used(it.key(), it->tiles.value(0)) : missingTile();
+        return used(it.key(), it->tiles.value(index));
+    }
+
+    Tile *userTileFor(const QString &tilesetName, int index) override
+    {
+        const auto it = mTilesets.byName.constFind(tilesetName);
+        if (it == mTilesets.byName.constEnd())
+            return missingTile();
+        return used(it.key(), it->tiles.value(index));
+    }
+
+private:
+    Tile *missingTile()
+    {
+        mMissingTileUsed = true;
+        return mTilesets.missingTile;
+    }
+
+    Tile *used(const QString &tilesetName, Tile *tile)
+    {
+        if (tile && !mUsed.contains(tilesetName)) {
+            mUsed.insert(tilesetName);
+            mUsedTilesetNames += tilesetName;
+        }
+        return tile;
+    }
+
+    const MapCache::SharedTilesets &mTilesets;
+    QSet<QString> mUsed;
+};
+
+} // namespace
+
+MapCache::CachedBuilding *MapReaderWorker::loadBuilding(MapInfo *mapInfo,
+                                                        const MapCache::SharedTilesets &tilesets,
+                                                        QStringList &neededTilesets, QString &error)
 {
-    QStringList out;
-    foreach (Job job, mJobs) {
-        out += QString::fromLatin1("    %1 priority=%2\n").arg(QFileInfo(job.mapInfo->path()).fileName()).arg(job.priority);
+    BuildingReader reader;
+    Building *building;
+    QByteArray tbxHash;
+    QFile file(mapInfo->path());
+    if (file.open(QIODevice::ReadOnly)) {
+        QByteArray tbx = file.readAll();
+        file.close();
+
+        tbxHash = MapCache::hash(tbx);
+        if (MapCache::CachedBuilding *cached = MapCache::readBuilding(mapInfo->path(), tbxHash, tilesets))
+            return cached;
+
+        // Read the same bytes that were hashed, in case the file was saved since.
+        QBuffer buffer(&tbx);
+        buffer.open(QIODevice::ReadOnly);
+        building = reader.read(&buffer, QFileInfo(mapInfo->path()).absolutePath());
+    } else {
+        // Let the reader report the error.
+        building = reader.read(mapInfo->path());
+    }
+    if (!building) {
+        error = reader.errorString();
+        return nullptr;
+    }
+
+    // Tilesets that aren't in Tilesets.txt are loaded by the main thread, as
+    // BuildingMap::loadNeededTilesets() does.
+    neededTilesets.clear();
+    foreach (QString tilesetName, building->tilesetNames()) {
+        if (tilesets.byName.contains(tilesetName) || tilesets.unloadable.contains(tilesetName))
+            continue;
+        if (QFileInfo::exists(tilesets.tilesDirectory + QLatin1Char('/') + tilesetName + QLatin1String(".png")))
+            neededTilesets += tilesetName;
+    }
+
+    // The building keeps the tiles the reader made rather than being fixed
+    // up with BuildingTilesMgr's, which only the main thread may change.
+    MapCache::CachedBuilding *cached = nullptr;
+    if (neededTilesets.isEmpty()) {
+        SharedTilesetsMapMaker maker(tilesets);
+        cached = new MapCache::CachedBuilding;
+        cached->map = maker.makeMap(building, cached->tileLayers, cached->cells);
+        cached->generation = tilesets.generation;
+        foreach (QString tilesetName, maker.mUsedTilesetNames) {
+            cached->map->addTileset(tilesets.byName.value(tilesetName).tileset);
+            cached->tilesetNames += tilesetName;
+        }
+        if (maker.mMissingTileUsed) {
+            cached->map->addTileset(tilesets.missingTileset);
+            cached->tilesetNames += QString();
+        }
     }
-    noise() << "MRW #" << mID << ": " << msg << "\n" << out;
+
+    delete building;
+    reader.deleteUnfixed();
+
+    // Next time the map is read from the cache.
+    if (cached && !tbxHash.isEmpty())
+        MapCache::writeBuilding(mapInfo->path(), tbxHash, tilesets, *cached);
+
+    return cached;
 }
@@ -20,38 +20,39 @@
 
 #include "map.h"
 #include "filesystemwatcher.h"
+#include "mapcache.h"
 #include "threads.h"
 
 #include <QDateTime>
 #include <QMap>
+#include <QMutex>
 #include <QTimer>
 
 class MapInfo;
 
-namespace BuildingEditor {
-class Building;
-}
-
-class MapReaderWorker : public BaseWorker
+/**
+ * The map files waiting to be read, shared by all the MapReaderWorkers.
+ * Whichever worker is free takes the job with the highest priority, so one
+ * slow file doesn't hold up the jobs behind it while other threads are idle.
+ */
+class MapReaderQueue
 {
-    Q_OBJECT
 public:
-    MapReaderWorker(InterruptibleThread *thread, int id);
-    ~MapReaderWorker();
+    void addJob(MapInfo *mapInfo, int priority);
 
-signals:
-    void loaded(Tiled::Map *map, MapInfo *mapInfo);
-    void loaded(BuildingEditor::Building *building, MapInfo *mapInfo);
-    void failedToLoad(const QString error, MapInfo *mapInfo);
+    // Returns the job with the highest priority, or 0 if there are none.
+    MapInfo *takeJob();
 
-public slots:
-    void work();
-    void addJob(MapInfo *mapInfo, int priority);
-    void possiblyRaisePriority(MapInfo *mapInfo, int priority);
+    // Removes the job for mapInfo.  Returns false if no worker has it yet.
+    bool takeJob(MapInfo *mapInfo);
+
+    void raisePriority(MapInfo *mapInfo, int priority);
+
+    bool isEmpty();
 
 private:
-    Tiled::Map *loadMap(MapInfo *mapInfo);
-    BuildingEditor::Building *loadBuilding(MapInfo *mapInfo);
+    void insertJob(MapInfo *mapInfo, int priority);
+    void debugJobs(const char *msg);
 
     class Job {
     public:
@@ -64,12 +65,43 @@ private:
         MapInfo *mapInfo;
         int priority;
     };
-    QList<Job> mJobs;
+    QList<Job> mJobs; // Highest priority first, oldest first within a priority
+    QMutex mMutex;
+};
 
-    int mID;
-    void debugJobs(const char *msg);
+class MapReaderWorker : public BaseWorker
+{
+    Q_OBJECT
+public:
+    MapReaderWorker(InterruptibleThread *thread, MapReaderQueue *queue);
+    ~MapReaderWorker();
 
-    QString mError;
+    // These may be called on any thread.
+    static Tiled::Map *loadMap(MapInfo *mapInfo, QString &error);
+
+    /**
+     * Returns the map for the .tbx file, read from the cache or made with
+     * the tiles in \a tilesets, which must be finished with
+     * MapCache::CachedBuilding::takeMap() on the main thread.  Returns 0 if
+     * the building uses tilesets that only the main thread can load, which
+     * are put in \a neededTilesets, or if the file couldn't be read.
+     */
+    static MapCache::CachedBuilding *loadBuilding(MapInfo *mapInfo,
+                                                  const MapCache::SharedTilesets &tilesets,
+                                                  QStringList &neededTilesets, QString &error);
+
+signals:
+    void loaded(Tiled::Map *map, MapInfo *mapInfo);
+    void tilesetsNeeded(const QStringList &tilesetNames, MapInfo *mapInfo);
+    void buildingMapLoaded(MapCache::CachedBuilding *cached, MapInfo *mapInfo);
+    void failedToLoad(const QString error, MapInfo *mapInfo);
+
+public slots:
+    void work();
+    void workAvailable();
+
+private:
+    MapReaderQueue *mQueue;
 };
 
 class MapInfo
@@ -203,6 +235,9 @@ public:
     QString errorString() const
     { return mError; }
 
+    // May be called on any thread.
+    MapCache::SharedTilesets buildingTilesets();
+
 signals:
     void mapAboutToChange(MapInfo *mapInfo);
     void mapChanged(MapInfo *mapInfo);
@@ -221,7 +256,8 @@ private slots:
     void metaTilesetRemoved(Tiled::Tileset *tileset);
 
     void mapLoadedByThread(Tiled::Map *map, MapInfo *mapInfo);
-    void buildingLoadedByThread(BuildingEditor::Building *building, MapInfo *mapInfo);
+    void tilesetsNeededByThread(const QStringList &tilesetNames, MapInfo *mapInfo);
+    void buildingMapLoadedByThread(MapCache::CachedBuilding *cached, MapInfo *mapInfo);
     void failedToLoadByThread(const QString error, MapInfo *mapInfo);
 
     void processDeferrals();
@@ -255,9 +291,25 @@ private:
     bool mDeferralQueued;
     MapInfo *mWaitingForMapInfo;
 
+    void addJob(MapInfo *mapInfo, int priority);
+    void loadMapOnThisThread(MapInfo *mapInfo);
+
+    // The tilesets and config files .tbx files are turned into maps with,
+    // for the reader threads to make maps with and check the map cache
+    // against.  Only the main thread looks at the tilesets themselves.  The
+    // snapshot is only taken again once a tileset or config file changed.
+    void updateBuildingTilesets();
+    void loadBuildingTilesets(const QStringList &tilesetNames);
+    void tilesetChanged(Tiled::Tileset *tileset);
+    MapCache::SharedTilesets mBuildingTilesets;
+    bool mBuildingTilesetsDirty;
+    QMutex mBuildingTilesetsMutex;
+    QStringList mBuildingConfigFiles;
+    QSet<QString> mBuildingTilesetsUnloadable;
+
+    MapReaderQueue mMapReaderQueue;
     QVector<InterruptibleThread*> mMapReaderThread;
     QVector<MapReaderWorker*> mMapReaderWorker;
-    int mNextThreadForJob;
 #ifdef WORLDED
     int mReferenceEpoch;
 #endif
@@ -7,8 +7,12 @@
 #include "isochunk.h"
 #include "isogridsquare.h"
 
+#include "tile.h"
+#include "tileset.h"
+
 #include <QDataStream>
 #include <QFile>
+#include <QHash>
 
 using namespace Navigate;
 
@@ -45,26 +49,70 @@ void ChunkDataFile::fromMap(int cellX, int cellY, MapComposite *mapComposite, co
     int ROOM_CHUNK = 4;
 
 
-    quint8 *bitsArray = new quint8[IsoChunk::WIDTH * IsoChunk::WIDTH];
+    const int CHUNKS_PER_CELL = 30;
+    const int CELL_WIDTH = CHUNKS_PER_CELL * IsoChunk::WIDTH;
+
+    // Work out the bits for every square in the cell in a single pass.
+    QVector<quint8> cellBits(CELL_WIDTH * CELL_WIDTH, 0);
+
+    const QRect cellBounds(0, 0, CELL_WIDTH, CELL_WIDTH);
+    for (LotFile::RoomRect *rect : roomRects) {
+        QRect r = rect->bounds() & cellBounds;
+        for (int y = r.top(); y <= r.bottom(); y++) {
+            quint8 *row = cellBits.data() + y * CELL_WIDTH;
+            for (int x = r.left(); x <= r.right(); x++)
+                row[x] = BIT_ROOM;
+        }
+    }
+
+    if (CompositeLayerGroup *layerGroup = mapComposite->layerGroupForLevel(0)) {
+        QHash<const Tiled::Tileset*,const QVector<quint8>*> flagsByTileset;
+        const Tiled::Tileset *lastTileset = nullptr;
+        const QVector<quint8> *lastFlags = nullptr;
+        if (!layerGroup->isFlattened(cellBounds))
+            layerGroup->flatten(cellBounds);
+        for (int y = 0; y < CELL_WIDTH; y++) {
+            for (int x = 0; x < CELL_WIDTH; x++) {
+                const Tiled::Cell *cells;
+                int count = layerGroup->flatCellsAt(QPoint(x, y), cells);
+                bool solid = false, blockedWest = false, blockedNorth = false, water = false;
+                for (int i = 0; i < count; i++) {
+                    const Tiled::Cell *cell = &cells[i];
+                    const Tiled::Tileset *tileset = cell->tile->tileset();
+                    if (tileset != lastTileset) {
+                        auto it = flagsByTileset.constFind(tileset);
+                        if (it == flagsByTileset.constEnd())
+                            it = flagsByTileset.insert(tileset, IsoGridSquare::tileFlags(tileset->name()));
+                        lastTileset = tileset;
+                        lastFlags = it.value();
+                    }
+                    int tileID = cell->tile->id();
+                    if (lastFlags == nullptr || tileID < 0 || tileID >= lastFlags->size())
+                        continue;
+                    IsoGridSquare::applyTileFlags(lastFlags->at(tileID), solid, blockedWest,
+                                                  blockedNorth, water);
+                }
+                quint8 &bits = cellBits[x + y * CELL_WIDTH];
+                if (solid)
+                    bits |= BIT_SOLID;
+                if (blockedNorth)
+                    bits |= BIT_WALLN;
+                if (blockedWest)
+                    bits |= BIT_WALLW;
+                if (water)
+                    bits |= BIT_WATER;
+            }
+        }
+    }
+
+    quint8 bitsArray[IsoChunk::WIDTH * IsoChunk::WIDTH];
 
-    for (int yy = 0; yy < 30; yy++) {
-        for (int xx = 0; xx < 30; xx++) {
-            IsoChunk *chunk = new IsoChunk(xx, yy, mapComposite, roomRects);
+    for (int yy = 0; yy < CHUNKS_PER_CELL; yy++) {
+        for (int xx = 0; xx < CHUNKS_PER_CELL; xx++) {
             int empty = 0, solid = 0, water = 0, room = 0;
             for (int y = 0; y < IsoChunk::WIDTH; y++) {
                 for (int x = 0; x < IsoChunk::WIDTH; x++) {
-                    IsoGridSquare *sq = chunk->getGridSquare(x, y, 0);
-                    quint8 bits = 0;
-                    if (sq->isSolid())
-                        bits |= BIT_SOLID;
-                    if (sq->isBlockedNorth())
-                        bits |= BIT_WALLN;
-                    if (sq->isBlockedWest())
-                        bits |= BIT_WALLW;
-                    if (sq->isWater())
-                        bits |= BIT_WATER;
-                    if (sq->isRoom())
-                        bits |= BIT_ROOM;
+                    quint8 bits = cellBits[(xx * IsoChunk::WIDTH + x) + (yy * IsoChunk::WIDTH + y) * CELL_WIDTH];
                     bitsArray[x + y * IsoChunk::WIDTH] = bits;
                     if (bits == 0)
                         empty++;
@@ -76,7 +124,6 @@ void ChunkDataFile::fromMap(int cellX, int cellY, MapComposite *mapComposite, co
                         room++;
                 }
             }
-            delete chunk;
             if (empty == IsoChunk::WIDTH * IsoChunk::WIDTH)
                 out << quint8(EMPTY_CHUNK);
             else if (solid == IsoChunk::WIDTH * IsoChunk::WIDTH)
@@ -87,13 +134,10 @@ void ChunkDataFile::fromMap(int cellX, int cellY, MapComposite *mapComposite, co
                 out << quint8(ROOM_CHUNK);
             else {
                 out << quint8(REGULAR_CHUNK);
-                for (int i = 0; i < IsoChunk::WIDTH * IsoChunk::WIDTH; i++)
-                    out << bitsArray[i];
+                out.writeRawData(reinterpret_cast<const char*>(bitsArray), sizeof(bitsArray));
             }
         }
     }
 
-    delete[] bitsArray;
-
     file.close();
 }
@@ -13,6 +13,7 @@
 using namespace Navigate;
 
 QList<TileDefFile*> IsoGridSquare::mTileDefFiles;
+QHash<QString,QVector<quint8>> IsoGridSquare::mTileFlagsByTilesetName;
 
 IsoGridSquare::IsoGridSquare(int x, int y, int z, IsoChunk *chunk) :
     x(x),
@@ -28,60 +29,8 @@ IsoGridSquare::IsoGridSquare(int x, int y, int z, IsoChunk *chunk) :
     QVector<const Tiled::Cell *> cells;
     mChunk->orderedCellsAt(x, y, cells);
 
-    QString HoppableW(QLatin1String("HoppableW"));
-    QString HoppableN(QLatin1String("HoppableN"));
-    QString collideW(QLatin1String("collideW"));
-    QString collideN(QLatin1String("collideN"));
-    QString doorFrW(QLatin1String("doorFrW")); // FIXME: unused?
-    QString doorFrN(QLatin1String("doorFrN")); // FIXME: unused?
-    QString DoorWallW(QLatin1String("DoorWallW"));
-    QString DoorWallN(QLatin1String("DoorWallN"));
-    QString solid(QLatin1String("solid"));
-    QString solidtrans(QLatin1String("solidtrans"));
-    QString tree(QLatin1String("tree"));
-    QString WallW(QLatin1String("WallW"));
-    QString WallN(QLatin1String("WallN"));
-    QString wallNW(QLatin1String("WallNW"));
-    QString WallWTrans(QLatin1String("WallWTrans"));
-    QString WallNTrans(QLatin1String("WallNTrans"));
-    QString WallNWTrans(QLatin1String("WallNWTrans"));
-    QString water(QLatin1String("water"));
-    QString windowW(QLatin1String("windowW"));
-    QString windowN(QLatin1String("windowN"));
-    QString WindowW(QLatin1String("WindowW"));
-    QString WindowN(QLatin1String("WindowN"));
-
     foreach (const Tiled::Cell *cell, cells) {
-        TileDefTileset *tdts = NULL;
-        foreach (TileDefFile *tdefFile, mTileDefFiles) {
-            tdts = tdefFile->tileset(cell->tile->tileset()->name());
-            if (tdts != NULL)
-                break;
-        }
-        if (tdts != NULL) {
-            TileDefTile *tdt = tdts->tile(cell->tile->id() % tdts->mColumns, cell->tile->id() / tdts->mColumns);
-            if (tdt == NULL)
-                continue;
-            foreach (QString key, tdt->mProperties.keys()) {
-                if (key == WallW || key == wallNW || key == WallWTrans || key == WallNWTrans || key == doorFrW || key == DoorWallW || key == windowW || key == WindowW)
-                    mBlockedWest = true;
-                if (key == WallN || key == wallNW || key == WallNTrans || key == WallNWTrans || key == doorFrN || key == DoorWallN || key == windowN || key == WindowN)
-                    mBlockedNorth = true;
-                if (key == solid || key == solidtrans)
-                    mSolid = true;
-                // FIXME: stairs are mSolid
-            }
-            if (tdt->mProperties.contains(water)) {
-                mSolid = false;
-                mWater = true;
-            }
-            if (tdt->mProperties.contains(tree))
-                mSolid = false;
-            if (tdt->mProperties.contains(HoppableW))
-                mBlockedWest = false;
-            if (tdt->mProperties.contains(HoppableN))
-                mBlockedNorth = false;
-        }
+        applyTileFlags(tileFlags(cell->tile), mSolid, mBlockedWest, mBlockedNorth, mWater);
     }
 }
 
@@ -129,5 +78,87 @@ bool IsoGridSquare::loadTileDefFiles(const GenerateLotsSettings &settings, QStri
         qDebug() << "read " << fileName;
         mTileDefFiles += tdefFile;
     }
+    compileTileFlags();
     return true;
 }
+
+const QVector<quint8> *IsoGridSquare::tileFlags(const QString &tilesetName)
+{
+    auto it = mTileFlagsByTilesetName.constFind(tilesetName);
+    if (it == mTileFlagsByTilesetName.constEnd())
+        return nullptr;
+    return &it.value();
+}
+
+quint8 IsoGridSquare::tileFlags(const Tiled::Tile *tile)
+{
+    const QVector<quint8> *flags = tileFlags(tile->tileset()->name());
+    if (flags == nullptr || tile->id() < 0 || tile->id() >= flags->size())
+        return 0;
+    return flags->at(tile->id());
+}
+
+// Checking the properties of every tile in every square is slow, so the
+// properties are turned into flags once after reading the .tiles files.
+void IsoGridSquare::compileTileFlags()
+{
+    const QStringList wallW = QStringList()
+            << QLatin1String("WallW")
+            << QLatin1String("WallNW")
+            << QLatin1String("WallWTrans")
+            << QLatin1String("WallNWTrans")
+            << QLatin1String("doorFrW") // FIXME: unused?
+            << QLatin1String("DoorWallW")
+            << QLatin1String("windowW")
+            << QLatin1String("WindowW");
+    const QStringList wallN = QStringList()
+            << QLatin1String("WallN")
+            << QLatin1String("WallNW")
+            << QLatin1String("WallNTrans")
+            << QLatin1String("WallNWTrans")
+            << QLatin1String("doorFrN") // FIXME: unused?
+            << QLatin1String("DoorWallN")
+            << QLatin1String("windowN")
+            << QLatin1String("WindowN");
+    const QString solid(QLatin1String("solid"));
+    const QString solidtrans(QLatin1String("solidtrans"));
+    const QString water(QLatin1String("water"));
+    const QString tree(QLatin1String("tree"));
+    const QString HoppableW(QLatin1String("HoppableW"));
+    const QString HoppableN(QLatin1String("HoppableN"));
+
+    mTileFlagsByTilesetName.clear();
+    foreach (TileDefFile *tdefFile, mTileDefFiles) {
+        foreach (TileDefTileset *tdts, tdefFile->tilesets()) {
+            // The first .tiles file with a tileset wins.
+            if (mTileFlagsByTilesetName.contains(tdts->mName))
+                continue;
+            QVector<quint8> flags(tdts->mTiles.size(), 0);
+            for (int i = 0; i < tdts->mTiles.size(); i++) {
+                const TileDefTile *tdt = tdts->mTiles[i];
+                if (tdt == nullptr)
+                    continue;
+                quint8 f = 0;
+                for (auto it = tdt->mProperties.constBegin(); it != tdt->mProperties.constEnd(); ++it) {
+                    const QString &key = it.key();
+                    if (wallW.contains(key))
+                        f |= TileWallW;
+                    if (wallN.contains(key))
+                        f |= TileWallN;
+                    if (key == solid || key == solidtrans)
+                        f |= TileSolid;
+                    if (key == water)
+                        f |= TileWater;
+                    if (key == tree)
+                        f |= TileTree;
+                    if (key == HoppableW)
+                        f |= TileHoppableW;
+                    if (key == HoppableN)
+                        f |= TileHoppableN;
+                }
+                flags[i] = f;
+            }
+            mTileFlagsByTilesetName.insert(tdts->mName, flags);
+        }
+    }
+}
@@ -3,12 +3,30 @@
 
 #include "tiledeffile.h"
 
+#include <QHash>
 #include <QStringList>
+#include <QVector>
 
 class GenerateLotsSettings;
 
+namespace Tiled {
+class Tile;
+}
+
 namespace Navigate {
 
+// The tiledef properties that affect navigation, one byte per tile.
+enum TileFlag
+{
+    TileSolid       = 1 << 0, // solid, solidtrans
+    TileWallW       = 1 << 1, // WallW, WallNW, doorFrW, windowW etc
+    TileWallN       = 1 << 2, // WallN, WallNW, doorFrN, windowN etc
+    TileWater       = 1 << 3, // water, not solid
+    TileTree        = 1 << 4, // tree, not solid
+    TileHoppableW   = 1 << 5, // not blocked to the west
+    TileHoppableN   = 1 << 6  // not blocked to the north
+};
+
 class IsoChunk;
 
 class IsoGridSquare
@@ -40,6 +58,41 @@ public:
 
     static QList<TileDefFile*> mTileDefFiles;
     static bool loadTileDefFiles(const GenerateLotsSettings &settings, QString &error);
+
+    // TileFlag values indexed by tile ID, or nullptr if no .tiles file has
+    // the tileset.  Read-only after loadTileDefFiles(), so it is safe to call
+    // from worker threads.
+    static const QVector<quint8> *tileFlags(const QString &tilesetName);
+    static quint8 tileFlags(const Tiled::Tile *tile);
+
+    // Applies one tile's flags to the state of a square.  The tiles in a
+    // square must be applied bottom to top.
+    static void applyTileFlags(quint8 flags, bool &solid, bool &blockedWest,
+                               bool &blockedNorth, bool &water)
+    {
+        if (flags & TileWallW)
+            blockedWest = true;
+        if (flags & TileWallN)
+            blockedNorth = true;
+        if (flags & TileSolid)
+            solid = true;
+        // FIXME: stairs are mSolid
+        if (flags & TileWater) {
+            solid = false;
+            water = true;
+        }
+        if (flags & TileTree)
+            solid = false;
+        if (flags & TileHoppableW)
+            blockedWest = false;
+        if (flags & TileHoppableN)
+            blockedNorth = false;
+    }
+
+private:
+    static void compileTileFlags();
+
+    static QHash<QString,QVector<quint8>> mTileFlagsByTilesetName;
 };
 
 } // namespace Navigate
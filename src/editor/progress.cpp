@@ -17,6 +17,7 @@
 
 #include "progress.h"
 
+#include "batchmode.h"
 #include "mainwindow.h"
 
 #include <QApplication>
@@ -61,31 +62,43 @@ void Progress::setMainWindow(QWidget *mainWindow)
 
 bool Progress::isVisible()
 {
-    return mDialog->isVisible();
+    return mDialog && mDialog->isVisible();
 }
 
 void Progress::hide()
 {
-    mDialog->hide();
+    if (mDialog)
+        mDialog->hide();
 }
 
 void Progress::show()
 {
-    mDialog->show();
+    if (mDialog)
+        mDialog->show();
 }
 
+// Without a main window (batch mode) there is no dialog, the text is
+// written to the console instead.
 void Progress::begin(const QString &text)
 {
-    mLabel->setText(text);
-    if (mDepth++ == 0)
-        mDialog->show();
+    if (mDialog) {
+        mLabel->setText(text);
+        if (mDepth == 0)
+            mDialog->show();
+    } else {
+        BatchMode::print(text);
+    }
+    ++mDepth;
     qApp->processEvents(QEventLoop::ExcludeUserInputEvents);
 }
 
 void Progress::update(const QString &text)
 {
     Q_ASSERT(mDepth > 0);
-    mLabel->setText(text);
+    if (mDialog)
+        mLabel->setText(text);
+    else
+        BatchMode::print(text);
     qApp->processEvents(QEventLoop::ExcludeUserInputEvents);
 }
 
@@ -93,7 +106,7 @@ void Progress::end()
 {
     Q_ASSERT(mDepth > 0);
 //    mDialog->setValue(mDialog->maximum()); // hides dialog!
-    if (--mDepth == 0)
+    if (--mDepth == 0 && mDialog)
         mDialog->hide();
     qApp->processEvents(QEventLoop::ExcludeUserInputEvents);
 }
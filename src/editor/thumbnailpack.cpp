@@ -0,0 +1,432 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "thumbnailpack.h"
+
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFileInfo>
+#include <QRandomGenerator>
+#include <QSaveFile>
+#include <QSet>
+
+#define PACK_MAGIC 0x544E5041 // "TNPA"
+#define INDEX_MAGIC 0x544E4958 // "TNIX"
+#define PACK_VERSION 1
+
+// Magic, version and the pack's id.  The id changes whenever the pack is
+// rewritten, so an index written for an older pack is ignored.
+#define PACK_HEADER_SIZE 16
+
+static qint64 entrySize(const ThumbnailPack::Entry &entry)
+{
+    return qint64(entry.bytesPerLine) * entry.imageSize.height();
+}
+
+ThumbnailPack::ThumbnailPack() :
+    mWritable(false),
+    mData(nullptr),
+    mDataSize(0),
+    mPackId(0),
+    mDirty(false)
+{
+}
+
+ThumbnailPack::~ThumbnailPack()
+{
+    close();
+}
+
+bool ThumbnailPack::open(const QString &directory, const QString &name)
+{
+    close();
+
+    if (!QDir().mkpath(directory)) {
+        mError = QStringLiteral("Couldn't create the directory %1").arg(directory);
+        return false;
+    }
+
+    const QString path = directory + QLatin1Char('/') + name;
+    mPackPath = path + QLatin1String(".pack");
+    mIndexPath = path + QLatin1String(".idx");
+
+    // Another instance of the application may be using the pack already.
+    mLock.reset(new QLockFile(path + QLatin1String(".lock")));
+    mWritable = mLock->tryLock(0);
+
+    mFile.setFileName(mPackPath);
+    if (!mWritable && !mFile.exists()) {
+        mError = QStringLiteral("%1 is locked").arg(mPackPath);
+        close();
+        return false;
+    }
+    if (!mFile.open(mWritable ? QIODevice::ReadWrite : QIODevice::ReadOnly)) {
+        mError = mFile.errorString();
+        close();
+        return false;
+    }
+
+    bool ok = false;
+    if (mFile.size() >= PACK_HEADER_SIZE) {
+        QDataStream in(&mFile);
+        quint32 magic, version;
+        in >> magic >> version >> mPackId;
+        ok = (in.status() == QDataStream::Ok) && (magic == PACK_MAGIC)
+                && (version == PACK_VERSION);
+    }
+    if (!ok && (!mWritable || !resetPack())) {
+        mError = QStringLiteral("%1 isn't a thumbnail pack").arg(mPackPath);
+        close();
+        return false;
+    }
+
+    mDataSize = mFile.size();
+    mData = mFile.map(0, mDataSize);
+    if (mData == nullptr) {
+        mError = mFile.errorString();
+        close();
+        return false;
+    }
+
+    if (ok && !readIndex()) {
+        // The thumbnails already in the pack are unknown, close() throws
+        // them away.
+        mEntries.clear();
+        mSources.clear();
+    }
+
+    return true;
+}
+
+void ThumbnailPack::close()
+{
+    if (mWritable && mFile.isOpen()) {
+        // Thumbnails of maps that are gone aren't kept.
+        for (auto it = mEntries.begin(); it != mEntries.end(); ) {
+            if (QFileInfo::exists(it.key())) {
+                ++it;
+            } else {
+                it = mEntries.erase(it);
+                mDirty = true;
+            }
+        }
+        compact();
+        writeIndex();
+    }
+
+    if (mData) {
+        mFile.unmap(const_cast<uchar*>(mData));
+        mData = nullptr;
+    }
+    mDataSize = 0;
+    mFile.close();
+    mEntries.clear();
+    mSources.clear();
+    mCurrentHashes.clear();
+    mDirty = false;
+    mWritable = false;
+    mLock.reset();
+}
+
+bool ThumbnailPack::find(const QString &mapFilePath, Entry &entry)
+{
+    auto it = mEntries.constFind(QFileInfo(mapFilePath).canonicalFilePath());
+    if (it == mEntries.cend())
+        return false;
+
+    // Thumbnails stored since the pack was opened aren't in the mapping,
+    // their entries hold them instead.
+    if (it->image.isNull() && it->offset + entrySize(*it) > mDataSize)
+        return false;
+
+    if (sourcesHash(it->sources) != it->hash)
+        return false;
+
+    entry = *it;
+    return true;
+}
+
+QImage ThumbnailPack::image(const Entry &entry) const
+{
+    if (!entry.image.isNull())
+        return entry.image;
+
+    if (mData == nullptr || entry.offset + entrySize(entry) > mDataSize)
+        return QImage();
+
+    QImage image(entry.imageSize, entry.format);
+    if (image.isNull())
+        return image;
+
+    const int rowBytes = qMin(int(image.bytesPerLine()), int(entry.bytesPerLine));
+    const uchar *row = mData + entry.offset;
+    for (int y = 0; y < image.height(); y++, row += entry.bytesPerLine)
+        memcpy(image.scanLine(y), row, rowBytes);
+    return image;
+}
+
+void ThumbnailPack::insert(const QString &mapFilePath, const Entry &entry, const QImage &image)
+{
+    if (!mWritable || !mFile.isOpen() || image.isNull())
+        return;
+
+    Entry stored = entry;
+    stored.hash = sourcesHash(entry.sources);
+    stored.offset = mFile.size();
+    stored.imageSize = image.size();
+    stored.bytesPerLine = image.bytesPerLine();
+    stored.format = image.format();
+    stored.image = image;
+
+    const qint64 size = entrySize(stored);
+    if (!mFile.seek(stored.offset)
+            || mFile.write(reinterpret_cast<const char*>(image.constBits()), size) != size) {
+        mError = mFile.errorString();
+        return;
+    }
+
+    mEntries.insert(QFileInfo(mapFilePath).canonicalFilePath(), stored);
+    mDirty = true;
+}
+
+void ThumbnailPack::sourceChanged(const QString &filePath)
+{
+    mCurrentHashes.remove(filePath);
+}
+
+bool ThumbnailPack::writeIndex()
+{
+    if (!mWritable || !mDirty || !mFile.isOpen())
+        return true;
+
+    if (!mFile.flush()) {
+        mError = mFile.errorString();
+        return false;
+    }
+
+    QSaveFile file(mIndexPath);
+    if (!file.open(QIODevice::WriteOnly)) {
+        mError = file.errorString();
+        return false;
+    }
+
+    QDataStream out(&file);
+    out << quint32(INDEX_MAGIC);
+    out << quint32(PACK_VERSION);
+    out.setVersion(QDataStream::Qt_5_0);
+
+    out << mPackId << mFile.size();
+
+    // Only the sources of stored thumbnails are kept.
+    QSet<QString> used;
+    for (const Entry &entry : std::as_const(mEntries)) {
+        for (const QString &source : entry.sources)
+            used.insert(source);
+    }
+    QStringList sources;
+    for (auto it = mSources.cbegin(); it != mSources.cend(); ++it) {
+        if (used.contains(it.key()))
+            sources += it.key();
+    }
+    out << qint32(sources.size());
+    for (const QString &path : std::as_const(sources)) {
+        const Source &source = mSources[path];
+        out << path << source.size << source.lastModified << source.hash;
+    }
+
+    out << qint32(mEntries.size());
+    for (auto it = mEntries.cbegin(); it != mEntries.cend(); ++it) {
+        const Entry &entry = it.value();
+        out << it.key() << entry.scale << entry.levelZeroBounds << entry.sources
+            << entry.missingTilesets << entry.mapSize << entry.tileSize
+            << entry.hash << entry.offset << entry.imageSize << entry.bytesPerLine
+            << qint32(entry.format);
+    }
+
+    if (out.status() != QDataStream::Ok) {
+        file.cancelWriting();
+        mError = QStringLiteral("Error writing %1").arg(mIndexPath);
+        return false;
+    }
+    if (!file.commit()) {
+        mError = file.errorString();
+        return false;
+    }
+
+    mDirty = false;
+    return true;
+}
+
+QByteArray ThumbnailPack::sourcesHash(const QStringList &sources)
+{
+    QCryptographicHash hash(QCryptographicHash::Sha1);
+    for (const QString &source : sources) {
+        hash.addData(source.toUtf8());
+        hash.addData(sourceHash(source));
+    }
+    return hash.result();
+}
+
+QByteArray ThumbnailPack::sourceHash(const QString &filePath)
+{
+    auto current = mCurrentHashes.constFind(filePath);
+    if (current != mCurrentHashes.cend())
+        return current.value();
+
+    // A missing file hashes to nothing.
+    QByteArray result;
+    QFileInfo info(filePath);
+    if (info.exists()) {
+        const qint64 size = info.size();
+        const qint64 lastModified = info.lastModified().toMSecsSinceEpoch();
+        auto it = mSources.constFind(filePath);
+        if (it != mSources.cend() && it->size == size && it->lastModified == lastModified) {
+            result = it->hash;
+        } else {
+            QFile file(filePath);
+            if (file.open(QIODevice::ReadOnly)) {
+                QCryptographicHash hash(QCryptographicHash::Sha1);
+                hash.addData(&file);
+                result = hash.result();
+                mSources.insert(filePath, { size, lastModified, result });
+                mDirty = true;
+            }
+        }
+    }
+
+    mCurrentHashes.insert(filePath, result);
+    return result;
+}
+
+bool ThumbnailPack::readIndex()
+{
+    QFile file(mIndexPath);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    QDataStream in(&file);
+
+    quint32 magic, version;
+    in >> magic >> version;
+    if (magic != INDEX_MAGIC || version != PACK_VERSION)
+        return false;
+    in.setVersion(QDataStream::Qt_5_0);
+
+    quint64 packId;
+    qint64 packSize;
+    in >> packId >> packSize;
+    if (packId != mPackId || packSize > mDataSize)
+        return false;
+
+    qint32 count;
+    in >> count;
+    for (int i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+        QString path;
+        Source source;
+        in >> path >> source.size >> source.lastModified >> source.hash;
+        mSources.insert(path, source);
+    }
+
+    in >> count;
+    for (int i = 0; i < count && in.status() == QDataStream::Ok; i++) {
+        QString mapFilePath;
+        Entry entry;
+        qint32 format;
+        in >> mapFilePath >> entry.scale >> entry.levelZeroBounds >> entry.sources
+           >> entry.missingTilesets >> entry.mapSize >> entry.tileSize
+           >> entry.hash >> entry.offset >> entry.imageSize >> entry.bytesPerLine
+           >> format;
+        entry.format = QImage::Format(format);
+        if (entry.offset < PACK_HEADER_SIZE || entry.bytesPerLine <= 0
+                || entry.imageSize.isEmpty() || entry.offset + entrySize(entry) > packSize)
+            continue;
+        mEntries.insert(mapFilePath, entry);
+    }
+
+    return in.status() == QDataStream::Ok;
+}
+
+bool ThumbnailPack::resetPack()
+{
+    mEntries.clear();
+    mSources.clear();
+    mPackId = QRandomGenerator::global()->generate64();
+    if (!mFile.resize(0) || !mFile.seek(0))
+        return false;
+
+    QDataStream out(&mFile);
+    out << quint32(PACK_MAGIC) << quint32(PACK_VERSION) << mPackId;
+    mDirty = true;
+    return out.status() == QDataStream::Ok && mFile.flush();
+}
+
+void ThumbnailPack::compact()
+{
+    qint64 live = 0;
+    for (const Entry &entry : std::as_const(mEntries))
+        live += entrySize(entry);
+    const qint64 dead = mFile.size() - PACK_HEADER_SIZE - live;
+    if (dead <= live)
+        return;
+
+    const quint64 packId = QRandomGenerator::global()->generate64();
+    QSaveFile file(mPackPath);
+    if (!file.open(QIODevice::WriteOnly))
+        return;
+
+    QDataStream out(&file);
+    out << quint32(PACK_MAGIC) << quint32(PACK_VERSION) << packId;
+
+    // Thumbnails stored since the pack was opened aren't in the mapping, so
+    // they are all read from the file.
+    QHash<QString,qint64> offsets;
+    for (auto it = mEntries.cbegin(); it != mEntries.cend(); ++it) {
+        const qint64 size = entrySize(it.value());
+        QByteArray bytes;
+        if (mFile.seek(it->offset))
+            bytes = mFile.read(size);
+        if (bytes.size() != size) {
+            file.cancelWriting();
+            return;
+        }
+        offsets.insert(it.key(), file.pos());
+        out.writeRawData(bytes.constData(), bytes.size());
+    }
+    if (out.status() != QDataStream::Ok) {
+        file.cancelWriting();
+        return;
+    }
+
+    // An open file can't be replaced on Windows.
+    if (mData) {
+        mFile.unmap(const_cast<uchar*>(mData));
+        mData = nullptr;
+        mDataSize = 0;
+    }
+    mFile.close();
+    const bool committed = file.commit();
+    mFile.open(QIODevice::ReadWrite);
+    if (!committed)
+        return;
+
+    for (auto it = offsets.cbegin(); it != offsets.cend(); ++it)
+        mEntries[it.key()].offset = it.value();
+    mPackId = packId;
+    mDirty = true;
+}
@@ -0,0 +1,142 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef THUMBNAILPACK_H
+#define THUMBNAILPACK_H
+
+#include <QFile>
+#include <QHash>
+#include <QImage>
+#include <QLockFile>
+#include <QRectF>
+#include <QScopedPointer>
+#include <QStringList>
+
+/**
+ * Every map thumbnail in one memory-mapped .pack file, with an .idx file
+ * describing them, instead of a .png and a .dat file for each map.
+ *
+ * Thumbnails are keyed by the canonical path of their map and record a hash
+ * of the contents of the map and the sub-maps drawn in it.  The size,
+ * modification time and hash of each of those source files is kept once, so
+ * a source is only read again after its size or modification time changes,
+ * and a thumbnail is only out of date once a source's contents changed.
+ *
+ * The pixels are stored as they are in memory and copied straight out of the
+ * mapping.  New thumbnails are appended, and kept in memory until the pack is
+ * opened again, since the mapping doesn't cover them.  The space of replaced
+ * ones is reclaimed by close() once it is more than the rest.  Only the
+ * process holding the pack's lock file writes to it, others just read it.
+ *
+ * image() may be called from any thread, the rest only from the thread the
+ * pack was opened on.
+ */
+class ThumbnailPack
+{
+public:
+    struct Entry
+    {
+        Entry() :
+            scale(0),
+            missingTilesets(false),
+            offset(0),
+            bytesPerLine(0),
+            format(QImage::Format_Invalid)
+        {
+        }
+
+        qreal scale;
+        QRectF levelZeroBounds;
+        QStringList sources;
+        bool missingTilesets;
+        QSize mapSize;
+        QSize tileSize;
+
+        // Set by insert().
+        QByteArray hash;
+        QImage image; // stored since the pack was opened
+        qint64 offset;
+        QSize imageSize;
+        qint32 bytesPerLine;
+        QImage::Format format;
+    };
+
+    ThumbnailPack();
+    ~ThumbnailPack();
+
+    bool open(const QString &directory, const QString &name);
+    void close();
+
+    /**
+     * Finds the thumbnail stored for \a mapFilePath.  Returns false if there
+     * is none, or the contents of one of its sources changed since.
+     */
+    bool find(const QString &mapFilePath, Entry &entry);
+
+    QImage image(const Entry &entry) const;
+
+    /**
+     * Stores \a image as the thumbnail of \a mapFilePath, replacing any
+     * older one.  The hashes of the entry's sources are taken now.
+     */
+    void insert(const QString &mapFilePath, const Entry &entry, const QImage &image);
+
+    /**
+     * Forgets the hash of a source file taken in this session, after the
+     * file was changed.
+     */
+    void sourceChanged(const QString &filePath);
+
+    /**
+     * Writes the index if any thumbnails were stored since it was last
+     * written.
+     */
+    bool writeIndex();
+
+    QString errorString() const
+    { return mError; }
+
+private:
+    struct Source
+    {
+        qint64 size;
+        qint64 lastModified;
+        QByteArray hash;
+    };
+
+    QByteArray sourcesHash(const QStringList &sources);
+    QByteArray sourceHash(const QString &filePath);
+    bool readIndex();
+    bool resetPack();
+    void compact();
+
+    QString mPackPath;
+    QString mIndexPath;
+    QScopedPointer<QLockFile> mLock;
+    bool mWritable;
+    QFile mFile;
+    const uchar *mData;
+    qint64 mDataSize;
+    quint64 mPackId;
+    QHash<QString,Entry> mEntries;
+    QHash<QString,Source> mSources;
+    QHash<QString,QByteArray> mCurrentHashes; // sources checked this session
+    bool mDirty;
+    QString mError;
+};
+
+#endif // THUMBNAILPACK_H
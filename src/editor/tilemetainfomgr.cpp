@@ -737,6 +737,21 @@ bool TileMetaInfoMgr::isEnumNorth(const QString &enumName) const
     return enumName.endsWith(QLatin1Char('N'));
 }
 
+QHash<QString,QHash<QString,int>> TileMetaInfoMgr::tileEnumValues() const
+{
+    QHash<QString,QHash<QString,int>> result;
+    for (auto it = mTilesetInfo.constBegin(); it != mTilesetInfo.constEnd(); ++it) {
+        QHash<QString,int> &values = result[it.key()];
+        const QMap<QString,TileMetaInfo> &info = it.value()->mInfo;
+        for (auto it2 = info.constBegin(); it2 != info.constEnd(); ++it2) {
+            const QString &enumName = it2.value().mMetaGameEnum;
+            if (!enumName.isEmpty())
+                values.insert(it2.key(), mEnums.value(enumName));
+        }
+    }
+    return result;
+}
+
 bool TileMetaInfoMgr::parse2Ints(const QString &s, int *pa, int *pb)
 {
     QStringList coords = s.split(QLatin1Char(','), Qt::SkipEmptyParts);
@@ -20,6 +20,7 @@
 #ifndef TILEMETAINFOMGR_H
 #define TILEMETAINFOMGR_H
 
+#include <QHash>
 #include <QMap>
 #include <QObject>
 #include <QStringList>
@@ -122,6 +123,12 @@ public:
     bool isEnumWest(const QString &enumName) const;
     bool isEnumNorth(const QString &enumName) const;
 
+    /**
+     * Returns the enum value of every tile that has one, by tileset name and
+     * TilesetMetaInfo::key(), for threads that can't use this class.
+     */
+    QHash<QString,QHash<QString,int>> tileEnumValues() const;
+
 signals:
     void tilesetAdded(Tiled::Tileset *ts);
     void tilesetAboutToBeRemoved(Tiled::Tileset *ts);
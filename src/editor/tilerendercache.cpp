@@ -0,0 +1,208 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tilerendercache.h"
+
+#include "mapcomposite.h"
+
+#include <qmath.h>
+#include <QPainter>
+#include <QRunnable>
+#include <QSemaphore>
+#include <QThreadPool>
+
+using namespace Tiled;
+
+// Size of a cached tile in device pixels.
+#define TILE_SIZE 256
+
+// Cost of a tile in the cache, in KB.
+#define TILE_COST (TILE_SIZE * TILE_SIZE * 4 / 1024)
+
+// 128 MB of tiles, a few screens' worth.
+#define MAX_COST (128 * 1024)
+
+namespace {
+
+void renderJob(const ZLevelRenderer *renderer, TileRenderJob &job)
+{
+    if (job.image == nullptr)
+        return;
+    QPainter painter(job.image);
+    painter.setRenderHints(job.renderHints);
+    painter.setTransform(job.transform);
+    painter.setOpacity(job.opacity);
+    renderer->drawCells(&painter, job.draws);
+}
+
+class TileRenderRunnable : public QRunnable
+{
+public:
+    TileRenderRunnable(const ZLevelRenderer *renderer, TileRenderJob &job, QSemaphore *done) :
+        mRenderer(renderer),
+        mJob(job),
+        mDone(done)
+    {
+    }
+
+    void run() override
+    {
+        renderJob(mRenderer, mJob);
+        mDone->release();
+    }
+
+private:
+    const ZLevelRenderer *mRenderer;
+    TileRenderJob &mJob;
+    QSemaphore *mDone;
+};
+
+quint64 tileKey(int x, int y)
+{
+    return (quint64(quint32(x)) << 32) | quint32(y);
+}
+
+} // namespace
+
+TileRenderCache::TileRenderCache() :
+    mTiles(MAX_COST),
+    mScale(0),
+    mOpacity(1)
+{
+}
+
+bool TileRenderCache::paint(QPainter *painter, const ZLevelRenderer *renderer,
+                            CompositeLayerGroup *layerGroup, const QRectF &exposed)
+{
+    const QTransform transform = painter->transform();
+    if (transform.type() > QTransform::TxScale || transform.m11() != transform.m22()
+            || transform.m11() <= 0)
+        return false;
+
+    // Tiles are only reused at the same scale and opacity.  The opacity is
+    // applied to each cell, as when drawing directly, since overlapping
+    // cells would blend differently if it was applied to the whole tile.
+    if (transform.m11() != mScale || painter->opacity() != mOpacity) {
+        clear();
+        mScale = transform.m11();
+        mOpacity = painter->opacity();
+    }
+
+    QRectF rect = exposed.isNull() ? layerGroup->boundingRect(renderer) : exposed;
+    const int x1 = qFloor(rect.left() * mScale / TILE_SIZE);
+    const int y1 = qFloor(rect.top() * mScale / TILE_SIZE);
+    const int x2 = qFloor(rect.right() * mScale / TILE_SIZE);
+    const int y2 = qFloor(rect.bottom() * mScale / TILE_SIZE);
+
+    // Draw directly when zoomed so far out that the tiles wouldn't fit.
+    if (qint64(x2 - x1 + 1) * (y2 - y1 + 1) * TILE_COST > MAX_COST)
+        return false;
+
+    // The tiles drawn are kept here too, since caching the new tiles may
+    // evict old ones that are still needed.
+    const int columns = x2 - x1 + 1;
+    QVector<QImage> images(columns * (y2 - y1 + 1));
+
+    QVector<TileRenderJob> jobs;
+    QVector<quint64> keys;
+    QVector<int> indices;
+    for (int y = y1; y <= y2; y++) {
+        for (int x = x1; x <= x2; x++) {
+            const quint64 key = tileKey(x, y);
+            const int index = (x - x1) + (y - y1) * columns;
+            if (const QImage *image = mTiles.object(key)) {
+                images[index] = *image;
+                continue;
+            }
+            TileRenderJob job;
+            renderer->collectTileLayerGroup(layerGroup, tileSceneRect(x, y), job.draws);
+            // Empty tiles are cached as null images.
+            job.image = job.draws.isEmpty() ? nullptr
+                                            : new QImage(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32_Premultiplied);
+            if (job.image)
+                job.image->fill(Qt::transparent);
+            job.transform = QTransform(mScale, 0, 0, mScale, -x * TILE_SIZE, -y * TILE_SIZE);
+            job.renderHints = painter->renderHints();
+            job.opacity = mOpacity;
+            jobs += job;
+            keys += key;
+            indices += index;
+        }
+    }
+
+    render(renderer, jobs);
+
+    for (int i = 0; i < jobs.size(); i++) {
+        QImage *image = jobs[i].image ? jobs[i].image : new QImage;
+        images[indices[i]] = *image;
+        mTiles.insert(keys[i], image, image->isNull() ? 1 : TILE_COST);
+    }
+
+    // The tiles are in device pixels, so only the painter's translation
+    // is kept, rounded so the tiles aren't resampled.
+    painter->save();
+    painter->setTransform(QTransform::fromTranslate(qRound(transform.dx()), qRound(transform.dy())));
+    painter->setOpacity(1);
+    for (int y = y1; y <= y2; y++) {
+        for (int x = x1; x <= x2; x++) {
+            const QImage &image = images[(x - x1) + (y - y1) * columns];
+            if (!image.isNull())
+                painter->drawImage(QPointF(x * TILE_SIZE, y * TILE_SIZE), image);
+        }
+    }
+    painter->restore();
+
+    return true;
+}
+
+void TileRenderCache::invalidate(const QList<QRectF> &sceneRects)
+{
+    if (mTiles.isEmpty())
+        return;
+    const QList<quint64> keys = mTiles.keys();
+    for (quint64 key : keys) {
+        const QRectF tileRect = tileSceneRect(int(key >> 32), int(key & 0xFFFFFFFF));
+        for (const QRectF &sceneRect : sceneRects) {
+            if (sceneRect.intersects(tileRect)) {
+                mTiles.remove(key);
+                break;
+            }
+        }
+    }
+}
+
+void TileRenderCache::clear()
+{
+    mTiles.clear();
+}
+
+void TileRenderCache::render(const ZLevelRenderer *renderer, QVector<TileRenderJob> &jobs)
+{
+    if (jobs.isEmpty())
+        return;
+    QSemaphore done;
+    for (int i = 1; i < jobs.size(); i++)
+        QThreadPool::globalInstance()->start(new TileRenderRunnable(renderer, jobs[i], &done));
+    renderJob(renderer, jobs[0]);
+    done.acquire(jobs.size() - 1);
+}
+
+QRectF TileRenderCache::tileSceneRect(int x, int y) const
+{
+    return QRectF(x * TILE_SIZE / mScale, y * TILE_SIZE / mScale,
+                  TILE_SIZE / mScale, TILE_SIZE / mScale);
+}
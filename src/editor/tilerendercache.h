@@ -0,0 +1,89 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILERENDERCACHE_H
+#define TILERENDERCACHE_H
+
+#include "zlevelrenderer.h"
+
+#include <QCache>
+#include <QImage>
+#include <QList>
+#include <QPainter>
+#include <QRectF>
+#include <QTransform>
+
+class CompositeLayerGroup;
+
+/**
+ * An image drawn from a list of cells by TileRenderCache::render().
+ */
+struct TileRenderJob
+{
+    TileRenderJob() :
+        image(nullptr),
+        opacity(1)
+    {
+    }
+
+    QImage *image;
+    QTransform transform; // scene to image pixels
+    QPainter::RenderHints renderHints;
+    qreal opacity;
+    QVector<Tiled::ZLevelRenderer::CellDraw> draws;
+};
+
+/**
+ * Keeps what a layer group draws as square tiles of device pixels, so a view
+ * can be scrolled without drawing every cell again.  Tiles that aren't
+ * cached are collected on the calling thread, which owns the layer group,
+ * and painted on the global thread pool at the same time.
+ *
+ * The cache only knows the view's scale and the painter's opacity, which is
+ * applied to each cell as it is drawn into a tile.  Tiles showing changed
+ * parts of the scene must be thrown away with invalidate() or clear().
+ */
+class TileRenderCache
+{
+public:
+    TileRenderCache();
+
+    /**
+     * Draws the \a exposed part of \a layerGroup.  Returns false without
+     * drawing anything when the painter is rotated or sheared.
+     */
+    bool paint(QPainter *painter, const Tiled::ZLevelRenderer *renderer,
+               CompositeLayerGroup *layerGroup, const QRectF &exposed);
+
+    void invalidate(const QList<QRectF> &sceneRects);
+    void clear();
+
+    /**
+     * Draws each job's cells into its image, the jobs at the same time.
+     * Returns once every job is done.  The tiles must not change until then.
+     */
+    static void render(const Tiled::ZLevelRenderer *renderer, QVector<TileRenderJob> &jobs);
+
+private:
+    QRectF tileSceneRect(int x, int y) const;
+
+    QCache<quint64,QImage> mTiles;
+    qreal mScale;
+    qreal mOpacity;
+};
+
+#endif // TILERENDERCACHE_H
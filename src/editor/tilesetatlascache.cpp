@@ -0,0 +1,219 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "tilesetatlascache.h"
+
+#include "tileset.h"
+
+#include <QBuffer>
+#include <QCryptographicHash>
+#include <QDataStream>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QSaveFile>
+
+using namespace Tiled;
+
+#define ATLAS_CACHE_MAGIC 0x41544C53 // "ATLS"
+#define ATLAS_CACHE_VERSION 1
+
+// Larger than the biggest atlas tryCreateAtlas() makes.
+#define ATLAS_CACHE_MAX_SIZE 8192
+
+static bool isAtlasFormat(QImage::Format format)
+{
+    return format == QImage::Format_RGB32
+            || format == QImage::Format_ARGB32
+            || format == QImage::Format_ARGB32_Premultiplied;
+}
+
+TilesetAtlasCache::TilesetAtlasCache(const QString &directory) :
+    mDirectory(directory)
+{
+    QDir().mkpath(mDirectory);
+}
+
+bool TilesetAtlasCache::read(Tileset *tileset, const QFileInfo &imageFileInfo,
+                             const QString &imageSource) const
+{
+    QFile file(cacheFilePath(imageFileInfo));
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+
+    const qint64 size = file.size();
+    uchar *data = (size > 0) ? file.map(0, size) : nullptr;
+    if (data == nullptr)
+        return false;
+
+    QByteArray bytes = QByteArray::fromRawData(reinterpret_cast<const char*>(data), size);
+    QBuffer buffer(&bytes);
+    buffer.open(QIODevice::ReadOnly);
+    QDataStream in(&buffer);
+
+    quint32 magic, version;
+    in >> magic >> version;
+    if (in.status() != QDataStream::Ok || magic != ATLAS_CACHE_MAGIC
+            || version != ATLAS_CACHE_VERSION)
+        return false;
+    in.setVersion(QDataStream::Qt_5_0);
+
+    QString filePath;
+    qint64 fileSize, lastModified;
+    in >> filePath >> fileSize >> lastModified;
+    if (filePath != imageFileInfo.absoluteFilePath()
+            || fileSize != imageFileInfo.size()
+            || lastModified != imageFileInfo.lastModified().toMSecsSinceEpoch())
+        return false;
+
+    qint32 imageWidth, imageHeight, atlasWidth, atlasHeight, format, tileCount;
+    in >> imageWidth >> imageHeight >> atlasWidth >> atlasHeight >> format >> tileCount;
+    if (in.status() != QDataStream::Ok)
+        return false;
+    if (atlasWidth < 0 || atlasWidth > ATLAS_CACHE_MAX_SIZE
+            || atlasHeight < 0 || atlasHeight > ATLAS_CACHE_MAX_SIZE
+            || tileCount < 0 || tileCount > 0xFFFF)
+        return false;
+    const QRect atlasRect(0, 0, atlasWidth, atlasHeight);
+
+    QVector<Tileset::AtlasTile> tiles(tileCount);
+    for (Tileset::AtlasTile &tile : tiles) {
+        qint32 x, y, w, h, offsetX, offsetY, width, height;
+        in >> x >> y >> w >> h >> offsetX >> offsetY >> width >> height;
+        tile.rect = QRect(x, y, w, h);
+        tile.offset = QPoint(offsetX, offsetY);
+        tile.size = QSize(width, height);
+        if (!tile.rect.isEmpty() && !atlasRect.contains(tile.rect))
+            return false;
+    }
+    if (in.status() != QDataStream::Ok)
+        return false;
+
+    // The pixels follow the header, one row after another.
+    QImage atlas;
+    if (!atlasRect.isEmpty()) {
+        if (!isAtlasFormat(QImage::Format(format)))
+            return false;
+        const int bytesPerLine = atlasWidth * 4;
+        if (buffer.bytesAvailable() < qint64(bytesPerLine) * atlasHeight)
+            return false;
+        const uchar *pixels = data + buffer.pos();
+        atlas = QImage(pixels, atlasWidth, atlasHeight, bytesPerLine,
+                       QImage::Format(format)).copy();
+    }
+
+    buffer.close();
+    file.unmap(data);
+
+    return tileset->loadFromAtlas(atlas, QSize(imageWidth, imageHeight), tiles, imageSource);
+}
+
+bool TilesetAtlasCache::write(const Tileset *tileset, const QFileInfo &imageFileInfo) const
+{
+    if (!tileset->isLoaded())
+        return false;
+
+    const QImage atlas = tileset->image();
+    if (!atlas.isNull() && !isAtlasFormat(atlas.format()))
+        return false;
+
+    const QVector<Tileset::AtlasTile> tiles = tileset->atlasTiles();
+    if (tiles.size() != tileset->tileCount())
+        return false;
+
+    // Other threads might be reading the old file, so it is replaced rather
+    // than overwritten.
+    QSaveFile file(cacheFilePath(imageFileInfo));
+    if (!file.open(QIODevice::WriteOnly))
+        return false;
+
+    QDataStream out(&file);
+    out << quint32(ATLAS_CACHE_MAGIC);
+    out << quint32(ATLAS_CACHE_VERSION);
+    out.setVersion(QDataStream::Qt_5_0);
+
+    out << imageFileInfo.absoluteFilePath();
+    out << qint64(imageFileInfo.size());
+    out << qint64(imageFileInfo.lastModified().toMSecsSinceEpoch());
+
+    out << qint32(tileset->imageWidth()) << qint32(tileset->imageHeight());
+    out << qint32(atlas.width()) << qint32(atlas.height()) << qint32(atlas.format());
+    out << qint32(tiles.size());
+    for (const Tileset::AtlasTile &tile : tiles) {
+        out << qint32(tile.rect.x()) << qint32(tile.rect.y())
+            << qint32(tile.rect.width()) << qint32(tile.rect.height())
+            << qint32(tile.offset.x()) << qint32(tile.offset.y())
+            << qint32(tile.size.width()) << qint32(tile.size.height());
+    }
+
+    for (int y = 0; y < atlas.height(); y++) {
+        out.writeRawData(reinterpret_cast<const char*>(atlas.constScanLine(y)),
+                         atlas.width() * 4);
+    }
+
+    if (out.status() != QDataStream::Ok) {
+        file.cancelWriting();
+        return false;
+    }
+    return file.commit();
+}
+
+void TilesetAtlasCache::prune() const
+{
+    QDir dir(mDirectory);
+    const QStringList fileNames = dir.entryList({ QLatin1String("*.atlas") }, QDir::Files);
+    for (const QString &fileName : fileNames) {
+        const QString filePath = dir.filePath(fileName);
+        if (!isUpToDate(filePath))
+            QFile::remove(filePath);
+    }
+}
+
+// Only the header is read, see write().
+bool TilesetAtlasCache::isUpToDate(const QString &filePath)
+{
+    QFile file(filePath);
+    if (!file.open(QIODevice::ReadOnly))
+        return false;
+    QDataStream in(&file);
+
+    quint32 magic, version;
+    in >> magic >> version;
+    if (in.status() != QDataStream::Ok || magic != ATLAS_CACHE_MAGIC
+            || version != ATLAS_CACHE_VERSION)
+        return false;
+    in.setVersion(QDataStream::Qt_5_0);
+
+    QString imageFilePath;
+    qint64 fileSize, lastModified;
+    in >> imageFilePath >> fileSize >> lastModified;
+    if (in.status() != QDataStream::Ok)
+        return false;
+
+    QFileInfo imageFileInfo(imageFilePath);
+    return imageFileInfo.exists()
+            && fileSize == imageFileInfo.size()
+            && lastModified == imageFileInfo.lastModified().toMSecsSinceEpoch();
+}
+
+QString TilesetAtlasCache::cacheFilePath(const QFileInfo &imageFileInfo) const
+{
+    const QByteArray hash = QCryptographicHash::hash(
+                imageFileInfo.absoluteFilePath().toUtf8(), QCryptographicHash::Sha1);
+    return mDirectory + QLatin1Char('/') + QString::fromLatin1(hash.toHex())
+            + QLatin1String(".atlas");
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TILESETATLASCACHE_H
+#define TILESETATLASCACHE_H
+
+#include <QFileInfo>
+#include <QString>
+
+namespace Tiled {
+class Tileset;
+}
+
+/**
+ * Keeps the atlas that Tileset::loadFromImage() builds from each tileset
+ * image, so later runs can skip decoding the PNG, trimming every tile and
+ * packing the atlas.
+ *
+ * Each image gets one file in the cache directory, named after a hash of
+ * the image's path.  The file records the image's size and modification
+ * time and is ignored once either changes.  prune() removes the files of
+ * images that changed or are gone.
+ *
+ * read() and write() may be called from any thread.
+ */
+class TilesetAtlasCache
+{
+public:
+    TilesetAtlasCache(const QString &directory);
+
+    /**
+     * Loads \a tileset from the cached atlas of \a imageFileInfo.
+     * \a imageSource becomes the tileset's image source, as with
+     * Tileset::loadFromImage().  Returns false if there is no usable atlas.
+     */
+    bool read(Tiled::Tileset *tileset, const QFileInfo &imageFileInfo,
+              const QString &imageSource) const;
+
+    /**
+     * Saves the atlas of \a tileset, just loaded from \a imageFileInfo.
+     * \a imageFileInfo must be taken before the image was read.
+     */
+    bool write(const Tiled::Tileset *tileset, const QFileInfo &imageFileInfo) const;
+
+    /**
+     * Removes every file whose image no longer matches it.  Nothing may be
+     * reading or writing the cache at the same time.
+     */
+    void prune() const;
+
+private:
+    static bool isUpToDate(const QString &filePath);
+    QString cacheFilePath(const QFileInfo &imageFileInfo) const;
+
+    QString mDirectory;
+};
+
+#endif // TILESETATLASCACHE_H
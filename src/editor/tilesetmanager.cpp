@@ -29,8 +29,10 @@
 #include "preferences.h"
 #include "progress.h"
 #include "tile.h"
+#include "tilesetatlascache.h"
 #include <QDebug>
 #include <QDir>
+#include <QElapsedTimer>
 #include <QImageReader>
 #include <QMetaType>
 #endif
@@ -77,12 +79,15 @@ TilesetManager::TilesetManager():
 
     qRegisterMetaType<Tileset*>("Tileset*");
 
-    mImageReaderThreads.resize(8);
+    mAtlasCache = new TilesetAtlasCache(Preferences::instance()->configPath(QLatin1String("tileset-cache")));
+
+    mImageReaderThreads.resize(qMax(1, QThread::idealThreadCount()));
     mImageReaderWorkers.resize(mImageReaderThreads.size());
     mNextThreadForJob = 0;
+    mMatchTime = 0;
     for (int i = 0; i < mImageReaderWorkers.size(); i++) {
         mImageReaderThreads[i] = new InterruptibleThread;
-        mImageReaderWorkers[i] = new TilesetImageReaderWorker(i, mImageReaderThreads[i]);
+        mImageReaderWorkers[i] = new TilesetImageReaderWorker(i, mImageReaderThreads[i], mAtlasCache);
         mImageReaderWorkers[i]->moveToThread(mImageReaderThreads[i]);
         connect(mImageReaderWorkers[i], &TilesetImageReaderWorker::imageLoaded,
                 this, qOverload<Tiled::Tileset*,Tiled::Tileset*>(&TilesetManager::imageLoaded));
@@ -117,6 +122,9 @@ TilesetManager::~TilesetManager()
         delete mImageReaderThreads[i];
     }
 
+    // The reader threads are gone, so nothing else uses the cache.
+    mAtlasCache->prune();
+    delete mAtlasCache;
     delete mTilesetImageCache;
 #endif
 
@@ -146,16 +154,16 @@ void TilesetManager::deleteInstance()
 
 Tileset *TilesetManager::findTileset(const QString &fileName) const
 {
-    foreach (Tileset *tileset, tilesets())
-        if (tileset->fileName() == fileName)
-            return tileset;
-
-    return 0;
+    if (fileName.isEmpty())
+        return 0;
+    return mTilesetsByFileName.value(fileName, 0);
 }
 
 Tileset *TilesetManager::findTileset(const TilesetSpec &spec) const
 {
-    foreach (Tileset *tileset, tilesets()) {
+    for (auto it = mTilesetsByImageSource.constFind(spec.imageSource);
+         it != mTilesetsByImageSource.constEnd() && it.key() == spec.imageSource; ++it) {
+        Tileset *tileset = it.value();
         if (tileset->imageSource() == spec.imageSource
             && tileset->tileWidth() == spec.tileWidth
             && tileset->tileHeight() == spec.tileHeight
@@ -175,6 +183,7 @@ void TilesetManager::addReference(Tileset *tileset)
         mTilesets[tileset]++;
     } else {
         mTilesets.insert(tileset, 1);
+        indexTileset(tileset);
 #ifdef ZOMBOID
 #else
         if (!tileset->imageSource().isEmpty())
@@ -198,6 +207,7 @@ void TilesetManager::removeReference(Tileset *tileset)
 
     if (mTilesets.value(tileset) == 0) {
         mTilesets.remove(tileset);
+        unindexTileset(tileset);
 #ifdef ZOMBOID
 #else
         if (!tileset->imageSource().isEmpty())
@@ -225,6 +235,43 @@ QList<Tileset*> TilesetManager::tilesets() const
     return mTilesets.keys();
 }
 
+void TilesetManager::indexTileset(Tileset *tileset)
+{
+    if (!mTilesets.contains(tileset))
+        return;
+    IndexedTileset indexed;
+    indexed.imageSource = tileset->imageSource();
+    indexed.imageSource2x = tileset->imageSource2x();
+    indexed.fileName = tileset->fileName();
+    auto it = mIndexedTilesets.find(tileset);
+    if (it != mIndexedTilesets.end()) {
+        if (it.value() == indexed)
+            return;
+        mTilesetsByImageSource.remove(it.value().imageSource, tileset);
+        mTilesetsByImageSource2x.remove(it.value().imageSource2x, tileset);
+        mTilesetsByFileName.remove(it.value().fileName, tileset);
+        it.value() = indexed;
+    } else {
+        mIndexedTilesets.insert(tileset, indexed);
+    }
+    mTilesetsByImageSource.insert(indexed.imageSource, tileset);
+    if (!indexed.imageSource2x.isEmpty())
+        mTilesetsByImageSource2x.insert(indexed.imageSource2x, tileset);
+    if (!indexed.fileName.isEmpty())
+        mTilesetsByFileName.insert(indexed.fileName, tileset);
+}
+
+void TilesetManager::unindexTileset(Tileset *tileset)
+{
+    auto it = mIndexedTilesets.find(tileset);
+    if (it == mIndexedTilesets.end())
+        return;
+    mTilesetsByImageSource.remove(it.value().imageSource, tileset);
+    mTilesetsByImageSource2x.remove(it.value().imageSource2x, tileset);
+    mTilesetsByFileName.remove(it.value().fileName, tileset);
+    mIndexedTilesets.erase(it);
+}
+
 void TilesetManager::setReloadTilesetsOnChange(bool enabled)
 {
     mReloadTilesetsOnChange = enabled;
@@ -316,6 +363,7 @@ void TilesetManager::fileChangedTimeout()
         if (mChangedFiles.contains(fileName2)) {
             if (Tileset *cached = mTilesetImageCache->findMatch(tileset, fileName, fileName2)) {
                 if (tileset->loadFromCache(cached)) {
+                    indexTileset(tileset);
                     tileset->setMissing(cached->isMissing());
 #ifdef ZOMBOID_TILE_LAYER_NAMES
                     syncTileLayerNames(tileset);
@@ -356,21 +404,7 @@ void TilesetManager::imageLoaded(QImage *image, Tileset *tileset)
     // Watch the image file for changes.
     mWatcher->addPath(tileset->imageSource2x().isEmpty() ? tileset->imageSource() : tileset->imageSource2x());
 
-    // Now update every tileset using this image.
-    foreach (Tileset *candidate, tilesets()) {
-        if (candidate->isLoaded())
-            continue;
-        if (((candidate->imageSource() == tileset->imageSource()) || (!tileset->imageSource2x().isEmpty() && (candidate->imageSource2x() == tileset->imageSource2x())))
-                && candidate->tileWidth() == tileset->tileWidth()
-                && candidate->tileHeight() == tileset->tileHeight()
-                && candidate->tileSpacing() == tileset->tileSpacing()
-                && candidate->margin() == tileset->margin()
-                && candidate->transparentColor() == tileset->transparentColor()) {
-            candidate->loadFromCache(tileset);
-            candidate->setMissing(false);
-            emit tilesetChanged(candidate);
-        }
-    }
+    updateTilesetsUsingImage(tileset);
     delete image;
 }
 
@@ -386,17 +420,34 @@ void TilesetManager::imageLoaded(Tileset *fromThread, Tileset *tileset)
     // Watch the image file for changes.
     mWatcher->addPath(tileset->imageSource2x().isEmpty() ? tileset->imageSource() : tileset->imageSource2x());
 
-    // Now update every tileset using this image.
-    foreach (Tileset *candidate, tilesets()) {
+    updateTilesetsUsingImage(tileset);
+}
+
+void TilesetManager::updateTilesetsUsingImage(Tileset *cached)
+{
+    QElapsedTimer timer;
+    timer.start();
+
+    // Look up the tilesets using this image by source rather than checking
+    // every tileset.  The candidates are a copy, since loading a candidate
+    // can change its sources and so its place in the indexes.
+    QList<Tileset*> candidates = mTilesetsByImageSource.values(cached->imageSource());
+    if (!cached->imageSource2x().isEmpty())
+        candidates += mTilesetsByImageSource2x.values(cached->imageSource2x());
+
+    mMatchTime += timer.nsecsElapsed();
+
+    for (Tileset *candidate : qAsConst(candidates)) {
         if (candidate->isLoaded())
             continue;
-        if (((candidate->imageSource() == tileset->imageSource()) || (!tileset->imageSource2x().isEmpty() && (candidate->imageSource2x() == tileset->imageSource2x())))
-                && candidate->tileWidth() == tileset->tileWidth()
-                && candidate->tileHeight() == tileset->tileHeight()
-                && candidate->tileSpacing() == tileset->tileSpacing()
-                && candidate->margin() == tileset->margin()
-                && candidate->transparentColor() == tileset->transparentColor()) {
-            candidate->loadFromCache(tileset);
+        if (((candidate->imageSource() == cached->imageSource()) || (!cached->imageSource2x().isEmpty() && (candidate->imageSource2x() == cached->imageSource2x())))
+                && candidate->tileWidth() == cached->tileWidth()
+                && candidate->tileHeight() == cached->tileHeight()
+                && candidate->tileSpacing() == cached->tileSpacing()
+                && candidate->margin() == cached->margin()
+                && candidate->transparentColor() == cached->transparentColor()) {
+            candidate->loadFromCache(cached);
+            indexTileset(candidate);
             candidate->setMissing(false);
             emit tilesetChanged(candidate);
         }
@@ -413,23 +464,30 @@ void TilesetManager::loadTileset(Tileset *tileset, const QString &imageSource_)
     if (!tileset->isLoaded() /*&& !tileset->isMissing()*/) {
         QString imageSource, imageSource2x;
         getTilesetFileName(tileset->name(), imageSource, imageSource2x);
-        if (Tileset *cached = mTilesetImageCache->findMatch(tileset, imageSource, imageSource2x)) {
+        QElapsedTimer timer;
+        timer.start();
+        Tileset *cached = mTilesetImageCache->findMatch(tileset, imageSource, imageSource2x);
+        mMatchTime += timer.nsecsElapsed();
+        if (cached) {
             // If it !isLoaded(), a thread is reading the image.
             // FIXME: 1) load TMX with tilesets from not-TilesDirectory -> no 2x images loaded
             //        2) switch TilesDirectory to the same not-TilesDirectory in 1)
             //        3) 2x images remain unloaded
             if (cached->isLoaded()) {
                 tileset->loadFromCache(cached);
+                indexTileset(tileset);
                 tileset->setMissing(false);
                 emit tilesetChanged(tileset);
             } else {
                 changeTilesetSource(tileset, imageSource, false);
                 tileset->setImageSource2x(cached->imageSource2x());
+                indexTileset(tileset);
             }
         } else if (QImageReader(imageSource2x).size().isValid()) {
             qDebug() << "2x YES " << imageSource;
             changeTilesetSource(tileset, imageSource, false);
             tileset->setImageSource2x(imageSource2x);
+            indexTileset(tileset);
             cached = mTilesetImageCache->addTileset(tileset);
 #if 1 /* QT_POINTER_SIZE == 8 */
             QMetaObject::invokeMethod(mImageReaderWorkers[mNextThreadForJob],
@@ -444,6 +502,7 @@ void TilesetManager::loadTileset(Tileset *tileset, const QString &imageSource_)
             qDebug() << "2x NO " << imageSource;
             changeTilesetSource(tileset, imageSource, false);
             tileset->setImageSource2x(QString());
+            indexTileset(tileset);
             cached = mTilesetImageCache->addTileset(tileset);
 #if 1 /* QT_POINTER_SIZE == 8 */
             QMetaObject::invokeMethod(mImageReaderWorkers[mNextThreadForJob],
@@ -462,6 +521,7 @@ void TilesetManager::loadTileset(Tileset *tileset, const QString &imageSource_)
             }
             changeTilesetSource(tileset, imageSource, true);
             tileset->setImageSource2x(QString());
+            indexTileset(tileset);
         }
     }
 }
@@ -526,6 +586,7 @@ void TilesetManager::changeTilesetSource(Tileset *tileset, const QString &source
                                          bool missing)
 {
     tileset->setImageSource(source);
+    indexTileset(tileset);
     tileset->setMissing(missing);
     if (!tileset->imageSource().isEmpty() && !tileset->isMissing()) {
 #ifdef ZOMBOID_TILE_LAYER_NAMES
@@ -825,9 +886,11 @@ void TilesetManager::syncTileLayerNames(Tileset *ts)
 #ifdef ZOMBOID
 /////
 
-TilesetImageReaderWorker::TilesetImageReaderWorker(int id, InterruptibleThread *thread) :
+TilesetImageReaderWorker::TilesetImageReaderWorker(int id, InterruptibleThread *thread,
+                                                   const TilesetAtlasCache *atlasCache) :
     BaseWorker(thread),
     mID(id),
+    mAtlasCache(atlasCache),
     mHasJobs(false)
 {
 }
@@ -854,15 +917,20 @@ void TilesetImageReaderWorker::work()
 
         Job job = mJobs.takeAt(0);
 
-        QImage *image = new QImage(job.tileset->imageSource2x().isEmpty() ? job.tileset->imageSource() : job.tileset->imageSource2x());
-#if 0
-        Sleep::msleep(500);
-        qDebug() << "TilesetImageReaderThread #" << mID << "loaded" << job.tileset->imageSource();
-#endif
+        // Taken before reading, in case the file is saved while it is read.
+        const QFileInfo imageFileInfo(job.tileset->imageSource2x().isEmpty() ? job.tileset->imageSource() : job.tileset->imageSource2x());
         Tileset *fromThread = new Tileset(job.tileset->name(), 64, 128);
         fromThread->setImageSource2x(job.tileset->imageSource2x());
-        fromThread->loadFromImage(*image, job.tileset->imageSource());
-        delete image;
+        if (!mAtlasCache->read(fromThread, imageFileInfo, job.tileset->imageSource())) {
+            QImage *image = new QImage(imageFileInfo.filePath());
+#if 0
+            Sleep::msleep(500);
+            qDebug() << "TilesetImageReaderThread #" << mID << "loaded" << job.tileset->imageSource();
+#endif
+            fromThread->loadFromImage(*image, job.tileset->imageSource());
+            delete image;
+            mAtlasCache->write(fromThread, imageFileInfo);
+        }
         emit imageLoaded(fromThread, job.tileset);
     }
 
@@ -25,6 +25,7 @@
 #ifdef ZOMBOID
 #include <QFileInfo>
 #endif
+#include <QHash>
 #include <QObject>
 #include <QList>
 #include <QMap>
@@ -39,11 +40,13 @@ namespace Tiled {
 class Tileset;
 }
 class QImage;
+class TilesetAtlasCache;
 class TilesetImageReaderWorker : public BaseWorker
 {
     Q_OBJECT
 public:
-    TilesetImageReaderWorker(int id, InterruptibleThread *thread);
+    TilesetImageReaderWorker(int id, InterruptibleThread *thread,
+                             const TilesetAtlasCache *atlasCache);
 
     ~TilesetImageReaderWorker();
 
@@ -70,6 +73,7 @@ private:
     QList<Job> mJobs;
 
     int mID;
+    const TilesetAtlasCache *mAtlasCache;
     QMutex mJobsMutex;
     bool mHasJobs;
 };
@@ -197,6 +201,15 @@ public:
     void loadTileset(Tileset *tileset, const QString &imageSource);
     void waitForTilesets(const QList<Tileset *> &tilesets = QList<Tileset*>(), QWidget *parent = nullptr);
     int countLoadingTilesets(const QList<Tileset *> &tilesets) const;
+
+    /**
+     * Time spent finding tilesets that share an image, in nanoseconds.
+     */
+    qint64 tilesetMatchTime() const
+    { return mMatchTime; }
+
+    void resetTilesetMatchTime()
+    { mMatchTime = 0; }
 #endif
 
 signals:
@@ -242,11 +255,44 @@ private:
     Tileset *mNoBlendTileset;
     Tile *mNoBlendTile;
 
+    TilesetAtlasCache *mAtlasCache;
     QVector<InterruptibleThread*> mImageReaderThreads;
     QVector<TilesetImageReaderWorker*> mImageReaderWorkers;
     int mNextThreadForJob;
+
+    void updateTilesetsUsingImage(Tileset *cached);
+
+    qint64 mMatchTime;
 #endif
 
+    void indexTileset(Tileset *tileset);
+    void unindexTileset(Tileset *tileset);
+
+    struct IndexedTileset
+    {
+        QString imageSource;
+        QString imageSource2x;
+        QString fileName;
+
+        bool operator==(const IndexedTileset &other) const
+        {
+            return imageSource == other.imageSource
+                    && imageSource2x == other.imageSource2x
+                    && fileName == other.fileName;
+        }
+    };
+
+    /**
+     * The referenced tilesets by image source and by file name, so the
+     * tilesets sharing an image are found without comparing every tileset.
+     * The index is updated whenever the manager changes a tileset's image
+     * source.
+     */
+    QMultiHash<QString,Tileset*> mTilesetsByImageSource;
+    QMultiHash<QString,Tileset*> mTilesetsByImageSource2x;
+    QMultiHash<QString,Tileset*> mTilesetsByFileName;
+    QHash<Tileset*,IndexedTileset> mIndexedTilesets;
+
 #ifdef ZOMBOID_TILE_LAYER_NAMES
     QMap<QString,ZTileLayerNames*> mTileLayerNames; // imageSource -> tile layer names
 
@@ -17,6 +17,7 @@
 
 #include "tmxtobmp.h"
 
+#include "batchmode.h"
 #include "bmptotmx.h"
 #include "lotfilesmanager.h"
 #include "mainwindow.h"
@@ -253,8 +254,9 @@ bool TMXToBMP::generateWorld(WorldDocument *worldDoc, TMXToBMP::GenerateMode mod
     // While displaying this, the MapManager's FileSystemWatcher might see some
     // changed .tmx files, which results in the PROGRESS dialog being displayed.
     // It's a bit odd to see the PROGRESS dialog blocked behind this messagebox.
-    QMessageBox::information(MainWindow::instance(),
-                             tr("TMP To BMP"), tr("Finished!"));
+    if (!BatchMode::isActive())
+        QMessageBox::information(MainWindow::instance(),
+                                 tr("TMP To BMP"), tr("Finished!"));
 
     return true;
 
@@ -328,18 +330,21 @@ bool TMXToBMP::generateCell(WorldCell *cell)
 
     if (mDoMain) {
         QPainter painter(&images->mBmp);
-        painter.drawImage((cell->pos() - images->mBounds.topLeft()) * 300, mapInfo->map()->bmpMain().image());
+        painter.drawImage((cell->pos() - images->mBounds.topLeft()) * 300, mapInfo->map()->bmpMain().toImage());
         mModifiedImages.insert(images);
     }
 
     if (mDoVeg) {
         QPainter painter(&images->mBmpVeg);
         QPoint p = (cell->pos() - images->mBounds.topLeft()) * 300;
-        painter.drawImage(p, mapInfo->map()->bmpVeg().image());
-        for (int y = 0; y < 300; y++) {
-            for (int x = 0; x < 300; x++) {
-                if (images->mBmpVeg.pixel(p + QPoint(x, y)) == black)
-                    images->mBmpVeg.setPixel(p + QPoint(x, y), transparent);
+        painter.drawImage(p, mapInfo->map()->bmpVeg().toImage());
+        painter.end();
+        QRect r = QRect(p, QSize(300, 300)) & images->mBmpVeg.rect();
+        for (int y = r.top(); y <= r.bottom(); y++) {
+            QRgb *line = reinterpret_cast<QRgb*>(images->mBmpVeg.scanLine(y));
+            for (int x = r.left(); x <= r.right(); x++) {
+                if (line[x] == black)
+                    line[x] = transparent;
             }
         }
         mModifiedImages.insert(images);
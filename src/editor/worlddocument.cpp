@@ -17,6 +17,7 @@
 
 #include "worlddocument.h"
 
+#include "batchmode.h"
 #include "bmptotmx.h"
 #include "celldocument.h"
 #include "documentmanager.h"
@@ -236,10 +237,13 @@ bool WorldDocument::save(const QString &filePath, QString &error)
     if (!luaFileName.isEmpty()) {
         LuaWriter writer;
         if (!writer.writeSpawnPoints(world(), luaFileName)) {
-            QMessageBox::warning(MainWindow::instance(), tr("Error saving spawnpoints"),
-                                 tr("An error occurred saving the LUA spawnpoints file.\n%1\n\n%2")
-                                 .arg(writer.errorString())
-                                 .arg(QDir::toNativeSeparators(luaFileName)));
+            QString message = tr("An error occurred saving the LUA spawnpoints file.\n%1\n\n%2")
+                    .arg(writer.errorString())
+                    .arg(QDir::toNativeSeparators(luaFileName));
+            if (BatchMode::isActive())
+                BatchMode::printError(message);
+            else
+                QMessageBox::warning(MainWindow::instance(), tr("Error saving spawnpoints"), message);
         }
     }
 
@@ -247,10 +251,13 @@ bool WorldDocument::save(const QString &filePath, QString &error)
     if (!luaFileName.isEmpty()) {
         LuaWriter writer;
         if (!writer.writeWorldObjects(world(), luaFileName)) {
-            QMessageBox::warning(MainWindow::instance(), tr("Error saving objects"),
-                                 tr("An error occurred saving the LUA objects file.\n%1\n\n%2")
-                                 .arg(writer.errorString())
-                                 .arg(QDir::toNativeSeparators(luaFileName)));
+            QString message = tr("An error occurred saving the LUA objects file.\n%1\n\n%2")
+                    .arg(writer.errorString())
+                    .arg(QDir::toNativeSeparators(luaFileName));
+            if (BatchMode::isActive())
+                BatchMode::printError(message);
+            else
+                QMessageBox::warning(MainWindow::instance(), tr("Error saving objects"), message);
         }
     }
 
@@ -0,0 +1,377 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "worldmosaic.h"
+
+#include "preferences.h"
+#include "worldscene.h"
+
+#include <qmath.h>
+#include <QPainter>
+#include <QRunnable>
+#include <QStyleOptionGraphicsItem>
+#include <QThreadPool>
+
+#include <algorithm>
+
+// Size of a tile in pixels.
+#define TILE_SIZE 256
+
+// Cost of a tile in the cache, in KB.
+#define TILE_COST (TILE_SIZE * TILE_SIZE * 4 / 1024)
+
+// 64 MB of tiles.
+#define MAX_COST (64 * 1024)
+
+// Level 0 tiles are drawn at this scale, level 1 tiles at half of it, and so
+// on.  Zoomed in closer than this, only a few cells are in view and they draw
+// their own thumbnails.
+#define MAX_SCALE 0.5
+#define LEVEL_COUNT 4
+
+// The cell items are indexed by the coarsest tiles they cover, each of which
+// contains the finer tiles below it.
+#define INDEX_LEVEL (LEVEL_COUNT - 1)
+
+namespace {
+
+qreal levelScale(int level)
+{
+    return MAX_SCALE / (1 << level);
+}
+
+// The level with the smallest tiles that don't get scaled up at this scale.
+int levelForScale(qreal scale)
+{
+    int level = 0;
+    while (level < LEVEL_COUNT - 1 && levelScale(level + 1) >= scale)
+        level++;
+    return level;
+}
+
+// Thumbnails are scaled down with QImage::scaled() first when they are much
+// bigger than the painter would draw them, since QPainter only samples them.
+void drawImages(QPainter *painter, const QVector<WorldMosaicImage> &images, bool prescale)
+{
+    const qreal scale = painter->transform().m11();
+    for (const WorldMosaicImage &image : images) {
+        const QSize size = (image.bounds.size() * scale).toSize();
+        if (prescale && !size.isEmpty() && size.width() < image.image.width() / 2) {
+            painter->drawImage(image.bounds, image.image.scaled(size, Qt::IgnoreAspectRatio,
+                                                                Qt::SmoothTransformation));
+            continue;
+        }
+        painter->drawImage(image.bounds, image.image);
+    }
+}
+
+} // namespace
+
+class WorldMosaicItem::TileRunnable : public QRunnable
+{
+public:
+    TileRunnable(WorldMosaicItem *item, const TileKey &key, const QRectF &sceneRect,
+                 const QVector<WorldMosaicImage> &images) :
+        mItem(item),
+        mKey(key),
+        mSceneRect(sceneRect),
+        mImages(images)
+    {
+    }
+
+    void run() override
+    {
+        QImage image(TILE_SIZE, TILE_SIZE, QImage::Format_ARGB32_Premultiplied);
+        image.fill(Qt::transparent);
+        {
+            QPainter painter(&image);
+            painter.setRenderHint(QPainter::SmoothPixmapTransform);
+            const qreal scale = levelScale(mKey.level);
+            painter.setTransform(QTransform(scale, 0, 0, scale,
+                                            -mSceneRect.left() * scale, -mSceneRect.top() * scale));
+            drawImages(&painter, mImages, true);
+        }
+
+        WorldMosaicItem *item = mItem;
+        const TileKey key = mKey;
+        QMetaObject::invokeMethod(item, [item, key, image]() {
+            item->tileBuilt(key, image);
+        }, Qt::QueuedConnection);
+        item->mDone.release();
+    }
+
+private:
+    WorldMosaicItem *mItem;
+    TileKey mKey;
+    QRectF mSceneRect;
+    QVector<WorldMosaicImage> mImages;
+};
+
+WorldMosaicItem::WorldMosaicItem(WorldScene *scene) :
+    QGraphicsItem(),
+    mScene(scene),
+    mTiles(MAX_COST),
+    mRunning(0)
+{
+    setAcceptedMouseButtons(Qt::NoButton);
+    setFlag(ItemUsesExtendedStyleOption);
+}
+
+WorldMosaicItem::~WorldMosaicItem()
+{
+    // The tiles still being built refer to this item.
+    mDone.acquire(mRunning);
+}
+
+QRectF WorldMosaicItem::boundingRect() const
+{
+    return mBoundingRect;
+}
+
+QPainterPath WorldMosaicItem::shape() const
+{
+    // Never found under the mouse, the WorldCellItems are.
+    return QPainterPath();
+}
+
+void WorldMosaicItem::paint(QPainter *painter, const QStyleOptionGraphicsItem *option,
+                            QWidget *)
+{
+    if (Preferences::instance()->showZonesInWorldView())
+        return;
+
+    const qreal scale = option->levelOfDetailFromTransform(painter->worldTransform());
+    if (!drawsThumbnails(scale))
+        return;
+
+    const int level = levelForScale(scale);
+    const qreal tileScale = levelScale(level);
+    const QRectF rect = option->exposedRect & mBoundingRect;
+    if (rect.isEmpty())
+        return;
+    const int x1 = qFloor(rect.left() * tileScale / TILE_SIZE);
+    const int y1 = qFloor(rect.top() * tileScale / TILE_SIZE);
+    const int x2 = qFloor(rect.right() * tileScale / TILE_SIZE);
+    const int y2 = qFloor(rect.bottom() * tileScale / TILE_SIZE);
+
+    QVector<WorldMosaicImage> images;
+    for (int y = y1; y <= y2; y++) {
+        for (int x = x1; x <= x2; x++) {
+            const TileKey key = { level, x, y };
+            const QRectF tileRect = tileSceneRect(key);
+            if (const QImage *image = mTiles.object(key)) {
+                if (!image->isNull())
+                    painter->drawImage(tileRect, *image);
+                continue;
+            }
+
+            // Until it is built, a tile is drawn from the images it is being
+            // built from, which are only collected again if it went stale.
+            auto building = mBuilding.find(key);
+            if (building != mBuilding.end() && !building->isEmpty()) {
+                images = *building;
+            } else {
+                images.clear();
+                collectImages(key, images);
+                if (images.isEmpty()) {
+                    // Empty tiles are cached as null images.
+                    mTiles.insert(key, new QImage, 1);
+                    continue;
+                }
+                if (building != mBuilding.end())
+                    *building = images;
+                else
+                    requestTile(key, images);
+            }
+
+            if (drawCoarserTile(painter, key))
+                continue;
+            painter->save();
+            painter->setClipRect(tileRect, Qt::IntersectClip);
+            drawImages(painter, images, false);
+            painter->restore();
+        }
+    }
+}
+
+bool WorldMosaicItem::drawsThumbnails(qreal scale)
+{
+    return scale <= MAX_SCALE;
+}
+
+void WorldMosaicItem::updateItem(BaseCellItem *item, const QRectF &bounds)
+{
+    const QRectF oldBounds = mItemBounds.value(item);
+    if (bounds != oldBounds) {
+        indexItem(item, oldBounds, false);
+        indexItem(item, bounds, true);
+        mItemBounds[item] = bounds;
+    }
+    invalidate(oldBounds | bounds);
+}
+
+void WorldMosaicItem::removeItem(BaseCellItem *item)
+{
+    const QRectF bounds = mItemBounds.take(item);
+    indexItem(item, bounds, false);
+    invalidate(bounds);
+}
+
+void WorldMosaicItem::invalidate(const QRectF &sceneRect)
+{
+    if (sceneRect.isEmpty())
+        return;
+
+    if (!mBoundingRect.contains(sceneRect)) {
+        prepareGeometryChange();
+        mBoundingRect |= sceneRect;
+    }
+
+    for (int level = 0; level < LEVEL_COUNT; level++) {
+        const qreal scale = levelScale(level);
+        const int x1 = qFloor(sceneRect.left() * scale / TILE_SIZE);
+        const int y1 = qFloor(sceneRect.top() * scale / TILE_SIZE);
+        const int x2 = qFloor(sceneRect.right() * scale / TILE_SIZE);
+        const int y2 = qFloor(sceneRect.bottom() * scale / TILE_SIZE);
+        for (int y = y1; y <= y2; y++) {
+            for (int x = x1; x <= x2; x++) {
+                const TileKey key = { level, x, y };
+                mTiles.remove(key);
+                auto building = mBuilding.find(key);
+                if (building != mBuilding.end()) {
+                    mStale.insert(key);
+                    building->clear();
+                }
+            }
+        }
+    }
+
+    update(sceneRect);
+}
+
+void WorldMosaicItem::clear()
+{
+    mTiles.clear();
+    for (auto it = mBuilding.begin(); it != mBuilding.end(); ++it) {
+        mStale.insert(it.key());
+        it->clear();
+    }
+    update();
+}
+
+void WorldMosaicItem::indexItem(BaseCellItem *item, const QRectF &bounds, bool add)
+{
+    if (bounds.isEmpty())
+        return;
+    const qreal scale = levelScale(INDEX_LEVEL);
+    const int x1 = qFloor(bounds.left() * scale / TILE_SIZE);
+    const int y1 = qFloor(bounds.top() * scale / TILE_SIZE);
+    const int x2 = qFloor(bounds.right() * scale / TILE_SIZE);
+    const int y2 = qFloor(bounds.bottom() * scale / TILE_SIZE);
+    for (int y = y1; y <= y2; y++) {
+        for (int x = x1; x <= x2; x++) {
+            const TileKey key = { INDEX_LEVEL, x, y };
+            if (add) {
+                mItemsByTile[key] += item;
+                continue;
+            }
+            auto it = mItemsByTile.find(key);
+            if (it == mItemsByTile.end())
+                continue;
+            it->removeOne(item);
+            if (it->isEmpty())
+                mItemsByTile.erase(it);
+        }
+    }
+}
+
+void WorldMosaicItem::tileBuilt(const TileKey &key, const QImage &image)
+{
+    mDone.acquire();
+    mRunning--;
+    mBuilding.remove(key);
+
+    // A tile that changed while it was being built is built again the next
+    // time it is drawn.
+    if (!mStale.remove(key))
+        mTiles.insert(key, new QImage(image), TILE_COST);
+    update(tileSceneRect(key));
+}
+
+void WorldMosaicItem::requestTile(const TileKey &key, const QVector<WorldMosaicImage> &images)
+{
+    if (mBuilding.contains(key))
+        return;
+    mBuilding.insert(key, images);
+    mRunning++;
+    QThreadPool::globalInstance()->start(new TileRunnable(this, key, tileSceneRect(key), images));
+}
+
+bool WorldMosaicItem::drawCoarserTile(QPainter *painter, const TileKey &key)
+{
+    const QRectF tileRect = tileSceneRect(key);
+    for (int level = key.level + 1; level < LEVEL_COUNT; level++) {
+        const int shift = level - key.level;
+        const TileKey coarse = { level, key.x >> shift, key.y >> shift };
+        const QImage *image = mTiles.object(coarse);
+        if (image == nullptr)
+            continue;
+        if (!image->isNull()) {
+            const qreal scale = levelScale(level);
+            const QRectF source((tileRect.topLeft() - tileSceneRect(coarse).topLeft()) * scale,
+                                tileRect.size() * scale);
+            painter->drawImage(tileRect, *image, source);
+        }
+        return true;
+    }
+    return false;
+}
+
+void WorldMosaicItem::collectImages(const TileKey &key, QVector<WorldMosaicImage> &images) const
+{
+    const QRectF sceneRect = tileSceneRect(key);
+    const int shift = INDEX_LEVEL - key.level;
+    const TileKey indexKey = { INDEX_LEVEL, key.x >> shift, key.y >> shift };
+    QVector<BaseCellItem*> items;
+    for (BaseCellItem *item : mItemsByTile.value(indexKey)) {
+        if (item->boundingRect().intersects(sceneRect))
+            items += item;
+    }
+
+    // The thumbnails overlap, so they are drawn in the same order as the
+    // cell items are.
+    std::sort(items.begin(), items.end(), [](BaseCellItem *a, BaseCellItem *b) {
+        const QPoint pa = a->cellPos(), pb = b->cellPos();
+        return (pa.y() != pb.y()) ? (pa.y() < pb.y()) : (pa.x() < pb.x());
+    });
+
+    QVector<WorldMosaicImage> itemImages;
+    for (BaseCellItem *item : std::as_const(items)) {
+        itemImages.clear();
+        item->mosaicImages(itemImages);
+        for (const WorldMosaicImage &image : std::as_const(itemImages)) {
+            if (image.bounds.intersects(sceneRect))
+                images += image;
+        }
+    }
+}
+
+QRectF WorldMosaicItem::tileSceneRect(const TileKey &key) const
+{
+    const qreal size = TILE_SIZE / levelScale(key.level);
+    return QRectF(key.x * size, key.y * size, size, size);
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright 2012, Tim Baker <treectrl@users.sf.net>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation; either version 2 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but WITHOUT
+ * ANY WARRANTY; without even the implied warranty of MERCHANTABILITY or
+ * FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License for
+ * more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef WORLDMOSAIC_H
+#define WORLDMOSAIC_H
+
+#include <QCache>
+#include <QGraphicsItem>
+#include <QHash>
+#include <QImage>
+#include <QSemaphore>
+#include <QSet>
+#include <QVector>
+
+class BaseCellItem;
+class WorldScene;
+
+/**
+ * A cell or lot thumbnail and where it is drawn in the scene.
+ */
+struct WorldMosaicImage
+{
+    QImage image;
+    QRectF bounds;
+};
+
+/**
+ * Draws the thumbnails of every WorldCellItem when the view is zoomed out,
+ * so that a frame is a few dozen tile images instead of one scaled image for
+ * each cell and lot.  Tiles are composited from the thumbnails at several
+ * scales, each half the one before, on the global thread pool.  Until a tile
+ * is ready part of a coarser tile, or the thumbnails themselves, are drawn.
+ */
+class WorldMosaicItem : public QObject, public QGraphicsItem
+{
+    Q_OBJECT
+    Q_INTERFACES(QGraphicsItem)
+public:
+    WorldMosaicItem(WorldScene *scene);
+    ~WorldMosaicItem();
+
+    QRectF boundingRect() const override;
+    QPainterPath shape() const override;
+
+    void paint(QPainter *painter,
+               const QStyleOptionGraphicsItem *option,
+               QWidget *widget = nullptr) override;
+
+    /**
+     * Returns true if this item draws the thumbnails at the given scale,
+     * in which case the WorldCellItems don't.
+     */
+    static bool drawsThumbnails(qreal scale);
+
+    /**
+     * Records that \a item's thumbnails now cover \a bounds, and throws away
+     * the tiles covering them before and after.  This is called whenever the
+     * item's thumbnails are added, moved or removed.
+     */
+    void updateItem(BaseCellItem *item, const QRectF &bounds);
+
+    /**
+     * Forgets \a item, which is about to be deleted.
+     */
+    void removeItem(BaseCellItem *item);
+
+    void clear();
+
+private:
+    struct TileKey
+    {
+        int level;
+        int x;
+        int y;
+
+        bool operator==(const TileKey &other) const
+        {
+            return level == other.level && x == other.x && y == other.y;
+        }
+
+        friend size_t qHash(const TileKey &key)
+        {
+            return qHash((quint64(quint32(key.x)) << 32) | quint32(key.y)) ^ uint(key.level);
+        }
+    };
+
+    class TileRunnable;
+
+    void invalidate(const QRectF &sceneRect);
+    void indexItem(BaseCellItem *item, const QRectF &bounds, bool add);
+    void tileBuilt(const TileKey &key, const QImage &image);
+    void requestTile(const TileKey &key, const QVector<WorldMosaicImage> &images);
+    bool drawCoarserTile(QPainter *painter, const TileKey &key);
+    void collectImages(const TileKey &key, QVector<WorldMosaicImage> &images) const;
+    QRectF tileSceneRect(const TileKey &key) const;
+
+    WorldScene *mScene;
+    QRectF mBoundingRect;
+    QCache<TileKey,QImage> mTiles;
+    QHash<TileKey,QVector<WorldMosaicImage>> mBuilding; // the images, or none if stale
+    QSet<TileKey> mStale; // invalidated while being built
+    QHash<TileKey,QVector<BaseCellItem*>> mItemsByTile; // by coarsest tile
+    QHash<BaseCellItem*,QRectF> mItemBounds;
+    int mRunning;
+    QSemaphore mDone;
+};
+
+#endif // WORLDMOSAIC_H
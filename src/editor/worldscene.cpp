@@ -32,6 +32,7 @@
 #include "undoredo.h"
 #include "world.h"
 #include "worlddocument.h"
+#include "worldmosaic.h"
 #include "worldreader.h"
 #include "zoomable.h"
 
@@ -61,6 +62,7 @@ WorldScene::WorldScene(WorldDocument *worldDoc, QObject *parent)
     , mGridItem(new WorldGridItem(this))
     , mCoordItem(new WorldCoordItem(this))
     , mSelectionItem(new WorldSelectionItem(this))
+    , mMosaicItem(nullptr)
     , mPasteCellsTool(0)
     , mActiveTool(0)
     , mDragMapImageItem(0)
@@ -164,6 +166,11 @@ WorldScene::WorldScene(WorldDocument *worldDoc, QObject *parent)
         }
     }
 
+    // Added before the cell items, so it is drawn below them.
+    mMosaicItem = new WorldMosaicItem(this);
+    mMosaicItem->setZValue(ZVALUE_CELLITEM);
+    addItem(mMosaicItem);
+
     mCellItems.resize(world()->width() * world()->height());
     for (int y = 0; y < world()->height(); y++) {
         for (int x = 0; x < world()->width(); x++) {
@@ -263,11 +270,13 @@ void WorldScene::setTool(AbstractTool *tool)
             worldDocument()->setSelectedCells(QList<WorldCell*>());
             foreach (WorldCellItem *item, mCellItems)
                 item->setVisible(false); //item->setOpacity(0.2);
+            mMosaicItem->setVisible(false);
             setShowBMPs(true);
         } else {
             worldDocument()->setSelectedBMPs(QList<WorldBMP*>());
             foreach (WorldCellItem *item, mCellItems)
                 item->setVisible(true); //item->setOpacity(1.0);
+            mMosaicItem->setVisible(true);
             setShowBMPs(Preferences::instance()->showBMPs());
         }
         mBMPToolActive = bmpToolActive;
@@ -374,6 +383,7 @@ void WorldScene::worldAboutToResize(const QSize &newSize)
     for (int x = 0; x < world()->width(); x++)
         for (int y = 0; y < world()->height(); y++) {
             if (!newBounds.contains(x, y)) {
+                mMosaicItem->removeItem(itemForCell(x, y));
                 delete itemForCell(x, y);
                 mCellItems[x + y * world()->width()] = 0;
             }
@@ -407,6 +417,7 @@ void WorldScene::worldResized(const QSize &oldSize)
     }
 
     mCellItems = items;
+    mMosaicItem->clear();
     mGridItem->updateBoundingRect();
     setSceneRect(mGridItem->boundingRect());
     mCoordItem->updateBoundingRect();
@@ -1045,19 +1056,23 @@ void BaseCellItem::paint(QPainter *painter,
                          const QStyleOptionGraphicsItem *option,
                          QWidget *)
 {
-    Q_UNUSED(option)
+    // Zoomed out, the WorldMosaicItem draws the thumbnails instead.
+    const bool drawImages = !inWorldMosaic() || !WorldMosaicItem::drawsThumbnails(
+                option->levelOfDetailFromTransform(painter->worldTransform()));
 
-    if (mMapImage && mMapImage->isLoaded()) {
-        QRectF target = mMapImageBounds.translated(mDrawOffset);
-        QRectF source = QRect(QPoint(0, 0), mMapImage->image().size());
-        painter->drawImage(target, mMapImage->image(), source);
-    }
+    if (drawImages) {
+        if (mMapImage && mMapImage->isLoaded()) {
+            QRectF target = mMapImageBounds.translated(mDrawOffset);
+            QRectF source = QRect(QPoint(0, 0), mMapImage->image().size());
+            painter->drawImage(target, mMapImage->image(), source);
+        }
 
-    foreach (const LotImage &lotImage, mLotImages) {
-        if (!lotImage.mMapImage || !lotImage.mMapImage->isLoaded()) continue;
-        QRectF target = lotImage.mBounds.translated(mDrawOffset);
-        QRectF source = QRect(QPoint(0, 0), lotImage.mMapImage->image().size());
-        painter->drawImage(target, lotImage.mMapImage->image(), source);
+        foreach (const LotImage &lotImage, mLotImages) {
+            if (!lotImage.mMapImage || !lotImage.mMapImage->isLoaded()) continue;
+            QRectF target = lotImage.mBounds.translated(mDrawOffset);
+            QRectF source = QRect(QPoint(0, 0), lotImage.mMapImage->image().size());
+            painter->drawImage(target, lotImage.mMapImage->image(), source);
+        }
     }
 
 #ifndef QT_NO_DEBUG
@@ -1132,12 +1147,27 @@ void BaseCellItem::updateBoundingRect()
 
     bounds.adjust(mDrawOffset.x(), mDrawOffset.y(), mDrawOffset.x(), mDrawOffset.y());
 
+    // This is called whenever the images or their bounds change.
+    if (inWorldMosaic())
+        mScene->mosaicItem()->updateItem(this, bounds);
+
     if (mBoundingRect != bounds) {
         prepareGeometryChange();
         mBoundingRect = bounds;
     }
 }
 
+void BaseCellItem::mosaicImages(QVector<WorldMosaicImage> &images) const
+{
+    if (mMapImage && mMapImage->isLoaded())
+        images += WorldMosaicImage{ mMapImage->image(), mMapImageBounds.translated(mDrawOffset) };
+
+    for (const LotImage &lotImage : mLotImages) {
+        if (!lotImage.mMapImage || !lotImage.mMapImage->isLoaded()) continue;
+        images += WorldMosaicImage{ lotImage.mMapImage->image(), lotImage.mBounds.translated(mDrawOffset) };
+    }
+}
+
 void BaseCellItem::mapImageChanged(MapImage *mapImage)
 {
     bool changed = false;
@@ -35,7 +35,9 @@ class World;
 class WorldBMP;
 class WorldCellTool;
 class WorldDocument;
+class WorldMosaicItem;
 class WorldScene;
+struct WorldMosaicImage;
 
 #define GRID_WIDTH (512)
 #define GRID_HEIGHT (256)
@@ -135,6 +137,11 @@ public:
     virtual QString mapFilePath() const = 0;
     virtual const QList<WorldCellLot*> &lots() const = 0;
 
+    // True if the WorldMosaicItem draws this item's thumbnails when zoomed out.
+    virtual bool inWorldMosaic() const { return false; }
+
+    void mosaicImages(QVector<WorldMosaicImage> &images) const;
+
     void updateCellImage();
     void updateLotImage(int index);
     void updateBoundingRect();
@@ -190,6 +197,8 @@ public:
     QString mapFilePath() const override { return mCell->mapFilePath(); }
     const QList<WorldCellLot*> &lots() const override { return mCell->lots(); }
 
+    bool inWorldMosaic() const override { return true; }
+
     WorldCell *cell() const { return mCell; }
 
     void lotAdded(int index);
@@ -230,6 +239,8 @@ public:
                const QStyleOptionGraphicsItem *option,
                QWidget *widget = 0);
 
+    bool inWorldMosaic() const override { return false; }
+
     void setDragOffset(const QPointF &offset);
 };
 
@@ -466,6 +477,9 @@ public:
     World *world() const;
     WorldCellItem *itemForCell(WorldCell *cell);
     WorldCellItem *itemForCell(int x, int y);
+    const QVector<WorldCellItem*> &cellItems() const { return mCellItems; }
+
+    WorldMosaicItem *mosaicItem() const { return mMosaicItem; }
 
     QPoint pixelToRoadCoords(qreal x, qreal y) const;
 
@@ -551,6 +565,7 @@ private:
     WorldGridItem *mGridItem;
     WorldCoordItem *mCoordItem;
     WorldSelectionItem *mSelectionItem;
+    WorldMosaicItem *mMosaicItem;
     QVector<WorldCellItem*> mSelectedCellItems;
     QVector<WorldCellItem*> mCellItems;
     QList<WorldCellItem*> mPendingThumbnails;
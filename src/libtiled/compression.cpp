@@ -57,14 +57,21 @@ static void logZlibError(int error)
 QByteArray Tiled::decompress(const QByteArray &data, int expectedSize)
 {
     QByteArray out;
+    if (!decompress(data.constData(), data.length(), out, expectedSize))
+        return QByteArray();
+    return out;
+}
+
+bool Tiled::decompress(const char *data, int length, QByteArray &out, int expectedSize)
+{
     out.resize(expectedSize);
     z_stream strm;
 
     strm.zalloc = Z_NULL;
     strm.zfree = Z_NULL;
     strm.opaque = Z_NULL;
-    strm.next_in = (Bytef *) data.data();
-    strm.avail_in = data.length();
+    strm.next_in = (Bytef *) data;
+    strm.avail_in = length;
     strm.next_out = (Bytef *) out.data();
     strm.avail_out = out.size();
 
@@ -72,7 +79,7 @@ QByteArray Tiled::decompress(const QByteArray &data, int expectedSize)
 
     if (ret != Z_OK) {
         logZlibError(ret);
-        return QByteArray();
+        return false;
     }
 
     do {
@@ -86,7 +93,7 @@ QByteArray Tiled::decompress(const QByteArray &data, int expectedSize)
             case Z_MEM_ERROR:
                 inflateEnd(&strm);
                 logZlibError(ret);
-                return QByteArray();
+                return false;
         }
 
         if (ret != Z_STREAM_END) {
@@ -101,14 +108,14 @@ QByteArray Tiled::decompress(const QByteArray &data, int expectedSize)
 
     if (strm.avail_in != 0) {
         logZlibError(Z_DATA_ERROR);
-        return QByteArray();
+        return false;
     }
 
     const int outLength = out.size() - strm.avail_out;
     inflateEnd(&strm);
 
     out.resize(outLength);
-    return out;
+    return true;
 }
 
 QByteArray Tiled::compress(const QByteArray &data, CompressionMethod method)
@@ -55,6 +55,15 @@ enum CompressionMethod {
 QByteArray TILEDSHARED_EXPORT decompress(const QByteArray &data,
                                          int expectedSize = 1024);
 
+/**
+ * Like decompress() above, but the uncompressed data is written to \a out so
+ * that its memory can be reused by the next call.
+ *
+ * @return true on success, false if decompressing failed
+ */
+bool TILEDSHARED_EXPORT decompress(const char *data, int length,
+                                   QByteArray &out, int expectedSize);
+
 /**
  * Compresses the give data in either gzip or zlib format. Returns a null
  * QByteArray if compression failed.
@@ -24,6 +24,8 @@
 #include "tileset.h"
 #include "map.h"
 
+#include <algorithm>
+
 using namespace Tiled;
 
 // Bits on the far end of the 32-bit global tile ID are used for tile flags
@@ -31,11 +33,13 @@ const int FlippedHorizontallyFlag   = 0x80000000;
 const int FlippedVerticallyFlag     = 0x40000000;
 const int FlippedAntiDiagonallyFlag = 0x20000000;
 
-GidMapper::GidMapper()
+GidMapper::GidMapper() :
+    mTableDirty(true)
 {
 }
 
-GidMapper::GidMapper(const QList<Tileset *> &tilesets)
+GidMapper::GidMapper(const QList<Tileset *> &tilesets) :
+    mTableDirty(true)
 {
     uint firstGid = 1;
     foreach (Tileset *tileset, tilesets) {
@@ -116,10 +120,87 @@ uint GidMapper::cellToGid(const Cell &cell) const
     return gid;
 }
 
+bool GidMapper::gidsToCells(const uint *gids, int count, Cell *cells, uint &badGid)
+{
+    if (mTableDirty)
+        updateTable();
+
+    const uint flags = FlippedHorizontallyFlag |
+                       FlippedVerticallyFlag |
+                       FlippedAntiDiagonallyFlag;
+    const uint *firstGids = mFirstGids.constData();
+    const int tilesetCount = mFirstGids.size();
+
+    // Layers are mostly empty, or runs of the same tile, or tiles from the
+    // same tileset, so the previous gid and tileset are checked first.
+    uint prevGid = 0;
+    Cell prevCell;
+    int ts = -1;
+    uint tsFirst = 1, tsEnd = 0;
+
+    for (int i = 0; i < count; i++) {
+        uint gid = gids[i];
+        if (gid == prevGid) {
+            cells[i] = prevCell;
+            continue;
+        }
+
+        Cell cell;
+        cell.flippedHorizontally = (gid & FlippedHorizontallyFlag);
+        cell.flippedVertically = (gid & FlippedVerticallyFlag);
+        cell.flippedAntiDiagonally = (gid & FlippedAntiDiagonallyFlag);
+        const uint tileGid = gid & ~flags;
+
+        if (tileGid != 0) {
+            if (tileGid < tsFirst || tileGid >= tsEnd) {
+                ts = int(std::upper_bound(firstGids, firstGids + tilesetCount, tileGid) - firstGids) - 1;
+                if (ts < 0) {
+                    badGid = gid;
+                    return false;
+                }
+                tsFirst = firstGids[ts];
+                tsEnd = (ts + 1 < tilesetCount) ? firstGids[ts + 1] : uint(-1);
+            }
+            if (const Tileset *tileset = mTilesets[ts]) {
+                int tileId = tileGid - tsFirst;
+                const int columnCount = mColumnCounts[ts];
+                if (columnCount > 0 && columnCount != tileset->columnCount()) {
+                    // Correct tile index for changes in image width
+                    const int row = tileId / columnCount;
+                    const int column = tileId % columnCount;
+                    tileId = row * tileset->columnCount() + column;
+                }
+                cell.tile = tileset->tileAt(tileId);
+            }
+        }
+
+        cells[i] = cell;
+        prevGid = gid;
+        prevCell = cell;
+    }
+
+    return true;
+}
+
 void GidMapper::setTilesetWidth(const Tileset *tileset, int width)
 {
     if (tileset->tileWidth() == 0)
         return;
 
     mTilesetColumnCounts.insert(tileset, tileset->columnCountForWidth(width));
+    mTableDirty = true;
+}
+
+void GidMapper::updateTable()
+{
+    mFirstGids.clear();
+    mTilesets.clear();
+    mColumnCounts.clear();
+    QMap<uint, Tileset*>::const_iterator it = mFirstGidToTileset.constBegin();
+    for (; it != mFirstGidToTileset.constEnd(); ++it) {
+        mFirstGids += it.key();
+        mTilesets += it.value();
+        mColumnCounts += mTilesetColumnCounts.value(it.value());
+    }
+    mTableDirty = false;
 }
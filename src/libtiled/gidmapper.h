@@ -48,12 +48,12 @@ public:
      * Insert the given \a tileset with \a firstGid as its first global ID.
      */
     void insert(uint firstGid, Tileset *tileset)
-    { mFirstGidToTileset.insert(firstGid, tileset); }
+    { mFirstGidToTileset.insert(firstGid, tileset); mTableDirty = true; }
 
     /**
      * Clears the gid mapper, so that it can be reused.
      */
-    void clear() { mFirstGidToTileset.clear(); }
+    void clear() { mFirstGidToTileset.clear(); mTableDirty = true; }
 
     /**
      * Returns true when no tilesets are known to this gid mapper.
@@ -72,6 +72,12 @@ public:
      */
     uint cellToGid(const Cell &cell) const;
 
+    /**
+     * Converts \a count gids to cells the same way as gidToCell().  Returns
+     * false and sets \a badGid when one of the gids is invalid.
+     */
+    bool gidsToCells(const uint *gids, int count, Cell *cells, uint &badGid);
+
     /**
      * This sets the original tileset width. In case the image size has
      * changed, the tile indexes will be adjusted automatically when using
@@ -80,8 +86,16 @@ public:
     void setTilesetWidth(const Tileset *tileset, int width);
 
 private:
+    void updateTable();
+
     QMap<uint, Tileset*> mFirstGidToTileset;
     QMap<const Tileset*, int> mTilesetColumnCounts;
+
+    // mFirstGidToTileset as sorted arrays, for gidsToCells().
+    QVector<uint> mFirstGids;
+    QVector<Tileset*> mTilesets;
+    QVector<int> mColumnCounts;
+    bool mTableDirty;
 };
 
 } // namespace Tiled
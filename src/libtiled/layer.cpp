@@ -101,10 +101,11 @@ ImageLayer *Layer::asImageLayer()
 }
 
 #ifdef ZOMBOID
-void Layer::addReference(Tileset *ts)
+void Layer::addReference(Tileset *ts, int count)
 {
-    mUsedTilesets[ts]++;
-    if (mMap && (mUsedTilesets[ts] == 1))
+    int &refs = mUsedTilesets[ts];
+    refs += count;
+    if (mMap && (refs == count))
         mMap->addTilesetUser(ts);
 }
 
@@ -370,6 +370,8 @@ Map *Map::fromLayer(Layer *layer)
 #include <QRandomGenerator>
 
 MapRands::MapRands(int width, int height, uint seed) :
+    mWidth(0),
+    mHeight(0),
     mSeed(seed)
 {
     setSize(width, height);
@@ -377,19 +379,22 @@ MapRands::MapRands(int width, int height, uint seed) :
 
 void MapRands::setSize(int width, int height)
 {
+    mWidth = width;
+    mHeight = height;
+    mRands.resize(width * height);
+    // The numbers are generated column by column, which is the order they
+    // have always been generated in.
     QRandomGenerator qrand(mSeed);
-    resize(width);
     for (int x = 0; x < width; x++) {
-        (*this)[x].resize(height);
         for (int y = 0; y < height; y++)
-            (*this)[x][y] = qrand.generate();
+            mRands[x + y * width] = qrand.generate();
     }
 }
 
 void MapRands::setSeed(uint seed)
 {
     mSeed = seed;
-    setSize(size(), at(0).size());
+    setSize(mWidth, mHeight);
 }
 
 /////
@@ -477,16 +482,96 @@ void BmpSettings::clone(const BmpSettings &other)
 /////
 
 MapBmp::MapBmp(int width, int height) :
-    mImage(width, height, QImage::Format_ARGB32),
+    mWidth(width),
+    mHeight(height),
+    mPixels(width * height, 0),
     mRands(width, height, 1)
 {
-    mImage.fill(Qt::black);
+    mColors += qRgb(0, 0, 0);
+    mIndexByColor[qRgb(0, 0, 0)] = 0;
+}
+
+QImage MapBmp::toImage() const
+{
+    QImage image(mWidth, mHeight, QImage::Format_ARGB32);
+    const QRgb *colors = mColors.constData();
+    for (int y = 0; y < mHeight; y++) {
+        const quint16 *src = indexLine(y);
+        QRgb *dest = reinterpret_cast<QRgb*>(image.scanLine(y));
+        for (int x = 0; x < mWidth; x++)
+            dest[x] = colors[src[x]];
+    }
+    return image;
+}
+
+void MapBmp::setImage(const QImage &image, int sx, int sy)
+{
+    QImage copy = image.copy(sx, sy, mWidth, mHeight).convertToFormat(QImage::Format_ARGB32);
+    QRgb lastColor = mColors.at(0);
+    quint16 lastIndex = 0;
+    for (int y = 0; y < mHeight; y++) {
+        const QRgb *src = reinterpret_cast<const QRgb*>(copy.constScanLine(y));
+        quint16 *dest = indexLine(y);
+        for (int x = 0; x < mWidth; x++) {
+            if (src[x] != lastColor) {
+                lastColor = src[x];
+                lastIndex = colorIndex(lastColor);
+            }
+            dest[x] = lastIndex;
+        }
+    }
+}
+
+void MapBmp::fill(QRgb rgb)
+{
+    mColors.resize(1);
+    mIndexByColor.clear();
+    mIndexByColor[mColors.at(0)] = 0;
+    mPixels.fill(colorIndex(rgb));
+}
+
+quint16 MapBmp::colorIndex(QRgb rgb)
+{
+    auto it = mIndexByColor.constFind(rgb);
+    if (it != mIndexByColor.constEnd())
+        return it.value();
+    if (mColors.size() > 0xFFFF) {
+        compactColorTable();
+        if (mColors.size() > 0xFFFF) {
+            qWarning("MapBmp: too many colors, using black");
+            return 0;
+        }
+    }
+    quint16 index = quint16(mColors.size());
+    mColors += rgb;
+    mIndexByColor[rgb] = index;
+    return index;
+}
+
+// Removes the colors that no pixel uses any more.
+void MapBmp::compactColorTable()
+{
+    QVector<int> remap(mColors.size(), -1);
+    remap[0] = 0;
+    for (quint16 index : qAsConst(mPixels))
+        remap[index] = 0;
+    QVector<QRgb> colors;
+    mIndexByColor.clear();
+    for (int i = 0; i < mColors.size(); i++) {
+        if (remap[i] == -1)
+            continue;
+        remap[i] = colors.size();
+        mIndexByColor[mColors[i]] = quint16(colors.size());
+        colors += mColors[i];
+    }
+    mColors = colors;
+    for (quint16 &index : mPixels)
+        index = quint16(remap[index]);
 }
 
 void MapBmp::resize(const QSize &size, const QPoint &offset)
 {
-    QImage newImage(size, QImage::Format_ARGB32);
-    newImage.fill(Qt::black);
+    QVector<quint16> newPixels(size.width() * size.height(), 0);
 
     // Copy over the preserved part
     const int startX = qMax(0, -offset.x());
@@ -495,28 +580,30 @@ void MapBmp::resize(const QSize &size, const QPoint &offset)
     const int endY = qMin(height(), size.height() - offset.y());
 
     for (int y = startY; y < endY; ++y) {
-        for (int x = startX; x < endX; ++x) {
-            newImage.setPixel(x + offset.x(), y + offset.y(), mImage.pixel(x, y));
-        }
+        const quint16 *src = indexLine(y);
+        quint16 *dest = newPixels.data() + (y + offset.y()) * size.width() + offset.x();
+        for (int x = startX; x < endX; ++x)
+            dest[x] = src[x];
     }
 
-    mImage = newImage;
+    mPixels = newPixels;
+    mWidth = size.width();
+    mHeight = size.height();
 
     mRands.setSize(size.width(), size.height());
 }
 
 QList<QRgb> MapBmp::colors() const
 {
-    const QRgb black = qRgb(0, 0, 0);
-    QSet<QRgb> colorSet;
-    for (int y = 0; y < height(); y++) {
-        for (int x = 0; x < width(); x++) {
-            QRgb rgb = mImage.pixel(x, y);
-            if (rgb != black)
-                colorSet += rgb;
-        }
+    QBitArray used(mColors.size());
+    for (quint16 index : mPixels)
+        used.setBit(index);
+    QList<QRgb> ret;
+    for (int i = 1; i < mColors.size(); i++) {
+        if (used.testBit(i))
+            ret += mColors[i];
     }
-    return { colorSet.begin(), colorSet.end() };
+    return ret;
 }
 
 /////
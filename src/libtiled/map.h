@@ -36,6 +36,8 @@
 
 #ifdef ZOMBOID
 #include <QBitArray>
+#include <QHash>
+#include <QImage>
 #endif
 #include <QList>
 #include <QMargins>
@@ -54,44 +56,92 @@ class ZTileLayerGroup;
 /**
   * This class represents a grid of random numbers for each cell in a Map.
   * The random numbers are used by the BmpBlender class.
+  * The numbers are stored row by row in a single array.
   */
-class TILEDSHARED_EXPORT MapRands : public QVector<QVector<quint32> >
+class TILEDSHARED_EXPORT MapRands
 {
 public:
     MapRands(int width, int height, uint seed);
     void setSize(int width, int height);
     void setSeed(uint seed);
     uint seed() const { return mSeed; }
+
+    int width() const { return mWidth; }
+    int height() const { return mHeight; }
+
+    quint32 at(int x, int y) const { return mRands.at(x + y * mWidth); }
+    const quint32 *line(int y) const { return mRands.constData() + y * mWidth; }
+
 private:
+    int mWidth;
+    int mHeight;
     uint mSeed;
+    QVector<quint32> mRands;
 };
 
+/**
+  * One of the two BMP images of a Map.  Each pixel is stored as an index
+  * into a table of colors; index 0 is always black.  Use toImage() to get
+  * a QImage for display.
+  */
 class TILEDSHARED_EXPORT MapBmp
 {
 public:
     MapBmp(int width, int height);
 
-    QImage &rimage() { return mImage; }
     MapRands &rrands() { return mRands; }
-
-    const QImage image() const { return mImage; }
     const MapRands &rands() const { return mRands; }
 
-    int width() const { return mImage.width(); }
-    int height() const { return mImage.height(); }
+    QImage toImage() const;
+    const QImage image() const { return toImage(); }
+
+    /**
+      * Replaces every pixel with the pixels of \a image starting at
+      * \a sx,\a sy.  Pixels outside \a image become transparent, as with
+      * QImage::copy().
+      */
+    void setImage(const QImage &image, int sx = 0, int sy = 0);
+
+    int width() const { return mWidth; }
+    int height() const { return mHeight; }
+
+    QRgb pixel(const QPoint &pt) const { return pixel(pt.x(), pt.y()); }
+    QRgb pixel(int x, int y) const { return mColors.at(mPixels.at(x + y * mWidth)); }
+    void setPixel(int x, int y, QRgb rgb) { mPixels[x + y * mWidth] = colorIndex(rgb); }
+
+    void fill(QRgb rgb);
 
-    QRgb pixel(const QPoint &pt) const { return mImage.pixel(pt); }
-    QRgb pixel(int x, int y) const { return mImage.pixel(x, y); }
-    void setPixel(int x, int y, QRgb rgb) { mImage.setPixel(x, y, rgb); }
+    /**
+      * The color table.  Pixels hold indices into this table.
+      */
+    const QVector<QRgb> &colorTable() const { return mColors; }
+
+    /**
+      * Returns the index of \a rgb in the color table, adding it if needed.
+      */
+    quint16 colorIndex(QRgb rgb);
 
-    quint32 rand(int x, int y) { return mRands.at(x).at(y); /*mRands[x][y]*/; }
+    const quint16 *indexLine(int y) const { return mPixels.constData() + y * mWidth; }
+    quint16 *indexLine(int y) { return mPixels.data() + y * mWidth; }
+
+    quint32 rand(int x, int y) const { return mRands.at(x, y); }
 
     void resize(const QSize &size, const QPoint &offset);
     void merge(const QPoint &pos, const MapBmp *other);
 
+    /**
+      * The colors of all the non-black pixels.
+      */
     QList<QRgb> colors() const;
 
-    QImage mImage;
+private:
+    void compactColorTable();
+
+    int mWidth;
+    int mHeight;
+    QVector<quint16> mPixels;
+    QVector<QRgb> mColors;
+    QHash<QRgb,quint16> mIndexByColor;
     MapRands mRands;
 };
 
@@ -105,6 +105,12 @@ private:
      */
     Cell cellForGid(uint gid);
 
+    /**
+     * Sets every cell of the layer from mGids.  Errors are raised with the
+     * QXmlStreamReader.
+     */
+    void setLayerCells(TileLayer *tileLayer);
+
     ImageLayer *readImageLayer();
     void readImageLayerImage(ImageLayer *imageLayer);
 
@@ -138,6 +144,12 @@ private:
     GidMapper mGidMapper;
     bool mReadingExternalTileset;
 
+    // Reused by every layer.
+    QByteArray mBase64Buffer;
+    QByteArray mInflateBuffer;
+    QVector<uint> mGids;
+    QVector<Cell> mCells;
+
     QXmlStreamReader xml;
 };
 
@@ -500,53 +512,119 @@ void MapReaderPrivate::readLayerData(TileLayer *tileLayer)
     }
 }
 
+namespace {
+
+// Decodes base64 text straight from the XML reader's UTF-16 text into \a out,
+// without the Latin-1 copy QByteArray::fromBase64() needs.  Characters that
+// aren't base64 are skipped, as QByteArray::fromBase64() does.
+void decodeBase64(QStringView text, QByteArray &out)
+{
+    static const struct Table {
+        signed char values[128];
+        Table()
+        {
+            const char *alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+            for (int i = 0; i < 128; i++)
+                values[i] = -1;
+            for (int i = 0; i < 64; i++)
+                values[int(alphabet[i])] = char(i);
+        }
+    } table;
+
+    out.resize((text.size() * 3) / 4 + 3);
+    uchar *dest = reinterpret_cast<uchar*>(out.data());
+    const QChar *src = text.data();
+    const QChar *end = src + text.size();
+
+    uint bits = 0;
+    int count = 0;
+    while (src < end) {
+        // Four characters at a time while there are no line breaks or padding.
+        if (count == 0 && end - src >= 4) {
+            const ushort c0 = src[0].unicode(), c1 = src[1].unicode();
+            const ushort c2 = src[2].unicode(), c3 = src[3].unicode();
+            if ((c0 | c1 | c2 | c3) < 128) {
+                const int v0 = table.values[c0], v1 = table.values[c1];
+                const int v2 = table.values[c2], v3 = table.values[c3];
+                if ((v0 | v1 | v2 | v3) >= 0) {
+                    const uint quad = (v0 << 18) | (v1 << 12) | (v2 << 6) | v3;
+                    dest[0] = uchar(quad >> 16);
+                    dest[1] = uchar(quad >> 8);
+                    dest[2] = uchar(quad);
+                    dest += 3;
+                    src += 4;
+                    continue;
+                }
+            }
+        }
+        const ushort c = (src++)->unicode();
+        if (c == '=')
+            break;
+        const int v = (c < 128) ? table.values[c] : -1;
+        if (v < 0)
+            continue;
+        bits = (bits << 6) | uint(v);
+        if (++count == 4) {
+            dest[0] = uchar(bits >> 16);
+            dest[1] = uchar(bits >> 8);
+            dest[2] = uchar(bits);
+            dest += 3;
+            bits = 0;
+            count = 0;
+        }
+    }
+    if (count == 2) {
+        *dest++ = uchar(bits >> 4);
+    } else if (count == 3) {
+        *dest++ = uchar(bits >> 10);
+        *dest++ = uchar(bits >> 2);
+    }
+
+    out.resize(int(dest - reinterpret_cast<uchar*>(out.data())));
+}
+
+} // namespace
+
 void MapReaderPrivate::decodeBinaryLayerData(TileLayer *tileLayer,
                                              QStringView text,
                                              QStringView compression)
 {
-#if QT_VERSION < 0x040800
-    const QString textData = QString::fromRawData(text.unicode(), text.size());
-    const QByteArray latin1Text = textData.toLatin1();
-#else
-    const QByteArray latin1Text = text.toLatin1();
-#endif
-    QByteArray tileData = QByteArray::fromBase64(latin1Text);
+    decodeBase64(text, mBase64Buffer);
+    const QByteArray *tileData = &mBase64Buffer;
     const int size = (tileLayer->width() * tileLayer->height()) * 4;
 
     if (compression == QLatin1String("zlib")
         || compression == QLatin1String("gzip")) {
-        tileData = decompress(tileData, size);
+        if (!decompress(mBase64Buffer.constData(), mBase64Buffer.length(),
+                        mInflateBuffer, size))
+            mInflateBuffer.clear();
+        tileData = &mInflateBuffer;
     } else if (!compression.isEmpty()) {
         xml.raiseError(tr("Compression method '%1' not supported")
                        .arg(compression.toString()));
         return;
     }
 
-    if (size != tileData.length()) {
+    if (size != tileData->length()) {
         xml.raiseError(tr("Corrupt layer data for layer '%1'")
                        .arg(tileLayer->name()));
         return;
     }
 
     const unsigned char *data =
-            reinterpret_cast<const unsigned char*>(tileData.constData());
-    int x = 0;
-    int y = 0;
-
-    for (int i = 0; i < size - 3; i += 4) {
-        const uint gid = data[i] |
-                         data[i + 1] << 8 |
-                         data[i + 2] << 16 |
-                         data[i + 3] << 24;
-
-        tileLayer->setCell(x, y, cellForGid(gid));
-
-        x++;
-        if (x == tileLayer->width()) {
-            x = 0;
-            y++;
-        }
+            reinterpret_cast<const unsigned char*>(tileData->constData());
+    const int count = tileLayer->width() * tileLayer->height();
+    mGids.resize(count);
+    uint *gids = mGids.data();
+
+    for (int i = 0; i < count; i++, data += 4) {
+        gids[i] = data[0] |
+                  data[1] << 8 |
+                  data[2] << 16 |
+                  data[3] << 24;
     }
+
+    setLayerCells(tileLayer);
 }
 
 #if defined(ZOMBOID) /*&& defined(_DEBUG)*/
@@ -572,6 +650,11 @@ void MapReaderPrivate::decodeCSVLayerData(TileLayer *tileLayer, const QString &t
 {
 #if defined(ZOMBOID) /*&& defined(_DEBUG)*/
 
+    // The gids are collected first and the cells set all at once.
+    mGids.fill(0, tileLayer->width() * tileLayer->height());
+    uint *gids = mGids.data();
+    const QStringView textView(text);
+
     int start = 0;
     int end = text.length();
     while (start < end && text.at(start).isSpace())
@@ -579,20 +662,17 @@ void MapReaderPrivate::decodeCSVLayerData(TileLayer *tileLayer, const QString &t
     int x = 0, y = 0;
     const QChar sep(QLatin1Char(','));
     const QChar nullChar(QLatin1Char('0'));
-    const Cell emptyCell = cellForGid(0);
     while ((end = text.indexOf(sep, start, Qt::CaseSensitive)) != -1) {
-        if (end - start == 1 && text.at(start) == nullChar) {
-            tileLayer->setCell(x, y, emptyCell);
-        } else {
+        if (end - start != 1 || text.at(start) != nullChar) {
             bool conversionOk;
-            uint gid = text.mid(start, end - start).toUInt(&conversionOk);
+            uint gid = textView.sliced(start, end - start).toUInt(&conversionOk);
             if (!conversionOk) {
                 xml.raiseError(
                         tr("Unable to parse tile at (%1,%2) on layer '%3'")
                                .arg(x + 1).arg(y + 1).arg(tileLayer->name()));
                 return;
             }
-            tileLayer->setCell(x, y, cellForGid(gid));
+            gids[x + y * tileLayer->width()] = gid;
         }
         start = end + 1;
         if (++x == tileLayer->width()) {
@@ -608,19 +688,19 @@ void MapReaderPrivate::decodeCSVLayerData(TileLayer *tileLayer, const QString &t
     end = text.size();
     while (start < end && text.at(end-1).isSpace())
         end--;
-    if (end - start == 1 && text.at(start) == nullChar) {
-        tileLayer->setCell(x, y, emptyCell);
-    } else {
+    if (end - start != 1 || text.at(start) != nullChar) {
         bool conversionOk;
-        uint gid = text.mid(start, end - start).toUInt(&conversionOk);
+        uint gid = textView.sliced(start, end - start).toUInt(&conversionOk);
         if (!conversionOk) {
             xml.raiseError(
                     tr("Unable to parse tile at (%1,%2) on layer '%3'")
                            .arg(x + 1).arg(y + 1).arg(tileLayer->name()));
             return;
         }
-        tileLayer->setCell(x, y, cellForGid(gid));
+        gids[x + y * tileLayer->width()] = gid;
     }
+
+    setLayerCells(tileLayer);
 #elif 0
     QString trimText = text.trimmed();
     static QVector<int> tiles;
@@ -684,6 +764,20 @@ void MapReaderPrivate::decodeCSVLayerData(TileLayer *tileLayer, const QString &t
 #endif
 }
 
+void MapReaderPrivate::setLayerCells(TileLayer *tileLayer)
+{
+    Q_ASSERT(mGids.size() == tileLayer->width() * tileLayer->height());
+
+    mCells.resize(mGids.size());
+    uint badGid;
+    if (!mGidMapper.gidsToCells(mGids.constData(), mGids.size(), mCells.data(), badGid)) {
+        cellForGid(badGid); // raises the error
+        return;
+    }
+
+    tileLayer->setCells(mCells);
+}
+
 Cell MapReaderPrivate::cellForGid(uint gid)
 {
     bool ok;
@@ -1133,41 +1227,38 @@ void MapReaderPrivate::readBmpPixels(int index, const QList<QRgb> &colors)
 
 void MapReaderPrivate::decodeBmpPixels(int bmpIndex, const QList<QRgb> &colors, QStringView text)
 {
-#if QT_VERSION < 0x040800
-    const QString textData = QString::fromRawData(text.unicode(), text.size());
-    const QByteArray latin1Text = textData.toLatin1();
-#else
-    const QByteArray latin1Text = text.toLatin1();
-#endif
-    QByteArray tileData = QByteArray::fromBase64(latin1Text);
+    decodeBase64(text, mBase64Buffer);
     const int size = (mMap->width() * mMap->height()) * 4;
 
-    tileData = decompress(tileData, size);
+    if (!decompress(mBase64Buffer.constData(), mBase64Buffer.length(),
+                    mInflateBuffer, size))
+        mInflateBuffer.clear();
+    const QByteArray &tileData = mInflateBuffer;
 
     if (size != tileData.length()) {
         xml.raiseError(tr("Corrupt bmp data"));
         return;
     }
 
+    MapBmp &bmp = mMap->rbmp(bmpIndex);
+
+    // Map the file's color numbers to the bmp's color table once.
+    QVector<quint16> colorIndex(colors.size());
+    for (int i = 0; i < colors.size(); i++)
+        colorIndex[i] = bmp.colorIndex(colors[i]);
+
     const unsigned char *data =
             reinterpret_cast<const unsigned char*>(tileData.constData());
-    int x = 0;
-    int y = 0;
-
-    for (int i = 0; i < size - 3; i += 4) {
-        const quint32 n = data[i] |
-                          data[i + 1] << 8 |
-                          data[i + 2] << 16 |
-                          data[i + 3] << 24;
-        if (n > 0 && int(n) <= colors.size()) {
-            QRgb rgb = colors[n - 1];
-            mMap->rbmp(bmpIndex).setPixel(x, y, rgb);
-        }
 
-        x++;
-        if (x == mMap->width()) {
-            x = 0;
-            y++;
+    for (int y = 0; y < mMap->height(); y++) {
+        quint16 *dest = bmp.indexLine(y);
+        for (int x = 0; x < mMap->width(); x++, data += 4) {
+            const quint32 n = data[0] |
+                              data[1] << 8 |
+                              data[2] << 16 |
+                              data[3] << 24;
+            if (n > 0 && n <= quint32(colors.size()))
+                dest[x] = colorIndex[n - 1];
         }
     }
 }
@@ -703,11 +703,18 @@ void MapWriterPrivate::writeBmpImage(QXmlStreamWriter &w,
     QByteArray tileData;
     tileData.reserve(bmp.height() * bmp.width() * 4);
 
+    // Map the bmp's color table to the numbers written above.
     const QRgb black = qRgb(0, 0, 0);
+    QVector<quint32> numbers(bmp.colorTable().size(), 0);
+    for (int i = 0; i < numbers.size(); i++) {
+        QRgb rgb = bmp.colorTable().at(i);
+        numbers[i] = (rgb == black) ? 0 : (colors.indexOf(rgb) + 1);
+    }
+
     for (int y = 0; y < bmp.height(); ++y) {
+        const quint16 *line = bmp.indexLine(y);
         for (int x = 0; x < bmp.width(); ++x) {
-            QRgb rgb = bmp.pixel(x, y);
-            quint32 n = (rgb == black) ? 0 : (colors.indexOf(rgb) + 1);
+            quint32 n = numbers[line[x]];
             tileData.append((unsigned char) (n)); // FIXME: big/little endian
             tileData.append((unsigned char) (n >> 8));
             tileData.append((unsigned char) (n >> 16));
@@ -91,6 +91,17 @@ public:
      */
     void setImage(const QImage &image);
     void setImage(const Tile *tile);
+
+    /**
+     * Sets an image that setImage() already trimmed, along with the offset
+     * and size it had before trimming.
+     */
+    void setImage(const QImage &image, const QPoint &offset, const QSize &size)
+    {
+        mImage = image;
+        mImageOffset = offset;
+        mImageSize = size;
+    }
     void setEmptyImage(int width, int height);
 
     void setEmptyImage()
@@ -91,25 +91,30 @@ static QMargins maxMargins(const QMargins &a,
                     qMax(a.bottom(), b.bottom()));
 }
 
-void TileLayer::setCell(int x, int y, const Cell &cell)
+void TileLayer::includeInDrawMargins(const Cell &cell)
 {
-    Q_ASSERT(contains(x, y));
+    int width = cell.tile->width();
+    int height = cell.tile->height();
 
-    if (cell.tile) {
-        int width = cell.tile->width();
-        int height = cell.tile->height();
+    if (cell.flippedAntiDiagonally)
+        std::swap(width, height);
 
-        if (cell.flippedAntiDiagonally)
-            std::swap(width, height);
+    const QPoint offset = cell.tile->tileset()->tileOffset();
 
-        const QPoint offset = cell.tile->tileset()->tileOffset();
+    mMaxTileSize = maxSize(QSize(width, height), mMaxTileSize);
+    mOffsetMargins = maxMargins(QMargins(-offset.x(),
+                                         -offset.y(),
+                                         offset.x(),
+                                         offset.y()),
+                                mOffsetMargins);
+}
 
-        mMaxTileSize = maxSize(QSize(width, height), mMaxTileSize);
-        mOffsetMargins = maxMargins(QMargins(-offset.x(),
-                                             -offset.y(),
-                                             offset.x(),
-                                             offset.y()),
-                                    mOffsetMargins);
+void TileLayer::setCell(int x, int y, const Cell &cell)
+{
+    Q_ASSERT(contains(x, y));
+
+    if (cell.tile) {
+        includeInDrawMargins(cell);
 
         if (mMap)
             mMap->adjustDrawMargins(drawMargins());
@@ -129,6 +134,60 @@ void TileLayer::setCell(int x, int y, const Cell &cell)
 #endif
 }
 
+void TileLayer::setCells(const QVector<Cell> &cells)
+{
+    Q_ASSERT(cells.size() == mWidth * mHeight);
+
+#ifdef ZOMBOID
+    if (!mGrid.isEmpty()) {
+        for (int i = 0, i_end = mGrid.size(); i < i_end; ++i) {
+            if (Tile *tile = mGrid.at(i).tile)
+                removeReference(tile->tileset());
+        }
+    }
+
+    // Neighbouring cells usually use the same tileset, so references are
+    // added once per run of cells.
+    Tileset *runTileset = 0;
+    int runLength = 0;
+#endif
+
+    int nonEmptyCount = 0;
+    const Cell *prevCell = 0;
+    for (const Cell &cell : cells) {
+        if (!cell.tile)
+            continue;
+        ++nonEmptyCount;
+        if (!prevCell || cell.tile != prevCell->tile
+                || cell.flippedAntiDiagonally != prevCell->flippedAntiDiagonally)
+            includeInDrawMargins(cell);
+        prevCell = &cell;
+#ifdef ZOMBOID
+        Tileset *tileset = cell.tile->tileset();
+        if (tileset != runTileset) {
+            if (runLength > 0)
+                addReference(runTileset, runLength);
+            runTileset = tileset;
+            runLength = 0;
+        }
+        ++runLength;
+#endif
+    }
+#ifdef ZOMBOID
+    if (runLength > 0)
+        addReference(runTileset, runLength);
+#endif
+
+    if (nonEmptyCount > 0 && mMap)
+        mMap->adjustDrawMargins(drawMargins());
+
+#if SPARSE_TILELAYER
+    mGrid.setCells(cells, nonEmptyCount);
+#else
+    mGrid = cells;
+#endif
+}
+
 TileLayer *TileLayer::copy(const QRegion &region) const
 {
     const QRegion area = region.intersected(QRect(0, 0, width(), height()));
@@ -151,6 +151,28 @@ public:
         replace(index, cell);
     }
 
+    /**
+      * Replaces every cell.  The storage is chosen once from the number of
+      * non-empty cells instead of growing the hash one cell at a time.
+      */
+    void setCells(const QVector<Cell> &cells, int nonEmptyCount)
+    {
+        Q_ASSERT(cells.size() == size());
+        mCells.clear();
+        if (nonEmptyCount > 300 * 300 / 3) {
+            mCellsVector = cells;
+            mUseVector = true;
+            return;
+        }
+        mCellsVector.clear();
+        mUseVector = false;
+        mCells.reserve(nonEmptyCount);
+        for (int i = 0; i < cells.size(); i++) {
+            if (!cells[i].isEmpty())
+                mCells.insert(i, cells[i]);
+        }
+    }
+
     void setTile(int index, Tile *tile)
     {
         Cell cell = at(index);
@@ -266,6 +288,13 @@ public:
      */
     void setCell(int x, int y, const Cell &cell);
 
+    /**
+     * Replaces every cell of this layer with the given \a cells, which are
+     * in row order and must number width() * height().  This is much faster
+     * than calling setCell() for each cell.
+     */
+    void setCells(const QVector<Cell> &cells);
+
     /**
      * Returns a copy of the area specified by the given \a region. The
      * caller is responsible for the returned tile layer.
@@ -385,6 +414,8 @@ protected:
     TileLayer *initializeClone(TileLayer *clone) const;
 
 private:
+    void includeInDrawMargins(const Cell &cell);
+
     QSize mMaxTileSize;
     QMargins mOffsetMargins;
     ZTileLayerGroup *mTileLayerGroup;
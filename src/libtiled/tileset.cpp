@@ -270,6 +270,85 @@ bool Tileset::loadFromCache(Tileset *cached)
     return true;
 }
 
+QVector<Tileset::AtlasTile> Tileset::atlasTiles() const
+{
+    QVector<AtlasTile> tiles(mTiles.size());
+    for (int i = 0; i < mTiles.size(); i++) {
+        const Tile *tile = mTiles.at(i);
+        AtlasTile &atlasTile = tiles[i];
+        atlasTile.offset = tile->offset();
+        atlasTile.size = tile->size();
+        if (tile->image().isNull())
+            continue;
+        // tryCreateAtlas() failed.
+        if (mImage.isNull())
+            return QVector<AtlasTile>();
+        // The coordinates are whole pixels divided by the atlas size, so this
+        // gets the original values back exactly.
+        const Tile::UVST &uvst = tile->atlasUVST();
+        atlasTile.rect = QRect(qRound(uvst.u * mImage.width()),
+                               qRound(uvst.v * mImage.height()),
+                               tile->atlasSize().width(),
+                               tile->atlasSize().height());
+    }
+    return tiles;
+}
+
+bool Tileset::loadFromAtlas(const QImage &atlas, const QSize &imageSize,
+                            const QVector<AtlasTile> &tiles, const QString &fileName)
+{
+    Q_ASSERT(mTileWidth > 0 && mTileHeight > 0);
+
+    // The tiles are cut from the atlas as it is, converting it to a
+    // premultiplied format and back would round semi-transparent pixels.
+    int oldTilesetSize = mTiles.size();
+    int tileNum = 0;
+
+    for (const AtlasTile &atlasTile : tiles) {
+        Tile *tile;
+        if (tileNum < oldTilesetSize) {
+            tile = mTiles.at(tileNum);
+        } else {
+            tile = new Tile(atlasTile.size.width(), atlasTile.size.height(), tileNum, this);
+            mTiles.append(tile);
+        }
+        if (atlasTile.rect.isEmpty()) {
+            tile->setImage(QImage(), atlasTile.offset, atlasTile.size);
+        } else {
+            const QRect &r = atlasTile.rect;
+            tile->setImage(atlas.copy(r), atlasTile.offset, atlasTile.size);
+
+            // Same as tryCreateAtlas()
+            Tile::UVST uvst;
+            uvst.u = r.x() / float(atlas.width());
+            uvst.v = r.y() / float(atlas.height());
+            uvst.s = (r.x() + r.width()) / float(atlas.width());
+            uvst.t = (r.y() + r.height()) / float(atlas.height());
+            tile->setAtlasUVST(uvst);
+            tile->setAtlasSize(r.size());
+        }
+        ++tileNum;
+    }
+
+    // Blank out any remaining tiles to avoid confusion
+    while (tileNum < oldTilesetSize) {
+        int scale = mImageSource2x.isEmpty() ? 1 : 2;
+        mTiles.at(tileNum)->setEmptyImage(mTileWidth * scale, mTileHeight * scale);
+        ++tileNum;
+    }
+
+    if (!atlas.isNull())
+        mImage = atlas;
+
+    mImageWidth = imageSize.width();
+    mImageHeight = imageSize.height();
+    mColumnCount = columnCountForWidth(mImageWidth);
+    mLoaded = true;
+    mChangeCount++;
+    mImageSource = fileName;
+    return true;
+}
+
 bool Tileset::loadFromNothing(const QSize &imageSize, const QString &fileName)
 {
     Q_ASSERT(mTileWidth > 0 && mTileHeight > 0);
@@ -395,6 +474,9 @@ Tileset *TilesetImageCache::addTileset(Tileset *ts)
         cached->mTiles.append(new Tile(tile, tileNum, cached));
     }
 
+    mIndexByImageSource.insert(cached->mImageSource, mTilesets.size());
+    if (!cached->mImageSource2x.isEmpty())
+        mIndexByImageSource2x.insert(cached->mImageSource2x, mTilesets.size());
     mTilesets.append(cached);
 
 //    qDebug() << "added tileset image " << ts->imageSource() << " to cache";
@@ -404,18 +486,32 @@ Tileset *TilesetImageCache::addTileset(Tileset *ts)
 
 Tileset *TilesetImageCache::findMatch(Tileset *ts, const QString &imageSource, const QString &imageSource2x)
 {
-    foreach (Tileset *candidate, mTilesets) {
-        if (((candidate->imageSource() == imageSource) || (!imageSource2x.isEmpty() && (candidate->imageSource2x() == imageSource2x)))
-                && candidate->tileWidth() == ts->tileWidth()
+    // When several cached tilesets match, the one added first wins.
+    int best = findMatch(mIndexByImageSource, imageSource, ts, mTilesets.size());
+    if (!imageSource2x.isEmpty())
+        best = findMatch(mIndexByImageSource2x, imageSource2x, ts, best);
+    if (best < mTilesets.size()) {
+//        qDebug() << "retrieved tileset image " << mTilesets[best]->imageSource() << " from cache";
+        return mTilesets[best];
+    }
+    return NULL;
+}
+
+int TilesetImageCache::findMatch(const QMultiHash<QString,int> &index, const QString &source,
+                                 Tileset *ts, int best) const
+{
+    for (auto it = index.constFind(source); it != index.constEnd() && it.key() == source; ++it) {
+        if (it.value() >= best)
+            continue;
+        Tileset *candidate = mTilesets[it.value()];
+        if (candidate->tileWidth() == ts->tileWidth()
                 && candidate->tileHeight() == ts->tileHeight()
                 && candidate->tileSpacing() == ts->tileSpacing()
                 && candidate->margin() == ts->margin()
-                && candidate->transparentColor() == ts->transparentColor()) {
-//            qDebug() << "retrieved tileset image " << candidate->imageSource() << " from cache";
-            return candidate;
-        }
+                && candidate->transparentColor() == ts->transparentColor())
+            best = it.value();
     }
-    return NULL;
+    return best;
 }
 
 #endif
@@ -33,6 +33,7 @@
 #include "object.h"
 
 #include <QColor>
+#include <QHash>
 #include <QList>
 #include <QPoint>
 #ifdef ZOMBOID
@@ -40,6 +41,7 @@
 #include <QSize>
 #endif
 #include <QString>
+#include <QVector>
 
 class QImage;
 
@@ -56,6 +58,15 @@ public:
     Tileset *addTileset(Tileset *ts);
     Tileset *findMatch(Tileset *ts, const QString &imageSource, const QString &imageSource2x);
     QList<Tileset*> mTilesets;
+
+private:
+    int findMatch(const QMultiHash<QString,int> &index, const QString &source,
+                  Tileset *ts, int best) const;
+
+    // Indices into mTilesets.  The image sources of cached tilesets never
+    // change once they are added.
+    QMultiHash<QString,int> mIndexByImageSource;
+    QMultiHash<QString,int> mIndexByImageSource2x;
 };
 
 #endif
@@ -219,6 +230,27 @@ public:
 #ifdef ZOMBOID
     bool loadFromCache(Tileset *cached);
     friend class TilesetImageCache;
+
+    /**
+     * Where one tile's image is in the atlas made by loadFromImage().
+     * The rect is empty for tiles with no visible pixels.
+     */
+    struct AtlasTile
+    {
+        QRect rect;
+        QPoint offset; // Tile::offset()
+        QSize size; // Tile::size()
+    };
+
+    QVector<AtlasTile> atlasTiles() const;
+
+    /**
+     * Loads this tileset from an atlas made by an earlier loadFromImage(),
+     * without decoding and cutting up the original image again.
+     *  imageSize is the size of the original image.
+     */
+    bool loadFromAtlas(const QImage &atlas, const QSize &imageSize,
+                       const QVector<AtlasTile> &tiles, const QString &fileName);
 #endif
 
 #ifdef ZOMBOID
@@ -335,9 +335,17 @@ void ZLevelRenderer::drawTileLayer(QPainter *painter,
 }
 
 #ifdef ZOMBOID
-#include <QThreadStorage>
 void ZLevelRenderer::drawTileLayerGroup(QPainter *painter, ZTileLayerGroup *layerGroup,
                             const QRectF &exposed) const
+{
+    QVector<CellDraw> draws;
+    collectTileLayerGroup(layerGroup, exposed, draws);
+    drawCells(painter, draws);
+}
+
+void ZLevelRenderer::collectTileLayerGroup(ZTileLayerGroup *layerGroup,
+                                           const QRectF &exposed,
+                                           QVector<CellDraw> &draws) const
 {
     const int tileWidth = DISPLAY_TILE_WIDTH;
     const int tileHeight = DISPLAY_TILE_HEIGHT;
@@ -390,22 +398,11 @@ void ZLevelRenderer::drawTileLayerGroup(QPainter *painter, ZTileLayerGroup *laye
     // Determine whether the current row is shifted half a tile to the right
     bool shifted = inUpperHalf ^ inLeftHalf;
 
-    QTransform baseTransform = painter->transform();
-
-#if 0
-    QThreadStorage<QVector<const Cell*> > cellStorage;
-    QThreadStorage<QVector<qreal> > opacityStorage;
-    QVector<const Cell*> &cells = cellStorage.localData();
-    QVector<qreal> &opacities = opacityStorage.localData();
-#else
-    /*static*/ QVector<const Cell*> cells(40); // or QVarLengthArray
-    /*static*/ QVector<qreal> opacities(40); // or QVarLengthArray
-#endif
+    QVector<const Cell*> cells(40); // or QVarLengthArray
+    QVector<qreal> opacities(40); // or QVarLengthArray
 
     layerGroup->prepareDrawing(this, rect);
 
-    qreal opacity = painter->opacity();
-
     for (int y = startPos.y(); y - tileHeight < rect.bottom();
          y += tileHeight / 2)
     {
@@ -414,80 +411,28 @@ void ZLevelRenderer::drawTileLayerGroup(QPainter *painter, ZTileLayerGroup *laye
         for (int x = startPos.x(); x < rect.right(); x += tileWidth) {
             cells.resize(0);
             if (layerGroup->orderedCellsAt(columnItr, cells, opacities)) {
+                // Multi-threading
+                if (mAbortDrawing && *mAbortDrawing)
+                    return;
                 for (int i = 0; i < cells.size(); i++) {
-                    // Multi-threading
-                    if (mAbortDrawing && *mAbortDrawing) {
-                        painter->setTransform(baseTransform);
-                        return;
-                    }
                     const Cell *cell = cells[i];
-                    if (!cell->isEmpty()) {
-                        Tile *tile = cell->tile;
-                        if (tile->image().isNull()) {
-                            if (g_missing_tile == 0) {
-                                Tileset *ts = new Tileset(QLatin1String("MISSING"), 64, 128);
-                                if (ts->loadFromImage(QImage(QLatin1String(":/images/missing-tile.png")), QLatin1String(":/images/missing-tile.png"))) {
-                                    g_missing_tile = ts->tileAt(0);
-                                }
+                    if (cell->isEmpty())
+                        continue;
+                    CellDraw draw;
+                    draw.cell = *cell;
+                    if (cell->tile->image().isNull()) {
+                        if (g_missing_tile == 0) {
+                            Tileset *ts = new Tileset(QLatin1String("MISSING"), 64, 128);
+                            if (ts->loadFromImage(QImage(QLatin1String(":/images/missing-tile.png")), QLatin1String(":/images/missing-tile.png"))) {
+                                g_missing_tile = ts->tileAt(0);
                             }
-                            if (g_missing_tile)
-                                tile = g_missing_tile;
-                        }
-                        QImage img = tile->image();
-                        const QPoint offset = tile->tileset()->tileOffset() + tile->offset();
-
-                        qreal m11 = 1;      // Horizontal scaling factor
-                        qreal m12 = 0;      // Vertical shearing factor
-                        qreal m21 = 0;      // Horizontal shearing factor
-                        qreal m22 = 1;      // Vertical scaling factor
-                        qreal dx = offset.x() + x;
-                        qreal dy = offset.y() + y - tile->height();
-
-                        if (cell->flippedAntiDiagonally) {
-                            // Use shearing to swap the X/Y axis
-                            m11 = 0;
-                            m12 = 1;
-                            m21 = 1;
-                            m22 = 0;
-
-                            // Compensate for the swap of image dimensions
-                            dy += img.height() - img.width();
                         }
-                        if (cell->flippedHorizontally) {
-                            m11 = -m11;
-                            m21 = -m21;
-                            dx += cell->flippedAntiDiagonally ? img.height()
-                                                             : img.width();
-                        }
-                        if (cell->flippedVertically) {
-                            m12 = -m12;
-                            m22 = -m22;
-                            dy += cell->flippedAntiDiagonally ? img.width()
-                                                             : img.height();
-                        }
-
-                        if (tileWidth == tile->width() * 2) {
-                            m11 *= 2.0f;
-                            m22 *= 2.0f;
-                            dx += tile->offset().x();
-                            dy -= tile->height() - tile->offset().y();
-                        } else if (tileWidth == tile->width() / 2) {
-                            float scale = 0.5f;
-                            m11 *= scale;
-                            m22 *= scale;
-//                            dx += (tileWidth - img.width() * scale) / 2;
-//                            dy += (tile->tileset()->tileHeight() - img.height() * scale);
-//                            dy -= (tileHeight - tileHeight * scale) / 2;
-                            dy += tile->height() / 2;
-                        }
-
-                        const QTransform transform(m11, m12, m21, m22, dx, dy);
-                        painter->setTransform(transform * baseTransform);
-
-                        painter->setOpacity(opacities[i] * opacity);
-
-                        painter->drawImage(0, 0, img);
+                        if (g_missing_tile)
+                            draw.cell.tile = g_missing_tile;
                     }
+                    draw.pos = QPoint(x, y);
+                    draw.opacity = opacities[i];
+                    draws += draw;
                 }
             }
 
@@ -507,8 +452,100 @@ void ZLevelRenderer::drawTileLayerGroup(QPainter *painter, ZTileLayerGroup *laye
             shifted = false;
         }
     }
+}
+
+void ZLevelRenderer::drawCells(QPainter *painter, const QVector<CellDraw> &draws) const
+{
+    const int tileWidth = DISPLAY_TILE_WIDTH;
+
+    const QTransform baseTransform = painter->transform();
+    const qreal opacity = painter->opacity();
+    qreal lastOpacity = opacity;
+    bool transformed = false;
+
+    for (const CellDraw &draw : draws) {
+        // Multi-threading
+        if (mAbortDrawing && *mAbortDrawing)
+            break;
+
+        const Cell *cell = &draw.cell;
+        const Tile *tile = cell->tile;
+        const QImage &img = tile->image();
+        const QPoint offset = tile->tileset()->tileOffset() + tile->offset();
+
+        if (draw.opacity * opacity != lastOpacity) {
+            lastOpacity = draw.opacity * opacity;
+            painter->setOpacity(lastOpacity);
+        }
+
+        qreal m11 = 1;      // Horizontal scaling factor
+        qreal m12 = 0;      // Vertical shearing factor
+        qreal m21 = 0;      // Horizontal shearing factor
+        qreal m22 = 1;      // Vertical scaling factor
+        qreal dx = offset.x() + draw.pos.x();
+        qreal dy = offset.y() + draw.pos.y() - tile->height();
+
+        const bool flipped = cell->flippedHorizontally || cell->flippedVertically
+                || cell->flippedAntiDiagonally;
+
+        if (cell->flippedAntiDiagonally) {
+            // Use shearing to swap the X/Y axis
+            m11 = 0;
+            m12 = 1;
+            m21 = 1;
+            m22 = 0;
+
+            // Compensate for the swap of image dimensions
+            dy += img.height() - img.width();
+        }
+        if (cell->flippedHorizontally) {
+            m11 = -m11;
+            m21 = -m21;
+            dx += cell->flippedAntiDiagonally ? img.height()
+                                             : img.width();
+        }
+        if (cell->flippedVertically) {
+            m12 = -m12;
+            m22 = -m22;
+            dy += cell->flippedAntiDiagonally ? img.width()
+                                             : img.height();
+        }
+
+        if (tileWidth == tile->width() * 2) {
+            m11 *= 2.0f;
+            m22 *= 2.0f;
+            dx += tile->offset().x();
+            dy -= tile->height() - tile->offset().y();
+        } else if (tileWidth == tile->width() / 2) {
+            float scale = 0.5f;
+            m11 *= scale;
+            m22 *= scale;
+            dy += tile->height() / 2;
+        }
+
+        // Most cells aren't flipped, so they are drawn into a target rect
+        // instead of changing the painter's transform for each one.
+        if (!flipped) {
+            if (transformed) {
+                painter->setTransform(baseTransform);
+                transformed = false;
+            }
+            if (m11 == 1 && m22 == 1)
+                painter->drawImage(QPointF(dx, dy), img);
+            else
+                painter->drawImage(QRectF(dx, dy, img.width() * m11, img.height() * m22), img);
+            continue;
+        }
+
+        const QTransform transform(m11, m12, m21, m22, dx, dy);
+        painter->setTransform(transform * baseTransform);
+        transformed = true;
+
+        painter->drawImage(0, 0, img);
+    }
 
     painter->setTransform(baseTransform);
+    painter->setOpacity(opacity);
 }
 #endif // ZOMBOID
 
@@ -27,6 +27,11 @@
 #define ZLEVELRENDERER_H
 
 #include "maprenderer.h"
+#ifdef ZOMBOID
+#include "tilelayer.h"
+
+#include <QVector>
+#endif
 
 namespace Tiled {
 
@@ -54,6 +59,30 @@ public:
    void drawTileLayerGroup(QPainter *painter, ZTileLayerGroup *layerGroup,
                                const QRectF &exposed = QRectF()) const;
 
+#ifdef ZOMBOID
+    /**
+     * A cell drawTileLayerGroup() draws, with the square's position in
+     * pixels and the opacity of its layer.
+     */
+    struct CellDraw
+    {
+        Cell cell;
+        QPoint pos;
+        qreal opacity;
+    };
+
+    /**
+     * Collects the cells drawTileLayerGroup() draws in \a exposed, in the
+     * order they are drawn.  Only drawCells() touches the painter, so the
+     * cells can be drawn on other threads as long as their tiles don't
+     * change in the meantime.
+     */
+    void collectTileLayerGroup(ZTileLayerGroup *layerGroup, const QRectF &exposed,
+                               QVector<CellDraw> &draws) const;
+
+    void drawCells(QPainter *painter, const QVector<CellDraw> &draws) const;
+#endif
+
     void drawTileSelection(QPainter *painter,
                            const QRegion &region,
                            const QColor &color,